@@ -35,6 +35,8 @@ extern char *optarg;
 #include "e2p/e2p.h"
 
 #include <ext2fs/ext2_ext_attr.h>
+#include <ext2fs/zimage.h>
+#include <ext2fs/qcow2.h>
 
 #include "../version.h"
 #include "jfs_user.h"
@@ -170,6 +172,13 @@ static void open_filesystem(char *device, int open_flags, blk64_t superblock,
 	if (catastrophic)
 		open_flags |= EXT2_FLAG_SKIP_MMP | EXT2_FLAG_IGNORE_SB_ERRORS;
 
+	if (!(open_flags & EXT2_FLAG_IMAGE_FILE)) {
+		if (ext2fs_zimage_probe(device, NULL))
+			io_ptr = zimage_io_manager;
+		else if (ext2fs_qcow2_probe(device, NULL))
+			io_ptr = qcow2_io_manager;
+	}
+
 	if (undo_file) {
 		retval = debugfs_setup_tdb(device, undo_file, &io_ptr);
 		if (retval)
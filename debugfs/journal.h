@@ -14,6 +14,22 @@
 
 #include "jfs_user.h"
 
+/* A transaction being written to the journal by hand */
+#define J_TRANS_MAGIC		0xD15EA5ED
+#define J_TRANS_OPEN		1
+#define J_TRANS_COMMITTED	2
+struct journal_transaction_s {
+	unsigned int magic;
+	ext2_filsys fs;
+	journal_t *journal;
+	blk64_t block;
+	blk64_t start, end;
+	tid_t tid;
+	int flags;
+};
+
+typedef struct journal_transaction_s journal_transaction_t;
+
 /* journal.c */
 errcode_t ext2fs_open_journal(ext2_filsys fs, journal_t **j);
 errcode_t ext2fs_close_journal(ext2_filsys fs, journal_t **j);
@@ -23,3 +39,15 @@ void jbd2_revoke_csum_set(journal_t *j, struct buffer_head *bh);
 void jbd2_descr_block_csum_set(journal_t *j, struct buffer_head *bh);
 void jbd2_block_tag_csum_set(journal_t *j, journal_block_tag_t *tag,
 			     struct buffer_head *bh, __u32 sequence);
+errcode_t ext2fs_write_journal_sb(journal_t *journal);
+errcode_t journal_open_trans(journal_t *journal, journal_transaction_t *trans,
+			     blk64_t blocks);
+errcode_t journal_add_blocks_to_trans(journal_transaction_t *trans,
+				      blk64_t *block_list, size_t block_len,
+				      void **block_data);
+errcode_t journal_add_revoke_to_trans(journal_transaction_t *trans,
+				      blk64_t *revoke_list, size_t revoke_len);
+errcode_t journal_commit_trans(journal_transaction_t *trans);
+errcode_t journal_close_trans(journal_transaction_t *trans);
+blk64_t journal_guess_blocks(journal_t *journal, blk64_t data_blocks,
+			     blk64_t revoke_blocks);
@@ -21,6 +21,9 @@
 #include "e2fsck.h"
 #include "problem.h"
 
+/* Free space discards kept in flight at once */
+#define DISCARD_MAX_INFLIGHT	8
+
 static void check_block_bitmaps(e2fsck_t ctx);
 static void check_inode_bitmaps(e2fsck_t ctx);
 static void check_inode_end(e2fsck_t ctx);
@@ -189,8 +192,13 @@ static void check_block_bitmap_checksum(e2fsck_t ctx)
 	ext2fs_free_mem(&buf);
 }
 
-static void e2fsck_discard_blocks(e2fsck_t ctx, blk64_t start,
-				  blk64_t count)
+/*
+ * Discard 'count' blocks starting at 'start'.  If 'batch' is set the
+ * range is only queued, to be merged with its neighbours and issued
+ * together with them; see e2fsck_finish_discard().
+ */
+static void e2fsck_discard_blocks(e2fsck_t ctx, io_discard_batch batch,
+				  blk64_t start, blk64_t count)
 {
 	ext2_filsys fs = ctx->fs;
 
@@ -203,8 +211,29 @@ static void e2fsck_discard_blocks(e2fsck_t ctx, blk64_t start,
 	if (ext2fs_test_changed(fs))
 		ctx->options &= ~E2F_OPT_DISCARD;
 
-	if ((ctx->options & E2F_OPT_DISCARD) &&
-	    (io_channel_discard(fs->io, start, count)))
+	if (!(ctx->options & E2F_OPT_DISCARD))
+		return;
+	if (batch) {
+		if (io_channel_discard_batch_add(batch, start, count))
+			ctx->options &= ~E2F_OPT_DISCARD;
+	} else if (io_channel_discard(fs->io, start, count))
+		ctx->options &= ~E2F_OPT_DISCARD;
+}
+
+/*
+ * Issue and wait for the queued discards, unless discard was turned off
+ * along the way because a problem was found, in which case whatever
+ * hasn't been sent to the device yet is dropped.
+ */
+static void e2fsck_finish_discard(e2fsck_t ctx, io_discard_batch batch)
+{
+	if (!batch)
+		return;
+	if (!(ctx->options & E2F_OPT_DISCARD) ||
+	    ext2fs_test_changed(ctx->fs)) {
+		ctx->options &= ~E2F_OPT_DISCARD;
+		io_channel_discard_batch_cancel(batch);
+	} else if (io_channel_discard_batch_finish(batch))
 		ctx->options &= ~E2F_OPT_DISCARD;
 }
 
@@ -261,7 +290,7 @@ static void e2fsck_discard_inodes(e2fsck_t ctx, dgrp_t group,
 	num = count / EXT2_INODES_PER_BLOCK(fs->super);
 
 	if (num > 0)
-		e2fsck_discard_blocks(ctx, blk, num);
+		e2fsck_discard_blocks(ctx, NULL, blk, num);
 }
 
 #define NO_BLK ((blk64_t) -1)
@@ -323,6 +352,7 @@ static void check_block_bitmaps(e2fsck_t ctx)
 	errcode_t	retval;
 	int	redo_flag = 0;
 	char *actual_buf, *bitmap_buf;
+	io_discard_batch batch = NULL;
 
 	actual_buf = (char *) e2fsck_allocate_memory(ctx, fs->blocksize,
 						     "actual bitmap buffer");
@@ -363,6 +393,11 @@ static void check_block_bitmaps(e2fsck_t ctx)
 		goto errout;
 	}
 
+	if ((ctx->options & E2F_OPT_DISCARD) &&
+	    io_channel_discard_batch_init(fs->io, DISCARD_MAX_INFLIGHT,
+					  &batch))
+		batch = NULL;
+
 redo_counts:
 	had_problem = 0;
 	save_problem = 0;
@@ -470,7 +505,7 @@ redo_counts:
 			if (first_free > i)
 				first_free = i;
 		} else if (i > first_free) {
-			e2fsck_discard_blocks(ctx, first_free,
+			e2fsck_discard_blocks(ctx, batch, first_free,
 					      (i - first_free));
 			first_free = ext2fs_blocks_count(fs->super);
 		}
@@ -483,7 +518,7 @@ redo_counts:
 			 * discard it as well.
 			 */
 			if (!bitmap && i >= first_free)
-				e2fsck_discard_blocks(ctx, first_free,
+				e2fsck_discard_blocks(ctx, batch, first_free,
 						      (i - first_free) + 1);
 		next_group:
 			first_free = ext2fs_blocks_count(fs->super);
@@ -498,6 +533,8 @@ redo_counts:
 					goto errout;
 		}
 	}
+	e2fsck_finish_discard(ctx, batch);
+	batch = NULL;
 	if (pctx.blk != NO_BLK)
 		print_bitmap_problem(ctx, save_problem, &pctx);
 	if (had_problem)
@@ -553,6 +590,8 @@ redo_counts:
 		}
 	}
 errout:
+	if (batch)
+		io_channel_discard_batch_cancel(batch);
 	ext2fs_free_mem(&free_array);
 	ext2fs_free_mem(&actual_buf);
 	ext2fs_free_mem(&bitmap_buf);
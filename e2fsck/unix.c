@@ -53,6 +53,8 @@ extern int optind;
 #include "uuid/uuid.h"
 #include "support/plausible.h"
 #include "support/devname.h"
+#include "ext2fs/zimage.h"
+#include "ext2fs/qcow2.h"
 #include "e2fsck.h"
 #include "problem.h"
 #include "jfs_user.h"
@@ -1410,6 +1412,8 @@ int main (int argc, char *argv[])
 	char *cp;
 	enum quota_type qtype;
 	struct ext2fs_journal_params jparams;
+	unsigned long long image_size = 0;
+	io_manager image_io = NULL;
 
 	clear_problem_context(&pctx);
 	sigcatcher_setup();
@@ -1490,6 +1494,14 @@ int main (int argc, char *argv[])
 	}
 	ctx->superblock = ctx->use_superblock;
 
+	if (ext2fs_zimage_probe(ctx->filesystem_name, &image_size))
+		image_io = zimage_io_manager;
+	else if (ext2fs_qcow2_probe(ctx->filesystem_name, &image_size))
+		image_io = qcow2_io_manager;
+	if (image_io && !(ctx->options & E2F_OPT_READONLY))
+		fatal_error(ctx, _("A compressed or QCOW2 e2image file can "
+				   "only be checked read-only (-n)"));
+
 	flags = EXT2_FLAG_SKIP_MMP | EXT2_FLAG_THREADS;
 restart:
 #ifdef CONFIG_TESTIO_DEBUG
@@ -1498,6 +1510,9 @@ restart:
 		test_io_backing_manager = unix_io_manager;
 	} else
 #endif
+	if (image_io)
+		io_ptr = image_io;
+	else
 		io_ptr = unix_io_manager;
 	flags |= EXT2_FLAG_NOFREE_ON_ERROR;
 	profile_get_boolean(ctx->profile, "options", "old_bitmaps", 0, 0,
@@ -1668,9 +1683,12 @@ failure:
 		__u32 blocksize = EXT2_BLOCK_SIZE(fs->super);
 		int need_restart = 0;
 
-		pctx.errcode = ext2fs_get_device_size2(ctx->filesystem_name,
-						       blocksize,
-						       &ctx->num_blocks);
+		if (image_io)
+			ctx->num_blocks = image_size / blocksize;
+		else
+			pctx.errcode = ext2fs_get_device_size2(
+						ctx->filesystem_name,
+						blocksize, &ctx->num_blocks);
 		/*
 		 * The floppy driver refuses to allow anyone else to
 		 * open the device if has been opened with O_EXCL;
@@ -24,7 +24,7 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
@@ -140,6 +140,113 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 	return 0;
 }
 
+/*
+ * Account for n inodes (the highest of which is last) allocated from
+ * a block group, updating the group descriptor and its checksum once.
+ */
+static void inode_batch_stats(ext2_filsys fs, dgrp_t group, ext2_ino_t n,
+			      ext2_ino_t last, int isdir)
+{
+	ext2_ino_t	ipg = EXT2_INODES_PER_GROUP(fs->super);
+	ext2_ino_t	first_unused;
+
+	ext2fs_bg_free_inodes_count_set(fs, group,
+			ext2fs_bg_free_inodes_count(fs, group) - n);
+	if (isdir)
+		ext2fs_bg_used_dirs_count_set(fs, group,
+			ext2fs_bg_used_dirs_count(fs, group) + n);
+	ext2fs_bg_flags_clear(fs, group, EXT2_BG_INODE_UNINIT);
+	if (ext2fs_has_group_desc_csum(fs)) {
+		first_unused = ipg - ext2fs_bg_itable_unused(fs, group) +
+			group * ipg + 1;
+		if (last >= first_unused)
+			ext2fs_bg_itable_unused_set(fs, group,
+						    (group + 1) * ipg - last);
+		ext2fs_group_desc_csum_set(fs, group);
+	}
+}
+
+/*
+ * Allocate up to count inodes in one pass over the inode bitmap,
+ * starting in the parent directory's block group and handing them
+ * out in the same order as repeated calls to ext2fs_new_inode() would.
+ *
+ * Unlike ext2fs_new_inode(), the inodes are marked in use here, and
+ * the group descriptor, checksum and superblock accounting is done
+ * once per block group rather than once per inode; the caller must
+ * not call ext2fs_inode_alloc_stats2() for them.  Inodes which turn
+ * out not to be needed can be given back with
+ * ext2fs_inode_alloc_stats2(fs, ino, -1, isdir).
+ *
+ * The number of inodes allocated is returned in ret_count; it is only
+ * less than count if the file system runs out of free inodes.
+ */
+errcode_t ext2fs_new_inodes_batch(ext2_filsys fs, ext2_ino_t dir, int mode,
+				  ext2_ino_t count, ext2_ino_t *ret,
+				  ext2_ino_t *ret_count)
+{
+	ext2fs_inode_bitmap map;
+	ext2_ino_t	ipg, start_inode = 0;
+	ext2_ino_t	i, upto, ino, n = 0, group_start;
+	dgrp_t		group;
+	int		isdir = LINUX_S_ISDIR(mode);
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	map = fs->inode_map;
+	if (!map)
+		return EXT2_ET_NO_INODE_BITMAP;
+	if (count == 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	ipg = EXT2_INODES_PER_GROUP(fs->super);
+	if (dir > 0) {
+		group = (dir - 1) / ipg;
+		start_inode = (group * ipg) + 1;
+	}
+	if (start_inode < EXT2_FIRST_INODE(fs->super))
+		start_inode = EXT2_FIRST_INODE(fs->super);
+	if (start_inode > fs->super->s_inodes_count)
+		return EXT2_ET_INODE_ALLOC_FAIL;
+	i = start_inode;
+	do {
+		group = (i - 1) / ipg;
+
+		check_inode_uninit(fs, map, group);
+		upto = (group + 1) * ipg;
+		if (i < start_inode && upto >= start_inode)
+			upto = start_inode - 1;
+		if (upto > fs->super->s_inodes_count)
+			upto = fs->super->s_inodes_count;
+
+		group_start = n;
+		while (n < count && i <= upto) {
+			if (ext2fs_find_first_zero_inode_bitmap2(map, i, upto,
+								 &ino))
+				break;
+			ext2fs_fast_mark_inode_bitmap2(map, ino);
+			ret[n++] = ino;
+			i = ino + 1;
+		}
+		if (n > group_start)
+			inode_batch_stats(fs, group, n - group_start,
+					  ret[n - 1], isdir);
+		if (n >= count)
+			break;
+		i = upto + 1;
+		if (i > fs->super->s_inodes_count)
+			i = EXT2_FIRST_INODE(fs->super);
+	} while (i != start_inode);
+
+	if (n) {
+		fs->super->s_free_inodes_count -= n;
+		ext2fs_mark_super_dirty(fs);
+		ext2fs_mark_ib_dirty(fs);
+	}
+	*ret_count = n;
+	return n ? 0 : EXT2_ET_INODE_ALLOC_FAIL;
+}
+
 /*
  * Stupid algorithm --- we now just search forward starting from the
  * goal.  Should put in a smarter one someday....
@@ -185,6 +292,14 @@ errcode_t ext2fs_new_block3(ext2_filsys fs, blk64_t goal,
 		goal = fs->super->s_first_data_block;
 	goal &= ~EXT2FS_CLUSTER_MASK(fs);
 
+	if (map == fs->block_map && fs->free_index) {
+		blk64_t	len;
+
+		retval = ext2fs_free_index_find(fs, 0, goal, 1, &b, &len);
+		if (retval == 0)
+			goto allocated;
+	}
+
 	retval = ext2fs_find_first_zero_block_bitmap2(map,
 			goal, ext2fs_blocks_count(fs->super) - 1, &b);
 	if ((retval == ENOENT) && (goal != fs->super->s_first_data_block))
@@ -392,6 +507,10 @@ no_blocks:
  * that's at least _len_ blocks long.  Possible flags:
  * - EXT2_NEWRANGE_EXACT_GOAL: The range of blocks must start at _goal_.
  * - EXT2_NEWRANGE_MIN_LENGTH: do not return a allocation shorter than _len_.
+ * - EXT2_NEWRANGE_BEST_FIT: ignore _goal_ and pick the smallest free run
+ *   that is long enough.  This needs the free extent index (see
+ *   alloc_index.c); without it the search starts from _goal_ as usual.
+ *   It cannot be combined with EXT2_NEWRANGE_FIXED_GOAL.
  * - EXT2_NEWRANGE_ZERO_BLOCKS: Zero blocks pblk to pblk+plen before returning.
  *
  * The starting block is returned in _pblk_ and the length is returned via
@@ -417,6 +536,10 @@ errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 	if (len == 0 || (flags & ~EXT2_NEWRANGE_ALL_FLAGS))
 		return EXT2_ET_INVALID_ARGUMENT;
+	/* A best fit can't also be required to start at the goal */
+	if ((flags & EXT2_NEWRANGE_BEST_FIT) &&
+	    (flags & EXT2_NEWRANGE_FIXED_GOAL))
+		return EXT2_ET_INVALID_ARGUMENT;
 
 	if (!map && fs->new_range) {
 		/*
@@ -442,6 +565,16 @@ errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
 	if (!goal || goal >= ext2fs_blocks_count(fs->super))
 		goal = fs->super->s_first_data_block;
 
+	if (map == fs->block_map && fs->free_index &&
+	    ext2fs_free_index_find(fs, flags, goal, len, pblk, plen) == 0) {
+		start = *pblk;
+		end = *pblk + *plen;
+		dbg_printf("%s: indexed goal=%llu--%llu blk=%llu--%llu %llu\n",
+			   __func__, goal, goal + len - 1,
+			   *pblk, *pblk + *plen - 1, *plen);
+		goto allocated;
+	}
+
 	start = goal;
 	while (!looped || start <= goal) {
 		retval = ext2fs_find_first_zero_block_bitmap2(map, start,
@@ -454,9 +587,10 @@ errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
 			 * user told us only to allocate from _goal_, or if
 			 * we're already scanning the whole filesystem.
 			 */
-			if (flags & EXT2_NEWRANGE_FIXED_GOAL ||
+			if (flags & EXT2_NEWRANGE_FIXED_GOAL || looped ||
 			    start == fs->super->s_first_data_block)
 				goto fail;
+			looped = 1;
 			start = fs->super->s_first_data_block;
 			continue;
 		} else if (retval)
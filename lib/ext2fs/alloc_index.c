@@ -0,0 +1,468 @@
+/*
+ * alloc_index.c --- index of free block extents for the allocator
+ *
+ * The free extent index mirrors fs->block_map as a set of free extents
+ * kept in two red-black trees: one ordered by starting block, which is
+ * used to find the free space nearest a goal block, and one ordered by
+ * length, which is used to find the best fitting extent for a request
+ * of N blocks.  It is kept up to date by ext2fs_block_alloc_stats2()
+ * and ext2fs_block_alloc_stats_range().
+ *
+ * Callers which manipulate the block bitmap directly can make the
+ * index go stale, so it is only ever used as a hint: every extent
+ * handed out is checked against the bitmap first, and any region
+ * which turns out to disagree with the bitmap is rebuilt from it.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "rbtree.h"
+
+/*
+ * Number of free extents around the goal which are examined, nearest
+ * first, for one that is big enough before falling back to a best fit
+ * allocation.
+ */
+#define FREE_INDEX_GOAL_SCAN	32
+
+struct free_extent {
+	struct rb_node	start_node;
+	struct rb_node	len_node;
+	blk64_t		start;
+	blk64_t		count;
+};
+
+struct ext2_free_index {
+	ext2fs_block_bitmap	map;
+	struct rb_root		by_start;
+	struct rb_root		by_len;
+	blk64_t			nr_extents;
+};
+
+static struct free_extent *start_to_extent(struct rb_node *node)
+{
+	return node ? (struct free_extent *) node : NULL;
+}
+
+static struct free_extent *len_to_extent(struct rb_node *node)
+{
+	if (!node)
+		return NULL;
+	return (struct free_extent *) ((char *) node -
+				       offsetof(struct free_extent, len_node));
+}
+
+static void len_tree_insert(struct ext2_free_index *idx,
+			    struct free_extent *ext)
+{
+	struct rb_node		**n = &idx->by_len.rb_node, *parent = NULL;
+	struct free_extent	*cur;
+
+	while (*n) {
+		parent = *n;
+		cur = len_to_extent(parent);
+		if (ext->count < cur->count ||
+		    (ext->count == cur->count && ext->start < cur->start))
+			n = &parent->rb_left;
+		else
+			n = &parent->rb_right;
+	}
+	ext2fs_rb_link_node(&ext->len_node, parent, n);
+	ext2fs_rb_insert_color(&ext->len_node, &idx->by_len);
+}
+
+static void start_tree_insert(struct ext2_free_index *idx,
+			      struct free_extent *ext)
+{
+	struct rb_node		**n = &idx->by_start.rb_node, *parent = NULL;
+
+	while (*n) {
+		parent = *n;
+		if (ext->start < start_to_extent(parent)->start)
+			n = &parent->rb_left;
+		else
+			n = &parent->rb_right;
+	}
+	ext2fs_rb_link_node(&ext->start_node, parent, n);
+	ext2fs_rb_insert_color(&ext->start_node, &idx->by_start);
+}
+
+static void remove_extent(struct ext2_free_index *idx, struct free_extent *ext)
+{
+	ext2fs_rb_erase(&ext->start_node, &idx->by_start);
+	ext2fs_rb_erase(&ext->len_node, &idx->by_len);
+	idx->nr_extents--;
+	ext2fs_free_mem(&ext);
+}
+
+static errcode_t insert_extent(struct ext2_free_index *idx, blk64_t start,
+			       blk64_t count)
+{
+	struct free_extent	*ext;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(sizeof(struct free_extent), &ext);
+	if (retval)
+		return retval;
+	ext->start = start;
+	ext->count = count;
+	start_tree_insert(idx, ext);
+	len_tree_insert(idx, ext);
+	idx->nr_extents++;
+	return 0;
+}
+
+/* Change the length of an extent, keeping the length tree in order. */
+static void resize_extent(struct ext2_free_index *idx,
+			  struct free_extent *ext, blk64_t start, blk64_t count)
+{
+	ext2fs_rb_erase(&ext->len_node, &idx->by_len);
+	ext->start = start;
+	ext->count = count;
+	len_tree_insert(idx, ext);
+}
+
+/*
+ * Return the extent containing blk, or failing that the first extent
+ * after blk.
+ */
+static struct free_extent *find_extent(struct ext2_free_index *idx,
+				       blk64_t blk)
+{
+	struct rb_node		*n = idx->by_start.rb_node;
+	struct free_extent	*ext, *next = NULL;
+
+	while (n) {
+		ext = start_to_extent(n);
+		if (blk < ext->start) {
+			next = ext;
+			n = n->rb_left;
+		} else if (blk >= ext->start + ext->count)
+			n = n->rb_right;
+		else
+			return ext;
+	}
+	return next;
+}
+
+/* Return the smallest extent which is at least len blocks long. */
+static struct free_extent *find_best_fit(struct ext2_free_index *idx,
+					 blk64_t len)
+{
+	struct rb_node		*n = idx->by_len.rb_node;
+	struct free_extent	*ext, *best = NULL;
+
+	while (n) {
+		ext = len_to_extent(n);
+		if (ext->count >= len) {
+			best = ext;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	return best;
+}
+
+static errcode_t index_add_range(struct ext2_free_index *idx, blk64_t start,
+				 blk64_t count)
+{
+	struct free_extent	*ext, *next;
+	blk64_t			end = start + count;
+
+	/* Absorb the extents touching or overlapping the new range */
+	ext = find_extent(idx, start ? start - 1 : 0);
+	while (ext && ext->start <= end) {
+		next = start_to_extent(ext2fs_rb_next(&ext->start_node));
+		if (ext->start < start)
+			start = ext->start;
+		if (ext->start + ext->count > end)
+			end = ext->start + ext->count;
+		remove_extent(idx, ext);
+		ext = next;
+	}
+	return insert_extent(idx, start, end - start);
+}
+
+static errcode_t index_remove_range(struct ext2_free_index *idx,
+				    blk64_t start, blk64_t count)
+{
+	struct free_extent	*ext, *next;
+	blk64_t			end = start + count, ext_end;
+
+	ext = find_extent(idx, start);
+	while (ext && ext->start < end) {
+		next = start_to_extent(ext2fs_rb_next(&ext->start_node));
+		ext_end = ext->start + ext->count;
+		if (ext->start < start) {
+			resize_extent(idx, ext, ext->start, start - ext->start);
+			if (ext_end > end)
+				return insert_extent(idx, end, ext_end - end);
+		} else if (ext_end > end) {
+			ext2fs_rb_erase(&ext->start_node, &idx->by_start);
+			resize_extent(idx, ext, end, ext_end - end);
+			start_tree_insert(idx, ext);
+			break;
+		} else
+			remove_extent(idx, ext);
+		ext = next;
+	}
+	return 0;
+}
+
+/* Rebuild the part of the index covering [start, end) from the bitmap. */
+static errcode_t index_load_range(struct ext2_free_index *idx,
+				  blk64_t start, blk64_t end)
+{
+	blk64_t		first_free, first_used;
+	errcode_t	retval;
+
+	retval = index_remove_range(idx, start, end - start);
+	if (retval)
+		return retval;
+
+	while (start < end) {
+		retval = ext2fs_find_first_zero_block_bitmap2(idx->map, start,
+							      end - 1,
+							      &first_free);
+		if (retval == ENOENT)
+			break;
+		if (retval)
+			return retval;
+		retval = ext2fs_find_first_set_block_bitmap2(idx->map,
+							     first_free,
+							     end - 1,
+							     &first_used);
+		if (retval == ENOENT)
+			first_used = end;
+		else if (retval)
+			return retval;
+		retval = index_add_range(idx, first_free,
+					 first_used - first_free);
+		if (retval)
+			return retval;
+		start = first_used;
+	}
+	return 0;
+}
+
+void ext2fs_release_free_index(ext2_filsys fs)
+{
+	struct ext2_free_index	*idx = fs->free_index;
+	struct rb_node		*n;
+
+	if (!idx)
+		return;
+
+	fs->free_index = NULL;
+	while ((n = ext2fs_rb_first(&idx->by_start)) != NULL)
+		remove_extent(idx, start_to_extent(n));
+	ext2fs_free_mem(&idx);
+}
+
+/*
+ * Build a free extent index from the in-memory block bitmap.
+ */
+errcode_t ext2fs_create_free_index(ext2_filsys fs)
+{
+	struct ext2_free_index	*idx;
+	errcode_t		retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!fs->block_map)
+		return EXT2_ET_NO_BLOCK_BITMAP;
+	if (fs->free_index)
+		ext2fs_release_free_index(fs);
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_free_index), &idx);
+	if (retval)
+		return retval;
+	idx->map = fs->block_map;
+	idx->by_start = RB_ROOT;
+	idx->by_len = RB_ROOT;
+	fs->free_index = idx;
+
+	retval = index_load_range(idx, fs->super->s_first_data_block,
+				  ext2fs_blocks_count(fs->super));
+	if (retval)
+		ext2fs_release_free_index(fs);
+	return retval;
+}
+
+/*
+ * Called by the block allocation statistics functions to keep the
+ * index in sync with the block bitmap.
+ */
+void ext2fs_free_index_update(ext2_filsys fs, blk64_t blk, blk64_t num,
+			      int inuse)
+{
+	struct ext2_free_index	*idx = fs->free_index;
+	blk64_t			end;
+	errcode_t		retval;
+
+	if (!idx || !num)
+		return;
+	if (idx->map != fs->block_map) {
+		ext2fs_release_free_index(fs);
+		return;
+	}
+
+	/* The bitmap tracks whole clusters */
+	end = EXT2FS_C2B(fs, EXT2FS_B2C(fs, blk + num - 1) + 1);
+	blk &= ~EXT2FS_CLUSTER_MASK(fs);
+	if (inuse > 0)
+		retval = index_remove_range(idx, blk, end - blk);
+	else
+		retval = index_add_range(idx, blk, end - blk);
+	if (retval)
+		ext2fs_release_free_index(fs);
+}
+
+/*
+ * Check the part of the extent we are about to hand out against the
+ * bitmap; if it has gone stale, reload the extent from the bitmap and
+ * return non-zero.
+ */
+static int extent_is_stale(ext2_filsys fs, struct ext2_free_index *idx,
+			   struct free_extent *ext, blk64_t start,
+			   blk64_t count)
+{
+	if (ext2fs_test_block_bitmap_range2(idx->map, start, count))
+		return 0;
+	if (index_load_range(idx, ext->start, ext->start + ext->count))
+		ext2fs_release_free_index(fs);
+	return 1;
+}
+
+/*
+ * Return the free extent nearest to goal, on either side of it, which
+ * can hold len blocks, and where in it to start.  Only the first
+ * FREE_INDEX_GOAL_SCAN extents out from the goal are looked at.
+ */
+static struct free_extent *find_near_goal(struct ext2_free_index *idx,
+					  blk64_t goal, blk64_t len,
+					  blk64_t *start)
+{
+	struct free_extent	*fwd, *back, *ext;
+	blk64_t			fwd_dist, back_dist;
+	int			i;
+
+	fwd = find_extent(idx, goal);
+	if (fwd && fwd->start <= goal) {
+		if (fwd->start + fwd->count - goal >= len) {
+			*start = goal;
+			return fwd;
+		}
+		/* Too little left after the goal; try it whole later */
+		back = fwd;
+		fwd = start_to_extent(ext2fs_rb_next(&fwd->start_node));
+	} else if (fwd)
+		back = start_to_extent(ext2fs_rb_prev(&fwd->start_node));
+	else
+		back = start_to_extent(ext2fs_rb_last(&idx->by_start));
+
+	for (i = 0; (fwd || back) && i < FREE_INDEX_GOAL_SCAN; i++) {
+		fwd_dist = fwd ? fwd->start - goal : ~0ULL;
+		if (!back)
+			back_dist = ~0ULL;
+		else if (back->start + back->count > goal)
+			back_dist = 0;
+		else
+			back_dist = goal - (back->start + back->count);
+		if (fwd_dist <= back_dist) {
+			ext = fwd;
+			fwd = start_to_extent(ext2fs_rb_next(&fwd->start_node));
+		} else {
+			ext = back;
+			back = start_to_extent(ext2fs_rb_prev(&back->start_node));
+		}
+		if (ext->count >= len) {
+			*start = ext->start;
+			return ext;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find free space for ext2fs_new_range() and ext2fs_new_block3().  The
+ * extent containing (or following) the goal is tried first; if the
+ * request has to be satisfied in full, the nearest extents on either
+ * side of the goal are checked as well before the smallest extent
+ * which is big enough is picked.  Returns EXT2_ET_BLOCK_ALLOC_FAIL if the index cannot
+ * satisfy the request, in which case the caller should fall back to
+ * scanning the bitmap.
+ */
+errcode_t ext2fs_free_index_find(ext2_filsys fs, int flags, blk64_t goal,
+				 blk64_t len, blk64_t *pblk, blk64_t *plen)
+{
+	struct ext2_free_index	*idx = fs->free_index;
+	struct free_extent	*ext;
+	blk64_t			start, avail;
+	int			retries = 0;
+
+	if (!idx || idx->map != fs->block_map)
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+
+retry:
+	if (retries++ > 4 || !(idx = fs->free_index))
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+
+	if (flags & EXT2_NEWRANGE_FIXED_GOAL) {
+		ext = find_extent(idx, goal);
+		if (!ext || ext->start > goal)
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+		start = goal;
+		avail = ext->start + ext->count - start;
+		if ((flags & EXT2_NEWRANGE_MIN_LENGTH) && avail < len)
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+		goto found;
+	}
+
+	if (!(flags & (EXT2_NEWRANGE_MIN_LENGTH | EXT2_NEWRANGE_BEST_FIT))) {
+		ext = find_extent(idx, goal);
+		if (!ext)
+			ext = start_to_extent(ext2fs_rb_first(&idx->by_start));
+		if (!ext)
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+		start = ext->start > goal ? ext->start : goal;
+		avail = ext->start + ext->count - start;
+		goto found;
+	}
+
+	if (!(flags & EXT2_NEWRANGE_BEST_FIT)) {
+		ext = find_near_goal(idx, goal, len, &start);
+		if (ext) {
+			avail = ext->start + ext->count - start;
+			goto found;
+		}
+	}
+
+	ext = find_best_fit(idx, len);
+	if (!ext)
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+	start = ext->start;
+	avail = ext->count;
+
+found:
+	if (avail > len)
+		avail = len;
+	if (extent_is_stale(fs, idx, ext, start, avail))
+		goto retry;
+	*pblk = start;
+	*plen = avail;
+	return 0;
+}
@@ -13,7 +13,7 @@
 #include <stdio.h>
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 void ext2fs_inode_alloc_stats2(ext2_filsys fs, ext2_ino_t ino,
 			       int inuse, int isdir)
@@ -72,8 +72,11 @@ void ext2fs_block_alloc_stats2(ext2_filsys fs, blk64_t blk, int inuse)
 	}
 	if (inuse > 0)
 		ext2fs_mark_block_bitmap2(fs->block_map, blk);
-	else
+	else {
 		ext2fs_unmark_block_bitmap2(fs->block_map, blk);
+		ext2fs_extent_cache_invalidate(fs, blk, 1);
+	}
+	ext2fs_free_index_update(fs, blk, 1, inuse);
 	ext2fs_bg_free_blocks_count_set(fs, group, ext2fs_bg_free_blocks_count(fs, group) - inuse);
 	ext2fs_bg_flags_clear(fs, group, EXT2_BG_BLOCK_UNINIT);
 	ext2fs_group_desc_csum_set(fs, group);
@@ -125,8 +128,10 @@ void ext2fs_block_alloc_stats_range(ext2_filsys fs, blk64_t blk,
 		inuse = 1;
 	} else {
 		ext2fs_unmark_block_bitmap_range2(fs->block_map, blk, num);
+		ext2fs_extent_cache_invalidate(fs, blk, num);
 		inuse = -1;
 	}
+	ext2fs_free_index_update(fs, blk, num, inuse);
 	while (num) {
 		int group = ext2fs_group_of_blk2(fs, blk);
 		blk64_t last_blk = ext2fs_group_last_block2(fs, group);
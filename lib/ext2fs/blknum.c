@@ -12,7 +12,7 @@
  */
 
 #include "config.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 /*
  * Return the group # of a block
@@ -191,6 +191,199 @@ void ext2fs_free_blocks_count_add(struct ext2_super_block *super, blk64_t blk)
 	ext2fs_free_blocks_count_set(super, tmp);
 }
 
+/*
+ * Read n descriptor blocks starting at block i of a file system opened
+ * with EXT2_FLAG_LAZY_GDT; the caller holds the lock.  Only blocks
+ * before s_first_meta_bg are contiguous on disk, so n must be 1 past
+ * that.  Blocks which cannot be read are left zeroed and the error is
+ * remembered, for ext2fs_fill_lazy_gdt() to fail with.
+ */
+static errcode_t lazy_gdt_read(ext2_filsys fs, unsigned long i,
+			       unsigned long n)
+{
+	struct ext2_lazy_gdt *lazy = fs->lazy_gdt;
+	char		*dest = (char *) fs->group_desc + i * fs->blocksize;
+	blk64_t		blk;
+	errcode_t	retval;
+	unsigned long	j;
+#ifdef WORDS_BIGENDIAN
+	dgrp_t		group, last;
+	int		desc_size = EXT2_DESC_SIZE(fs->super) & ~7;
+#endif
+
+	if (i < lazy->first_meta_bg)
+		blk = lazy->group_block + lazy->zero_adjust + 1 + i;
+	else
+		blk = ext2fs_descriptor_block_loc2(fs, lazy->group_block, i);
+	retval = io_channel_read_blk64(fs->io, blk, n, dest);
+	if (retval) {
+		memset(dest, 0, n * fs->blocksize);
+		if (!lazy->error)
+			lazy->error = retval;
+	}
+#ifdef WORDS_BIGENDIAN
+	else {
+		group = i * EXT2_DESC_PER_BLOCK(fs->super);
+		last = (i + n) * EXT2_DESC_PER_BLOCK(fs->super);
+		if (last > fs->group_desc_count)
+			last = fs->group_desc_count;
+		for (; group < last; group++, dest += desc_size)
+			ext2fs_swap_group_desc2(fs,
+					(struct ext2_group_desc *) dest);
+	}
+#endif
+	for (j = i; j < i + n; j++)
+		ext2fs_set_bit(j, lazy->loaded);
+	lazy->unloaded -= n;
+	return retval;
+}
+
+static void lazy_gdt_lock(struct ext2_lazy_gdt *lazy)
+{
+#ifdef HAVE_PTHREAD
+	if (lazy->use_mutex)
+		pthread_mutex_lock(&lazy->mutex);
+#endif
+}
+
+static void lazy_gdt_unlock(struct ext2_lazy_gdt *lazy)
+{
+#ifdef HAVE_PTHREAD
+	if (lazy->use_mutex)
+		pthread_mutex_unlock(&lazy->mutex);
+#endif
+}
+
+/*
+ * Check the checksums of the descriptors in n blocks starting at block
+ * i, which have just been read.  Called without the lock, since
+ * computing a checksum looks the descriptor up again.
+ */
+static errcode_t lazy_gdt_verify(ext2_filsys fs, unsigned long i,
+				 unsigned long n)
+{
+	struct ext2_lazy_gdt *lazy = fs->lazy_gdt;
+	dgrp_t		group, last;
+
+	if (fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS)
+		return 0;
+	group = i * EXT2_DESC_PER_BLOCK(fs->super);
+	last = (i + n) * EXT2_DESC_PER_BLOCK(fs->super);
+	if (last > fs->group_desc_count)
+		last = fs->group_desc_count;
+	for (; group < last; group++)
+		if (!ext2fs_group_desc_csum_verify(fs, group))
+			break;
+	if (group >= last)
+		return 0;
+	lazy_gdt_lock(lazy);
+	if (!lazy->csum_error)
+		lazy->csum_error = EXT2_ET_GDESC_CSUM_INVALID;
+	lazy_gdt_unlock(lazy);
+	return EXT2_ET_GDESC_CSUM_INVALID;
+}
+
+static errcode_t lazy_gdt_load(ext2_filsys fs, unsigned long i)
+{
+	struct ext2_lazy_gdt *lazy = fs->lazy_gdt;
+	errcode_t	retval = 0;
+	int		was_loaded;
+
+	lazy_gdt_lock(lazy);
+	was_loaded = ext2fs_test_bit(i, lazy->loaded);
+	if (!was_loaded)
+		retval = lazy_gdt_read(fs, i, 1);
+	lazy_gdt_unlock(lazy);
+	if (!was_loaded && !retval)
+		retval = lazy_gdt_verify(fs, i, 1);
+	return retval;
+}
+
+void ext2fs_free_lazy_gdt(ext2_filsys fs)
+{
+	struct ext2_lazy_gdt *lazy = fs->lazy_gdt;
+
+	if (!lazy)
+		return;
+#ifdef HAVE_PTHREAD
+	if (lazy->use_mutex)
+		pthread_mutex_destroy(&lazy->mutex);
+#endif
+	ext2fs_free_mem(&lazy->loaded);
+	ext2fs_free_mem(&fs->lazy_gdt);
+}
+
+/*
+ * Read in all of the descriptor blocks which have not been used yet,
+ * checking the checksums of each as it comes in.  Returns the first
+ * read error seen since the file system was opened, or failing that
+ * EXT2_ET_GDESC_CSUM_INVALID if any descriptor loaded so far had a
+ * bad checksum.
+ */
+errcode_t ext2fs_load_group_descs(ext2_filsys fs)
+{
+	struct ext2_lazy_gdt *lazy = fs->lazy_gdt;
+	unsigned long	i, j, bytes;
+	blk64_t		blk;
+	char		*was_loaded;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!lazy)
+		return 0;
+	bytes = (fs->desc_blocks + 7) / 8;
+	retval = ext2fs_get_mem(bytes, &was_loaded);
+	if (retval)
+		return retval;
+
+	lazy_gdt_lock(lazy);
+	memcpy(was_loaded, lazy->loaded, bytes);
+	for (i = 0; lazy->unloaded && i < lazy->first_meta_bg; i = j) {
+		for (j = i; j < lazy->first_meta_bg &&
+			     !ext2fs_test_bit(j, lazy->loaded); j++)
+			;
+		if (j > i)
+			lazy_gdt_read(fs, i, j - i);
+		else
+			j++;
+	}
+	for (i = lazy->first_meta_bg; lazy->unloaded && i < fs->desc_blocks;
+	     i++) {
+		if (ext2fs_test_bit(i, lazy->loaded))
+			continue;
+		blk = ext2fs_descriptor_block_loc2(fs, lazy->group_block, i);
+		io_channel_cache_readahead(fs->io, blk, 1);
+	}
+	for (i = lazy->first_meta_bg; lazy->unloaded && i < fs->desc_blocks;
+	     i++)
+		if (!ext2fs_test_bit(i, lazy->loaded))
+			lazy_gdt_read(fs, i, 1);
+	retval = lazy->error;
+	lazy_gdt_unlock(lazy);
+
+	for (i = 0; !retval && i < fs->desc_blocks; i++)
+		if (!ext2fs_test_bit(i, was_loaded))
+			lazy_gdt_verify(fs, i, 1);
+	ext2fs_free_mem(&was_loaded);
+	return retval ? retval : lazy->csum_error;
+}
+
+/*
+ * Read in the rest of a lazily read table before it is used as a
+ * whole.  A bad checksum doesn't stop that, any more than it does when
+ * the table is read at open time; a block which could not be read does.
+ */
+errcode_t ext2fs_fill_lazy_gdt(ext2_filsys fs)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_load_group_descs(fs);
+	if (retval == EXT2_ET_GDESC_CSUM_INVALID)
+		retval = 0;
+	return retval;
+}
+
 /*
  * Get a pointer to a block group descriptor.  We need the explicit
  * pointer to the group desc for code that swaps block group
@@ -211,9 +404,18 @@ struct ext2_group_desc *ext2fs_group_desc(ext2_filsys fs,
 
 	if (group > fs->group_desc_count)
 		return NULL;
-	if (gdp)
+	if (gdp) {
+		/*
+		 * A descriptor block which can't be read stays zeroed.
+		 * That fails inode lookups, and the file system refuses
+		 * to read or write its bitmaps or write the table back.
+		 */
+		if (fs->lazy_gdt && gdp == fs->group_desc &&
+		    group < fs->group_desc_count)
+			lazy_gdt_load(fs, group / desc_per_blk);
 		return (struct ext2_group_desc *)((char *)gdp +
 						  group * desc_size);
+	}
 	/*
 	 * If fs->group_desc wasn't read in when the file system was
 	 * opened, then read it on demand here.
@@ -481,6 +481,131 @@ done:
 	return retval;
 }
 
+static errcode_t extent_bmap_range(ext2_filsys fs, ext2_ino_t ino,
+				   struct ext2_inode *inode, blk64_t lblk,
+				   blk64_t max_len,
+				   struct ext2fs_extent *ret_extent)
+{
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	errcode_t		retval;
+
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_extent_goto(handle, lblk);
+	if (retval == 0) {
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
+					   &extent);
+		if (retval)
+			goto out;
+		ret_extent->e_pblk = extent.e_pblk + (lblk - extent.e_lblk);
+		ret_extent->e_len = extent.e_lblk + extent.e_len - lblk;
+		if (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+			ret_extent->e_flags |= EXT2_EXTENT_FLAGS_UNINIT;
+		goto out;
+	}
+	if (retval != EXT2_ET_EXTENT_NOT_FOUND)
+		goto out;
+
+	/*
+	 * We're in a hole; the handle is left pointing at the leaf
+	 * extent closest to lblk, so find the next mapped extent (if
+	 * any) to figure out how big the hole is.  Since goto leaves
+	 * the interior nodes marked as not yet visited, the walk may
+	 * revisit the current leaf before moving on to the next one.
+	 */
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent);
+	while (retval == 0 && extent.e_lblk <= lblk)
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF,
+					   &extent);
+	if (retval == 0)
+		ret_extent->e_len = extent.e_lblk - lblk;
+	else if (retval == EXT2_ET_EXTENT_NO_NEXT ||
+		 retval == EXT2_ET_NO_CURRENT_NODE)
+		retval = 0;	/* hole runs to the end of the file */
+out:
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
+/*
+ * Map the range of logical blocks starting at lblk onto the disk.
+ * On return, ret_extent describes the longest run starting at lblk
+ * (but no longer than max_len blocks) which is either physically
+ * contiguous, or is a hole, in which case e_pblk is zero.  Unwritten
+ * extents are flagged with EXT2_EXTENT_FLAGS_UNINIT.  For block-mapped
+ * files the run may be cut short, so callers should be prepared to
+ * call again for the rest of the range.
+ */
+errcode_t ext2fs_bmap_range(ext2_filsys fs, ext2_ino_t ino,
+			    struct ext2_inode *inode, char *block_buf,
+			    blk64_t lblk, blk64_t max_len,
+			    struct ext2fs_extent *ret_extent)
+{
+	struct ext2_inode	inode_buf;
+	errcode_t		retval;
+	blk64_t			pblk, next;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (max_len == 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	memset(ret_extent, 0, sizeof(struct ext2fs_extent));
+	ret_extent->e_lblk = lblk;
+
+	if (!inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode_buf);
+		if (retval)
+			return retval;
+		inode = &inode_buf;
+	}
+
+	if (ext2fs_file_block_offset_too_big(fs, inode, lblk))
+		return EXT2_ET_FILE_TOO_BIG;
+	if (inode->i_flags & EXT4_INLINE_DATA_FL)
+		return EXT2_ET_INLINE_DATA_NO_BLOCK;
+
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		retval = extent_bmap_range(fs, ino, inode, lblk, max_len,
+					   ret_extent);
+		if (retval)
+			return retval;
+		if (ret_extent->e_len == 0 || ret_extent->e_len > max_len)
+			ret_extent->e_len = max_len;
+		return 0;
+	}
+
+	/*
+	 * Block-mapped files have no notion of an extent, so just walk
+	 * forward until the mapping stops being contiguous.  Each step
+	 * is a full bmap lookup, so don't walk further than one indirect
+	 * block's worth of entries; a long hole would otherwise cost a
+	 * lookup per block all the way to max_len.
+	 */
+	if (max_len > EXT2_ADDR_PER_BLOCK(fs->super))
+		max_len = EXT2_ADDR_PER_BLOCK(fs->super);
+	retval = ext2fs_bmap2(fs, ino, inode, block_buf, 0, lblk, 0, &pblk);
+	if (retval)
+		return retval;
+	ret_extent->e_pblk = pblk;
+	ret_extent->e_len = 1;
+	while (ret_extent->e_len < max_len &&
+	       !ext2fs_file_block_offset_too_big(fs, inode,
+						 lblk + ret_extent->e_len)) {
+		retval = ext2fs_bmap2(fs, ino, inode, block_buf, 0,
+				      lblk + ret_extent->e_len, 0, &next);
+		if (retval)
+			return retval;
+		if (pblk ? (next != pblk + ret_extent->e_len) : (next != 0))
+			break;
+		ret_extent->e_len++;
+	}
+	return 0;
+}
+
 errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 		      char *block_buf, int bmap_flags, blk_t block,
 		      blk_t *phys_blk)
@@ -25,7 +25,7 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 /*
  * This routine sanity checks the group descriptors
@@ -45,6 +45,10 @@ errcode_t ext2fs_check_desc(ext2_filsys fs)
 	if (EXT2_DESC_SIZE(fs->super) & (EXT2_DESC_SIZE(fs->super) - 1))
 		return EXT2_ET_BAD_DESC_SIZE;
 
+	retval = ext2fs_fill_lazy_gdt(fs);
+	if (retval)
+		return retval;
+
 	retval = ext2fs_allocate_subcluster_bitmap(fs, "check_desc map", &bmap);
 	if (retval)
 		return retval;
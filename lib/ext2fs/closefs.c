@@ -20,6 +20,9 @@
 #include "ext2_fs.h"
 #include "ext2fsP.h"
 
+/* Backup groups written at once by ext2fs_flush() */
+#define FLUSH_MAX_INFLIGHT	8
+
 static int test_root(unsigned int a, unsigned int b)
 {
 	while (1) {
@@ -250,9 +253,15 @@ void ext2fs_update_dynamic_rev(ext2_filsys fs)
 	/* other fields should be left alone */
 }
 
-static errcode_t write_backup_super(ext2_filsys fs, dgrp_t group,
-				    blk64_t group_block,
-				    struct ext2_super_block *super_shadow)
+/*
+ * Queue a backup superblock.  It takes up the whole block, with the
+ * rest of it zeroed, so that it can be merged with the descriptor
+ * blocks which follow it.
+ */
+static errcode_t write_backup_super(ext2_filsys fs, io_write_batch batch,
+				    dgrp_t group, blk64_t group_block,
+				    struct ext2_super_block *super_shadow,
+				    char *buf)
 {
 	errcode_t retval;
 	dgrp_t	sgrp = group;
@@ -266,8 +275,17 @@ static errcode_t write_backup_super(ext2_filsys fs, dgrp_t group,
 	if (retval)
 		return retval;
 
-	return io_channel_write_blk64(fs->io, group_block, -SUPERBLOCK_SIZE,
-				    super_shadow);
+	memcpy(buf, super_shadow, SUPERBLOCK_SIZE);
+	return io_channel_write_batch_add(batch, group_block, 1, buf);
+}
+
+/* Queue a write if there is a batch, or else write straight away */
+static errcode_t flush_write(ext2_filsys fs, io_write_batch batch,
+			     blk64_t blk, blk64_t count, void *buf)
+{
+	if (batch)
+		return io_channel_write_batch_add(batch, blk, count, buf);
+	return io_channel_write_blk64(fs->io, blk, count, buf);
 }
 
 errcode_t ext2fs_flush(ext2_filsys fs)
@@ -288,7 +306,10 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	dgrp_t		j;
 #endif
 	char	*group_ptr;
-	blk64_t	old_desc_blocks;
+	char	*super_buf = 0;
+	io_write_batch batch = 0;
+	blk64_t	old_desc_blocks, max_blocks;
+	int	inflight;
 	struct ext2fs_numeric_progress_struct progress;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
@@ -298,6 +319,13 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	    fs->group_desc == NULL)
 		return EXT2_ET_NO_GDESC;
 
+	/* Never write back a table which was only partly read in */
+	if ((fs->flags & EXT2_FLAG_SUPER_ONLY) == 0) {
+		retval = ext2fs_fill_lazy_gdt(fs);
+		if (retval)
+			return retval;
+	}
+
 	fs_state = fs->super->s_state;
 	feature_incompat = fs->super->s_feature_incompat;
 
@@ -378,6 +406,31 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 		(fs->progress_ops->init)(fs, &progress, NULL,
 					 fs->group_desc_count);
 
+	/*
+	 * Groups are visited in ascending block order, so a backup
+	 * superblock and the descriptor blocks right after it go out as
+	 * one write, and with a thread-safe channel several groups are
+	 * written at once.  That is only worth setting up when there are
+	 * backups to write; no write is longer than one superblock and
+	 * its descriptors.  Nothing is flushed until the primary
+	 * superblock is written below.
+	 */
+	if (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&
+	    fs->group_desc_count > 1) {
+		retval = ext2fs_get_memzero(fs->blocksize, &super_buf);
+		if (retval)
+			goto errout;
+		max_blocks = 1;
+		if (!(fs->flags & EXT2_FLAG_SUPER_ONLY))
+			max_blocks += old_desc_blocks ? old_desc_blocks : 1;
+		inflight = FLUSH_MAX_INFLIGHT;
+		if (fs->group_desc_count - 1 < (dgrp_t) inflight)
+			inflight = fs->group_desc_count - 1;
+		retval = io_channel_write_batch_init2(fs->io, inflight,
+						      max_blocks, &batch);
+		if (retval)
+			goto errout;
+	}
 
 	for (i = 0; i < fs->group_desc_count; i++) {
 		blk64_t	super_blk, old_desc_blk, new_desc_blk;
@@ -388,8 +441,8 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 					 &new_desc_blk, 0);
 
 		if (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&i && super_blk) {
-			retval = write_backup_super(fs, i, super_blk,
-						    super_shadow);
+			retval = write_backup_super(fs, batch, i, super_blk,
+						    super_shadow, super_buf);
 			if (retval)
 				goto errout;
 		}
@@ -397,20 +450,26 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 			continue;
 		if ((old_desc_blk) &&
 		    (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) || (i == 0))) {
-			retval = io_channel_write_blk64(fs->io,
-			      old_desc_blk, old_desc_blocks, group_ptr);
+			retval = flush_write(fs, batch, old_desc_blk,
+					     old_desc_blocks, group_ptr);
 			if (retval)
 				goto errout;
 		}
 		if (new_desc_blk) {
 			int meta_bg = i / EXT2_DESC_PER_BLOCK(fs->super);
 
-			retval = io_channel_write_blk64(fs->io, new_desc_blk,
-				1, group_ptr + (meta_bg*fs->blocksize));
+			retval = flush_write(fs, batch, new_desc_blk, 1,
+				group_ptr + (meta_bg*fs->blocksize));
 			if (retval)
 				goto errout;
 		}
 	}
+	if (batch) {
+		retval = io_channel_write_batch_finish(batch);
+		batch = NULL;
+		if (retval)
+			goto errout;
+	}
 
 	if (fs->progress_ops && fs->progress_ops->close)
 		(fs->progress_ops->close)(fs, &progress, NULL);
@@ -434,7 +493,7 @@ write_primary_superblock_only:
 
 	retval = ext2fs_superblock_csum_set(fs, super_shadow);
 	if (retval)
-		return retval;
+		goto errout;
 
 	if (!(flags & EXT2_FLAG_FLUSH_NO_SYNC)) {
 		retval = io_channel_flush(fs->io);
@@ -454,6 +513,10 @@ write_primary_superblock_only:
 	}
 errout:
 	fs->super->s_state = fs_state;
+	if (batch)
+		io_channel_write_batch_cancel(batch);
+	if (super_buf)
+		ext2fs_free_mem(&super_buf);
 #ifdef WORDS_BIGENDIAN
 	if (super_shadow)
 		ext2fs_free_mem(&super_shadow);
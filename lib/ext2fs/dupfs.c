@@ -43,10 +43,15 @@ errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest)
 	fs->mmp_buf = 0;
 	fs->mmp_cmp = 0;
 	fs->mmp_fd = -1;
+	fs->free_index = 0;
+	fs->lazy_gdt = 0;
+	fs->flags &= ~EXT2_FLAG_LAZY_GDT;
 
 	io_channel_bumpcount(fs->io);
 	if (fs->icache)
 		fs->icache->refcount++;
+	if (fs->ecache)
+		fs->ecache->refcount++;
 
 	retval = ext2fs_get_mem(strlen(src->device_name)+1, &fs->device_name);
 	if (retval)
@@ -63,6 +68,9 @@ errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest)
 		goto errout;
 	memcpy(fs->orig_super, src->orig_super, SUPERBLOCK_SIZE);
 
+	retval = ext2fs_fill_lazy_gdt(src);
+	if (retval)
+		goto errout;
 	retval = ext2fs_get_array(fs->desc_blocks, fs->blocksize,
 				&fs->group_desc);
 	if (retval)
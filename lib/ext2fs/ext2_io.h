@@ -29,6 +29,8 @@ ext2_loff_t ext2fs_llseek (int, ext2_loff_t, int);
 typedef struct struct_io_manager *io_manager;
 typedef struct struct_io_channel *io_channel;
 typedef struct struct_io_stats *io_stats;
+typedef struct struct_io_discard_batch *io_discard_batch;
+typedef struct struct_io_write_batch *io_write_batch;
 
 #define CHANNEL_FLAGS_WRITETHROUGH	0x01
 #define CHANNEL_FLAGS_DISCARD_ZEROES	0x02
@@ -58,7 +60,8 @@ struct struct_io_channel {
 				       errcode_t error);
 	int		refcount;
 	int		flags;
-	long		reserved[14];
+	unsigned long	discard_max_sectors;	/* 0 if unknown */
+	long		reserved[13];
 	void		*private_data;
 	void		*app_data;
 	int		align;
@@ -136,6 +139,29 @@ extern errcode_t io_channel_discard(io_channel channel,
 extern errcode_t io_channel_zeroout(io_channel channel,
 				    unsigned long long block,
 				    unsigned long long count);
+extern errcode_t io_channel_discard_batch_init(io_channel channel,
+					       int max_inflight,
+					       io_discard_batch *ret_batch);
+extern errcode_t io_channel_discard_batch_add(io_discard_batch batch,
+					      unsigned long long block,
+					      unsigned long long count);
+extern unsigned long long
+io_channel_discard_batch_progress(io_discard_batch batch);
+extern errcode_t io_channel_discard_batch_finish(io_discard_batch batch);
+extern void io_channel_discard_batch_cancel(io_discard_batch batch);
+extern errcode_t io_channel_write_batch_init(io_channel channel,
+					     int max_inflight,
+					     io_write_batch *ret_batch);
+extern errcode_t io_channel_write_batch_init2(io_channel channel,
+					      int max_inflight,
+					      unsigned long long max_blocks,
+					      io_write_batch *ret_batch);
+extern errcode_t io_channel_write_batch_add(io_write_batch batch,
+					    unsigned long long block,
+					    unsigned long long count,
+					    const void *data);
+extern errcode_t io_channel_write_batch_finish(io_write_batch batch);
+extern void io_channel_write_batch_cancel(io_write_batch batch);
 extern errcode_t io_channel_alloc_buf(io_channel channel,
 				      int count, void *ptr);
 extern errcode_t io_channel_cache_readahead(io_channel io,
@@ -155,11 +181,17 @@ extern io_manager unixfd_io_manager;
 extern io_manager sparse_io_manager;
 extern io_manager sparsefd_io_manager;
 
+/* qcow2_io.c */
+extern io_manager qcow2_io_manager;
+
 /* undo_io.c */
 extern io_manager undo_io_manager;
 extern errcode_t set_undo_io_backing_manager(io_manager manager);
 extern errcode_t set_undo_io_backup_file(char *file_name);
 
+/* zimage_io.c */
+extern io_manager zimage_io_manager;
+
 /* test_io.c */
 extern io_manager test_io_manager, test_io_backing_manager;
 extern void (*test_io_cb_read_blk)
@@ -220,6 +220,7 @@ typedef struct ext2_file *ext2_file_t;
 #define EXT2_FLAG_IBITMAP_TAIL_PROBLEM	0x2000000
 #define EXT2_FLAG_THREADS		0x4000000
 #define EXT2_FLAG_IGNORE_SWAP_DIRENT	0x8000000
+#define EXT2_FLAG_LAZY_GDT		0x10000000
 
 /*
  * Special flag in the ext2 inode i_flag field that means that this is
@@ -331,6 +332,15 @@ struct struct_ext2_filsys {
 	struct ext2fs_hashmap* block_sha_map;
 
 	const struct ext2fs_nls_table *encoding;
+
+	/* Extent tree block cache (optional) */
+	struct ext2_extent_cache *ecache;
+
+	/* Index of free block extents (optional) */
+	struct ext2_free_index *free_index;
+
+	/* Descriptor blocks not yet read (EXT2_FLAG_LAZY_GDT) */
+	struct ext2_lazy_gdt *lazy_gdt;
 };
 
 #if EXT2_FLAT_INCLUDES
@@ -482,6 +492,17 @@ struct ext2_extent_info {
 	__u32		max_uninit_len;
 };
 
+/*
+ * Statistics for the optional extent tree block cache
+ */
+struct ext2_extent_cache_stats {
+	__u64		lookups;
+	__u64		hits;
+	__u64		invalidations;
+	unsigned int	cache_size;
+	unsigned int	cache_used;
+};
+
 /*
  * Flags for directory block reading and writing functions
  */
@@ -737,6 +758,9 @@ static inline int ext2fs_needs_large_file_feature(unsigned long long file_size)
 extern void ext2fs_clear_block_uninit(ext2_filsys fs, dgrp_t group);
 extern errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir, int mode,
 				  ext2fs_inode_bitmap map, ext2_ino_t *ret);
+extern errcode_t ext2fs_new_inodes_batch(ext2_filsys fs, ext2_ino_t dir,
+					 int mode, ext2_ino_t count,
+					 ext2_ino_t *ret, ext2_ino_t *ret_count);
 extern errcode_t ext2fs_new_block(ext2_filsys fs, blk_t goal,
 				  ext2fs_block_bitmap map, blk_t *ret);
 extern errcode_t ext2fs_new_block2(ext2_filsys fs, blk64_t goal,
@@ -781,7 +805,8 @@ extern void ext2fs_set_block_alloc_stats_range_callback(ext2_filsys fs,
 				    blk_t num, int inuse));
 #define EXT2_NEWRANGE_FIXED_GOAL	(0x1)
 #define EXT2_NEWRANGE_MIN_LENGTH	(0x2)
-#define EXT2_NEWRANGE_ALL_FLAGS		(0x3)
+#define EXT2_NEWRANGE_BEST_FIT		(0x4)
+#define EXT2_NEWRANGE_ALL_FLAGS		(0x7)
 errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
 			   blk64_t len, ext2fs_block_bitmap map, blk64_t *pblk,
 			   blk64_t *plen);
@@ -791,6 +816,10 @@ errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
 errcode_t ext2fs_alloc_range(ext2_filsys fs, int flags, blk64_t goal,
 			     blk_t len, blk64_t *ret);
 
+/* alloc_index.c */
+extern errcode_t ext2fs_create_free_index(ext2_filsys fs);
+extern void ext2fs_release_free_index(ext2_filsys fs);
+
 /* alloc_sb.c */
 extern int ext2fs_reserve_super_and_bgd(ext2_filsys fs,
 					dgrp_t group,
@@ -957,6 +986,7 @@ extern void ext2fs_free_blocks_count_add(struct ext2_super_block *super,
 extern struct ext2_group_desc *ext2fs_group_desc(ext2_filsys fs,
 					  struct opaque_ext2_group_desc *gdp,
 					  dgrp_t group);
+extern errcode_t ext2fs_load_group_descs(ext2_filsys fs);
 extern blk64_t ext2fs_block_bitmap_csum(ext2_filsys fs, dgrp_t group);
 extern blk64_t ext2fs_block_bitmap_loc(ext2_filsys fs, dgrp_t group);
 extern void ext2fs_block_bitmap_loc_set(ext2_filsys fs, dgrp_t group,
@@ -1039,6 +1069,10 @@ extern errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino,
 errcode_t ext2fs_map_cluster_block(ext2_filsys fs, ext2_ino_t ino,
 				   struct ext2_inode *inode, blk64_t lblk,
 				   blk64_t *pblk);
+extern errcode_t ext2fs_bmap_range(ext2_filsys fs, ext2_ino_t ino,
+				   struct ext2_inode *inode, char *block_buf,
+				   blk64_t lblk, blk64_t max_len,
+				   struct ext2fs_extent *ret_extent);
 
 #if 0
 /* bmove.c */
@@ -1357,13 +1391,21 @@ extern errcode_t ext2fs_count_blocks(ext2_filsys fs, ext2_ino_t ino,
 				     struct ext2_inode *inode, blk64_t *ret_count);
 extern errcode_t ext2fs_decode_extent(struct ext2fs_extent *to, void *from,
 				      int len);
+extern errcode_t ext2fs_create_extent_cache(ext2_filsys fs,
+					    unsigned int cache_size);
+extern void ext2fs_free_extent_cache(struct ext2_extent_cache *ecache);
+extern void ext2fs_extent_cache_invalidate(ext2_filsys fs, blk64_t blk,
+					   blk64_t num);
+extern void ext2fs_get_extent_cache_stats(ext2_filsys fs,
+					  struct ext2_extent_cache_stats *stats);
 
 /* fallocate.c */
 #define EXT2_FALLOCATE_ZERO_BLOCKS	(0x1)
 #define EXT2_FALLOCATE_FORCE_INIT	(0x2)
 #define EXT2_FALLOCATE_FORCE_UNINIT	(0x4)
 #define EXT2_FALLOCATE_INIT_BEYOND_EOF	(0x8)
-#define EXT2_FALLOCATE_ALL_FLAGS	(0xF)
+#define EXT2_FALLOCATE_WILL_OVERWRITE	(0x10)
+#define EXT2_FALLOCATE_ALL_FLAGS	(0x1F)
 errcode_t ext2fs_fallocate(ext2_filsys fs, int flags, ext2_ino_t ino,
 			   struct ext2_inode *inode, blk64_t goal,
 			   blk64_t start, blk64_t len);
@@ -1391,6 +1433,8 @@ errcode_t ext2fs_file_get_lsize(ext2_file_t file, __u64 *ret_size);
 extern ext2_off_t ext2fs_file_get_size(ext2_file_t file);
 extern errcode_t ext2fs_file_set_size(ext2_file_t file, ext2_off_t size);
 extern errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size);
+extern errcode_t ext2fs_file_set_bufsize(ext2_file_t file,
+					 unsigned int nblocks);
 
 /* finddev.c */
 extern char *ext2fs_find_block_device(dev_t device);
@@ -12,6 +12,9 @@
 #if HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "ext2fs.h"
 
@@ -85,6 +88,10 @@ struct ext2_inode_cache {
 	unsigned int			cache_size;
 	int				refcount;
 	struct ext2_inode_cache_ent	*cache;
+#ifdef HAVE_PTHREAD
+	int				use_mutex;
+	pthread_mutex_t			mutex;
+#endif
 };
 
 struct ext2_inode_cache_ent {
@@ -92,6 +99,51 @@ struct ext2_inode_cache_ent {
 	struct ext2_inode	*inode;
 };
 
+/*
+ * Extent tree block cache structure; entries are looked up by the
+ * owning inode and the physical block of the index or leaf node.
+ */
+struct ext2_extent_cache {
+	unsigned int			cache_size;
+	unsigned int			cache_used;
+	int				refcount;
+	unsigned long			tick;
+	__u64				lookups;
+	__u64				hits;
+	__u64				invalidations;
+	struct ext2_extent_cache_ent	*cache;
+#ifdef HAVE_PTHREAD
+	int				use_mutex;
+	pthread_mutex_t			mutex;
+#endif
+};
+
+struct ext2_extent_cache_ent {
+	ext2_ino_t		ino;
+	blk64_t			blk;
+	unsigned long		last_used;
+	char			*buf;
+};
+
+/*
+ * Group descriptor blocks of a file system opened with
+ * EXT2_FLAG_LAZY_GDT.  A block is read from group_block (or its
+ * meta_bg location) the first time one of its descriptors is used.
+ */
+struct ext2_lazy_gdt {
+	blk64_t				group_block;
+	int				zero_adjust;
+	unsigned long			first_meta_bg;
+	unsigned long			unloaded;
+	errcode_t			error;
+	errcode_t			csum_error;
+	char				*loaded;
+#ifdef HAVE_PTHREAD
+	int				use_mutex;
+	pthread_mutex_t			mutex;
+#endif
+};
+
 /*
  * NLS defintions
  */
@@ -111,8 +163,117 @@ struct ext2fs_nls_ops {
 			    const unsigned char *str2, size_t len2);
 };
 
+/*
+ * Common part of the private data of the read-only I/O managers for
+ * e2image files (zimage_io.c, qcow2_io.c).  The image is read in
+ * chunks of chunk_bytes, which the manager looks up through its ops.
+ */
+struct ext2fs_image_io;
+
+struct ext2fs_image_io_ops {
+	int		magic;
+	/*
+	 * Return the contents of a chunk in *buf, or NULL if the chunk
+	 * reads as zeroes.  Called with the channel locked.
+	 */
+	errcode_t	(*get_chunk)(struct ext2fs_image_io *data,
+				     unsigned long long chunk, char **buf);
+	/* Free the manager's own state, including data itself */
+	void		(*free_data)(struct ext2fs_image_io *data);
+};
+
+struct ext2fs_image_io {
+	int			magic;
+	int			dev;
+	const struct ext2fs_image_io_ops *ops;
+	unsigned long long	size;		/* in bytes */
+	size_t			chunk_bytes;
+	struct struct_io_stats	io_stats;
+#ifdef HAVE_PTHREAD
+	int			use_lock;
+	pthread_mutex_t		lock;
+#endif
+};
+
+/*
+ * The path from the root of a htree directory's index to the leaf
+ * which holds a given name; see ext2fs_dx_lookup().
+ */
+struct dx_frame {
+	void *buf;
+	blk64_t pblock;
+	struct ext2_dx_countlimit *head;
+	struct ext2_dx_entry *entries;
+	struct ext2_dx_entry *at;
+};
+
+struct dx_lookup_info {
+	const char *name;
+	int namelen;
+	int hash_alg;
+	__u32 hash;
+	unsigned levels;
+	struct dx_frame frames[EXT4_HTREE_LEVEL];
+};
+
 /* Function prototypes */
 
+/* blknum.c */
+extern void ext2fs_free_lazy_gdt(ext2_filsys fs);
+extern errcode_t ext2fs_fill_lazy_gdt(ext2_filsys fs);
+
+/* image_io.c */
+extern errcode_t ext2fs_image_io_read_full(int fd, ext2_loff_t offset,
+					   void *buf, size_t len);
+extern errcode_t ext2fs_image_io_open(const char *name, int flags,
+				      const struct ext2fs_image_io_ops *ops,
+				      struct ext2fs_image_io *data);
+extern errcode_t ext2fs_image_io_channel(io_manager manager, const char *name,
+					 int flags,
+					 struct ext2fs_image_io *data,
+					 io_channel *channel);
+extern void ext2fs_image_io_free(struct ext2fs_image_io *data);
+extern void ext2fs_image_io_lock(struct ext2fs_image_io *data);
+extern void ext2fs_image_io_unlock(struct ext2fs_image_io *data);
+extern errcode_t ext2fs_image_io_close(io_channel channel);
+extern errcode_t ext2fs_image_io_set_blksize(io_channel channel, int blksize);
+extern errcode_t ext2fs_image_io_read_blk(io_channel channel,
+					  unsigned long block, int count,
+					  void *buf);
+extern errcode_t ext2fs_image_io_read_blk64(io_channel channel,
+					    unsigned long long block,
+					    int count, void *buf);
+extern errcode_t ext2fs_image_io_write_blk(io_channel channel,
+					   unsigned long block, int count,
+					   const void *buf);
+extern errcode_t ext2fs_image_io_write_blk64(io_channel channel,
+					     unsigned long long block,
+					     int count, const void *buf);
+extern errcode_t ext2fs_image_io_write_byte(io_channel channel,
+					    unsigned long offset, int size,
+					    const void *buf);
+extern errcode_t ext2fs_image_io_flush(io_channel channel);
+extern errcode_t ext2fs_image_io_set_option(io_channel channel,
+					    const char *option,
+					    const char *arg);
+extern errcode_t ext2fs_image_io_get_stats(io_channel channel,
+					   io_stats *stats);
+
+/* link.c */
+extern errcode_t ext2fs_dx_read_block(ext2_filsys fs, ext2_ino_t dir,
+				      struct ext2_inode *diri, blk64_t block,
+				      blk64_t *pblk, void *buf);
+extern errcode_t ext2fs_dx_lookup(ext2_filsys fs, ext2_ino_t dir,
+				  struct ext2_inode *diri,
+				  struct dx_lookup_info *info);
+extern void ext2fs_dx_release(struct dx_lookup_info *info);
+
+extern void ext2fs_free_index_update(ext2_filsys fs, blk64_t blk, blk64_t num,
+				     int inuse);
+extern errcode_t ext2fs_free_index_find(ext2_filsys fs, int flags,
+					blk64_t goal, blk64_t len,
+					blk64_t *pblk, blk64_t *plen);
+
 extern int ext2fs_process_dir_block(ext2_filsys  	fs,
 				    blk64_t		*blocknr,
 				    e2_blkcnt_t		blockcnt,
@@ -62,6 +62,7 @@ struct ext2_extent_handle {
 	int			level;
 	int			max_depth;
 	int			max_paths;
+	int			verify_csum;
 	struct extent_path	*path;
 };
 
@@ -189,6 +190,189 @@ errcode_t ext2fs_extent_header_verify(void *ptr, int size)
 }
 
 
+/*
+ * Extent tree block cache
+ *
+ * When enabled with ext2fs_create_extent_cache(), index and leaf
+ * blocks read by ext2fs_extent_get() are kept in a small LRU cache
+ * shared by all of the extent handles opened on the file system, so
+ * that repeatedly opening or repositioning a handle on the same file
+ * does not have to go back to the io_channel for every level of the
+ * tree.  Entries are dropped when the block is written through an
+ * extent handle or released via ext2fs_block_alloc_stats*().  As with
+ * the inode cache, a file system opened with EXT2_FLAG_THREADS gets a
+ * cache which may be used from several threads.
+ */
+static inline void ecache_lock(struct ext2_extent_cache *ecache)
+{
+#ifdef HAVE_PTHREAD
+	if (ecache->use_mutex)
+		pthread_mutex_lock(&ecache->mutex);
+#endif
+}
+
+static inline void ecache_unlock(struct ext2_extent_cache *ecache)
+{
+#ifdef HAVE_PTHREAD
+	if (ecache->use_mutex)
+		pthread_mutex_unlock(&ecache->mutex);
+#endif
+}
+
+void ext2fs_free_extent_cache(struct ext2_extent_cache *ecache)
+{
+	unsigned int	i;
+
+	if (--ecache->refcount)
+		return;
+	for (i = 0; i < ecache->cache_size; i++)
+		if (ecache->cache[i].buf)
+			ext2fs_free_mem(&ecache->cache[i].buf);
+	if (ecache->cache)
+		ext2fs_free_mem(&ecache->cache);
+#ifdef HAVE_PTHREAD
+	if (ecache->use_mutex)
+		pthread_mutex_destroy(&ecache->mutex);
+#endif
+	ext2fs_free_mem(&ecache);
+}
+
+errcode_t ext2fs_create_extent_cache(ext2_filsys fs, unsigned int cache_size)
+{
+	struct ext2_extent_cache	*ecache;
+	unsigned int			i;
+	errcode_t			retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (fs->ecache)
+		return 0;
+	if (cache_size == 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_extent_cache), &ecache);
+	if (retval)
+		return retval;
+	ecache->refcount = 1;
+	ecache->cache_size = cache_size;
+	retval = ext2fs_get_arrayzero(cache_size,
+				      sizeof(struct ext2_extent_cache_ent),
+				      &ecache->cache);
+	if (retval)
+		goto errout;
+	for (i = 0; i < cache_size; i++) {
+		retval = ext2fs_get_mem(fs->blocksize, &ecache->cache[i].buf);
+		if (retval)
+			goto errout;
+	}
+#ifdef HAVE_PTHREAD
+	if (fs->io->flags & CHANNEL_FLAGS_THREADS) {
+		retval = pthread_mutex_init(&ecache->mutex, NULL);
+		if (retval)
+			goto errout;
+		ecache->use_mutex = 1;
+	}
+#endif
+	fs->ecache = ecache;
+	return 0;
+
+errout:
+	ext2fs_free_extent_cache(ecache);
+	return retval;
+}
+
+void ext2fs_extent_cache_invalidate(ext2_filsys fs, blk64_t blk, blk64_t num)
+{
+	struct ext2_extent_cache_ent	*ent;
+	unsigned int			i;
+
+	if (!fs->ecache)
+		return;
+
+	ecache_lock(fs->ecache);
+	for (i = 0, ent = fs->ecache->cache;
+	     fs->ecache->cache_used && i < fs->ecache->cache_size;
+	     i++, ent++) {
+		if (!ent->blk || ent->blk < blk || ent->blk >= blk + num)
+			continue;
+		ent->blk = 0;
+		fs->ecache->cache_used--;
+		fs->ecache->invalidations++;
+	}
+	ecache_unlock(fs->ecache);
+}
+
+void ext2fs_get_extent_cache_stats(ext2_filsys fs,
+				   struct ext2_extent_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(struct ext2_extent_cache_stats));
+	if (!fs->ecache)
+		return;
+	ecache_lock(fs->ecache);
+	stats->lookups = fs->ecache->lookups;
+	stats->hits = fs->ecache->hits;
+	stats->invalidations = fs->ecache->invalidations;
+	stats->cache_size = fs->ecache->cache_size;
+	stats->cache_used = fs->ecache->cache_used;
+	ecache_unlock(fs->ecache);
+}
+
+static int extent_cache_lookup(ext2_filsys fs, ext2_ino_t ino, blk64_t blk,
+			       char *buf)
+{
+	struct ext2_extent_cache	*ecache = fs->ecache;
+	struct ext2_extent_cache_ent	*ent;
+	unsigned int			i;
+
+	if (!ecache)
+		return 0;
+
+	ecache_lock(ecache);
+	ecache->lookups++;
+	for (i = 0, ent = ecache->cache; i < ecache->cache_size; i++, ent++) {
+		if (ent->blk != blk || ent->ino != ino)
+			continue;
+		memcpy(buf, ent->buf, fs->blocksize);
+		ent->last_used = ++ecache->tick;
+		ecache->hits++;
+		ecache_unlock(ecache);
+		return 1;
+	}
+	ecache_unlock(ecache);
+	return 0;
+}
+
+static void extent_cache_insert(ext2_filsys fs, ext2_ino_t ino, blk64_t blk,
+				char *buf)
+{
+	struct ext2_extent_cache	*ecache = fs->ecache;
+	struct ext2_extent_cache_ent	*ent, *victim = NULL;
+	unsigned int			i;
+
+	if (!ecache)
+		return;
+
+	ecache_lock(ecache);
+	for (i = 0, ent = ecache->cache; i < ecache->cache_size; i++, ent++) {
+		/* Another thread may have raced us to it */
+		if (ent->blk == blk && ent->ino == ino) {
+			victim = ent;
+			break;
+		}
+		if (!victim || (victim->blk &&
+				(!ent->blk ||
+				 ent->last_used < victim->last_used)))
+			victim = ent;
+	}
+	if (!victim->blk)
+		ecache->cache_used++;
+	victim->ino = ino;
+	victim->blk = blk;
+	victim->last_used = ++ecache->tick;
+	memcpy(victim->buf, buf, fs->blocksize);
+	ecache_unlock(ecache);
+}
+
 /*
  * Begin functions to handle an inode's extent information
  */
@@ -316,6 +500,7 @@ errcode_t ext2fs_extent_get(ext2_extent_handle_t handle,
 	blk64_t				end_blk;
 	int				orig_op, op, l;
 	int				failed_csum = 0;
+	int				cached;
 
 	EXT2_CHECK_MAGIC(handle, EXT2_ET_MAGIC_EXTENT_HANDLE);
 
@@ -474,9 +659,13 @@ retry:
 				return EXT2_ET_EXTENT_CYCLE;
 		}
 		newpath->blk = blk;
+		cached = 0;
 		if ((handle->fs->flags & EXT2_FLAG_IMAGE_FILE) &&
 		    (handle->fs->io != handle->fs->image_io))
 			memset(newpath->buf, 0, handle->fs->blocksize);
+		else if (extent_cache_lookup(handle->fs, handle->ino, blk,
+					     newpath->buf))
+			cached = 1;
 		else {
 			retval = io_channel_read_blk64(handle->fs->io,
 						     blk, 1, newpath->buf);
@@ -493,10 +682,18 @@ retry:
 			return retval;
 		}
 
-		if (!(handle->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-		    !ext2fs_extent_block_csum_verify(handle->fs, handle->ino,
-						     eh))
-			failed_csum = 1;
+		/* Only blocks with a valid checksum make it into the cache */
+		if (cached)
+			;
+		else if (!ext2fs_extent_block_csum_verify(handle->fs,
+							  handle->ino, eh)) {
+			if (handle->verify_csum ||
+			    !(handle->fs->flags &
+			      EXT2_FLAG_IGNORE_CSUM_ERRORS))
+				failed_csum = 1;
+		} else if (!(handle->fs->flags & EXT2_FLAG_IMAGE_FILE))
+			extent_cache_insert(handle->fs, handle->ino, blk,
+					    newpath->buf);
 
 		newpath->left = newpath->entries =
 			ext2fs_le16_to_cpu(eh->eh_entries);
@@ -609,6 +806,7 @@ static errcode_t update_path(ext2_extent_handle_t handle)
 		if (retval)
 			return retval;
 
+		ext2fs_extent_cache_invalidate(handle->fs, blk, 1);
 		retval = io_channel_write_blk64(handle->fs->io,
 				      blk, 1, handle->path[handle->level].buf);
 	}
@@ -1077,6 +1275,7 @@ static errcode_t extent_node_split(ext2_extent_handle_t handle,
 		goto done;
 
 	/* ...and write the new node block out to disk. */
+	ext2fs_extent_cache_invalidate(handle->fs, new_node_pblk, 1);
 	retval = io_channel_write_blk64(handle->fs->io, new_node_pblk, 1,
 					block_buf);
 
@@ -1758,7 +1957,6 @@ errcode_t ext2fs_fix_extents_checksums(ext2_filsys fs, ext2_ino_t ino,
 	ext2_extent_handle_t	handle;
 	struct ext2fs_extent	extent;
 	errcode_t		errcode;
-	int    			save_flags = fs->flags;
 
 	if (!ext2fs_has_feature_metadata_csum(fs->super) ||
 	    (inode && !(inode->i_flags & EXT4_EXTENTS_FL)))
@@ -1771,7 +1969,13 @@ errcode_t ext2fs_fix_extents_checksums(ext2_filsys fs, ext2_ino_t ino,
 		return errcode;
 	}
 
-	fs->flags &= ~EXT2_FLAG_IGNORE_CSUM_ERRORS;
+	/*
+	 * Report bad checksums to us even if the caller ignores them.
+	 * This is done on the handle rather than by clearing
+	 * EXT2_FLAG_IGNORE_CSUM_ERRORS so that other threads sharing
+	 * the file system are unaffected.
+	 */
+	handle->verify_csum = 1;
 	errcode = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
 	if (errcode)
 		goto out;
@@ -1796,7 +2000,6 @@ out:
 	if (errcode == EXT2_ET_EXTENT_NO_NEXT)
 		errcode = 0;
 	ext2fs_extent_free(handle);
-	fs->flags = save_flags;
 	return errcode;
 }
 
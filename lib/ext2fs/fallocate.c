@@ -262,11 +262,12 @@ try_merge:
 			goto try_left;
 
 		/*
-		 * Skip initialized extent unless user wants to zero blocks
-		 * or requires init extent.
+		 * Skip initialized extent unless user wants to zero (or
+		 * overwrite) blocks or requires init extent.
 		 */
 		if (!(left_ext->e_flags & EXT2_EXTENT_FLAGS_UNINIT) &&
-		    (!(flags & EXT2_FALLOCATE_ZERO_BLOCKS) ||
+		    (!(flags & (EXT2_FALLOCATE_ZERO_BLOCKS |
+				EXT2_FALLOCATE_WILL_OVERWRITE)) ||
 		     !(flags & EXT2_FALLOCATE_FORCE_INIT)))
 			goto try_left;
 
@@ -332,7 +333,8 @@ try_left:
 		/* How many more blocks can be attached to left_ext? */
 		if (left_ext->e_flags & EXT2_EXTENT_FLAGS_UNINIT)
 			fillable = max_uninit_len - left_ext->e_len;
-		else if (flags & EXT2_FALLOCATE_ZERO_BLOCKS)
+		else if (flags & (EXT2_FALLOCATE_ZERO_BLOCKS |
+				  EXT2_FALLOCATE_WILL_OVERWRITE))
 			fillable = max_init_len - left_ext->e_len;
 		else
 			fillable = 0;
@@ -413,7 +415,8 @@ try_right:
 		/* How much can we attach to right_ext? */
 		if (right_ext->e_flags & EXT2_EXTENT_FLAGS_UNINIT)
 			fillable = max_uninit_len - right_ext->e_len;
-		else if (flags & EXT2_FALLOCATE_ZERO_BLOCKS)
+		else if (flags & (EXT2_FALLOCATE_ZERO_BLOCKS |
+				  EXT2_FALLOCATE_WILL_OVERWRITE))
 			fillable = max_init_len - right_ext->e_len;
 		else
 			fillable = 0;
@@ -796,6 +799,9 @@ errout:
  * - EXT2_FALLOCATE_FORCE_INIT: Create only initialized extents.
  * - EXT2_FALLOCATE_FORCE_UNINIT: Create only uninitialized extents.
  * - EXT2_FALLOCATE_INIT_BEYOND_EOF: Create extents beyond EOF.
+ * - EXT2_FALLOCATE_WILL_OVERWRITE: The caller will write every block that
+ *   is allocated, so they may be added to initialized extents without
+ *   being zeroed first.
  *
  * If neither FORCE_INIT nor FORCE_UNINIT are specified, this function will
  * try to expand any extents it finds, zeroing blocks as necessary.
@@ -30,8 +30,20 @@ struct ext2_file {
 	blk64_t			blockno;
 	blk64_t			physblock;
 	char 			*buf;
+	struct ext2fs_extent	map;	/* cached logical->physical mapping */
+	char			*wb_buf;	/* write-back buffer */
+	unsigned int		wb_max;		/* its size in blocks */
+	unsigned int		wb_count;	/* blocks queued in it */
+	blk64_t			wb_lblk;
+	blk64_t			wb_pblk;
 };
 
+/*
+ * Default number of dirty blocks which are held back and written out
+ * with a single I/O once they are evicted from the block buffer.
+ */
+#define EXT2_FILE_WB_BLOCKS	16
+
 struct block_entry {
 	blk64_t		physblock;
 	unsigned char 	sha[EXT2FS_SHA512_LENGTH];
@@ -64,6 +76,7 @@ errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
 	file->fs = fs;
 	file->ino = ino;
 	file->flags = flags & EXT2_FILE_MASK;
+	file->wb_max = EXT2_FILE_WB_BLOCKS;
 
 	if (inode) {
 		memcpy(&file->inode, inode, sizeof(struct ext2_inode));
@@ -122,18 +135,114 @@ ext2_ino_t ext2fs_file_get_inode_num(ext2_file_t file)
 }
 
 /*
- * This function flushes the dirty block buffer out to disk if
- * necessary.
+ * This function maps the logical block lblk, using the mapping cached
+ * in the file handle if it covers lblk.  On return ext describes the
+ * run of blocks from lblk to the end of the cached mapping.
  */
-errcode_t ext2fs_file_flush(ext2_file_t file)
+static errcode_t file_map_block(ext2_file_t file, blk64_t lblk,
+				struct ext2fs_extent *ext)
 {
+	ext2_filsys	fs = file->fs;
+	blk64_t		max_len;
 	errcode_t	retval;
-	ext2_filsys fs;
-	int		ret_flags;
-	blk64_t		dontcare;
 
-	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
-	fs = file->fs;
+	if (!file->map.e_len || lblk < file->map.e_lblk ||
+	    lblk >= file->map.e_lblk + file->map.e_len) {
+		max_len = (EXT2_I_SIZE(&file->inode) + fs->blocksize - 1) /
+			fs->blocksize;
+		max_len = (lblk < max_len) ? max_len - lblk : 1;
+		retval = ext2fs_bmap_range(fs, file->ino, &file->inode,
+					   BMAP_BUFFER, lblk, max_len,
+					   &file->map);
+		if (retval) {
+			file->map.e_len = 0;
+			return retval;
+		}
+	}
+
+	ext->e_lblk = lblk;
+	ext->e_len = file->map.e_lblk + file->map.e_len - lblk;
+	ext->e_pblk = 0;
+	if (file->map.e_pblk)
+		ext->e_pblk = file->map.e_pblk + (lblk - file->map.e_lblk);
+	ext->e_flags = file->map.e_flags;
+	return 0;
+}
+
+/*
+ * This function writes out the blocks queued in the write-back buffer.
+ */
+static errcode_t file_wb_flush(ext2_file_t file)
+{
+	errcode_t	retval;
+
+	if (!file->wb_count)
+		return 0;
+
+	retval = io_channel_write_blk64(file->fs->io, file->wb_pblk,
+					file->wb_count, file->wb_buf);
+	/* Keep the blocks queued on error so a later flush retries them */
+	if (retval == 0)
+		file->wb_count = 0;
+	return retval;
+}
+
+/*
+ * Returns true if any of the count logical blocks starting at lblk are
+ * queued in the write-back buffer.
+ */
+static int file_wb_overlaps(ext2_file_t file, blk64_t lblk, blk64_t count)
+{
+	return file->wb_count && lblk < file->wb_lblk + file->wb_count &&
+		lblk + count > file->wb_lblk;
+}
+
+/*
+ * This function queues the (dirty) block buffer for writing.  Blocks
+ * which are both logically and physically contiguous are gathered in
+ * the write-back buffer, so that they can be written out together.
+ */
+static errcode_t file_wb_queue(ext2_file_t file)
+{
+	ext2_filsys	fs = file->fs;
+	errcode_t	retval;
+
+	if (file->wb_count &&
+	    (file->wb_count >= file->wb_max ||
+	     file->physblock != file->wb_pblk + file->wb_count ||
+	     file->blockno != file->wb_lblk + file->wb_count)) {
+		retval = file_wb_flush(file);
+		if (retval)
+			return retval;
+	}
+
+	if (file->wb_max > 1 && !file->wb_buf &&
+	    ext2fs_get_array(file->wb_max, fs->blocksize, &file->wb_buf))
+		file->wb_max = 1;
+	if (file->wb_max <= 1)
+		return io_channel_write_blk64(fs->io, file->physblock, 1,
+					      file->buf);
+
+	if (!file->wb_count) {
+		file->wb_lblk = file->blockno;
+		file->wb_pblk = file->physblock;
+	}
+	memcpy(file->wb_buf + (size_t) file->wb_count * fs->blocksize,
+	       file->buf, fs->blocksize);
+	if (++file->wb_count >= file->wb_max)
+		return file_wb_flush(file);
+	return 0;
+}
+
+/*
+ * This function hands the dirty block buffer to the write-back buffer,
+ * allocating or initializing its block first if necessary.
+ */
+static errcode_t flush_block_buffer(ext2_file_t file)
+{
+	errcode_t	retval;
+	ext2_filsys fs = file->fs;
+	struct ext2fs_extent	ext;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID) ||
 	    !(file->flags & EXT2_FILE_BUF_DIRTY))
@@ -141,11 +250,11 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 
 	/* Is this an uninit block? */
 	if (file->physblock && file->inode.i_flags & EXT4_EXTENTS_FL) {
-		retval = ext2fs_bmap2(fs, file->ino, &file->inode, BMAP_BUFFER,
-				      0, file->blockno, &ret_flags, &dontcare);
+		retval = file_map_block(file, file->blockno, &ext);
 		if (retval)
 			return retval;
-		if (ret_flags & BMAP_RET_UNINIT) {
+		if (ext.e_flags & EXT2_EXTENT_FLAGS_UNINIT) {
+			file->map.e_len = 0;
 			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
 					      BMAP_BUFFER, BMAP_SET,
 					      file->blockno, 0,
@@ -160,6 +269,7 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 	 * Allocate it.
 	 */
 	if (!file->physblock) {
+		file->map.e_len = 0;
 		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
 				     BMAP_BUFFER, file->ino ? BMAP_ALLOC : 0,
 				     file->blockno, 0, &file->physblock);
@@ -167,7 +277,7 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 			return retval;
 	}
 
-	retval = io_channel_write_blk64(fs->io, file->physblock, 1, file->buf);
+	retval = file_wb_queue(file);
 	if (retval)
 		return retval;
 
@@ -176,6 +286,42 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 	return retval;
 }
 
+/*
+ * This function flushes the dirty block buffer and any queued blocks
+ * out to disk if necessary.
+ */
+errcode_t ext2fs_file_flush(ext2_file_t file)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+
+	retval = flush_block_buffer(file);
+	if (retval)
+		return retval;
+	return file_wb_flush(file);
+}
+
+/*
+ * This function sets the number of blocks which may be gathered in
+ * the write-back buffer; a size of 0 or 1 writes each block as soon as
+ * it leaves the block buffer.
+ */
+errcode_t ext2fs_file_set_bufsize(ext2_file_t file, unsigned int nblocks)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+
+	retval = file_wb_flush(file);
+	if (retval)
+		return retval;
+	if (file->wb_buf)
+		ext2fs_free_mem(&file->wb_buf);
+	file->wb_max = nblocks ? nblocks : 1;
+	return 0;
+}
+
 /*
  * This function synchronizes the file's block buffer and the current
  * file position, possibly invalidating block buffer if necessary
@@ -187,7 +333,7 @@ static errcode_t sync_buffer_position(ext2_file_t file)
 
 	b = file->pos / file->fs->blocksize;
 	if (b != file->blockno) {
-		retval = ext2fs_file_flush(file);
+		retval = flush_block_buffer(file);
 		if (retval)
 			return retval;
 		file->flags &= ~EXT2_FILE_BUF_VALID;
@@ -209,17 +355,21 @@ static errcode_t load_buffer(ext2_file_t file, int dontfill)
 {
 	ext2_filsys	fs = file->fs;
 	errcode_t	retval;
-	int		ret_flags;
+	struct ext2fs_extent	ext;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID)) {
-		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
-				     BMAP_BUFFER, 0, file->blockno, &ret_flags,
-				     &file->physblock);
+		if (file_wb_overlaps(file, file->blockno, 1)) {
+			retval = file_wb_flush(file);
+			if (retval)
+				return retval;
+		}
+		retval = file_map_block(file, file->blockno, &ext);
 		if (retval)
 			return retval;
+		file->physblock = ext.e_pblk;
 		if (!dontfill) {
 			if (file->physblock &&
-			    !(ret_flags & BMAP_RET_UNINIT)) {
+			    !(ext.e_flags & EXT2_EXTENT_FLAGS_UNINIT)) {
 				retval = io_channel_read_blk64(fs->io,
 							       file->physblock,
 							       1, file->buf);
@@ -244,6 +394,8 @@ errcode_t ext2fs_file_close(ext2_file_t file)
 
 	if (file->buf)
 		ext2fs_free_mem(&file->buf);
+	if (file->wb_buf)
+		ext2fs_free_mem(&file->wb_buf);
 	ext2fs_free_mem(&file);
 
 	return retval;
@@ -282,6 +434,55 @@ out:
 }
 
 
+/*
+ * Read as many whole blocks as possible, starting at the (block
+ * aligned) current position, directly into the caller's buffer
+ * with a single I/O per physically contiguous run.
+ */
+static errcode_t file_read_direct(ext2_file_t file, char *ptr,
+				  unsigned int wanted, unsigned int *got)
+{
+	ext2_filsys	fs = file->fs;
+	struct ext2fs_extent	ext;
+	blk64_t		lblk, nblocks, left;
+	errcode_t	retval;
+
+	*got = 0;
+	lblk = file->pos / fs->blocksize;
+	nblocks = wanted / fs->blocksize;
+	left = (EXT2_I_SIZE(&file->inode) - file->pos) / fs->blocksize;
+	if (nblocks > left)
+		nblocks = left;
+	if (nblocks == 0)
+		return 0;
+
+	/* Make sure the disk has the contents of our buffers */
+	if (((file->flags & EXT2_FILE_BUF_DIRTY) &&
+	     file->blockno >= lblk && file->blockno < lblk + nblocks) ||
+	    file_wb_overlaps(file, lblk, nblocks)) {
+		retval = ext2fs_file_flush(file);
+		if (retval)
+			return retval;
+	}
+
+	retval = file_map_block(file, lblk, &ext);
+	if (retval)
+		return retval;
+	if (nblocks > ext.e_len)
+		nblocks = ext.e_len;
+
+	if (ext.e_pblk && !(ext.e_flags & EXT2_EXTENT_FLAGS_UNINIT)) {
+		retval = io_channel_read_blk64(fs->io, ext.e_pblk, nblocks,
+					       ptr);
+		if (retval)
+			return retval;
+	} else
+		memset(ptr, 0, nblocks * fs->blocksize);
+
+	*got = nblocks * fs->blocksize;
+	return 0;
+}
+
 errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 			   unsigned int wanted, unsigned int *got)
 {
@@ -299,6 +500,20 @@ errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 		return ext2fs_file_read_inline_data(file, buf, wanted, got);
 
 	while ((file->pos < EXT2_I_SIZE(&file->inode)) && (wanted > 0)) {
+		if ((file->pos % fs->blocksize) == 0 &&
+		    wanted >= fs->blocksize) {
+			retval = file_read_direct(file, ptr, wanted, &c);
+			if (retval)
+				goto fail;
+			if (c) {
+				file->pos += c;
+				ptr += c;
+				count += c;
+				wanted -= c;
+				continue;
+			}
+		}
+
 		retval = sync_buffer_position(file);
 		if (retval)
 			goto fail;
@@ -381,6 +596,7 @@ expand:
 	 * in ext2fs_file_open2().  We have no way to modify
 	 * the outside inode.
 	 */
+	file->map.e_len = 0;
 	retval = ext2fs_read_inode(fs, file->ino, &file->inode);
 	if (retval)
 		return retval;
@@ -388,6 +604,56 @@ expand:
 }
 
 
+/*
+ * Write as many whole blocks as possible, starting at the (block
+ * aligned) current position, directly from the caller's buffer.  This
+ * is only done for requests larger than the write-back buffer which
+ * overwrite a run of already allocated and initialized blocks.
+ */
+static errcode_t file_write_direct(ext2_file_t file, const char *ptr,
+				   unsigned int nbytes, unsigned int *written)
+{
+	ext2_filsys	fs = file->fs;
+	struct ext2fs_extent	ext;
+	blk64_t		lblk, nblocks;
+	errcode_t	retval;
+
+	*written = 0;
+	lblk = file->pos / fs->blocksize;
+	nblocks = nbytes / fs->blocksize;
+	if (nblocks < 2 || nblocks < file->wb_max)
+		return 0;
+
+	retval = file_map_block(file, lblk, &ext);
+	if (retval)
+		return retval;
+	if (!ext.e_pblk || (ext.e_flags & EXT2_EXTENT_FLAGS_UNINIT))
+		return 0;
+	if (nblocks > ext.e_len)
+		nblocks = ext.e_len;
+
+	/* Get our buffers out of the way of the blocks being overwritten */
+	if ((file->flags & EXT2_FILE_BUF_VALID) &&
+	    file->blockno >= lblk && file->blockno < lblk + nblocks) {
+		retval = flush_block_buffer(file);
+		if (retval)
+			return retval;
+		file->flags &= ~EXT2_FILE_BUF_VALID;
+	}
+	if (file_wb_overlaps(file, lblk, nblocks)) {
+		retval = file_wb_flush(file);
+		if (retval)
+			return retval;
+	}
+
+	retval = io_channel_write_blk64(fs->io, ext.e_pblk, nblocks, ptr);
+	if (retval)
+		return retval;
+
+	*written = nblocks * fs->blocksize;
+	return 0;
+}
+
 errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 			    unsigned int nbytes, unsigned int *written)
 {
@@ -415,6 +681,20 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 	}
 
 	while (nbytes > 0) {
+		if ((file->pos % fs->blocksize) == 0 &&
+		    nbytes >= fs->blocksize) {
+			retval = file_write_direct(file, ptr, nbytes, &c);
+			if (retval)
+				goto fail;
+			if (c) {
+				file->pos += c;
+				ptr += c;
+				count += c;
+				nbytes -= c;
+				continue;
+			}
+		}
+
 		retval = sync_buffer_position(file);
 		if (retval)
 			goto fail;
@@ -455,6 +735,7 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 							sizeof(new_block->sha));
 			}
 
+			file->map.e_len = 0;
 			if (old_block) {
 				file->physblock = old_block->physblock;
 				bmap_flags |= BMAP_SET;
@@ -588,6 +869,11 @@ static errcode_t ext2fs_file_zero_past_offset(ext2_file_t file,
 	retval = sync_buffer_position(file);
 	if (retval)
 		return retval;
+	if (file_wb_overlaps(file, offset / fs->blocksize, 1)) {
+		retval = file_wb_flush(file);
+		if (retval)
+			return retval;
+	}
 
 	/* Is there an initialized block at the end? */
 	retval = ext2fs_bmap2(fs, file->ino, NULL, NULL, 0,
@@ -638,6 +924,7 @@ errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size)
 	old_size = EXT2_I_SIZE(&file->inode);
 	old_truncate = ((old_size + file->fs->blocksize - 1) >>
 		      EXT2_BLOCK_SIZE_BITS(file->fs->super));
+	file->map.e_len = 0;
 
 	retval = ext2fs_inode_size_set(file->fs, &file->inode, size);
 	if (retval)
@@ -656,6 +943,11 @@ errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size)
 	if (truncate_block >= old_truncate)
 		return 0;
 
+	/* Don't let queued blocks land on blocks we are about to free */
+	retval = file_wb_flush(file);
+	if (retval)
+		return retval;
+
 	return ext2fs_punch(file->fs, file->ino, &file->inode, 0,
 			    truncate_block, ~0ULL);
 }
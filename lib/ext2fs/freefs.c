@@ -55,6 +55,12 @@ void ext2fs_free(ext2_filsys fs)
 	if (fs->icache)
 		ext2fs_free_inode_cache(fs->icache);
 
+	if (fs->ecache)
+		ext2fs_free_extent_cache(fs->ecache);
+
+	ext2fs_release_free_index(fs);
+	ext2fs_free_lazy_gdt(fs);
+
 	if (fs->mmp_buf)
 		ext2fs_free_mem(&fs->mmp_buf);
 	if (fs->mmp_cmp)
@@ -0,0 +1,298 @@
+/*
+ * image_io.c --- common code for the read-only e2image I/O managers
+ *
+ * zimage_io.c and qcow2_io.c differ only in how they find a chunk of
+ * the image; opening, locking, copying reads out of the chunks and
+ * refusing writes is done here.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <errno.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+static errcode_t image_data(io_channel channel, struct ext2fs_image_io **ret)
+{
+	struct ext2fs_image_io *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct ext2fs_image_io *) channel->private_data;
+	if (!data || !data->ops)
+		return EXT2_ET_BAD_MAGIC;
+	EXT2_CHECK_MAGIC(data, data->ops->magic);
+	*ret = data;
+	return 0;
+}
+
+errcode_t ext2fs_image_io_read_full(int fd, ext2_loff_t offset, void *buf,
+				    size_t len)
+{
+	ssize_t ret;
+
+	if (ext2fs_llseek(fd, offset, SEEK_SET) != offset)
+		return errno;
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (ret == 0)
+			return EXT2_ET_SHORT_READ;
+		buf = (char *) buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Open the image file for data, which the caller has zeroed.  Whether
+ * this succeeds or not, data must be released with ext2fs_image_io_free().
+ */
+errcode_t ext2fs_image_io_open(const char *name, int flags,
+			       const struct ext2fs_image_io_ops *ops,
+			       struct ext2fs_image_io *data)
+{
+	data->magic = ops->magic;
+	data->ops = ops;
+	data->dev = -1;
+	data->io_stats.num_fields = 2;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	if (flags & IO_FLAG_RW)
+		return EROFS;
+	data->dev = ext2fs_open_file(name, O_RDONLY, 0);
+	if (data->dev < 0)
+		return errno;
+	return 0;
+}
+
+/* Wrap an opened image in a channel, once size and chunk_bytes are set */
+errcode_t ext2fs_image_io_channel(io_manager manager, const char *name,
+				  int flags, struct ext2fs_image_io *data,
+				  io_channel *channel)
+{
+	io_channel	io = NULL;
+	errcode_t	retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		return retval;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	io->manager = manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->block_size = 1024;
+	io->refcount = 1;
+#ifdef HAVE_PTHREAD
+	if (flags & IO_FLAG_THREADS) {
+		retval = pthread_mutex_init(&data->lock, NULL);
+		if (retval)
+			goto cleanup;
+		data->use_lock = 1;
+		io->flags |= CHANNEL_FLAGS_THREADS;
+	}
+#endif
+
+	io->private_data = data;
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (io->name)
+		ext2fs_free_mem(&io->name);
+	ext2fs_free_mem(&io);
+	return retval;
+}
+
+void ext2fs_image_io_free(struct ext2fs_image_io *data)
+{
+	if (data->dev >= 0)
+		close(data->dev);
+#ifdef HAVE_PTHREAD
+	if (data->use_lock)
+		pthread_mutex_destroy(&data->lock);
+#endif
+	data->ops->free_data(data);
+}
+
+void ext2fs_image_io_lock(struct ext2fs_image_io *data EXT2FS_ATTR((unused)))
+{
+#ifdef HAVE_PTHREAD
+	if (data->use_lock)
+		pthread_mutex_lock(&data->lock);
+#endif
+}
+
+void ext2fs_image_io_unlock(struct ext2fs_image_io *data EXT2FS_ATTR((unused)))
+{
+#ifdef HAVE_PTHREAD
+	if (data->use_lock)
+		pthread_mutex_unlock(&data->lock);
+#endif
+}
+
+errcode_t ext2fs_image_io_close(io_channel channel)
+{
+	struct ext2fs_image_io *data;
+	errcode_t retval;
+
+	retval = image_data(channel, &data);
+	if (retval)
+		return retval;
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	ext2fs_image_io_free(data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return 0;
+}
+
+errcode_t ext2fs_image_io_set_blksize(io_channel channel, int blksize)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	channel->block_size = blksize;
+	return 0;
+}
+
+errcode_t ext2fs_image_io_read_blk64(io_channel channel,
+				     unsigned long long block,
+				     int count, void *buf)
+{
+	struct ext2fs_image_io *data;
+	unsigned long long offset;
+	size_t size, skip, len;
+	errcode_t retval;
+	char *src;
+
+	retval = image_data(channel, &data);
+	if (retval)
+		return retval;
+
+	size = (count < 0) ? (size_t) -count :
+		(size_t) count * channel->block_size;
+	offset = block * channel->block_size;
+	if (offset >= data->size || size > data->size - offset) {
+		retval = EXT2_ET_SHORT_READ;
+		goto error_out;
+	}
+
+	ext2fs_image_io_lock(data);
+	while (size) {
+		skip = offset % data->chunk_bytes;
+		len = data->chunk_bytes - skip;
+		if (len > size)
+			len = size;
+		retval = data->ops->get_chunk(data,
+					      offset / data->chunk_bytes, &src);
+		if (retval) {
+			ext2fs_image_io_unlock(data);
+			goto error_out;
+		}
+		if (src)
+			memcpy(buf, src + skip, len);
+		else
+			memset(buf, 0, len);
+		buf = (char *) buf + len;
+		offset += len;
+		size -= len;
+	}
+	ext2fs_image_io_unlock(data);
+	return 0;
+
+error_out:
+	if (channel->read_error)
+		retval = (channel->read_error)(channel, block, count, buf,
+					       size, 0, retval);
+	return retval;
+}
+
+errcode_t ext2fs_image_io_read_blk(io_channel channel, unsigned long block,
+				   int count, void *buf)
+{
+	return ext2fs_image_io_read_blk64(channel, block, count, buf);
+}
+
+errcode_t ext2fs_image_io_write_blk64(io_channel channel EXT2FS_ATTR((unused)),
+				      unsigned long long block EXT2FS_ATTR((unused)),
+				      int count EXT2FS_ATTR((unused)),
+				      const void *buf EXT2FS_ATTR((unused)))
+{
+	return EROFS;
+}
+
+errcode_t ext2fs_image_io_write_blk(io_channel channel, unsigned long block,
+				    int count, const void *buf)
+{
+	return ext2fs_image_io_write_blk64(channel, block, count, buf);
+}
+
+errcode_t ext2fs_image_io_write_byte(io_channel channel EXT2FS_ATTR((unused)),
+				     unsigned long offset EXT2FS_ATTR((unused)),
+				     int size EXT2FS_ATTR((unused)),
+				     const void *buf EXT2FS_ATTR((unused)))
+{
+	return EROFS;
+}
+
+errcode_t ext2fs_image_io_flush(io_channel channel EXT2FS_ATTR((unused)))
+{
+	return 0;
+}
+
+errcode_t ext2fs_image_io_set_option(io_channel channel EXT2FS_ATTR((unused)),
+				     const char *option, const char *arg)
+{
+	/* e2image always passes an offset; only a zero one makes sense */
+	if (!strcmp(option, "offset") && arg && !strtoull(arg, NULL, 0))
+		return 0;
+	return EXT2_ET_INVALID_ARGUMENT;
+}
+
+errcode_t ext2fs_image_io_get_stats(io_channel channel, io_stats *stats)
+{
+	struct ext2fs_image_io *data;
+	errcode_t retval;
+
+	retval = image_data(channel, &data);
+	if (retval)
+		return retval;
+
+	if (stats)
+		*stats = &data->io_stats;
+	return 0;
+}
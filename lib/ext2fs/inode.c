@@ -59,6 +59,28 @@ struct ext2_struct_inode_scan {
 	int			reserved[6];
 };
 
+/*
+ * If the file system was opened with EXT2_FLAG_THREADS, the inode
+ * cache (and its block buffer) is protected by a mutex so that inodes
+ * may be read and written from several threads at once.  The cache
+ * must already exist by then; see ext2fs_create_inode_cache().
+ */
+static inline void icache_lock(struct ext2_inode_cache *icache)
+{
+#ifdef HAVE_PTHREAD
+	if (icache->use_mutex)
+		pthread_mutex_lock(&icache->mutex);
+#endif
+}
+
+static inline void icache_unlock(struct ext2_inode_cache *icache)
+{
+#ifdef HAVE_PTHREAD
+	if (icache->use_mutex)
+		pthread_mutex_unlock(&icache->mutex);
+#endif
+}
+
 /*
  * This routine flushes the icache, if it exists.
  */
@@ -69,10 +91,12 @@ errcode_t ext2fs_flush_icache(ext2_filsys fs)
 	if (!fs->icache)
 		return 0;
 
+	icache_lock(fs->icache);
 	for (i=0; i < fs->icache->cache_size; i++)
 		fs->icache->cache[i].ino = 0;
 
 	fs->icache->buffer_blk = 0;
+	icache_unlock(fs->icache);
 	return 0;
 }
 
@@ -92,6 +116,10 @@ void ext2fs_free_inode_cache(struct ext2_inode_cache *icache)
 	if (icache->cache)
 		ext2fs_free_mem(&icache->cache);
 	icache->buffer_blk = 0;
+#ifdef HAVE_PTHREAD
+	if (icache->use_mutex)
+		pthread_mutex_destroy(&icache->mutex);
+#endif
 	ext2fs_free_mem(&icache);
 }
 
@@ -110,6 +138,14 @@ errcode_t ext2fs_create_inode_cache(ext2_filsys fs, unsigned int cache_size)
 	retval = ext2fs_get_mem(fs->blocksize, &fs->icache->buffer);
 	if (retval)
 		goto errout;
+#ifdef HAVE_PTHREAD
+	if (fs->io && (fs->io->flags & CHANNEL_FLAGS_THREADS)) {
+		retval = pthread_mutex_init(&fs->icache->mutex, NULL);
+		if (retval)
+			goto errout;
+		fs->icache->use_mutex = 1;
+	}
+#endif
 
 	fs->icache->buffer_blk = 0;
 	fs->icache->cache_last = -1;
@@ -794,11 +830,13 @@ errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
 			return retval;
 	}
 	/* Check to see if it's in the inode cache */
+	icache_lock(fs->icache);
 	for (i = 0; i < fs->icache->cache_size; i++) {
 		if (fs->icache->cache[i].ino == ino) {
 			memcpy(inode, fs->icache->cache[i].inode,
 			       (bufsize > length) ? length : bufsize);
-			return 0;
+			retval = 0;
+			goto out;
 		}
 	}
 	if (fs->flags & EXT2_FLAG_IMAGE_FILE) {
@@ -810,18 +848,24 @@ errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
 		io = fs->image_io;
 	} else {
 		group = (ino - 1) / EXT2_INODES_PER_GROUP(fs->super);
-		if (group > fs->group_desc_count)
-			return EXT2_ET_BAD_INODE_NUM;
+		if (group > fs->group_desc_count) {
+			retval = EXT2_ET_BAD_INODE_NUM;
+			goto out;
+		}
 		offset = ((ino - 1) % EXT2_INODES_PER_GROUP(fs->super)) *
 			EXT2_INODE_SIZE(fs->super);
 		block = offset >> EXT2_BLOCK_SIZE_BITS(fs->super);
 		block_nr = ext2fs_inode_table_loc(fs, group);
-		if (!block_nr)
-			return EXT2_ET_MISSING_INODE_TABLE;
+		if (!block_nr) {
+			retval = EXT2_ET_MISSING_INODE_TABLE;
+			goto out;
+		}
 		if ((block_nr < fs->super->s_first_data_block) ||
 		    (block_nr + fs->inode_blocks_per_group - 1 >=
-		     ext2fs_blocks_count(fs->super)))
-			return EXT2_ET_GDESC_BAD_INODE_TABLE;
+		     ext2fs_blocks_count(fs->super))) {
+			retval = EXT2_ET_GDESC_BAD_INODE_TABLE;
+			goto out;
+		}
 		block_nr += block;
 		io = fs->io;
 	}
@@ -840,7 +884,7 @@ errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
 			retval = io_channel_read_blk64(io, block_nr, 1,
 						     fs->icache->buffer);
 			if (retval)
-				return retval;
+				goto out;
 			fs->icache->buffer_blk = block_nr;
 		}
 
@@ -870,11 +914,13 @@ errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
 	}
 	memcpy(inode, iptr, (bufsize > length) ? length : bufsize);
 
+	retval = 0;
 	if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
 	    !(flags & READ_INODE_NOCSUM) && fail_csum)
-		return EXT2_ET_INODE_CSUM_INVALID;
-
-	return 0;
+		retval = EXT2_ET_INODE_CSUM_INVALID;
+out:
+	icache_unlock(fs->icache);
+	return retval;
 }
 
 errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
@@ -932,25 +978,25 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 			goto errout;
 	}
 
-	/* Check to see if the inode cache needs to be updated */
-	if (fs->icache) {
-		for (i=0; i < fs->icache->cache_size; i++) {
-			if (fs->icache->cache[i].ino == ino) {
-				memcpy(fs->icache->cache[i].inode, inode,
-				       (bufsize > length) ? length : bufsize);
-				break;
-			}
-		}
-	} else {
+	if (!fs->icache) {
 		retval = ext2fs_create_inode_cache(fs, 4);
 		if (retval)
 			goto errout;
 	}
+	/* Check to see if the inode cache needs to be updated */
+	icache_lock(fs->icache);
+	for (i=0; i < fs->icache->cache_size; i++) {
+		if (fs->icache->cache[i].ino == ino) {
+			memcpy(fs->icache->cache[i].inode, inode,
+			       (bufsize > length) ? length : bufsize);
+			break;
+		}
+	}
 	memcpy(w_inode, inode, (bufsize > length) ? length : bufsize);
 
 	if (!(fs->flags & EXT2_FLAG_RW)) {
 		retval = EXT2_ET_RO_FILSYS;
-		goto errout;
+		goto out;
 	}
 
 #ifdef WORDS_BIGENDIAN
@@ -960,7 +1006,7 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 	if ((flags & WRITE_INODE_NOCSUM) == 0) {
 		retval = ext2fs_inode_csum_set(fs, ino, w_inode);
 		if (retval)
-			goto errout;
+			goto out;
 	}
 
 	group = (ino - 1) / EXT2_INODES_PER_GROUP(fs->super);
@@ -970,13 +1016,13 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 	block_nr = ext2fs_inode_table_loc(fs, (unsigned) group);
 	if (!block_nr) {
 		retval = EXT2_ET_MISSING_INODE_TABLE;
-		goto errout;
+		goto out;
 	}
 	if ((block_nr < fs->super->s_first_data_block) ||
 	    (block_nr + fs->inode_blocks_per_group - 1 >=
 	     ext2fs_blocks_count(fs->super))) {
 		retval = EXT2_ET_GDESC_BAD_INODE_TABLE;
-		goto errout;
+		goto out;
 	}
 	block_nr += block;
 
@@ -993,7 +1039,7 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 			retval = io_channel_read_blk64(fs->io, block_nr, 1,
 						     fs->icache->buffer);
 			if (retval)
-				goto errout;
+				goto out;
 			fs->icache->buffer_blk = block_nr;
 		}
 
@@ -1004,7 +1050,7 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 		retval = io_channel_write_blk64(fs->io, block_nr, 1,
 					      fs->icache->buffer);
 		if (retval)
-			goto errout;
+			goto out;
 
 		offset = 0;
 		ptr += clen;
@@ -1012,7 +1058,11 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 		block_nr++;
 	}
 
-	fs->flags |= EXT2_FLAG_CHANGED;
+	/* Don't store to fs->flags needlessly, other threads may read it */
+	if (!(fs->flags & EXT2_FLAG_CHANGED))
+		fs->flags |= EXT2_FLAG_CHANGED;
+out:
+	icache_unlock(fs->icache);
 errout:
 	ext2fs_free_mem(&w_inode);
 	return retval;
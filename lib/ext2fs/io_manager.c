@@ -16,6 +16,9 @@
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
@@ -123,6 +126,593 @@ errcode_t io_channel_zeroout(io_channel channel, unsigned long long block,
 	return EXT2_ET_UNIMPLEMENTED;
 }
 
+/*
+ * Batched discards.  The caller queues up the ranges it wants discarded;
+ * adjacent ranges are merged, and the result is cut into chunks no
+ * larger than the device accepts in one request.  On a channel that may
+ * be used from several threads, up to max_inflight of those chunks are
+ * issued at once, since thin-provisioned and network block devices can
+ * take a long time to complete each one.
+ */
+
+/* Chunk size if the device doesn't tell us its limit */
+#define DISCARD_DEFAULT_CHUNK	(2ULL * 1024 * 1024 * 1024)
+
+struct discard_chunk {
+	unsigned long long	block;
+	unsigned long long	count;
+};
+
+struct struct_io_discard_batch {
+	io_channel		channel;
+	unsigned long long	chunk;		/* in blocks */
+	unsigned long long	block;		/* range not yet issued */
+	unsigned long long	count;
+	unsigned long long	completed;	/* blocks discarded so far */
+	errcode_t		err;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		/* chunk queued, or shutdown */
+	pthread_cond_t		done;		/* chunk taken or finished */
+	pthread_t		*threads;
+	int			num_threads;
+	struct discard_chunk	*queue;
+	int			queue_size;
+	int			head;
+	int			nr_queued;
+	int			busy;
+	int			shutdown;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+static void *discard_thread(void *arg)
+{
+	io_discard_batch batch = arg;
+	struct discard_chunk c;
+	errcode_t retval;
+
+	pthread_mutex_lock(&batch->lock);
+	while (1) {
+		while (!batch->nr_queued && !batch->shutdown)
+			pthread_cond_wait(&batch->work, &batch->lock);
+		if (!batch->nr_queued)
+			break;
+		c = batch->queue[batch->head];
+		batch->head = (batch->head + 1) % batch->queue_size;
+		batch->nr_queued--;
+		pthread_cond_broadcast(&batch->done);
+		if (batch->err)
+			continue;
+		batch->busy++;
+		pthread_mutex_unlock(&batch->lock);
+		retval = io_channel_discard(batch->channel, c.block, c.count);
+		pthread_mutex_lock(&batch->lock);
+		if (retval && !batch->err)
+			batch->err = retval;
+		else if (!retval)
+			batch->completed += c.count;
+		batch->busy--;
+		pthread_cond_broadcast(&batch->done);
+	}
+	pthread_mutex_unlock(&batch->lock);
+	return NULL;
+}
+
+static void stop_discard_threads(io_discard_batch batch)
+{
+	int i;
+
+	pthread_mutex_lock(&batch->lock);
+	batch->shutdown = 1;
+	pthread_cond_broadcast(&batch->work);
+	pthread_mutex_unlock(&batch->lock);
+	for (i = 0; i < batch->num_threads; i++)
+		pthread_join(batch->threads[i], NULL);
+	pthread_mutex_destroy(&batch->lock);
+	pthread_cond_destroy(&batch->work);
+	pthread_cond_destroy(&batch->done);
+	ext2fs_free_mem(&batch->threads);
+	ext2fs_free_mem(&batch->queue);
+	batch->num_threads = 0;
+}
+#endif
+
+static errcode_t issue_discard_chunk(io_discard_batch batch,
+				     unsigned long long block,
+				     unsigned long long count)
+{
+	errcode_t retval;
+
+#ifdef HAVE_PTHREAD
+	if (batch->num_threads) {
+		pthread_mutex_lock(&batch->lock);
+		while (batch->nr_queued == batch->queue_size && !batch->err)
+			pthread_cond_wait(&batch->done, &batch->lock);
+		retval = batch->err;
+		if (!retval) {
+			struct discard_chunk *c;
+
+			c = &batch->queue[(batch->head + batch->nr_queued) %
+					  batch->queue_size];
+			c->block = block;
+			c->count = count;
+			batch->nr_queued++;
+			pthread_cond_signal(&batch->work);
+		}
+		pthread_mutex_unlock(&batch->lock);
+		return retval;
+	}
+#endif
+	if (batch->err)
+		return batch->err;
+	retval = io_channel_discard(batch->channel, block, count);
+	if (retval)
+		batch->err = retval;
+	else
+		batch->completed += count;
+	return retval;
+}
+
+/*
+ * Issue the front of the pending range in whole chunks, or all of it
+ * if 'all' is set.
+ */
+static errcode_t issue_discard_range(io_discard_batch batch, int all)
+{
+	unsigned long long count;
+	errcode_t retval;
+
+	while (batch->count >= batch->chunk || (all && batch->count)) {
+		count = batch->count;
+		if (count > batch->chunk)
+			count = batch->chunk;
+		retval = issue_discard_chunk(batch, batch->block, count);
+		if (retval)
+			return retval;
+		batch->block += count;
+		batch->count -= count;
+	}
+	return 0;
+}
+
+errcode_t io_channel_discard_batch_init(io_channel channel, int max_inflight,
+					io_discard_batch *ret_batch)
+{
+	io_discard_batch batch;
+	errcode_t retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (!channel->manager->discard)
+		return EXT2_ET_UNIMPLEMENTED;
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_discard_batch),
+				    &batch);
+	if (retval)
+		return retval;
+	batch->channel = channel;
+	if (channel->discard_max_sectors)
+		batch->chunk = (unsigned long long)
+			channel->discard_max_sectors * 512 /
+			channel->block_size;
+	else
+		batch->chunk = DISCARD_DEFAULT_CHUNK / channel->block_size;
+	if (batch->chunk == 0)
+		batch->chunk = 1;
+
+#ifdef HAVE_PTHREAD
+	if (max_inflight > 1 && (channel->flags & CHANNEL_FLAGS_THREADS)) {
+		batch->queue_size = max_inflight * 2;
+		if (ext2fs_get_array(max_inflight, sizeof(pthread_t),
+				     &batch->threads) ||
+		    ext2fs_get_array(batch->queue_size,
+				     sizeof(struct discard_chunk),
+				     &batch->queue)) {
+			ext2fs_free_mem(&batch->threads);
+			goto out;
+		}
+		pthread_mutex_init(&batch->lock, NULL);
+		pthread_cond_init(&batch->work, NULL);
+		pthread_cond_init(&batch->done, NULL);
+		for (; batch->num_threads < max_inflight; batch->num_threads++)
+			if (pthread_create(&batch->threads[batch->num_threads],
+					   NULL, discard_thread, batch))
+				break;
+		if (!batch->num_threads)
+			stop_discard_threads(batch);
+	}
+out:
+#endif
+	*ret_batch = batch;
+	return 0;
+}
+
+/*
+ * Queue a range for discarding.  An error returned here (or by
+ * io_channel_discard_batch_finish) may come from an earlier range;
+ * once a discard has failed, nothing more is issued.
+ */
+errcode_t io_channel_discard_batch_add(io_discard_batch batch,
+				       unsigned long long block,
+				       unsigned long long count)
+{
+	errcode_t retval;
+
+	if (!count)
+		return 0;
+	if (batch->count && batch->block + batch->count == block) {
+		batch->count += count;
+	} else {
+		retval = issue_discard_range(batch, 1);
+		if (retval)
+			return retval;
+		batch->block = block;
+		batch->count = count;
+	}
+	return issue_discard_range(batch, 0);
+}
+
+/*
+ * Return the number of blocks whose discards have completed so far, for
+ * progress reports.  Ranges are only issued in whole chunks until the
+ * batch is finished, so this may lag well behind what has been queued.
+ */
+unsigned long long io_channel_discard_batch_progress(io_discard_batch batch)
+{
+#ifdef HAVE_PTHREAD
+	if (batch->num_threads) {
+		unsigned long long completed;
+
+		pthread_mutex_lock(&batch->lock);
+		completed = batch->completed;
+		pthread_mutex_unlock(&batch->lock);
+		return completed;
+	}
+#endif
+	return batch->completed;
+}
+
+/*
+ * Issue whatever is still pending, wait for all discards to complete,
+ * and free the batch.  Returns the first error encountered.
+ */
+errcode_t io_channel_discard_batch_finish(io_discard_batch batch)
+{
+	errcode_t retval;
+
+	issue_discard_range(batch, 1);
+#ifdef HAVE_PTHREAD
+	if (batch->num_threads) {
+		pthread_mutex_lock(&batch->lock);
+		while (batch->nr_queued || batch->busy)
+			pthread_cond_wait(&batch->done, &batch->lock);
+		pthread_mutex_unlock(&batch->lock);
+		stop_discard_threads(batch);
+	}
+#endif
+	retval = batch->err;
+	ext2fs_free_mem(&batch);
+	return retval;
+}
+
+/*
+ * Free the batch without issuing anything that is still queued.
+ * Discards already submitted to the device are waited for.
+ */
+void io_channel_discard_batch_cancel(io_discard_batch batch)
+{
+#ifdef HAVE_PTHREAD
+	if (batch->num_threads) {
+		pthread_mutex_lock(&batch->lock);
+		batch->nr_queued = 0;
+		pthread_mutex_unlock(&batch->lock);
+		stop_discard_threads(batch);
+	}
+#endif
+	ext2fs_free_mem(&batch);
+}
+
+/*
+ * Batched writes.  The caller queues up blocks to be written, in
+ * ascending order if it wants them merged; data is copied when queued,
+ * and adjacent blocks are gathered into one write of up to
+ * WRITE_BATCH_CHUNK bytes.  On a channel that may be used from several
+ * threads, up to max_inflight of those writes are issued at once.
+ * Nothing is flushed; that is left to the caller.
+ */
+
+#define WRITE_BATCH_CHUNK	(1024 * 1024)
+
+struct write_chunk {
+	unsigned long long	block;
+	unsigned long long	count;
+	char			*buf;
+};
+
+struct struct_io_write_batch {
+	io_channel		channel;
+	unsigned long long	chunk;		/* in blocks */
+	struct write_chunk	pending;	/* not yet issued */
+	errcode_t		err;
+	char			**bufs;
+	int			num_bufs;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		/* chunk queued, or shutdown */
+	pthread_cond_t		done;		/* chunk taken or finished */
+	pthread_t		*threads;
+	int			num_threads;
+	struct write_chunk	*queue;
+	int			queue_size;
+	int			head;
+	int			nr_queued;
+	char			**spare;	/* buffers not in use */
+	int			nr_spare;
+	int			busy;
+	int			shutdown;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+static void *write_thread(void *arg)
+{
+	io_write_batch batch = arg;
+	struct write_chunk c;
+	errcode_t retval;
+
+	pthread_mutex_lock(&batch->lock);
+	while (1) {
+		while (!batch->nr_queued && !batch->shutdown)
+			pthread_cond_wait(&batch->work, &batch->lock);
+		if (!batch->nr_queued)
+			break;
+		c = batch->queue[batch->head];
+		batch->head = (batch->head + 1) % batch->queue_size;
+		batch->nr_queued--;
+		if (!batch->err) {
+			batch->busy++;
+			pthread_mutex_unlock(&batch->lock);
+			retval = io_channel_write_blk64(batch->channel, c.block,
+							c.count, c.buf);
+			pthread_mutex_lock(&batch->lock);
+			if (retval && !batch->err)
+				batch->err = retval;
+			batch->busy--;
+		}
+		batch->spare[batch->nr_spare++] = c.buf;
+		pthread_cond_broadcast(&batch->done);
+	}
+	pthread_mutex_unlock(&batch->lock);
+	return NULL;
+}
+
+static void stop_write_threads(io_write_batch batch)
+{
+	int i;
+
+	pthread_mutex_lock(&batch->lock);
+	batch->shutdown = 1;
+	pthread_cond_broadcast(&batch->work);
+	pthread_mutex_unlock(&batch->lock);
+	for (i = 0; i < batch->num_threads; i++)
+		pthread_join(batch->threads[i], NULL);
+	pthread_mutex_destroy(&batch->lock);
+	pthread_cond_destroy(&batch->work);
+	pthread_cond_destroy(&batch->done);
+	ext2fs_free_mem(&batch->threads);
+	ext2fs_free_mem(&batch->queue);
+	ext2fs_free_mem(&batch->spare);
+	batch->num_threads = 0;
+}
+#endif
+
+static errcode_t issue_pending_write(io_write_batch batch)
+{
+	struct write_chunk *c = &batch->pending;
+	errcode_t retval;
+
+	if (!c->count)
+		return 0;
+#ifdef HAVE_PTHREAD
+	if (batch->num_threads) {
+		pthread_mutex_lock(&batch->lock);
+		while (batch->nr_queued == batch->queue_size && !batch->err)
+			pthread_cond_wait(&batch->done, &batch->lock);
+		retval = batch->err;
+		if (!retval) {
+			batch->queue[(batch->head + batch->nr_queued) %
+				     batch->queue_size] = *c;
+			batch->nr_queued++;
+			pthread_cond_signal(&batch->work);
+			/* There is one more buffer than can be in flight */
+			while (!batch->nr_spare)
+				pthread_cond_wait(&batch->done, &batch->lock);
+			c->buf = batch->spare[--batch->nr_spare];
+		}
+		pthread_mutex_unlock(&batch->lock);
+		c->count = 0;
+		return retval;
+	}
+#endif
+	if (!batch->err) {
+		retval = io_channel_write_blk64(batch->channel, c->block,
+						c->count, c->buf);
+		if (retval)
+			batch->err = retval;
+	}
+	c->count = 0;
+	return batch->err;
+}
+
+/*
+ * A caller which knows that none of its writes is longer than
+ * max_blocks can pass that, so that smaller buffers are allocated.
+ */
+errcode_t io_channel_write_batch_init2(io_channel channel, int max_inflight,
+				       unsigned long long max_blocks,
+				       io_write_batch *ret_batch)
+{
+	io_write_batch batch;
+	errcode_t retval;
+	int num_bufs = 1;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_write_batch),
+				    &batch);
+	if (retval)
+		return retval;
+	batch->channel = channel;
+	batch->chunk = WRITE_BATCH_CHUNK / channel->block_size;
+	if (max_blocks && max_blocks < batch->chunk)
+		batch->chunk = max_blocks;
+	if (batch->chunk == 0)
+		batch->chunk = 1;
+
+#ifdef HAVE_PTHREAD
+	if (max_inflight > 1 && (channel->flags & CHANNEL_FLAGS_THREADS)) {
+		batch->queue_size = max_inflight;
+		num_bufs = batch->queue_size + max_inflight + 1;
+		if (ext2fs_get_array(max_inflight, sizeof(pthread_t),
+				     &batch->threads) ||
+		    ext2fs_get_array(batch->queue_size,
+				     sizeof(struct write_chunk),
+				     &batch->queue) ||
+		    ext2fs_get_array(num_bufs, sizeof(char *),
+				     &batch->spare)) {
+			ext2fs_free_mem(&batch->threads);
+			ext2fs_free_mem(&batch->queue);
+			num_bufs = 1;
+		}
+	}
+#endif
+	retval = ext2fs_get_array(num_bufs, sizeof(char *), &batch->bufs);
+	if (retval)
+		goto errout;
+	for (; batch->num_bufs < num_bufs; batch->num_bufs++) {
+		retval = io_channel_alloc_buf(channel, batch->chunk,
+					      &batch->bufs[batch->num_bufs]);
+		if (retval)
+			goto errout;
+	}
+	batch->pending.buf = batch->bufs[0];
+
+#ifdef HAVE_PTHREAD
+	if (batch->threads) {
+		for (batch->nr_spare = 0; batch->nr_spare < num_bufs - 1;
+		     batch->nr_spare++)
+			batch->spare[batch->nr_spare] =
+				batch->bufs[batch->nr_spare + 1];
+		pthread_mutex_init(&batch->lock, NULL);
+		pthread_cond_init(&batch->work, NULL);
+		pthread_cond_init(&batch->done, NULL);
+		for (; batch->num_threads < max_inflight; batch->num_threads++)
+			if (pthread_create(&batch->threads[batch->num_threads],
+					   NULL, write_thread, batch))
+				break;
+		if (!batch->num_threads)
+			stop_write_threads(batch);
+	}
+#endif
+	*ret_batch = batch;
+	return 0;
+
+errout:
+	io_channel_write_batch_cancel(batch);
+	return retval;
+}
+
+errcode_t io_channel_write_batch_init(io_channel channel, int max_inflight,
+				      io_write_batch *ret_batch)
+{
+	return io_channel_write_batch_init2(channel, max_inflight, 0,
+					    ret_batch);
+}
+
+/*
+ * Queue count blocks of data to be written at block.  An error
+ * returned here (or by io_channel_write_batch_finish) may come from an
+ * earlier write; once a write has failed, nothing more is issued.
+ */
+errcode_t io_channel_write_batch_add(io_write_batch batch,
+				     unsigned long long block,
+				     unsigned long long count,
+				     const void *data)
+{
+	struct write_chunk *c = &batch->pending;
+	unsigned int bs = batch->channel->block_size;
+	unsigned long long n;
+	const char *cp = data;
+	errcode_t retval;
+
+	while (count) {
+		if (c->count && (c->block + c->count != block ||
+				 c->count == batch->chunk)) {
+			retval = issue_pending_write(batch);
+			if (retval)
+				return retval;
+		}
+		if (!c->count)
+			c->block = block;
+		n = batch->chunk - c->count;
+		if (n > count)
+			n = count;
+		memcpy(c->buf + c->count * bs, cp, n * bs);
+		c->count += n;
+		block += n;
+		cp += n * bs;
+		count -= n;
+	}
+	return 0;
+}
+
+/*
+ * Issue whatever is still pending, wait for all writes to complete,
+ * and free the batch.  Returns the first error encountered.
+ */
+errcode_t io_channel_write_batch_finish(io_write_batch batch)
+{
+	errcode_t retval;
+
+	issue_pending_write(batch);
+#ifdef HAVE_PTHREAD
+	if (batch->num_threads) {
+		pthread_mutex_lock(&batch->lock);
+		while (batch->nr_queued || batch->busy)
+			pthread_cond_wait(&batch->done, &batch->lock);
+		pthread_mutex_unlock(&batch->lock);
+	}
+#endif
+	retval = batch->err;
+	io_channel_write_batch_cancel(batch);
+	return retval;
+}
+
+/*
+ * Free the batch without issuing anything that is still queued.
+ * Writes already submitted to the device are waited for.
+ */
+void io_channel_write_batch_cancel(io_write_batch batch)
+{
+	int i;
+
+#ifdef HAVE_PTHREAD
+	if (batch->num_threads) {
+		pthread_mutex_lock(&batch->lock);
+		batch->nr_queued = 0;
+		pthread_mutex_unlock(&batch->lock);
+		stop_write_threads(batch);
+	}
+	ext2fs_free_mem(&batch->threads);
+	ext2fs_free_mem(&batch->queue);
+	ext2fs_free_mem(&batch->spare);
+#endif
+	for (i = 0; i < batch->num_bufs; i++)
+		ext2fs_free_mem(&batch->bufs[i]);
+	ext2fs_free_mem(&batch->bufs);
+	ext2fs_free_mem(&batch);
+}
+
 errcode_t io_channel_alloc_buf(io_channel io, int count, void *ptr)
 {
 	size_t	size;
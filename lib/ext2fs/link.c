@@ -22,29 +22,12 @@
 
 #define EXT2_DX_ROOT_OFF 24
 
-struct dx_frame {
-	void *buf;
-	blk64_t pblock;
-	struct ext2_dx_countlimit *head;
-	struct ext2_dx_entry *entries;
-	struct ext2_dx_entry *at;
-};
-
-struct dx_lookup_info {
-	const char *name;
-	int namelen;
-	int hash_alg;
-	__u32 hash;
-	unsigned levels;
-	struct dx_frame frames[EXT4_HTREE_LEVEL];
-};
-
 static errcode_t alloc_dx_frame(ext2_filsys fs, struct dx_frame *frame)
 {
 	return ext2fs_get_mem(fs->blocksize, &frame->buf);
 }
 
-static void dx_release(struct dx_lookup_info *info)
+void ext2fs_dx_release(struct dx_lookup_info *info)
 {
 	unsigned level;
 
@@ -72,9 +55,9 @@ static void dx_search_entry(struct dx_frame *frame, int count, __u32 hash)
 	frame->at = p - 1;
 }
 
-static errcode_t load_logical_dir_block(ext2_filsys fs, ext2_ino_t dir,
-					struct ext2_inode *diri, blk64_t block,
-					blk64_t *pblk, void *buf)
+errcode_t ext2fs_dx_read_block(ext2_filsys fs, ext2_ino_t dir,
+			       struct ext2_inode *diri, blk64_t block,
+			       blk64_t *pblk, void *buf)
 {
 	errcode_t errcode;
 	int ret_flags;
@@ -88,7 +71,12 @@ static errcode_t load_logical_dir_block(ext2_filsys fs, ext2_ino_t dir,
 	return ext2fs_read_dir_block4(fs, *pblk, buf, 0, dir);
 }
 
-static errcode_t dx_lookup(ext2_filsys fs, ext2_ino_t dir,
+/*
+ * Walk the index of a htree directory down to the leaf block which
+ * would hold info->name.  The path taken is left in info->frames[],
+ * which must be freed with ext2fs_dx_release().
+ */
+errcode_t ext2fs_dx_lookup(ext2_filsys fs, ext2_ino_t dir,
 			   struct ext2_inode *diri, struct dx_lookup_info *info)
 {
 	struct ext2_dx_root_info *root;
@@ -105,9 +93,9 @@ static errcode_t dx_lookup(ext2_filsys fs, ext2_ino_t dir,
 		return errcode;
 	info->levels = 1;
 
-	errcode = load_logical_dir_block(fs, dir, diri, 0,
-					 &(info->frames[0].pblock),
-					 info->frames[0].buf);
+	errcode = ext2fs_dx_read_block(fs, dir, diri, 0,
+				       &(info->frames[0].pblock),
+				       info->frames[0].buf);
 	if (errcode)
 		goto out_err;
 	root = (struct ext2_dx_root_info *) ((char *)info->frames[0].buf +
@@ -142,7 +130,7 @@ static errcode_t dx_lookup(ext2_filsys fs, ext2_ino_t dir,
 				goto out_err;
 			info->levels++;
 
-			errcode = load_logical_dir_block(fs, dir, diri,
+			errcode = ext2fs_dx_read_block(fs, dir, diri,
 				ext2fs_le32_to_cpu(info->frames[level-1].at->block) & 0x0fffffff,
 				&(frame->pblock), frame->buf);
 			if (errcode)
@@ -164,7 +152,7 @@ static errcode_t dx_lookup(ext2_filsys fs, ext2_ino_t dir,
 	}
 	return 0;
 out_err:
-	dx_release(info);
+	ext2fs_dx_release(info);
 	return errcode;
 }
 
@@ -269,7 +257,7 @@ static errcode_t add_dirent_to_buf(ext2_filsys fs, e2_blkcnt_t blockcnt,
 	struct link_struct ls;
 	errcode_t retval;
 
-	retval = load_logical_dir_block(fs, dir, diri, blockcnt, pblkp, buf);
+	retval = ext2fs_dx_read_block(fs, dir, diri, blockcnt, pblkp, buf);
 	if (retval)
 		return retval;
 	ctx.errcode = 0;
@@ -570,7 +558,7 @@ static errcode_t dx_link(ext2_filsys fs, ext2_ino_t dir,
 	dx_info.name = name;
 	dx_info.namelen = strlen(name);
 again:
-	retval = dx_lookup(fs, dir, diri, &dx_info);
+	retval = ext2fs_dx_lookup(fs, dir, diri, &dx_info);
 	if (retval)
 		goto free_buf;
 
@@ -589,10 +577,10 @@ again:
 		goto free_frames;
 	/* Restart everything now that the tree is larger */
 	restart++;
-	dx_release(&dx_info);
+	ext2fs_dx_release(&dx_info);
 	goto again;
 free_frames:
-	dx_release(&dx_info);
+	ext2fs_dx_release(&dx_info);
 free_buf:
 	ext2fs_free_mem(&blockbuf);
 	return retval;
@@ -18,6 +18,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 
 struct lookup_struct  {
 	const char	*name;
@@ -46,15 +47,154 @@ static int lookup_proc(struct ext2_dir_entry *dirent,
 	return DIRENT_ABORT;
 }
 
+/*
+ * Search one leaf block of a htree directory for the name.
+ */
+static errcode_t dx_search_leaf(ext2_filsys fs, char *buf, const char *name,
+				int namelen, ext2_ino_t *inode)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset = 0, rec_len;
+	errcode_t	retval;
+
+	while (offset < fs->blocksize) {
+		if (offset + 8 > fs->blocksize)
+			return EXT2_ET_DIR_CORRUPTED;
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (retval)
+			return retval;
+		if (rec_len < 8 || (rec_len % 4) ||
+		    offset + rec_len > fs->blocksize ||
+		    ext2fs_dirent_name_len(dirent) + 8U > rec_len)
+			return EXT2_ET_DIR_CORRUPTED;
+		if (dirent->inode &&
+		    ext2fs_dirent_name_len(dirent) == namelen &&
+		    !memcmp(dirent->name, name, namelen)) {
+			*inode = dirent->inode;
+			return 0;
+		}
+		offset += rec_len;
+	}
+	return EXT2_ET_FILE_NOT_FOUND;
+}
+
+/*
+ * Move on to the next leaf block, if names with our hash may continue
+ * into it.  Returns EXT2_ET_FILE_NOT_FOUND if they can't.
+ */
+static errcode_t dx_next_leaf(ext2_filsys fs, ext2_ino_t dir,
+			      struct ext2_inode *diri,
+			      struct dx_lookup_info *info)
+{
+	struct dx_frame	*frame;
+	unsigned	level = info->levels - 1;
+	blk64_t		block;
+	errcode_t	retval;
+	int		count;
+
+	while (1) {
+		frame = &info->frames[level];
+		frame->at++;
+		if (frame->at < frame->entries +
+				ext2fs_le16_to_cpu(frame->head->count))
+			break;
+		if (level == 0)
+			return EXT2_ET_FILE_NOT_FOUND;
+		level--;
+	}
+	if ((ext2fs_le32_to_cpu(frame->at->hash) & ~1) != info->hash)
+		return EXT2_ET_FILE_NOT_FOUND;
+
+	/* Go back down the tree along the left edge of the new subtree */
+	while (level < info->levels - 1) {
+		block = ext2fs_le32_to_cpu(frame->at->block) & 0x0fffffff;
+		frame = &info->frames[++level];
+		retval = ext2fs_dx_read_block(fs, dir, diri, block,
+					      &frame->pblock, frame->buf);
+		if (retval)
+			return retval;
+		retval = ext2fs_get_dx_countlimit(fs, frame->buf,
+						  &frame->head, NULL);
+		if (retval)
+			return retval;
+		count = ext2fs_le16_to_cpu(frame->head->count);
+		if (!count || count > ext2fs_le16_to_cpu(frame->head->limit))
+			return EXT2_ET_DIR_CORRUPTED;
+		frame->entries = (struct ext2_dx_entry *) frame->head;
+		frame->at = frame->entries;
+	}
+	return 0;
+}
+
+/*
+ * Look the name up through the directory's htree index, reading only
+ * the leaf blocks whose hash range could hold it.  Any error other than
+ * EXT2_ET_FILE_NOT_FOUND means the index couldn't be used.
+ */
+static errcode_t dx_lookup_name(ext2_filsys fs, ext2_ino_t dir,
+				struct ext2_inode *diri, const char *name,
+				int namelen, char *buf, ext2_ino_t *inode)
+{
+	struct dx_lookup_info info;
+	struct dx_frame	*leaf;
+	blk64_t		pblk;
+	char		*block_buf = buf;
+	errcode_t	retval;
+
+	if (!block_buf) {
+		retval = ext2fs_get_mem(fs->blocksize, &block_buf);
+		if (retval)
+			return retval;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.name = name;
+	info.namelen = namelen;
+	retval = ext2fs_dx_lookup(fs, dir, diri, &info);
+	if (retval)
+		goto out;
+
+	do {
+		leaf = &info.frames[info.levels - 1];
+		retval = ext2fs_dx_read_block(fs, dir, diri,
+				ext2fs_le32_to_cpu(leaf->at->block) & 0x0fffffff,
+				&pblk, block_buf);
+		if (retval)
+			break;
+		retval = dx_search_leaf(fs, block_buf, name, namelen, inode);
+		if (retval != EXT2_ET_FILE_NOT_FOUND)
+			break;
+		retval = dx_next_leaf(fs, dir, diri, &info);
+	} while (!retval);
+	ext2fs_dx_release(&info);
+out:
+	if (block_buf != buf)
+		ext2fs_free_mem(&block_buf);
+	return retval;
+}
 
 errcode_t ext2fs_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name,
 			int namelen, char *buf, ext2_ino_t *inode)
 {
 	errcode_t	retval;
 	struct lookup_struct ls;
+	struct ext2_inode diri;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	if (ext2fs_has_feature_dir_index(fs->super) &&
+	    ext2fs_read_inode(fs, dir, &diri) == 0 &&
+	    LINUX_S_ISDIR(diri.i_mode) &&
+	    (diri.i_flags & EXT2_INDEX_FL) &&
+	    !(diri.i_flags & EXT4_INLINE_DATA_FL)) {
+		retval = dx_lookup_name(fs, dir, &diri, name, namelen, buf,
+					inode);
+		if (retval == 0 || retval == EXT2_ET_FILE_NOT_FOUND)
+			return retval;
+		/* The index is damaged or unusable; fall back to a scan */
+	}
+
 	ls.name = name;
 	ls.len = namelen;
 	ls.inode = inode;
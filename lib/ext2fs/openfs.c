@@ -29,7 +29,7 @@
 
 #include "ext2_fs.h"
 
-#include "ext2fs.h"
+#include "ext2fsP.h"
 #include "e2image.h"
 
 blk64_t ext2fs_descriptor_block_loc2(ext2_filsys fs, blk64_t group_block,
@@ -447,6 +447,36 @@ retry:
 			first_meta_bg = fs->desc_blocks;
 	} else
 		first_meta_bg = fs->desc_blocks;
+	/*
+	 * With EXT2_FLAG_LAZY_GDT, descriptor blocks are read the first
+	 * time ext2fs_group_desc() is asked for one of their groups.
+	 */
+	if ((flags & EXT2_FLAG_LAZY_GDT) && !(flags & EXT2_FLAG_IMAGE_FILE)) {
+		struct ext2_lazy_gdt *lazy;
+
+		retval = ext2fs_get_memzero(sizeof(struct ext2_lazy_gdt),
+					    &lazy);
+		if (retval)
+			goto cleanup;
+		fs->lazy_gdt = lazy;
+		retval = ext2fs_get_memzero((fs->desc_blocks + 7) / 8,
+					    &lazy->loaded);
+		if (retval)
+			goto cleanup;
+#ifdef HAVE_PTHREAD
+		if (fs->io->flags & CHANNEL_FLAGS_THREADS) {
+			retval = pthread_mutex_init(&lazy->mutex, NULL);
+			if (retval)
+				goto cleanup;
+			lazy->use_mutex = 1;
+		}
+#endif
+		lazy->group_block = group_block;
+		lazy->zero_adjust = group_zero_adjust;
+		lazy->first_meta_bg = first_meta_bg;
+		lazy->unloaded = fs->desc_blocks;
+		goto read_bg_done;
+	}
 	if (first_meta_bg) {
 		retval = io_channel_read_blk(fs->io, group_block +
 					     group_zero_adjust + 1,
@@ -484,7 +514,7 @@ retry:
 #endif
 		dest += fs->blocksize;
 	}
-
+read_bg_done:
 	fs->stride = fs->super->s_raid_stride;
 
 	/*
@@ -270,3 +270,25 @@ out:
 		ext2fs_free_mem(&l2_table);
 	return ret;
 }
+
+/*
+ * Returns 1 if name is a QCOW2 image, and its size in bytes in
+ * *ret_size.
+ */
+int ext2fs_qcow2_probe(const char *name, unsigned long long *ret_size)
+{
+	struct ext2_qcow2_hdr *hdr;
+	int fd;
+
+	fd = ext2fs_open_file(name, O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	hdr = qcow2_read_header(fd);
+	close(fd);
+	if (!hdr)
+		return 0;
+	if (ret_size)
+		*ret_size = ext2fs_be64_to_cpu(hdr->size);
+	ext2fs_free_mem(&hdr);
+	return 1;
+}
@@ -24,7 +24,9 @@
  * %End-Header%
  */
 
-/* Number of l2 tables in memory before writeback */
+#include "ext2fs.h"
+
+/* Number of l2 tables in memory before they are written out together */
 #define L2_CACHE_PREALLOC	512
 
 
@@ -58,34 +60,24 @@ struct ext2_qcow2_hdr {
 	__u64	snapshots_offset;
 };
 
-typedef struct ext2_qcow2_l2_table L2_CACHE_HEAD;
-
-struct ext2_qcow2_l2_table {
-	__u32		l1_index;
-	__u64		offset;
-	__u64		*data;
-	L2_CACHE_HEAD	*next;
-};
-
+/*
+ * e2image writes the image sequentially: the L2 tables are allocated in
+ * order right after the L1 table, and are filled in and written out in
+ * batches as the data clusters behind them are streamed out.
+ */
 struct ext2_qcow2_l2_cache {
-	L2_CACHE_HEAD	*used_head;
-	L2_CACHE_HEAD	*used_tail;
-	L2_CACHE_HEAD	*free_head;
-	__u32		free;
-	__u32		count;
-	__u64		next_offset;
+	__u64	*tables;	/* count tables of l2_size entries */
+	__u32	count;
+	__u32	used;		/* tables[used - 1] is being filled in */
+	__u32	l1_index;	/* of tables[used - 1] */
+	__u64	first_offset;	/* where tables[0] goes */
 };
 
+/* The refcount table and blocks go at the end of the image */
 struct ext2_qcow2_refcount {
-	__u64	*refcount_table;
 	__u64	refcount_table_offset;
-	__u64	refcount_block_offset;
-
 	__u32	refcount_table_clusters;
-	__u32	refcount_table_index;
-	__u32	refcount_block_index;
-
-	__u16	*refcount_block;
+	__u64	refcount_blocks;
 };
 
 struct ext2_qcow2_image {
@@ -102,6 +94,8 @@ struct ext2_qcow2_image {
 	__u64	l2_offset;
 	__u64	l1_offset;
 	__u64	image_size;
+	__u64	data_offset;
+	__u32	l2_tables;	/* room reserved at l2_offset */
 };
 
 /* Function prototypes */
@@ -111,4 +105,5 @@ struct ext2_qcow2_image {
 /* Functions for converting qcow2 image into raw image */
 struct ext2_qcow2_hdr *qcow2_read_header(int);
 int qcow2_write_raw_image(int, int, struct ext2_qcow2_hdr *);
+int ext2fs_qcow2_probe(const char *name, unsigned long long *ret_size);
 
@@ -0,0 +1,309 @@
+/*
+ * qcow2_io.c --- read-only I/O manager for QCOW2 images
+ *
+ * This lets debugfs, dumpe2fs and "e2fsck -n" work on a QCOW2 image,
+ * such as one written by "e2image -Q", without converting it to a raw
+ * image first.  Guest clusters are looked up through the L1 table and
+ * a small LRU cache of L2 tables.  When a cluster has to be read, the
+ * clusters after it which are also stored contiguously in the image
+ * file are read along with it, since callers tend to read on.  The
+ * rest of the manager is shared with zimage_io.c, in image_io.c.
+ *
+ * Compressed clusters, encryption and backing files are not supported.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <errno.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "qcow2.h"
+
+#define QCOW2_L2_CACHE_SIZE	64
+#define QCOW2_READAHEAD_BYTES	(256 * 1024)
+#define QCOW2_MAX_CLUSTER_BITS	21
+
+#define QCOW2_OFFSET_MASK	(~(QCOW_OFLAG_COPIED | QCOW_OFLAG_COMPRESSED))
+
+struct qcow2_l2_cache {
+	__u32		l1_index;
+	unsigned long	access_time;
+	int		in_use;
+	__u64		*table;
+};
+
+struct qcow2_private_data {
+	struct ext2fs_image_io	image;		/* chunks are clusters */
+	struct ext2_qcow2_image	img;
+	unsigned long long	file_size;
+	unsigned long		access_time;
+	struct qcow2_l2_cache	l2_cache[QCOW2_L2_CACHE_SIZE];
+	char			*ra_buf;
+	unsigned int		ra_clusters;	/* ra_buf holds this many */
+	__u64			ra_offset;	/* in the image file */
+	size_t			ra_len;		/* valid bytes in ra_buf */
+};
+
+static struct struct_io_manager struct_qcow2_manager;
+io_manager qcow2_io_manager = &struct_qcow2_manager;
+
+/* Check that a cluster offset taken from the image is usable */
+static errcode_t check_offset(struct qcow2_private_data *data, __u64 entry)
+{
+	__u64 offset = entry & QCOW2_OFFSET_MASK;
+
+	if (entry & QCOW_OFLAG_COMPRESSED)
+		return EXT2_ET_QCOW2_UNSUPPORTED;
+	if ((offset & (data->img.cluster_size - 1)) ||
+	    offset + data->img.cluster_size > data->file_size)
+		return EXT2_ET_QCOW2_CORRUPT;
+	return 0;
+}
+
+/*
+ * Return the L2 table for l1_index in *table, or NULL if it is not
+ * allocated and so all of its clusters read as zeroes.
+ */
+static errcode_t get_l2_table(struct qcow2_private_data *data,
+			      __u32 l1_index, __u64 **table)
+{
+	struct qcow2_l2_cache *c, *victim = NULL;
+	__u64 entry;
+	errcode_t retval;
+	int i;
+
+	*table = NULL;
+	for (i = 0, c = data->l2_cache; i < QCOW2_L2_CACHE_SIZE; i++, c++) {
+		if (c->in_use && c->l1_index == l1_index) {
+			c->access_time = ++data->access_time;
+			*table = c->table;
+			return 0;
+		}
+		if (!victim || !c->in_use ||
+		    (victim->in_use && c->access_time < victim->access_time))
+			victim = c;
+	}
+
+	entry = ext2fs_be64_to_cpu(data->img.l1_table[l1_index]);
+	if (!(entry & QCOW2_OFFSET_MASK))
+		return 0;
+	retval = check_offset(data, entry);
+	if (retval)
+		return retval;
+
+	if (!victim->table) {
+		retval = ext2fs_get_mem(data->img.cluster_size, &victim->table);
+		if (retval)
+			return retval;
+	}
+	victim->in_use = 0;
+	retval = ext2fs_image_io_read_full(data->image.dev,
+				entry & QCOW2_OFFSET_MASK, victim->table,
+				data->img.cluster_size);
+	if (retval)
+		return retval == EXT2_ET_SHORT_READ ?
+			EXT2_ET_QCOW2_CORRUPT : retval;
+	data->image.io_stats.bytes_read += data->img.cluster_size;
+
+	victim->l1_index = l1_index;
+	victim->in_use = 1;
+	victim->access_time = ++data->access_time;
+	*table = victim->table;
+	return 0;
+}
+
+/*
+ * Return the contents of a guest cluster in *buf, or NULL if it is not
+ * allocated and so reads as zeroes.
+ */
+static errcode_t get_cluster(struct ext2fs_image_io *image,
+			     unsigned long long cluster, char **buf)
+{
+	struct qcow2_private_data *data = (struct qcow2_private_data *) image;
+	__u32 l1_index = cluster / data->img.l2_size;
+	__u32 l2_index = cluster & (data->img.l2_size - 1);
+	__u64 *table, offset, next;
+	unsigned int n;
+	errcode_t retval;
+
+	*buf = NULL;
+	retval = get_l2_table(data, l1_index, &table);
+	if (retval || !table)
+		return retval;
+	offset = ext2fs_be64_to_cpu(table[l2_index]);
+	if (!(offset & QCOW2_OFFSET_MASK))
+		return 0;
+	retval = check_offset(data, offset);
+	if (retval)
+		return retval;
+	offset &= QCOW2_OFFSET_MASK;
+
+	if (offset < data->ra_offset ||
+	    offset >= data->ra_offset + data->ra_len) {
+		/* Read ahead while the clusters are contiguous in the file */
+		for (n = 1; n < data->ra_clusters &&
+			     l2_index + n < data->img.l2_size; n++) {
+			next = ext2fs_be64_to_cpu(table[l2_index + n]);
+			if ((next & QCOW_OFLAG_COMPRESSED) ||
+			    (next & QCOW2_OFFSET_MASK) !=
+			    offset + ((__u64) n << data->img.cluster_bits) ||
+			    check_offset(data, next))
+				break;
+		}
+		data->ra_len = 0;
+		retval = ext2fs_image_io_read_full(data->image.dev, offset,
+				data->ra_buf,
+				(size_t) n << data->img.cluster_bits);
+		if (retval)
+			return retval == EXT2_ET_SHORT_READ ?
+				EXT2_ET_QCOW2_CORRUPT : retval;
+		data->ra_offset = offset;
+		data->ra_len = (size_t) n << data->img.cluster_bits;
+		data->image.io_stats.bytes_read += data->ra_len;
+	}
+	*buf = data->ra_buf + (offset - data->ra_offset);
+	return 0;
+}
+
+static void free_private_data(struct ext2fs_image_io *image)
+{
+	struct qcow2_private_data *data = (struct qcow2_private_data *) image;
+	int i;
+
+	for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++)
+		if (data->l2_cache[i].table)
+			ext2fs_free_mem(&data->l2_cache[i].table);
+	if (data->img.hdr)
+		ext2fs_free_mem(&data->img.hdr);
+	if (data->img.l1_table)
+		ext2fs_free_mem(&data->img.l1_table);
+	if (data->ra_buf)
+		ext2fs_free_mem(&data->ra_buf);
+	ext2fs_free_mem(&data);
+}
+
+static const struct ext2fs_image_io_ops qcow2_ops = {
+	.magic		= EXT2_ET_MAGIC_QCOW2_IO_CHANNEL,
+	.get_chunk	= get_cluster,
+	.free_data	= free_private_data,
+};
+
+static errcode_t read_header(struct qcow2_private_data *data)
+{
+	struct ext2_qcow2_image *img = &data->img;
+	struct ext2_qcow2_hdr *hdr;
+	ext2fs_struct_stat st;
+	__u64 l2_span;
+	errcode_t retval;
+
+	if (ext2fs_fstat(data->image.dev, &st) < 0)
+		return errno;
+	data->file_size = st.st_size;
+
+	hdr = qcow2_read_header(data->image.dev);
+	if (!hdr)
+		return EXT2_ET_QCOW2_CORRUPT;
+	img->hdr = hdr;
+	if (hdr->crypt_method || hdr->backing_file_offset)
+		return EXT2_ET_QCOW2_UNSUPPORTED;
+
+	img->cluster_bits = ext2fs_be32_to_cpu(hdr->cluster_bits);
+	if (img->cluster_bits < 9 ||
+	    img->cluster_bits > QCOW2_MAX_CLUSTER_BITS)
+		return EXT2_ET_QCOW2_CORRUPT;
+	img->cluster_size = 1 << img->cluster_bits;
+	img->l2_size = 1 << (img->cluster_bits - 3);
+	img->l1_size = ext2fs_be32_to_cpu(hdr->l1_size);
+	img->l1_offset = ext2fs_be64_to_cpu(hdr->l1_table_offset);
+	img->image_size = ext2fs_be64_to_cpu(hdr->size);
+
+	/* The L1 table has to cover the whole image, and fit in the file */
+	l2_span = (__u64) img->l2_size << img->cluster_bits;
+	if (img->l1_size < (img->image_size + l2_span - 1) / l2_span ||
+	    (img->l1_offset & (img->cluster_size - 1)) ||
+	    img->l1_offset + (__u64) img->l1_size * sizeof(__u64) >
+	    data->file_size)
+		return EXT2_ET_QCOW2_CORRUPT;
+
+	retval = ext2fs_get_array(img->l1_size ? img->l1_size : 1,
+				  sizeof(__u64), &img->l1_table);
+	if (retval)
+		return retval;
+	retval = ext2fs_image_io_read_full(data->image.dev, img->l1_offset,
+				img->l1_table,
+				(size_t) img->l1_size * sizeof(__u64));
+	if (retval)
+		return retval == EXT2_ET_SHORT_READ ?
+			EXT2_ET_QCOW2_CORRUPT : retval;
+	return 0;
+}
+
+static errcode_t qcow2_open(const char *name, int flags, io_channel *channel)
+{
+	struct qcow2_private_data *data = NULL;
+	errcode_t	retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct qcow2_private_data), &data);
+	if (retval)
+		return retval;
+	retval = ext2fs_image_io_open(name, flags, &qcow2_ops, &data->image);
+	if (retval)
+		goto cleanup;
+	retval = read_header(data);
+	if (retval)
+		goto cleanup;
+	data->image.size = data->img.image_size;
+	data->image.chunk_bytes = data->img.cluster_size;
+
+	data->ra_clusters = QCOW2_READAHEAD_BYTES / data->img.cluster_size;
+	if (!data->ra_clusters)
+		data->ra_clusters = 1;
+	retval = ext2fs_get_array(data->ra_clusters, data->img.cluster_size,
+				  &data->ra_buf);
+	if (retval)
+		goto cleanup;
+
+	retval = ext2fs_image_io_channel(qcow2_io_manager, name, flags,
+					 &data->image, channel);
+	if (retval)
+		goto cleanup;
+	return 0;
+
+cleanup:
+	ext2fs_image_io_free(&data->image);
+	return retval;
+}
+
+static struct struct_io_manager struct_qcow2_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "QCOW2 I/O Manager",
+	.open		= qcow2_open,
+	.close		= ext2fs_image_io_close,
+	.set_blksize	= ext2fs_image_io_set_blksize,
+	.read_blk	= ext2fs_image_io_read_blk,
+	.write_blk	= ext2fs_image_io_write_blk,
+	.flush		= ext2fs_image_io_flush,
+	.write_byte	= ext2fs_image_io_write_byte,
+	.set_option	= ext2fs_image_io_set_option,
+	.get_stats	= ext2fs_image_io_get_stats,
+	.read_blk64	= ext2fs_image_io_read_blk64,
+	.write_blk64	= ext2fs_image_io_write_blk64,
+};
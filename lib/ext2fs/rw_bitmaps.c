@@ -28,7 +28,7 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 #include "e2image.h"
 
 #ifdef HAVE_PTHREAD
@@ -538,6 +538,14 @@ errcode_t ext2fs_rw_bitmaps(ext2_filsys fs, int flags, int num_threads)
 	if (ext2fs_has_feature_journal_dev(fs->super))
 		return EXT2_ET_EXTERNAL_JOURNAL_NOSUPP;
 
+	/* Don't go by descriptors which could not be read */
+	if (fs->lazy_gdt) {
+		errcode_t err = ext2fs_fill_lazy_gdt(fs);
+
+		if (err)
+			return err;
+	}
+
 	if (flags & EXT2FS_BITMAPS_WRITE)
 		return write_bitmaps(fs, flags & EXT2FS_BITMAPS_INODE,
 				     flags & EXT2FS_BITMAPS_BLOCK);
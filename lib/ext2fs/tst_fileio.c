@@ -0,0 +1,697 @@
+/*
+ * tst_fileio.c --- test the extent block cache, ext2fs_bmap_range(),
+ *	the ext2_file write-back buffer, and sharing the inode and
+ *	extent caches between threads
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define TEST_BLOCKS	16384
+#define SPARSE_BLOCKS	600	/* every other block, so 300 extents */
+#define UNINIT_START	1000
+#define UNINIT_LEN	8
+
+static char tmp_name[] = "tst_fileio.XXXXXX";
+static int failed;
+
+/*
+ * An io_manager which passes everything through to the unix manager,
+ * but counts the multi-block writes and can be told to fail them.
+ */
+static struct struct_io_manager counting_io;
+static int multi_writes, fail_writes;
+
+static errcode_t counting_write_blk64(io_channel channel,
+				      unsigned long long block, int count,
+				      const void *buf)
+{
+	if (fail_writes)
+		return EIO;
+	if (count > 1)
+		multi_writes++;
+	return unix_io_manager->write_blk64(channel, block, count, buf);
+}
+
+#define check(cond, fmt, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			printf("FAILED: " fmt "\n", ## __VA_ARGS__);	\
+			failed++;					\
+		}							\
+	} while (0)
+
+static void fill_block(char *buf, int size, blk64_t lblk)
+{
+	memset(buf, (int) (lblk % 251) + 1, size);
+}
+
+static ext2_filsys setup(void)
+{
+	struct ext2_super_block param;
+	ext2_filsys	fs;
+	errcode_t	retval;
+	int		fd;
+
+	initialize_ext2_error_table();
+
+	fd = mkstemp(tmp_name);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	if (ftruncate(fd, (off_t) TEST_BLOCKS * 1024) < 0) {
+		perror("ftruncate");
+		unlink(tmp_name);
+		exit(1);
+	}
+	close(fd);
+
+	memset(&param, 0, sizeof(param));
+	ext2fs_blocks_count_set(&param, TEST_BLOCKS);
+	param.s_rev_level = EXT2_DYNAMIC_REV;
+	param.s_inode_size = 256;
+	param.s_inodes_count = 256;
+	param.s_feature_incompat = EXT3_FEATURE_INCOMPAT_EXTENTS;
+	param.s_feature_ro_compat = EXT4_FEATURE_RO_COMPAT_METADATA_CSUM;
+
+	retval = ext2fs_initialize(tmp_name, EXT2_FLAG_64BITS, &param,
+				   unix_io_manager, &fs);
+	if (retval) {
+		com_err("setup", retval, "while initializing filesystem");
+		exit(1);
+	}
+	fs->super->s_checksum_type = EXT2_CRC32C_CHKSUM;
+	ext2fs_init_csum_seed(fs);
+	retval = ext2fs_allocate_tables(fs);
+	if (retval) {
+		com_err("setup", retval, "while allocating tables");
+		exit(1);
+	}
+
+	counting_io = *unix_io_manager;
+	counting_io.write_blk64 = counting_write_blk64;
+	fs->io->manager = &counting_io;
+	return fs;
+}
+
+static ext2_ino_t new_file(ext2_filsys fs, int extents)
+{
+	struct ext2_inode inode;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+
+	retval = ext2fs_new_inode(fs, EXT2_ROOT_INO, LINUX_S_IFREG | 0644,
+				  0, &ino);
+	if (retval) {
+		com_err("new_file", retval, "while allocating an inode");
+		exit(1);
+	}
+	ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+
+	memset(&inode, 0, sizeof(inode));
+	inode.i_mode = LINUX_S_IFREG | 0644;
+	inode.i_links_count = 1;
+	if (extents) {
+		ext2_extent_handle_t handle;
+
+		retval = ext2fs_extent_open2(fs, ino, &inode, &handle);
+		if (retval) {
+			com_err("new_file", retval, "while creating extents");
+			exit(1);
+		}
+		ext2fs_extent_free(handle);
+	}
+	retval = ext2fs_write_new_inode(fs, ino, &inode);
+	if (retval) {
+		com_err("new_file", retval, "while writing inode %u", ino);
+		exit(1);
+	}
+	return ino;
+}
+
+/*
+ * Write the given logical block of a file, one block at a time.
+ */
+static errcode_t write_block(ext2_file_t file, blk64_t lblk)
+{
+	ext2_filsys	fs = ext2fs_file_get_fs(file);
+	char		buf[EXT2_MAX_BLOCK_SIZE];
+	unsigned int	written;
+	errcode_t	retval;
+
+	fill_block(buf, fs->blocksize, lblk);
+	retval = ext2fs_file_llseek(file, lblk * fs->blocksize,
+				    EXT2_SEEK_SET, NULL);
+	if (retval)
+		return retval;
+	retval = ext2fs_file_write(file, buf, fs->blocksize, &written);
+	if (!retval && written != fs->blocksize)
+		retval = EXT2_ET_SHORT_WRITE;
+	return retval;
+}
+
+/*
+ * Read nblocks blocks starting at lblk, and check them against the
+ * pattern written by write_block().  If holes is HOLES_ODD, the odd
+ * blocks must read back as zeroes, and if it is HOLES_ALL, all of
+ * them must.
+ */
+#define HOLES_NONE	0
+#define HOLES_ODD	1
+#define HOLES_ALL	2
+
+static errcode_t verify_blocks(ext2_filsys fs, ext2_ino_t ino,
+			       blk64_t lblk, int nblocks, int holes)
+{
+	ext2_file_t	file;
+	char		*buf, *expect;
+	unsigned int	got;
+	errcode_t	retval;
+	int		i;
+
+	retval = ext2fs_get_array(2 * nblocks, fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	expect = buf + nblocks * fs->blocksize;
+	for (i = 0; i < nblocks; i++) {
+		if (holes == HOLES_ALL ||
+		    (holes == HOLES_ODD && ((lblk + i) & 1)))
+			memset(expect + i * fs->blocksize, 0, fs->blocksize);
+		else
+			fill_block(expect + i * fs->blocksize, fs->blocksize,
+				   lblk + i);
+	}
+
+	retval = ext2fs_file_open(fs, ino, 0, &file);
+	if (retval)
+		goto out;
+	retval = ext2fs_file_llseek(file, lblk * fs->blocksize,
+				    EXT2_SEEK_SET, NULL);
+	if (!retval)
+		retval = ext2fs_file_read(file, buf, nblocks * fs->blocksize,
+					  &got);
+	ext2fs_file_close(file);
+	if (retval)
+		goto out;
+	if (got != nblocks * fs->blocksize ||
+	    memcmp(buf, expect, nblocks * fs->blocksize))
+		retval = EXT2_ET_SHORT_READ;
+out:
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+/*
+ * Create a file with a mapped block at every even logical block, so
+ * that its extent tree needs several leaf blocks.
+ */
+static ext2_ino_t create_sparse_file(ext2_filsys fs)
+{
+	ext2_file_t	file;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+	blk64_t		lblk;
+
+	ino = new_file(fs, 1);
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &file);
+	if (retval) {
+		com_err("create_sparse_file", retval, "while opening file");
+		exit(1);
+	}
+	for (lblk = 0; lblk < SPARSE_BLOCKS; lblk += 2) {
+		retval = write_block(file, lblk);
+		if (retval) {
+			com_err("create_sparse_file", retval,
+				"while writing block %llu", lblk);
+			exit(1);
+		}
+	}
+	retval = ext2fs_file_close(file);
+	if (retval) {
+		com_err("create_sparse_file", retval, "while closing file");
+		exit(1);
+	}
+	return ino;
+}
+
+/*
+ * Check that the extent block cache is used, and that it is kept in
+ * sync with the tree as blocks are added to the file.
+ */
+static void test_extent_cache(ext2_filsys fs)
+{
+	struct ext2_extent_cache_stats stats;
+	ext2_file_t	file;
+	ext2_ino_t	ino;
+	blk64_t		lblk, pblk, map[SPARSE_BLOCKS];
+	errcode_t	retval;
+	int		pass, prev_failed = failed;
+
+	retval = ext2fs_create_extent_cache(fs, 8);
+	check(retval == 0, "creating extent cache: %s",
+	      error_message(retval));
+	if (retval)
+		return;
+	ino = create_sparse_file(fs);
+
+	for (pass = 0; pass < 2; pass++) {
+		for (lblk = 0; lblk < SPARSE_BLOCKS; lblk++) {
+			retval = ext2fs_bmap2(fs, ino, NULL, NULL, 0, lblk,
+					      0, &pblk);
+			check(retval == 0, "bmap of block %llu: %s", lblk,
+			      error_message(retval));
+			check(!!pblk == !(lblk & 1),
+			      "block %llu mapped to %llu", lblk, pblk);
+			if (pass)
+				check(pblk == map[lblk],
+				      "block %llu moved: %llu != %llu",
+				      lblk, pblk, map[lblk]);
+			map[lblk] = pblk;
+		}
+	}
+	ext2fs_get_extent_cache_stats(fs, &stats);
+	check(stats.hits > 0 && stats.hits <= stats.lookups,
+	      "extent cache: %llu hits / %llu lookups",
+	      (unsigned long long) stats.hits,
+	      (unsigned long long) stats.lookups);
+
+	/* Fill in the holes, which rewrites (and splits) the leaves */
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &file);
+	check(retval == 0, "opening file: %s", error_message(retval));
+	if (retval)
+		goto out;
+	for (lblk = 1; lblk < SPARSE_BLOCKS; lblk += 2) {
+		retval = write_block(file, lblk);
+		if (retval)
+			break;
+	}
+	if (!retval)
+		retval = ext2fs_file_close(file);
+	else
+		ext2fs_file_close(file);
+	check(retval == 0, "filling holes: %s", error_message(retval));
+	ext2fs_get_extent_cache_stats(fs, &stats);
+	check(stats.invalidations > 0, "no extent cache invalidations");
+
+	retval = verify_blocks(fs, ino, 0, SPARSE_BLOCKS, HOLES_NONE);
+	check(retval == 0, "verifying filled file: %s",
+	      error_message(retval));
+
+	ext2fs_extent_cache_invalidate(fs, 0, ext2fs_blocks_count(fs->super));
+	ext2fs_get_extent_cache_stats(fs, &stats);
+	check(stats.cache_used == 0, "%u extent cache entries left",
+	      stats.cache_used);
+out:
+	ext2fs_free_extent_cache(fs->ecache);
+	fs->ecache = NULL;
+	if (failed == prev_failed)
+		printf("tst_fileio(extent cache): OK\n");
+}
+
+/*
+ * Map a range and check the result.
+ */
+static void check_range(ext2_filsys fs, ext2_ino_t ino, blk64_t lblk,
+			blk64_t max_len, int mapped, blk64_t len, int flags)
+{
+	struct ext2fs_extent ext;
+	errcode_t	retval;
+
+	retval = ext2fs_bmap_range(fs, ino, NULL, NULL, lblk, max_len, &ext);
+	check(retval == 0, "bmap_range(%u, %llu, %llu): %s", ino, lblk,
+	      max_len, error_message(retval));
+	if (retval)
+		return;
+	check(ext.e_lblk == lblk && !!ext.e_pblk == mapped &&
+	      ext.e_len == len && ext.e_flags == flags,
+	      "bmap_range(%u, %llu, %llu) returned %llu->%llu len %u "
+	      "flags %x, expected len %llu flags %x%s", ino, lblk, max_len,
+	      ext.e_lblk, ext.e_pblk, ext.e_len, ext.e_flags, len, flags,
+	      mapped ? "" : " (hole)");
+}
+
+/*
+ * Check ext2fs_bmap_range() on holes, unwritten extents and block
+ * mapped files, and that errors from the extent tree are passed back
+ * rather than being reported as holes.
+ */
+static void test_bmap_range(ext2_filsys fs)
+{
+	struct ext2fs_extent extent;
+	struct ext2_inode inode;
+	ext2_extent_handle_t handle = NULL;
+	ext2_file_t	file;
+	ext2_ino_t	ino, bm_ino;
+	blk64_t		leaf_lblk, leaf_pblk;
+	char		buf[EXT2_MAX_BLOCK_SIZE], save[EXT2_MAX_BLOCK_SIZE];
+	errcode_t	retval;
+	int		prev_failed = failed;
+
+	ino = create_sparse_file(fs);
+	retval = ext2fs_read_inode(fs, ino, &inode);
+	if (!retval)
+		retval = ext2fs_fallocate(fs, EXT2_FALLOCATE_FORCE_UNINIT,
+					  ino, &inode, ~0ULL, UNINIT_START,
+					  UNINIT_LEN);
+	if (!retval) {
+		retval = ext2fs_read_inode(fs, ino, &inode);
+		ext2fs_inode_size_set(fs, &inode, (UNINIT_START + UNINIT_LEN) *
+				      (__u64) fs->blocksize);
+	}
+	if (!retval)
+		retval = ext2fs_write_inode(fs, ino, &inode);
+	check(retval == 0, "fallocate: %s", error_message(retval));
+
+	check_range(fs, ino, 0, 100, 1, 1, 0);
+	check_range(fs, ino, 1, 100, 0, 1, 0);
+	check_range(fs, ino, SPARSE_BLOCKS - 1, 100, 0, 100, 0);
+	check_range(fs, ino, SPARSE_BLOCKS - 1, 10000, 0,
+		    UNINIT_START - SPARSE_BLOCKS + 1, 0);
+	check_range(fs, ino, UNINIT_START, 100, 1, UNINIT_LEN,
+		    EXT2_EXTENT_FLAGS_UNINIT);
+	check_range(fs, ino, UNINIT_START + 2, 3, 1, 3,
+		    EXT2_EXTENT_FLAGS_UNINIT);
+	check_range(fs, ino, UNINIT_START + UNINIT_LEN, 50, 0, 50, 0);
+
+	retval = verify_blocks(fs, ino, 0, SPARSE_BLOCKS, HOLES_ODD);
+	check(retval == 0, "reading sparse file: %s", error_message(retval));
+	retval = verify_blocks(fs, ino, UNINIT_START - 4, UNINIT_LEN + 4,
+			       HOLES_ALL);
+	check(retval == 0, "reading unwritten extent: %s",
+	      error_message(retval));
+
+	/* Find the second leaf of the extent tree */
+	retval = ext2fs_extent_open2(fs, ino, NULL, &handle);
+	if (!retval)
+		retval = ext2fs_extent_goto2(handle, 1, 0);
+	if (!retval)
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_SIB,
+					   &extent);
+	if (handle)
+		ext2fs_extent_free(handle);
+	check(retval == 0, "finding second extent leaf: %s",
+	      error_message(retval));
+	if (retval)
+		goto block_mapped;
+	leaf_lblk = extent.e_lblk;
+	leaf_pblk = extent.e_pblk;
+
+	/* Corrupt its checksum, then map the hole just before it */
+	retval = io_channel_read_blk64(fs->io, leaf_pblk, 1, save);
+	check(retval == 0, "reading leaf: %s", error_message(retval));
+	if (retval)
+		goto block_mapped;
+	memcpy(buf, save, fs->blocksize);
+	buf[fs->blocksize - 1] ^= 0xff;
+	io_channel_write_blk64(fs->io, leaf_pblk, 1, buf);
+
+	retval = ext2fs_bmap_range(fs, ino, NULL, NULL, leaf_lblk - 1, 4,
+				   &extent);
+	check(retval == EXT2_ET_EXTENT_CSUM_INVALID,
+	      "bmap_range across a corrupt leaf returned %s",
+	      retval ? error_message(retval) : "success");
+	retval = verify_blocks(fs, ino, leaf_lblk - 1, 4, HOLES_ODD);
+	check(retval == EXT2_ET_EXTENT_CSUM_INVALID,
+	      "reading across a corrupt leaf returned %s",
+	      retval ? error_message(retval) : "success");
+
+	io_channel_write_blk64(fs->io, leaf_pblk, 1, save);
+	check_range(fs, ino, leaf_lblk - 1, 4, 0, 1, 0);
+
+block_mapped:
+	/*
+	 * A block-mapped file with a long hole; the walk over the hole
+	 * is cut short after one indirect block's worth of entries.
+	 */
+	bm_ino = new_file(fs, 0);
+	retval = ext2fs_file_open(fs, bm_ino, EXT2_FILE_WRITE, &file);
+	if (!retval) {
+		retval = write_block(file, 0);
+		if (!retval)
+			retval = ext2fs_file_set_size2(file, 1ULL << 32);
+		if (!retval)
+			retval = ext2fs_file_close(file);
+		else
+			ext2fs_file_close(file);
+	}
+	check(retval == 0, "creating block-mapped file: %s",
+	      error_message(retval));
+	check_range(fs, bm_ino, 0, 10, 1, 1, 0);
+	check_range(fs, bm_ino, 1, (1ULL << 32) / fs->blocksize - 1, 0,
+		    EXT2_ADDR_PER_BLOCK(fs->super), 0);
+	retval = verify_blocks(fs, bm_ino, 0, 1, HOLES_NONE);
+	if (!retval)
+		retval = verify_blocks(fs, bm_ino, 1, 3, HOLES_ALL);
+	check(retval == 0, "reading block-mapped file: %s",
+	      error_message(retval));
+
+	if (failed == prev_failed)
+		printf("tst_fileio(bmap_range): OK\n");
+}
+
+/*
+ * Check that sequential writes are gathered into multi-block writes,
+ * that large overwrites bypass the block buffer, and that blocks stay
+ * queued (and are written later) if writing them out fails.
+ */
+static void test_write_back(ext2_filsys fs)
+{
+	ext2_file_t	file;
+	ext2_ino_t	ino, ino2;
+	char		*buf;
+	unsigned int	written;
+	errcode_t	retval;
+	blk64_t		lblk;
+	int		prev_failed = failed;
+
+	/* Sequential writes, eight blocks at a time */
+	ino = new_file(fs, 1);
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &file);
+	check(retval == 0, "opening file: %s", error_message(retval));
+	if (retval)
+		return;
+	retval = ext2fs_file_set_bufsize(file, 8);
+	check(retval == 0, "set_bufsize: %s", error_message(retval));
+	multi_writes = 0;
+	for (lblk = 0; lblk < 32 && !retval; lblk++)
+		retval = write_block(file, lblk);
+	if (!retval)
+		retval = ext2fs_file_close(file);
+	else
+		ext2fs_file_close(file);
+	check(retval == 0, "sequential writes: %s", error_message(retval));
+	check(multi_writes >= 3, "only %d multi-block writes", multi_writes);
+	retval = verify_blocks(fs, ino, 0, 32, HOLES_NONE);
+	check(retval == 0, "verifying sequential writes: %s",
+	      error_message(retval));
+
+	/* With the buffer turned off, every block is written by itself */
+	ino2 = new_file(fs, 1);
+	retval = ext2fs_file_open(fs, ino2, EXT2_FILE_WRITE, &file);
+	check(retval == 0, "opening file: %s", error_message(retval));
+	if (retval)
+		return;
+	retval = ext2fs_file_set_bufsize(file, 0);
+	multi_writes = 0;
+	for (lblk = 0; lblk < 8 && !retval; lblk++)
+		retval = write_block(file, lblk);
+	if (!retval)
+		retval = ext2fs_file_close(file);
+	else
+		ext2fs_file_close(file);
+	check(retval == 0, "unbuffered writes: %s", error_message(retval));
+	check(multi_writes == 0, "%d multi-block writes without a buffer",
+	      multi_writes);
+	retval = verify_blocks(fs, ino2, 0, 8, HOLES_NONE);
+	check(retval == 0, "verifying unbuffered writes: %s",
+	      error_message(retval));
+
+	/* Overwrite the middle of the first file in one go */
+	retval = ext2fs_get_arrayzero(16, fs->blocksize, &buf);
+	if (retval)
+		return;
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &file);
+	if (!retval) {
+		multi_writes = 0;
+		retval = ext2fs_file_llseek(file, 8 * fs->blocksize,
+					    EXT2_SEEK_SET, NULL);
+		if (!retval)
+			retval = ext2fs_file_write(file, buf,
+						   16 * fs->blocksize,
+						   &written);
+		if (!retval)
+			retval = ext2fs_file_close(file);
+		else
+			ext2fs_file_close(file);
+	}
+	ext2fs_free_mem(&buf);
+	check(retval == 0, "overwriting 16 blocks: %s",
+	      error_message(retval));
+	check(multi_writes > 0, "overwrite was not written directly");
+	retval = verify_blocks(fs, ino, 0, 8, HOLES_NONE);
+	if (!retval)
+		retval = verify_blocks(fs, ino, 8, 16, HOLES_ALL);
+	if (!retval)
+		retval = verify_blocks(fs, ino, 24, 8, HOLES_NONE);
+	check(retval == 0, "verifying overwrite: %s", error_message(retval));
+
+	/* A failed flush must leave the queued blocks to be retried */
+	ino = new_file(fs, 1);
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &file);
+	check(retval == 0, "opening file: %s", error_message(retval));
+	if (retval)
+		return;
+	retval = ext2fs_file_set_bufsize(file, 4);
+	for (lblk = 0; lblk < 2 && !retval; lblk++)
+		retval = write_block(file, lblk);
+	check(retval == 0, "queueing writes: %s", error_message(retval));
+	fail_writes = 1;
+	retval = ext2fs_file_flush(file);
+	fail_writes = 0;
+	check(retval == EIO, "failing flush returned %s",
+	      retval ? error_message(retval) : "success");
+	retval = ext2fs_file_close(file);
+	check(retval == 0, "closing file: %s", error_message(retval));
+	retval = verify_blocks(fs, ino, 0, 2, HOLES_NONE);
+	check(retval == 0, "verifying retried writes: %s",
+	      error_message(retval));
+
+	if (failed == prev_failed)
+		printf("tst_fileio(write-back): OK\n");
+}
+
+#ifdef HAVE_PTHREAD
+#define NUM_THREADS	4
+#define THREAD_LOOPS	1000
+
+struct thread_data {
+	ext2_filsys	fs;
+	ext2_ino_t	ino;		/* updated by this thread only */
+	ext2_ino_t	sparse_ino;	/* read by all of them */
+	errcode_t	retval;
+};
+
+static void *thread_proc(void *arg)
+{
+	struct thread_data *td = arg;
+	struct ext2_inode inode;
+	errcode_t	retval = 0;
+	blk64_t		lblk;
+	int		i;
+
+	for (i = 1; i <= THREAD_LOOPS && !retval; i++) {
+		retval = ext2fs_read_inode(td->fs, td->ino, &inode);
+		if (retval)
+			break;
+		inode.i_atime = i;
+		retval = ext2fs_write_inode(td->fs, td->ino, &inode);
+		if (retval)
+			break;
+		lblk = (i * 16) % (SPARSE_BLOCKS - 8);
+		retval = verify_blocks(td->fs, td->sparse_ino, lblk, 8,
+				       HOLES_ODD);
+	}
+	td->retval = retval;
+	return NULL;
+}
+
+/*
+ * Reopen the file system with EXT2_FLAG_THREADS and have several
+ * threads rewrite inodes in the same inode table block while reading
+ * a file through small inode and extent caches.  No update may be lost.
+ */
+static ext2_filsys test_threads(ext2_filsys fs)
+{
+	struct thread_data td[NUM_THREADS];
+	pthread_t	threads[NUM_THREADS];
+	struct ext2_inode inode;
+	ext2_ino_t	sparse_ino;
+	errcode_t	retval;
+	int		i, prev_failed = failed;
+
+	sparse_ino = create_sparse_file(fs);
+	for (i = 0; i < NUM_THREADS; i++)
+		td[i].ino = new_file(fs, 1);
+	retval = ext2fs_close_free(&fs);
+	if (!retval)
+		retval = ext2fs_open(tmp_name, EXT2_FLAG_RW | EXT2_FLAG_64BITS |
+				     EXT2_FLAG_THREADS, 0, 0, unix_io_manager,
+				     &fs);
+	if (!retval)
+		retval = ext2fs_create_inode_cache(fs, 4);
+	if (!retval)
+		retval = ext2fs_create_extent_cache(fs, 4);
+	if (retval) {
+		com_err("test_threads", retval, "while reopening filesystem");
+		exit(1);
+	}
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		td[i].fs = fs;
+		td[i].sparse_ino = sparse_ino;
+		td[i].retval = 0;
+		if (pthread_create(&threads[i], NULL, thread_proc, &td[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		check(td[i].retval == 0, "thread %d: %s", i,
+		      error_message(td[i].retval));
+	}
+
+	ext2fs_flush_icache(fs);
+	for (i = 0; i < NUM_THREADS; i++) {
+		retval = ext2fs_read_inode(fs, td[i].ino, &inode);
+		check(retval == 0, "reading inode %u: %s", td[i].ino,
+		      error_message(retval));
+		check(retval || inode.i_atime == THREAD_LOOPS,
+		      "inode %u: atime %u, expected %u", td[i].ino,
+		      inode.i_atime, THREAD_LOOPS);
+	}
+
+	if (failed == prev_failed)
+		printf("tst_fileio(threads): OK\n");
+	return fs;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	ext2_filsys	fs;
+
+	fs = setup();
+	test_extent_cache(fs);
+	test_bmap_range(fs);
+	test_write_back(fs);
+#ifdef HAVE_PTHREAD
+	fs = test_threads(fs);
+#endif
+
+	ext2fs_free(fs);
+	unlink(tmp_name);
+	if (failed)
+		printf("tst_fileio: %d tests FAILED\n", failed);
+	return failed != 0;
+}
@@ -42,6 +42,9 @@
 #include <sys/resource.h>
 #endif
 #include <limits.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
@@ -148,6 +151,20 @@ struct undo_private_data {
 	struct struct_ext2_filsys fake_fs;
 	char *tdb_file;
 	struct undo_header hdr;
+
+	/* Bytes read by the last short read of the backing channel */
+	int actual_size;
+
+	/*
+	 * With IO_FLAG_THREADS, writes (which must save the old contents
+	 * first) and actual_size are protected by this lock; reads go
+	 * straight to the backing channel.  The lock is recursive because
+	 * a short read made while saving old contents records its size.
+	 */
+	int use_lock;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
 };
 #define KEYS_PER_BLOCK(d) (((d)->tdb_data_size / sizeof(struct undo_key)) - 1)
 
@@ -163,7 +180,6 @@ static inline void e2undo_clear_feature_fs_offset(struct undo_header *header) {
 
 static io_manager undo_io_backing_manager;
 static char *tdb_file;
-static int actual_size;
 
 errcode_t set_undo_io_backing_manager(io_manager manager)
 {
@@ -317,6 +333,22 @@ static errcode_t undo_setup_tdb(struct undo_private_data *data)
 	return 0;
 }
 
+static void undo_lock(struct undo_private_data *data EXT2FS_ATTR((unused)))
+{
+#ifdef HAVE_PTHREAD
+	if (data->use_lock)
+		pthread_mutex_lock(&data->lock);
+#endif
+}
+
+static void undo_unlock(struct undo_private_data *data EXT2FS_ATTR((unused)))
+{
+#ifdef HAVE_PTHREAD
+	if (data->use_lock)
+		pthread_mutex_unlock(&data->lock);
+#endif
+}
+
 static errcode_t undo_write_tdb(io_channel channel,
 				unsigned long long block, int count)
 
@@ -394,7 +426,7 @@ static errcode_t undo_write_tdb(io_channel channel,
 		}
 
 		memset(read_ptr, 0, data->tdb_data_size);
-		actual_size = 0;
+		data->actual_size = 0;
 		if ((data->tdb_data_size % channel->block_size) == 0)
 			sz = data->tdb_data_size / channel->block_size;
 		else
@@ -410,7 +442,7 @@ static errcode_t undo_write_tdb(io_channel channel,
 			 * short read so update the record size
 			 * accordingly
 			 */
-			data_size = actual_size;
+			data_size = data->actual_size;
 		} else {
 			data_size = data->tdb_data_size;
 		}
@@ -477,7 +509,7 @@ static errcode_t undo_write_tdb(io_channel channel,
 	return retval;
 }
 
-static errcode_t undo_io_read_error(io_channel channel ATTR((unused)),
+static errcode_t undo_io_read_error(io_channel channel,
 				    unsigned long block ATTR((unused)),
 				    int count ATTR((unused)),
 				    void *data ATTR((unused)),
@@ -485,12 +517,18 @@ static errcode_t undo_io_read_error(io_channel channel ATTR((unused)),
 				    int actual,
 				    errcode_t error ATTR((unused)))
 {
-	actual_size = actual;
+	struct undo_private_data *undo = channel->app_data;
+
+	undo_lock(undo);
+	undo->actual_size = actual;
+	undo_unlock(undo);
 	return error;
 }
 
-static void undo_err_handler_init(io_channel channel)
+static void undo_err_handler_init(io_channel channel,
+				  struct undo_private_data *data)
 {
+	channel->app_data = data;
 	channel->read_error = undo_io_read_error;
 }
 
@@ -698,8 +736,6 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 	int		undo_fd = -1;
 	errcode_t	retval;
 
-	/* We don't support multi-threading, at least for now */
-	flags &= ~IO_FLAG_THREADS;
 	if (name == 0)
 		return EXT2_ET_BAD_DEVICE_NAME;
 	retval = ext2fs_get_mem(sizeof(struct struct_io_channel), &io);
@@ -753,16 +789,35 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 		data->undo_file = NULL;
 	}
 
-	if (data->real)
+	if (data->real) {
 		io->flags = (io->flags & ~CHANNEL_FLAGS_DISCARD_ZEROES) |
 			    (data->real->flags & CHANNEL_FLAGS_DISCARD_ZEROES);
+		io->discard_max_sectors = data->real->discard_max_sectors;
+	}
+#ifdef HAVE_PTHREAD
+	if ((flags & IO_FLAG_THREADS) && data->real &&
+	    (data->real->flags & CHANNEL_FLAGS_THREADS)) {
+		pthread_mutexattr_t attr;
+
+		retval = pthread_mutexattr_init(&attr);
+		if (retval)
+			goto cleanup;
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		retval = pthread_mutex_init(&data->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		if (retval)
+			goto cleanup;
+		data->use_lock = 1;
+		io->flags |= CHANNEL_FLAGS_THREADS;
+	}
+#endif
 
 	/*
 	 * setup err handler for read so that we know
 	 * when the backing manager fails do short read
 	 */
 	if (data->real)
-		undo_err_handler_init(data->real);
+		undo_err_handler_init(data->real, data);
 
 	if (data->undo_file) {
 		retval = try_reopen_undo_file(undo_fd, data);
@@ -822,6 +877,10 @@ static errcode_t undo_close(io_channel channel)
 	ext2fs_free_mem(&data->keyb);
 	if (data->written_block_map)
 		ext2fs_free_generic_bitmap(data->written_block_map);
+#ifdef HAVE_PTHREAD
+	if (data->use_lock)
+		pthread_mutex_destroy(&data->lock);
+#endif
 	ext2fs_free_mem(&channel->private_data);
 	if (channel->name)
 		ext2fs_free_mem(&channel->name);
@@ -889,11 +948,11 @@ static errcode_t undo_write_blk64(io_channel channel, unsigned long long block,
 	/*
 	 * First write the existing content into database
 	 */
+	undo_lock(data);
 	retval = undo_write_tdb(channel, block, count);
-	if (retval)
-		 return retval;
-	if (data->real)
+	if (!retval && data->real)
 		retval = io_channel_write_blk64(data->real, block, count, buf);
+	undo_unlock(data);
 
 	return retval;
 }
@@ -926,11 +985,11 @@ static errcode_t undo_write_byte(io_channel channel, unsigned long offset,
 	 */
 	count = (size + (location % channel->block_size) +
 			channel->block_size  -1)/channel->block_size;
+	undo_lock(data);
 	retval = undo_write_tdb(channel, blk_num, count);
-	if (retval)
-		return retval;
-	if (data->real && data->real->manager->write_byte)
+	if (!retval && data->real && data->real->manager->write_byte)
 		retval = io_channel_write_byte(data->real, offset, size, buf);
+	undo_unlock(data);
 
 	return retval;
 }
@@ -953,11 +1012,11 @@ static errcode_t undo_discard(io_channel channel, unsigned long long block,
 	/*
 	 * First write the existing content into database
 	 */
+	undo_lock(data);
 	retval = undo_write_tdb(channel, block, icount);
-	if (retval)
-		return retval;
-	if (data->real)
+	if (!retval && data->real)
 		retval = io_channel_discard(data->real, block, count);
+	undo_unlock(data);
 
 	return retval;
 }
@@ -980,11 +1039,11 @@ static errcode_t undo_zeroout(io_channel channel, unsigned long long block,
 	/*
 	 * First write the existing content into database
 	 */
+	undo_lock(data);
 	retval = undo_write_tdb(channel, block, icount);
-	if (retval)
-		return retval;
-	if (data->real)
+	if (!retval && data->real)
 		retval = io_channel_zeroout(data->real, block, count);
+	undo_unlock(data);
 
 	return retval;
 }
@@ -40,6 +40,7 @@
 #include <errno.h>
 #endif
 #include <fcntl.h>
+#include <limits.h>
 #include <time.h>
 #ifdef __linux__
 #include <sys/utsname.h>
@@ -61,6 +62,9 @@
 #if HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
 #if HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #endif
@@ -91,12 +95,13 @@
 struct unix_cache {
 	char			*buf;
 	unsigned long long	block;
-	int			access_time;
+	struct unix_cache	*hash_next;
+	struct unix_cache	*lru_prev, *lru_next;
 	unsigned		dirty:1;
 	unsigned		in_use:1;
 };
 
-#define CACHE_SIZE 8
+#define CACHE_SIZE 8		/* Default, and smallest, number of blocks */
 #define WRITE_DIRECT_SIZE 4	/* Must be smaller than CACHE_SIZE */
 #define READ_DIRECT_SIZE 4	/* Should be smaller than CACHE_SIZE */
 
@@ -105,9 +110,18 @@ struct unix_private_data {
 	int	dev;
 	int	flags;
 	int	align;
-	int	access_time;
 	ext2_loff_t offset;
-	struct unix_cache cache[CACHE_SIZE];
+	/*
+	 * Cached blocks are found through the hash table.  The LRU list
+	 * runs from the most recently used block to the least, with the
+	 * unused entries at its tail.
+	 */
+	int	cache_size;
+	unsigned int cache_hash_mask;
+	struct unix_cache *cache;
+	struct unix_cache **cache_hash;
+	struct unix_cache *lru_head, *lru_tail;
+	struct unix_cache **flush_list;
 	void	*bounce;
 	struct struct_io_stats io_stats;
 #ifdef HAVE_PTHREAD
@@ -493,54 +507,125 @@ error_out:
  * Here we implement the cache functions
  */
 
+/* Free the cache buffers */
+static void free_cache(struct unix_private_data *data)
+{
+	int			i;
+
+	if (data->cache) {
+		for (i = 0; i < data->cache_size; i++)
+			if (data->cache[i].buf)
+				ext2fs_free_mem(&data->cache[i].buf);
+		ext2fs_free_mem(&data->cache);
+	}
+	if (data->cache_hash)
+		ext2fs_free_mem(&data->cache_hash);
+	if (data->flush_list)
+		ext2fs_free_mem(&data->flush_list);
+	data->lru_head = data->lru_tail = NULL;
+	if (data->bounce)
+		ext2fs_free_mem(&data->bounce);
+}
+
 /* Allocate the cache buffers */
 static errcode_t alloc_cache(io_channel channel,
 			     struct unix_private_data *data)
 {
 	errcode_t		retval;
 	struct unix_cache	*cache;
+	unsigned int		hash_size;
 	int			i;
 
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
+	for (hash_size = 1; hash_size < (unsigned) data->cache_size;
+	     hash_size <<= 1)
+		;
+	data->cache_hash_mask = hash_size - 1;
+	retval = ext2fs_get_arrayzero(data->cache_size, sizeof(*data->cache),
+				      &data->cache);
+	if (!retval)
+		retval = ext2fs_get_arrayzero(hash_size,
+					      sizeof(*data->cache_hash),
+					      &data->cache_hash);
+	if (!retval)
+		retval = ext2fs_get_array(data->cache_size,
+					  sizeof(*data->flush_list),
+					  &data->flush_list);
+	if (retval)
+		return retval;
+
+	for (i = 0, cache = data->cache; i < data->cache_size; i++, cache++) {
+		cache->lru_prev = i ? cache - 1 : NULL;
+		cache->lru_next = i < data->cache_size - 1 ? cache + 1 : NULL;
 		retval = io_channel_alloc_buf(channel, 0, &cache->buf);
 		if (retval)
 			return retval;
 	}
-	if (channel->align || data->flags & IO_FLAG_FORCE_BOUNCE) {
-		if (data->bounce)
-			ext2fs_free_mem(&data->bounce);
+	data->lru_head = data->cache;
+	data->lru_tail = data->cache + data->cache_size - 1;
+
+	if (channel->align || data->flags & IO_FLAG_FORCE_BOUNCE)
 		retval = io_channel_alloc_buf(channel, 0, &data->bounce);
-	}
 	return retval;
 }
 
-/* Free the cache buffers */
-static void free_cache(struct unix_private_data *data)
+#ifndef NO_IO_CACHE
+/*
+ * Move a cache entry to the head of the LRU list if it's being used,
+ * or to the tail if it's being given up.
+ */
+static void cache_lru_move(struct unix_private_data *data,
+			   struct unix_cache *cache, int used)
 {
-	struct unix_cache	*cache;
-	int			i;
+	if (cache == (used ? data->lru_head : data->lru_tail))
+		return;
 
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
+	if (cache->lru_prev)
+		cache->lru_prev->lru_next = cache->lru_next;
+	else
+		data->lru_head = cache->lru_next;
+	if (cache->lru_next)
+		cache->lru_next->lru_prev = cache->lru_prev;
+	else
+		data->lru_tail = cache->lru_prev;
+
+	if (used) {
+		cache->lru_prev = NULL;
+		cache->lru_next = data->lru_head;
+		data->lru_head->lru_prev = cache;
+		data->lru_head = cache;
+	} else {
+		cache->lru_next = NULL;
+		cache->lru_prev = data->lru_tail;
+		data->lru_tail->lru_next = cache;
+		data->lru_tail = cache;
 	}
-	if (data->bounce)
-		ext2fs_free_mem(&data->bounce);
 }
 
-#ifndef NO_IO_CACHE
+static void cache_unhash(struct unix_private_data *data,
+			 struct unix_cache *cache)
+{
+	struct unix_cache **pp;
+
+	pp = &data->cache_hash[cache->block & data->cache_hash_mask];
+	while (*pp != cache)
+		pp = &(*pp)->hash_next;
+	*pp = cache->hash_next;
+	cache->hash_next = NULL;
+}
+
+/* Look a block up without counting it as a use */
+static struct unix_cache *lookup_cached_block(struct unix_private_data *data,
+					      unsigned long long block)
+{
+	struct unix_cache	*cache;
+
+	for (cache = data->cache_hash[block & data->cache_hash_mask];
+	     cache; cache = cache->hash_next)
+		if (cache->block == block)
+			return cache;
+	return NULL;
+}
+
 /*
  * Try to find a block in the cache.  If the block is not found, and
  * eldest is a non-zero pointer, then fill in eldest with the cache
@@ -550,26 +635,15 @@ static struct unix_cache *find_cached_block(struct unix_private_data *data,
 					    unsigned long long block,
 					    struct unix_cache **eldest)
 {
-	struct unix_cache	*cache, *unused_cache, *oldest_cache;
-	int			i;
+	struct unix_cache	*cache;
 
-	unused_cache = oldest_cache = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		if (!cache->in_use) {
-			if (!unused_cache)
-				unused_cache = cache;
-			continue;
-		}
-		if (cache->block == block) {
-			cache->access_time = ++data->access_time;
-			return cache;
-		}
-		if (!oldest_cache ||
-		    (cache->access_time < oldest_cache->access_time))
-			oldest_cache = cache;
+	cache = lookup_cached_block(data, block);
+	if (cache) {
+		cache_lru_move(data, cache, 1);
+		return cache;
 	}
 	if (eldest)
-		*eldest = (unused_cache) ? unused_cache : oldest_cache;
+		*eldest = data->lru_tail;
 	return 0;
 }
 
@@ -579,20 +653,99 @@ static struct unix_cache *find_cached_block(struct unix_private_data *data,
 static void reuse_cache(io_channel channel, struct unix_private_data *data,
 		 struct unix_cache *cache, unsigned long long block)
 {
-	if (cache->dirty && cache->in_use)
-		raw_write_blk(channel, data, cache->block, 1, cache->buf);
+	if (cache->in_use) {
+		if (cache->dirty)
+			raw_write_blk(channel, data, cache->block, 1,
+				      cache->buf);
+		cache_unhash(data, cache);
+	}
 
 	cache->in_use = 1;
 	cache->dirty = 0;
 	cache->block = block;
-	cache->access_time = ++data->access_time;
+	cache->hash_next = data->cache_hash[block & data->cache_hash_mask];
+	data->cache_hash[block & data->cache_hash_mask] = cache;
+	cache_lru_move(data, cache, 1);
+}
+
+/*
+ * Copy the cached blocks in a range over the buffer of a direct read,
+ * or refresh them from the buffer of a direct write.
+ */
+static void sync_cached_range(io_channel channel,
+			      struct unix_private_data *data,
+			      unsigned long long block, int count,
+			      char *buf, int from_buf)
+{
+	struct unix_cache	*cache;
+	char			*cp;
+	int			i;
+
+	for (i = 0; i < count && i < data->cache_size; i++) {
+		if (count <= data->cache_size) {
+			cache = lookup_cached_block(data, block + i);
+			if (!cache)
+				continue;
+		} else {
+			cache = &data->cache[i];
+			if (!cache->in_use || cache->block < block ||
+			    cache->block >= block + count)
+				continue;
+		}
+		cp = buf + (cache->block - block) * channel->block_size;
+		if (from_buf) {
+			memcpy(cache->buf, cp, channel->block_size);
+			cache->dirty = 0;
+		} else
+			memcpy(cp, cache->buf, channel->block_size);
+	}
+}
+
+/*
+ * Drop the cached copies of blocks which are being discarded or zeroed
+ * behind the cache's back.
+ */
+static void invalidate_cached_range(struct unix_private_data *data,
+				    unsigned long long block,
+				    unsigned long long count)
+{
+	struct unix_cache	*cache;
+	unsigned long long	i;
+
+	mutex_lock(data, CACHE_MTX);
+	for (i = 0; i < count && i < (unsigned) data->cache_size; i++) {
+		if (count <= (unsigned) data->cache_size) {
+			cache = lookup_cached_block(data, block + i);
+			if (!cache)
+				continue;
+		} else {
+			cache = &data->cache[i];
+			if (!cache->in_use || cache->block < block ||
+			    cache->block >= block + count)
+				continue;
+		}
+		cache_unhash(data, cache);
+		cache->in_use = 0;
+		cache->dirty = 0;
+		cache_lru_move(data, cache, 0);
+	}
+	mutex_unlock(data, CACHE_MTX);
+}
+
+static int cache_block_cmp(const void *a, const void *b)
+{
+	const struct unix_cache *ca = *(const struct unix_cache * const *) a;
+	const struct unix_cache *cb = *(const struct unix_cache * const *) b;
+
+	return (ca->block > cb->block) - (ca->block < cb->block);
 }
 
 #define FLUSH_INVALIDATE	0x01
 #define FLUSH_NOLOCK		0x02
 
 /*
- * Flush all of the blocks in the cache
+ * Flush all of the blocks in the cache.  They are written in block
+ * order, so that a large cache is written back with few seeks.
  */
 static errcode_t flush_cached_blocks(io_channel channel,
 				     struct unix_private_data *data,
@@ -600,21 +753,20 @@ static errcode_t flush_cached_blocks(io_channel channel,
 {
 	struct unix_cache	*cache;
 	errcode_t		retval, retval2;
-	int			i;
+	int			i, n = 0;
 
 	retval2 = 0;
 	if ((flags & FLUSH_NOLOCK) == 0)
 		mutex_lock(data, CACHE_MTX);
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		if (!cache->in_use)
-			continue;
-
-		if (flags & FLUSH_INVALIDATE)
-			cache->in_use = 0;
-
-		if (!cache->dirty)
-			continue;
-
+	for (i = 0, cache = data->cache; i < data->cache_size; i++, cache++)
+		if (cache->in_use && cache->dirty)
+			data->flush_list[n++] = cache;
+	if (n > 1)
+		qsort(data->flush_list, n, sizeof(*data->flush_list),
+		      cache_block_cmp);
+
+	for (i = 0; i < n; i++) {
+		cache = data->flush_list[i];
 		retval = raw_write_blk(channel, data,
 				       cache->block, 1, cache->buf);
 		if (retval)
@@ -622,6 +774,17 @@ static errcode_t flush_cached_blocks(io_channel channel,
 		else
 			cache->dirty = 0;
 	}
+
+	if (flags & FLUSH_INVALIDATE) {
+		for (i = 0, cache = data->cache; i < data->cache_size;
+		     i++, cache++) {
+			if (!cache->in_use)
+				continue;
+			cache_unhash(data, cache);
+			cache->in_use = 0;
+			cache_lru_move(data, cache, 0);
+		}
+	}
 	if ((flags & FLUSH_NOLOCK) == 0)
 		mutex_unlock(data, CACHE_MTX);
 	return retval2;
@@ -666,6 +829,37 @@ int ext2fs_fstat(int fd, ext2fs_struct_stat *buf)
 #endif
 }
 
+#if defined(__linux__) && defined(major) && defined(minor)
+/*
+ * The largest discard the block device accepts in a single request, in
+ * 512-byte sectors.  Partitions don't have a queue directory of their
+ * own, so fall back to the one of the whole disk.
+ */
+static unsigned long get_discard_max_sectors(dev_t devno)
+{
+	static const char *fmt[] = {
+		"/sys/dev/block/%u:%u/queue/discard_max_bytes",
+		"/sys/dev/block/%u:%u/../queue/discard_max_bytes",
+	};
+	unsigned long long bytes;
+	char path[64];
+	unsigned int i;
+	FILE *f;
+
+	for (i = 0; i < sizeof(fmt) / sizeof(fmt[0]); i++) {
+		snprintf(path, sizeof(path), fmt[i], major(devno),
+			 minor(devno));
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%llu", &bytes) != 1)
+			bytes = 0;
+		fclose(f);
+		return bytes / 512;
+	}
+	return 0;
+}
+#endif
 
 static errcode_t unix_open_channel(const char *name, int fd,
 				   int flags, io_channel *channel,
@@ -714,6 +908,7 @@ static errcode_t unix_open_channel(const char *name, int fd,
 
 	memset(data, 0, sizeof(struct unix_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->cache_size = CACHE_SIZE;
 	data->io_stats.num_fields = 2;
 	data->flags = flags;
 	data->dev = fd;
@@ -734,9 +929,13 @@ static errcode_t unix_open_channel(const char *name, int fd,
 	 * zero.
 	 */
 	if (ext2fs_fstat(data->dev, &st) == 0) {
-		if (ext2fsP_is_disk_device(st.st_mode))
+		if (ext2fsP_is_disk_device(st.st_mode)) {
 			io->flags |= CHANNEL_FLAGS_BLOCK_DEVICE;
-		else
+#if defined(__linux__) && defined(major) && defined(minor)
+			io->discard_max_sectors =
+				get_discard_max_sectors(st.st_rdev);
+#endif
+		} else
 			io->flags |= CHANNEL_FLAGS_DISCARD_ZEROES;
 	}
 
@@ -992,15 +1191,28 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 	if (data->flags & IO_FLAG_NOCACHE)
 		return raw_read_blk(channel, data, block, count, buf);
 	/*
-	 * If we're doing an odd-sized read or a very large read,
-	 * flush out the cache and then do a direct read.
+	 * If we're doing an odd-sized read, flush out the cache and
+	 * then do a direct read.
 	 */
-	if (count < 0 || count > WRITE_DIRECT_SIZE) {
+	if (count < 0) {
 		if ((retval = flush_cached_blocks(channel, data, 0)))
 			return retval;
 		return raw_read_blk(channel, data, block, count, buf);
 	}
 
+	/*
+	 * For a very large read, do a direct read and then copy in any
+	 * cached blocks, which may be newer than what's on disk.
+	 */
+	if (count > WRITE_DIRECT_SIZE) {
+		if ((retval = raw_read_blk(channel, data, block, count, buf)))
+			return retval;
+		mutex_lock(data, CACHE_MTX);
+		sync_cached_range(channel, data, block, count, buf, 0);
+		mutex_unlock(data, CACHE_MTX);
+		return 0;
+	}
+
 	cp = buf;
 	mutex_lock(data, CACHE_MTX);
 	while (count > 0) {
@@ -1021,7 +1233,7 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 		 * single read request
 		 */
 		for (i=1; i < count; i++)
-			if (find_cached_block(data, block+i, NULL))
+			if (lookup_cached_block(data, block+i))
 				break;
 #ifdef DEBUG
 		printf("Reading %d blocks starting at %lu\n", i, block);
@@ -1072,16 +1284,30 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 	if (data->flags & IO_FLAG_NOCACHE)
 		return raw_write_blk(channel, data, block, count, buf);
 	/*
-	 * If we're doing an odd-sized write or a very large write,
-	 * flush out the cache completely and then do a direct write.
+	 * If we're doing an odd-sized write, flush out the cache
+	 * completely and then do a direct write.
 	 */
-	if (count < 0 || count > WRITE_DIRECT_SIZE) {
+	if (count < 0) {
 		if ((retval = flush_cached_blocks(channel, data,
 						  FLUSH_INVALIDATE)))
 			return retval;
 		return raw_write_blk(channel, data, block, count, buf);
 	}
 
+	/*
+	 * For a very large write, do a direct write and then bring any
+	 * cached copies of the blocks up to date.
+	 */
+	if (count > WRITE_DIRECT_SIZE) {
+		if ((retval = raw_write_blk(channel, data, block, count, buf)))
+			return retval;
+		mutex_lock(data, CACHE_MTX);
+		sync_cached_range(channel, data, block, count,
+				  (char *) buf, 1);
+		mutex_unlock(data, CACHE_MTX);
+		return 0;
+	}
+
 	/*
 	 * For a moderate-sized multi-block write, first force a write
 	 * if we're in write-through cache mode, and then fill the
@@ -1219,6 +1445,33 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 			return EXT2_ET_INVALID_ARGUMENT;
 		return 0;
 	}
+	if (!strcmp(option, "cache_blocks")) {
+		if (!arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+		tmp = strtoull(arg, &end, 0);
+		if (*end || tmp < CACHE_SIZE || tmp > INT_MAX)
+			return EXT2_ET_INVALID_ARGUMENT;
+#ifndef NO_IO_CACHE
+		mutex_lock(data, CACHE_MTX);
+		mutex_lock(data, BOUNCE_MTX);
+		retval = flush_cached_blocks(channel, data, FLUSH_NOLOCK);
+		if (!retval) {
+			free_cache(data);
+			data->cache_size = tmp;
+			retval = alloc_cache(channel, data);
+			if (retval) {
+				free_cache(data);
+				data->cache_size = CACHE_SIZE;
+				(void) alloc_cache(channel, data);
+			}
+		}
+		mutex_unlock(data, BOUNCE_MTX);
+		mutex_unlock(data, CACHE_MTX);
+		return retval;
+#else
+		return 0;
+#endif
+	}
 	if (!strcmp(option, "cache")) {
 		if (!arg)
 			return EXT2_ET_INVALID_ARGUMENT;
@@ -1250,6 +1503,9 @@ static errcode_t unix_discard(io_channel channel, unsigned long long block,
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+#ifndef NO_IO_CACHE
+	invalidate_cached_range(data, block, count);
+#endif
 	if (channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE) {
 #ifdef BLKDISCARD
 		__u64 range[2];
@@ -1328,6 +1584,9 @@ static errcode_t unix_zeroout(io_channel channel, unsigned long long block,
 	if (safe_getenv("UNIX_IO_NOZEROOUT"))
 		goto unimplemented;
 
+#ifndef NO_IO_CACHE
+	invalidate_cached_range(data, block, count);
+#endif
 	if (!(channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE)) {
 		/* Regular file, try to use truncate/punch/zero. */
 		struct stat statbuf;
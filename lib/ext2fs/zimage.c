@@ -0,0 +1,445 @@
+/*
+ * zimage.c --- codecs and header handling for compressed e2image files
+ *
+ * The built-in codec is a simple LZ77 variant, so that a compressed
+ * image can always be written and read back.  When libzstd or liblz4
+ * can be loaded at run time they are offered as well; the library is
+ * only needed on the machine which reads the image back if the image
+ * was written with it.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <errno.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_DLOPEN
+#include <dlfcn.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "zimage.h"
+
+/*
+ * Built-in codec.  The compressed data is a series of sequences, each
+ * of which is a literal count, that many literal bytes, a match length
+ * less LZ_MIN_MATCH and the distance back to the match.  The counts
+ * are unsigned LEB128 numbers.  The last sequence ends after its
+ * literals.
+ */
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_BITS	14
+
+static unsigned char *lz_put_num(unsigned char *op, unsigned char *oend,
+				 size_t n)
+{
+	do {
+		if (op >= oend)
+			return NULL;
+		*op++ = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+		n >>= 7;
+	} while (n);
+	return op;
+}
+
+static const unsigned char *lz_get_num(const unsigned char *ip,
+				       const unsigned char *iend, size_t *n)
+{
+	unsigned int shift = 0;
+
+	*n = 0;
+	while (ip < iend && shift < 8 * sizeof(size_t)) {
+		*n |= (size_t) (*ip & 0x7f) << shift;
+		if (!(*ip++ & 0x80))
+			return ip;
+		shift += 7;
+	}
+	return NULL;
+}
+
+static __u32 lz_read32(const unsigned char *p)
+{
+	__u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned char *lz_put_seq(unsigned char *op, unsigned char *oend,
+				 const unsigned char *lit, size_t lit_len)
+{
+	op = lz_put_num(op, oend, lit_len);
+	if (!op || (size_t) (oend - op) < lit_len)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	return op + lit_len;
+}
+
+static size_t lz_compress(const unsigned char *src, size_t src_len,
+			  unsigned char *dst, size_t dst_len)
+{
+	const unsigned char *ip = src, *anchor = src, *ref;
+	const unsigned char *iend = src + src_len;
+	unsigned char *op = dst, *oend = dst + dst_len;
+	__u32 table[1 << LZ_HASH_BITS];
+	size_t len;
+	__u32 seq, h, pos;
+
+	/* Frames are far smaller than 4GiB, so __u32 positions will do */
+	memset(table, 0xff, sizeof(table));
+	while (iend - ip >= LZ_MIN_MATCH) {
+		seq = lz_read32(ip);
+		h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		pos = table[h];
+		table[h] = ip - src;
+		if (pos == 0xffffffff || lz_read32(src + pos) != seq) {
+			ip++;
+			continue;
+		}
+		ref = src + pos;
+		len = LZ_MIN_MATCH;
+		while (ip + len < iend && ref[len] == ip[len])
+			len++;
+		op = lz_put_seq(op, oend, anchor, ip - anchor);
+		if (op)
+			op = lz_put_num(op, oend, len - LZ_MIN_MATCH);
+		if (op)
+			op = lz_put_num(op, oend, ip - ref);
+		if (!op)
+			return 0;
+		ip += len;
+		anchor = ip;
+	}
+	op = lz_put_seq(op, oend, anchor, iend - anchor);
+	if (!op)
+		return 0;
+	return op - dst;
+}
+
+static errcode_t lz_decompress(const unsigned char *src, size_t src_len,
+			       unsigned char *dst, size_t dst_len)
+{
+	const unsigned char *ip = src, *iend = src + src_len;
+	unsigned char *op = dst, *oend = dst + dst_len;
+	size_t lit, len, dist;
+
+	while (1) {
+		ip = lz_get_num(ip, iend, &lit);
+		if (!ip || lit > (size_t) (iend - ip) ||
+		    lit > (size_t) (oend - op))
+			return EXT2_ET_ZIMAGE_CORRUPT;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;
+		ip = lz_get_num(ip, iend, &len);
+		if (ip)
+			ip = lz_get_num(ip, iend, &dist);
+		if (!ip || (size_t) (oend - op) < LZ_MIN_MATCH ||
+		    len > (size_t) (oend - op) - LZ_MIN_MATCH ||
+		    !dist || dist > (size_t) (op - dst))
+			return EXT2_ET_ZIMAGE_CORRUPT;
+		/* The match may overlap what it is being copied to */
+		for (len += LZ_MIN_MATCH; len; len--, op++)
+			*op = *(op - dist);
+	}
+	if (op != oend)
+		return EXT2_ET_ZIMAGE_CORRUPT;
+	return 0;
+}
+
+/*
+ * Optional codecs, loaded with dlopen() so that libext2fs does not
+ * depend on the compression libraries.
+ */
+#ifdef HAVE_DLOPEN
+static void *zstd_handle;
+static size_t (*dl_ZSTD_compress)(void *, size_t, const void *, size_t, int);
+static size_t (*dl_ZSTD_decompress)(void *, size_t, const void *, size_t);
+static unsigned (*dl_ZSTD_isError)(size_t);
+
+static void *lz4_handle;
+static int (*dl_LZ4_compress_default)(const char *, char *, int, int);
+static int (*dl_LZ4_decompress_safe)(const char *, char *, int, int);
+
+/*
+ * Each library is looked up once; a failed dlopen() is remembered too.
+ * The codecs may first be used from several threads at once.
+ */
+static int zstd_loaded, lz4_loaded;
+#ifdef HAVE_PTHREAD
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+static pthread_once_t lz4_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void load_zstd(void)
+{
+	zstd_handle = dlopen("libzstd.so.1", RTLD_NOW);
+	if (!zstd_handle)
+		return;
+
+	dl_ZSTD_compress = (size_t (*)(void *, size_t, const void *,
+				       size_t, int))
+		dlsym(zstd_handle, "ZSTD_compress");
+	dl_ZSTD_decompress = (size_t (*)(void *, size_t,
+					 const void *, size_t))
+		dlsym(zstd_handle, "ZSTD_decompress");
+	dl_ZSTD_isError = (unsigned (*)(size_t))
+		dlsym(zstd_handle, "ZSTD_isError");
+	zstd_loaded = dl_ZSTD_compress && dl_ZSTD_decompress &&
+		dl_ZSTD_isError;
+}
+
+static void load_lz4(void)
+{
+	lz4_handle = dlopen("liblz4.so.1", RTLD_NOW);
+	if (!lz4_handle)
+		return;
+
+	dl_LZ4_compress_default = (int (*)(const char *, char *,
+					   int, int))
+		dlsym(lz4_handle, "LZ4_compress_default");
+	dl_LZ4_decompress_safe = (int (*)(const char *, char *,
+					  int, int))
+		dlsym(lz4_handle, "LZ4_decompress_safe");
+	lz4_loaded = dl_LZ4_compress_default && dl_LZ4_decompress_safe;
+}
+
+static int zstd_available(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_once(&zstd_once, load_zstd);
+#else
+	static int tried;
+
+	if (!tried) {
+		tried = 1;
+		load_zstd();
+	}
+#endif
+	return zstd_loaded;
+}
+
+static int lz4_available(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_once(&lz4_once, load_lz4);
+#else
+	static int tried;
+
+	if (!tried) {
+		tried = 1;
+		load_lz4();
+	}
+#endif
+	return lz4_loaded;
+}
+#else
+static int zstd_available(void)
+{
+	return 0;
+}
+
+static int lz4_available(void)
+{
+	return 0;
+}
+#endif
+
+#define ZSTD_LEVEL	3
+
+int ext2fs_zimage_codec_available(int codec)
+{
+	switch (codec) {
+	case EXT2_ZIMAGE_CODEC_LZ:
+		return 1;
+	case EXT2_ZIMAGE_CODEC_LZ4:
+		return lz4_available();
+	case EXT2_ZIMAGE_CODEC_ZSTD:
+		return zstd_available();
+	}
+	return 0;
+}
+
+static const char *codec_names[] = { NULL, "lz", "lz4", "zstd" };
+
+const char *ext2fs_zimage_codec_name(int codec)
+{
+	if (codec <= 0 ||
+	    codec >= (int) (sizeof(codec_names) / sizeof(codec_names[0])))
+		return "unknown";
+	return codec_names[codec];
+}
+
+/* Returns -1 if the name is not known */
+int ext2fs_zimage_codec_by_name(const char *name)
+{
+	int i;
+
+	for (i = 1; i < (int) (sizeof(codec_names) / sizeof(codec_names[0]));
+	     i++)
+		if (!strcmp(name, codec_names[i]))
+			return i;
+	return -1;
+}
+
+int ext2fs_zimage_default_codec(void)
+{
+	if (zstd_available())
+		return EXT2_ZIMAGE_CODEC_ZSTD;
+	if (lz4_available())
+		return EXT2_ZIMAGE_CODEC_LZ4;
+	return EXT2_ZIMAGE_CODEC_LZ;
+}
+
+/*
+ * Compress src into dst.  If the result would not fit into dst_len
+ * bytes, *ret_len is set to zero and the data should be stored as is.
+ */
+errcode_t ext2fs_zimage_compress(int codec, const void *src, size_t src_len,
+				 void *dst, size_t dst_len, size_t *ret_len)
+{
+	*ret_len = 0;
+	if (!ext2fs_zimage_codec_available(codec))
+		return EXT2_ET_ZIMAGE_CODEC;
+
+	switch (codec) {
+	case EXT2_ZIMAGE_CODEC_LZ:
+		*ret_len = lz_compress(src, src_len, dst, dst_len);
+		break;
+#ifdef HAVE_DLOPEN
+	case EXT2_ZIMAGE_CODEC_LZ4: {
+		int ret;
+
+		ret = dl_LZ4_compress_default(src, dst, src_len, dst_len);
+		if (ret > 0)
+			*ret_len = ret;
+		break;
+	}
+	case EXT2_ZIMAGE_CODEC_ZSTD: {
+		size_t ret;
+
+		ret = dl_ZSTD_compress(dst, dst_len, src, src_len,
+				       ZSTD_LEVEL);
+		if (!dl_ZSTD_isError(ret))
+			*ret_len = ret;
+		break;
+	}
+#endif
+	}
+	return 0;
+}
+
+/* The data must decompress to exactly dst_len bytes. */
+errcode_t ext2fs_zimage_decompress(int codec, const void *src, size_t src_len,
+				   void *dst, size_t dst_len)
+{
+	if (!ext2fs_zimage_codec_available(codec))
+		return EXT2_ET_ZIMAGE_CODEC;
+
+	switch (codec) {
+	case EXT2_ZIMAGE_CODEC_LZ:
+		return lz_decompress(src, src_len, dst, dst_len);
+#ifdef HAVE_DLOPEN
+	case EXT2_ZIMAGE_CODEC_LZ4:
+		if (dl_LZ4_decompress_safe(src, dst, src_len, dst_len) !=
+		    (int) dst_len)
+			return EXT2_ET_ZIMAGE_CORRUPT;
+		return 0;
+	case EXT2_ZIMAGE_CODEC_ZSTD:
+		if (dl_ZSTD_decompress(dst, dst_len, src, src_len) != dst_len)
+			return EXT2_ET_ZIMAGE_CORRUPT;
+		return 0;
+#endif
+	}
+	return EXT2_ET_ZIMAGE_CODEC;
+}
+
+errcode_t ext2fs_zimage_read_header(int fd, struct ext2_zimage_hdr *hdr)
+{
+	struct ext2_zimage_hdr disk;
+	__u64 frame_bytes;
+
+	if (ext2fs_llseek(fd, 0, SEEK_SET) != 0)
+		return errno;
+	if (read(fd, &disk, sizeof(disk)) != sizeof(disk))
+		return EXT2_ET_ZIMAGE_CORRUPT;
+
+	hdr->magic = ext2fs_le32_to_cpu(disk.magic);
+	if (hdr->magic != EXT2_ZIMAGE_MAGIC)
+		return EXT2_ET_ZIMAGE_CORRUPT;
+	hdr->version = ext2fs_le32_to_cpu(disk.version);
+	hdr->block_size = ext2fs_le32_to_cpu(disk.block_size);
+	hdr->frame_blocks = ext2fs_le32_to_cpu(disk.frame_blocks);
+	hdr->blocks_count = ext2fs_le64_to_cpu(disk.blocks_count);
+	hdr->index_offset = ext2fs_le64_to_cpu(disk.index_offset);
+	hdr->index_count = ext2fs_le64_to_cpu(disk.index_count);
+	hdr->codec = ext2fs_le32_to_cpu(disk.codec);
+	hdr->flags = ext2fs_le32_to_cpu(disk.flags);
+	hdr->csum_offset = ext2fs_le64_to_cpu(disk.csum_offset);
+	hdr->image_id = ext2fs_le64_to_cpu(disk.image_id);
+	hdr->base_id = ext2fs_le64_to_cpu(disk.base_id);
+	hdr->map_offset = ext2fs_le64_to_cpu(disk.map_offset);
+	memset(hdr->reserved, 0, sizeof(hdr->reserved));
+	memcpy(hdr->base_name, disk.base_name, sizeof(hdr->base_name));
+	hdr->base_name[sizeof(hdr->base_name) - 1] = 0;
+
+	if (hdr->version != EXT2_ZIMAGE_VERSION)
+		return EXT2_ET_ZIMAGE_CORRUPT;
+	if (hdr->block_size < EXT2_MIN_BLOCK_SIZE ||
+	    hdr->block_size > EXT2_MAX_BLOCK_SIZE ||
+	    (hdr->block_size & (hdr->block_size - 1)))
+		return EXT2_ET_ZIMAGE_CORRUPT;
+	frame_bytes = (__u64) hdr->frame_blocks * hdr->block_size;
+	if (!frame_bytes || frame_bytes > EXT2_ZIMAGE_MAX_FRAME_BYTES)
+		return EXT2_ET_ZIMAGE_CORRUPT;
+	if (hdr->index_count > hdr->blocks_count / hdr->frame_blocks + 1)
+		return EXT2_ET_ZIMAGE_CORRUPT;
+	if (((hdr->flags & EXT2_ZIMAGE_CSUMS) && !hdr->csum_offset) ||
+	    ((hdr->flags & EXT2_ZIMAGE_DELTA) &&
+	     (!hdr->map_offset || !hdr->base_name[0] ||
+	      !(hdr->flags & EXT2_ZIMAGE_CSUMS))))
+		return EXT2_ET_ZIMAGE_CORRUPT;
+	return 0;
+}
+
+/*
+ * Returns 1 if name is a compressed e2image file, and its uncompressed
+ * size in bytes in *ret_size.
+ */
+int ext2fs_zimage_probe(const char *name, unsigned long long *ret_size)
+{
+	struct ext2_zimage_hdr hdr;
+	errcode_t retval;
+	int fd;
+
+	fd = ext2fs_open_file(name, O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	retval = ext2fs_zimage_read_header(fd, &hdr);
+	close(fd);
+	if (retval)
+		return 0;
+	if (ret_size)
+		*ret_size = hdr.blocks_count * hdr.block_size;
+	return 1;
+}
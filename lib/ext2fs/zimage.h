@@ -0,0 +1,101 @@
+/*
+ * zimage.h --- structures and function prototypes for compressed
+ * e2image files.
+ *
+ * A compressed image ("e2image -z") stores the file system in frames
+ * of a fixed number of blocks.  Each frame is compressed on its own,
+ * so a block can be read back by decompressing just the frame which
+ * contains it.  Frames which are entirely zero are not stored.  The
+ * frame index is written after the last frame and is located through
+ * the header at the start of the file.  All fields are little endian.
+ *
+ * Each image also stores a crc32c checksum of every block in its
+ * frames.  A delta image ("e2image -z -D base") only holds the blocks
+ * whose checksum differs from the one in its base image, with a bitmap
+ * per frame telling which blocks it overrides; the base may itself be
+ * a delta.  Reading a delta reads through to its base.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#ifndef _EXT2FS_ZIMAGE_H
+#define _EXT2FS_ZIMAGE_H
+
+#include "ext2fs.h"
+
+#define EXT2_ZIMAGE_MAGIC	0x45325a49	/* "IZ2E" on disk */
+#define EXT2_ZIMAGE_VERSION	1
+
+/* The first frame starts here; the header is padded out to it */
+#define EXT2_ZIMAGE_DATA_OFFSET	4096
+
+/* Uncompressed size of a frame */
+#define EXT2_ZIMAGE_FRAME_BYTES	(128 * 1024)
+#define EXT2_ZIMAGE_MAX_FRAME_BYTES (16 * 1024 * 1024)
+
+/* Codecs */
+#define EXT2_ZIMAGE_CODEC_LZ	1	/* built in */
+#define EXT2_ZIMAGE_CODEC_LZ4	2	/* liblz4, if it can be loaded */
+#define EXT2_ZIMAGE_CODEC_ZSTD	3	/* libzstd, if it can be loaded */
+
+/* Header flags */
+#define EXT2_ZIMAGE_CSUMS	0x0001	/* has a block checksum table */
+#define EXT2_ZIMAGE_DELTA	0x0002	/* delta against base_name */
+
+#define EXT2_ZIMAGE_BASE_NAME_LEN 256
+
+/* Frame flags */
+#define EXT2_ZIMAGE_FRAME_RAW	0x0001	/* stored uncompressed */
+
+struct ext2_zimage_hdr {
+	__u32	magic;
+	__u32	version;
+	__u32	block_size;	/* file system block size */
+	__u32	frame_blocks;	/* blocks per frame */
+	__u64	blocks_count;	/* size of the image, in blocks */
+	__u64	index_offset;	/* byte offset of the frame index */
+	__u64	index_count;	/* number of stored frames */
+	__u32	codec;
+	__u32	flags;
+	__u64	csum_offset;	/* frame_blocks checksums per stored frame */
+	__u64	image_id;
+	__u64	base_id;	/* delta: image_id of the base */
+	__u64	map_offset;	/* delta: block bitmap per stored frame */
+	__u64	reserved[4];
+	/* delta: relative to the directory of the delta, unless absolute */
+	char	base_name[EXT2_ZIMAGE_BASE_NAME_LEN];
+};
+
+/* Entries are sorted by frame number */
+struct ext2_zimage_frame {
+	__u64	frame;		/* frame number, i.e. block / frame_blocks */
+	__u64	offset;		/* byte offset of the stored frame */
+	__u32	length;		/* stored length */
+	__u32	flags;
+};
+
+/* zimage.c */
+extern int ext2fs_zimage_codec_available(int codec);
+extern int ext2fs_zimage_codec_by_name(const char *name);
+extern const char *ext2fs_zimage_codec_name(int codec);
+extern int ext2fs_zimage_default_codec(void);
+extern errcode_t ext2fs_zimage_compress(int codec, const void *src,
+					size_t src_len, void *dst,
+					size_t dst_len, size_t *ret_len);
+extern errcode_t ext2fs_zimage_decompress(int codec, const void *src,
+					  size_t src_len, void *dst,
+					  size_t dst_len);
+extern errcode_t ext2fs_zimage_read_header(int fd,
+					   struct ext2_zimage_hdr *hdr);
+extern int ext2fs_zimage_probe(const char *name,
+			       unsigned long long *ret_size);
+
+/* zimage_io.c */
+extern errcode_t ext2fs_zimage_frame_csums(io_channel channel,
+					   unsigned long long frame,
+					   __u32 *csums);
+
+#endif /* _EXT2FS_ZIMAGE_H */
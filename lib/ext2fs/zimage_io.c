@@ -0,0 +1,452 @@
+/*
+ * zimage_io.c --- read-only I/O manager for compressed e2image files
+ *
+ * This lets debugfs, dumpe2fs and "e2fsck -n" work on an image written
+ * by "e2image -z" without expanding it first.  Frames are decompressed
+ * as they are needed and a few of them are kept in a small LRU cache.
+ * The rest of the manager is shared with qcow2_io.c, in image_io.c.
+ *
+ * A delta image is opened together with the chain of images below it;
+ * frames which the delta does not store are read from its base, and
+ * the blocks which it does store are laid over the base's frame.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <errno.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "zimage.h"
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+#define ZIMAGE_CACHE_SIZE	16
+#define ZIMAGE_MAX_DEPTH	64	/* longest chain of deltas */
+
+struct zimage_cache {
+	unsigned long long	frame;
+	unsigned long		access_time;
+	int			in_use;
+	char			*buf;
+};
+
+struct zimage_private_data {
+	struct ext2fs_image_io	image;		/* chunks are frames */
+	struct ext2_zimage_hdr	hdr;
+	struct ext2_zimage_frame *index;
+	size_t			frame_bytes;
+	char			*cbuf;		/* one stored frame */
+	char			*dbuf;		/* delta: its own frame */
+	__u32			*csums;		/* read when first needed */
+	__u32			*maps;		/* delta: block bitmaps */
+	int			map_words;	/* per frame */
+	__u32			zero_csum;
+	io_channel		base;		/* delta: the image below */
+	unsigned long		access_time;
+	struct zimage_cache	cache[ZIMAGE_CACHE_SIZE];
+};
+
+static struct struct_io_manager struct_zimage_manager;
+io_manager zimage_io_manager = &struct_zimage_manager;
+
+static errcode_t read_table(struct zimage_private_data *data,
+			    ext2_loff_t offset, size_t per_frame,
+			    __u32 **ret_table)
+{
+	__u64 i, n = data->hdr.index_count * per_frame;
+	__u32 *table;
+	errcode_t retval;
+
+	retval = ext2fs_get_array(n ? n : 1, sizeof(__u32), &table);
+	if (retval)
+		return retval;
+	retval = ext2fs_image_io_read_full(data->image.dev, offset, table,
+					   n * sizeof(__u32));
+	if (retval) {
+		ext2fs_free_mem(&table);
+		return retval == EXT2_ET_SHORT_READ ?
+			EXT2_ET_ZIMAGE_CORRUPT : retval;
+	}
+	for (i = 0; i < n; i++)
+		table[i] = ext2fs_le32_to_cpu(table[i]);
+	*ret_table = table;
+	return 0;
+}
+
+static errcode_t load_index(struct zimage_private_data *data)
+{
+	struct ext2_zimage_frame *f;
+	__u64 i, n = data->hdr.index_count;
+	errcode_t retval;
+
+	if (!n)
+		return 0;
+	retval = ext2fs_get_array(n, sizeof(struct ext2_zimage_frame),
+				  &data->index);
+	if (retval)
+		return retval;
+	retval = ext2fs_image_io_read_full(data->image.dev,
+				data->hdr.index_offset, data->index,
+				n * sizeof(struct ext2_zimage_frame));
+	if (retval)
+		return retval == EXT2_ET_SHORT_READ ?
+			EXT2_ET_ZIMAGE_CORRUPT : retval;
+
+	for (i = 0, f = data->index; i < n; i++, f++) {
+		f->frame = ext2fs_le64_to_cpu(f->frame);
+		f->offset = ext2fs_le64_to_cpu(f->offset);
+		f->length = ext2fs_le32_to_cpu(f->length);
+		f->flags = ext2fs_le32_to_cpu(f->flags);
+		if ((i && f->frame <= (f - 1)->frame) ||
+		    f->length > data->frame_bytes ||
+		    ((f->flags & EXT2_ZIMAGE_FRAME_RAW) &&
+		     f->length != data->frame_bytes))
+			return EXT2_ET_ZIMAGE_CORRUPT;
+	}
+	return 0;
+}
+
+static struct ext2_zimage_frame *find_frame(struct zimage_private_data *data,
+					    unsigned long long frame)
+{
+	__u64 low = 0, high = data->hdr.index_count, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (data->index[mid].frame == frame)
+			return &data->index[mid];
+		if (data->index[mid].frame < frame)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return NULL;
+}
+
+static errcode_t read_stored_frame(struct zimage_private_data *data,
+				   struct ext2_zimage_frame *f, char *buf)
+{
+	errcode_t retval;
+
+	if (f->flags & EXT2_ZIMAGE_FRAME_RAW) {
+		retval = ext2fs_image_io_read_full(data->image.dev, f->offset,
+						   buf, data->frame_bytes);
+	} else {
+		retval = ext2fs_image_io_read_full(data->image.dev, f->offset,
+						   data->cbuf, f->length);
+		if (!retval)
+			retval = ext2fs_zimage_decompress(data->hdr.codec,
+					data->cbuf, f->length, buf,
+					data->frame_bytes);
+	}
+	if (retval)
+		return retval == EXT2_ET_SHORT_READ ?
+			EXT2_ET_ZIMAGE_CORRUPT : retval;
+	data->image.io_stats.bytes_read += f->length;
+	return 0;
+}
+
+static struct zimage_private_data *base_data(struct zimage_private_data *data)
+{
+	return (struct zimage_private_data *) data->base->private_data;
+}
+
+/*
+ * Return the uncompressed contents of a frame in *buf, or NULL if the
+ * frame is not stored and so reads as zeroes.
+ */
+static errcode_t get_frame(struct zimage_private_data *data,
+			   unsigned long long frame, char **buf)
+{
+	struct ext2_zimage_frame *f;
+	struct zimage_cache *c, *victim = NULL;
+	errcode_t retval;
+	int i;
+
+	*buf = NULL;
+	for (i = 0, c = data->cache; i < ZIMAGE_CACHE_SIZE; i++, c++) {
+		if (c->in_use && c->frame == frame) {
+			c->access_time = ++data->access_time;
+			*buf = c->buf;
+			return 0;
+		}
+		if (!victim || !c->in_use ||
+		    (victim->in_use && c->access_time < victim->access_time))
+			victim = c;
+	}
+
+	f = find_frame(data, frame);
+	if (!f)
+		return data->base ? get_frame(base_data(data), frame, buf) : 0;
+
+	if (!victim->buf) {
+		retval = ext2fs_get_mem(data->frame_bytes, &victim->buf);
+		if (retval)
+			return retval;
+	}
+	victim->in_use = 0;
+	if (data->base) {
+		__u32 *map = data->maps + (f - data->index) * data->map_words;
+		size_t bs = data->hdr.block_size;
+		char *base_buf;
+
+		retval = read_stored_frame(data, f, data->dbuf);
+		if (!retval)
+			retval = get_frame(base_data(data), frame, &base_buf);
+		if (retval)
+			return retval;
+		if (base_buf)
+			memcpy(victim->buf, base_buf, data->frame_bytes);
+		else
+			memset(victim->buf, 0, data->frame_bytes);
+		for (i = 0; i < (int) data->hdr.frame_blocks; i++)
+			if (map[i / 32] & (1U << (i % 32)))
+				memcpy(victim->buf + i * bs,
+				       data->dbuf + i * bs, bs);
+	} else {
+		retval = read_stored_frame(data, f, victim->buf);
+		if (retval)
+			return retval;
+	}
+	victim->frame = frame;
+	victim->in_use = 1;
+	victim->access_time = ++data->access_time;
+	*buf = victim->buf;
+	return 0;
+}
+
+static errcode_t get_chunk(struct ext2fs_image_io *image,
+			   unsigned long long frame, char **buf)
+{
+	return get_frame((struct zimage_private_data *) image, frame, buf);
+}
+
+static void free_private_data(struct ext2fs_image_io *image)
+{
+	struct zimage_private_data *data = (struct zimage_private_data *) image;
+	int i;
+
+	for (i = 0; i < ZIMAGE_CACHE_SIZE; i++)
+		if (data->cache[i].buf)
+			ext2fs_free_mem(&data->cache[i].buf);
+	if (data->index)
+		ext2fs_free_mem(&data->index);
+	if (data->cbuf)
+		ext2fs_free_mem(&data->cbuf);
+	if (data->dbuf)
+		ext2fs_free_mem(&data->dbuf);
+	if (data->csums)
+		ext2fs_free_mem(&data->csums);
+	if (data->maps)
+		ext2fs_free_mem(&data->maps);
+	if (data->base)
+		io_channel_close(data->base);
+	ext2fs_free_mem(&data);
+}
+
+static const struct ext2fs_image_io_ops zimage_ops = {
+	.magic		= EXT2_ET_MAGIC_ZIMAGE_IO_CHANNEL,
+	.get_chunk	= get_chunk,
+	.free_data	= free_private_data,
+};
+
+static errcode_t open_image(const char *name, int flags, int depth,
+			     io_channel *channel);
+
+static errcode_t open_base(struct zimage_private_data *data, const char *name,
+			   int depth)
+{
+	struct zimage_private_data *base;
+	const char *slash = strrchr(name, '/');
+	size_t dir_len = 0;
+	errcode_t retval;
+	char *path;
+
+	if (depth >= ZIMAGE_MAX_DEPTH)
+		return EXT2_ET_ZIMAGE_CORRUPT;
+	data->map_words = (data->hdr.frame_blocks + 31) / 32;
+	retval = read_table(data, data->hdr.map_offset, data->map_words,
+			    &data->maps);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_mem(data->frame_bytes, &data->dbuf);
+	if (retval)
+		return retval;
+
+	if (data->hdr.base_name[0] != '/' && slash)
+		dir_len = slash - name + 1;
+	retval = ext2fs_get_mem(dir_len + strlen(data->hdr.base_name) + 1,
+				&path);
+	if (retval)
+		return retval;
+	memcpy(path, name, dir_len);
+	strcpy(path + dir_len, data->hdr.base_name);
+	retval = open_image(path, 0, depth + 1, &data->base);
+	ext2fs_free_mem(&path);
+	if (retval)
+		return retval;
+
+	base = base_data(data);
+	if (base->hdr.image_id != data->hdr.base_id ||
+	    base->hdr.block_size != data->hdr.block_size ||
+	    base->hdr.frame_blocks != data->hdr.frame_blocks ||
+	    base->hdr.blocks_count != data->hdr.blocks_count)
+		return EXT2_ET_ZIMAGE_BASE;
+	return 0;
+}
+
+static errcode_t open_image(const char *name, int flags, int depth,
+			     io_channel *channel)
+{
+	struct zimage_private_data *data = NULL;
+	errcode_t	retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct zimage_private_data), &data);
+	if (retval)
+		return retval;
+	retval = ext2fs_image_io_open(name, flags, &zimage_ops, &data->image);
+	if (retval)
+		goto cleanup;
+	retval = ext2fs_zimage_read_header(data->image.dev, &data->hdr);
+	if (retval)
+		goto cleanup;
+	if (!ext2fs_zimage_codec_available(data->hdr.codec)) {
+		retval = EXT2_ET_ZIMAGE_CODEC;
+		goto cleanup;
+	}
+	data->frame_bytes = (size_t) data->hdr.frame_blocks *
+		data->hdr.block_size;
+	data->image.chunk_bytes = data->frame_bytes;
+	data->image.size = data->hdr.blocks_count * data->hdr.block_size;
+	retval = ext2fs_get_mem(data->frame_bytes, &data->cbuf);
+	if (retval)
+		goto cleanup;
+	memset(data->cbuf, 0, data->hdr.block_size);
+	data->zero_csum = ext2fs_crc32c_le(~0, (unsigned char *) data->cbuf,
+					   data->hdr.block_size);
+	retval = load_index(data);
+	if (retval)
+		goto cleanup;
+	if (data->hdr.flags & EXT2_ZIMAGE_DELTA) {
+		retval = open_base(data, name, depth);
+		if (retval)
+			goto cleanup;
+	}
+
+	retval = ext2fs_image_io_channel(zimage_io_manager, name, flags,
+					 &data->image, channel);
+	if (retval)
+		goto cleanup;
+	return 0;
+
+cleanup:
+	ext2fs_image_io_free(&data->image);
+	return retval;
+}
+
+static errcode_t zimage_open(const char *name, int flags, io_channel *channel)
+{
+	return open_image(name, flags, 0, channel);
+}
+
+static errcode_t get_csums(struct zimage_private_data *data,
+			   unsigned long long frame, __u32 *csums)
+{
+	struct ext2_zimage_frame *f;
+	errcode_t retval;
+	__u32 *src, *map;
+	unsigned int i;
+
+	if (!(data->hdr.flags & EXT2_ZIMAGE_CSUMS))
+		return EXT2_ET_ZIMAGE_NO_CSUMS;
+	if (data->base) {
+		retval = get_csums(base_data(data), frame, csums);
+		if (retval)
+			return retval;
+	} else {
+		for (i = 0; i < data->hdr.frame_blocks; i++)
+			csums[i] = data->zero_csum;
+	}
+
+	f = find_frame(data, frame);
+	if (!f)
+		return 0;
+	if (!data->csums) {
+		retval = read_table(data, data->hdr.csum_offset,
+				    data->hdr.frame_blocks, &data->csums);
+		if (retval)
+			return retval;
+	}
+	src = data->csums + (f - data->index) * data->hdr.frame_blocks;
+	if (!data->base) {
+		memcpy(csums, src, data->hdr.frame_blocks * sizeof(__u32));
+		return 0;
+	}
+	map = data->maps + (f - data->index) * data->map_words;
+	for (i = 0; i < data->hdr.frame_blocks; i++)
+		if (map[i / 32] & (1U << (i % 32)))
+			csums[i] = src[i];
+	return 0;
+}
+
+/*
+ * Return the crc32c checksums of the blocks in a frame, as seen through
+ * any deltas, in csums[], which must hold frame_blocks entries.  Blocks
+ * which are not stored have the checksum of a zeroed block.
+ */
+errcode_t ext2fs_zimage_frame_csums(io_channel channel,
+				    unsigned long long frame, __u32 *csums)
+{
+	struct zimage_private_data *data;
+	errcode_t retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	if (channel->manager != zimage_io_manager)
+		return EXT2_ET_INVALID_ARGUMENT;
+	data = (struct zimage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(&data->image, EXT2_ET_MAGIC_ZIMAGE_IO_CHANNEL);
+
+	ext2fs_image_io_lock(&data->image);
+	retval = get_csums(data, frame, csums);
+	ext2fs_image_io_unlock(&data->image);
+	return retval;
+}
+
+static struct struct_io_manager struct_zimage_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "Compressed e2image I/O Manager",
+	.open		= zimage_open,
+	.close		= ext2fs_image_io_close,
+	.set_blksize	= ext2fs_image_io_set_blksize,
+	.read_blk	= ext2fs_image_io_read_blk,
+	.write_blk	= ext2fs_image_io_write_blk,
+	.flush		= ext2fs_image_io_flush,
+	.write_byte	= ext2fs_image_io_write_byte,
+	.set_option	= ext2fs_image_io_set_option,
+	.get_stats	= ext2fs_image_io_get_stats,
+	.read_blk64	= ext2fs_image_io_read_blk64,
+	.write_blk64	= ext2fs_image_io_write_blk64,
+};
@@ -31,6 +31,9 @@
 #ifdef HAVE_SYS_SYSMACROS_H
 #include <sys/sysmacros.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include <ext2fs/ext2fs.h>
 #include <ext2fs/ext2_types.h>
@@ -69,8 +72,8 @@ static int ext2_file_type(unsigned int mode)
 }
 
 /* Link an inode number to a directory */
-static errcode_t add_link(ext2_filsys fs, ext2_ino_t parent_ino,
-			  ext2_ino_t ino, const char *name)
+errcode_t add_link(ext2_filsys fs, ext2_ino_t parent_ino, ext2_ino_t ino,
+		   const char *name)
 {
 	struct ext2_inode	inode;
 	errcode_t		retval;
@@ -108,8 +111,7 @@ static errcode_t add_link(ext2_filsys fs, ext2_ino_t parent_ino,
 }
 
 /* Set the uid, gid, mode and time for the inode */
-static errcode_t set_inode_extra(ext2_filsys fs, ext2_ino_t ino,
-				 struct stat *st)
+errcode_t set_inode_extra(ext2_filsys fs, ext2_ino_t ino, struct stat *st)
 {
 	errcode_t		retval;
 	struct ext2_inode	inode;
@@ -244,6 +246,52 @@ static errcode_t set_inode_xattr(ext2_filsys fs EXT2FS_ATTR((unused)),
 }
 #endif  /* HAVE_LLISTXATTR */
 
+/* Set the extended attributes in xattrs[] on the inode */
+errcode_t set_inode_xattrs(ext2_filsys fs, ext2_ino_t ino,
+			   struct inode_xattr *xattrs, int count)
+{
+	errcode_t			retval, close_retval;
+	struct ext2_xattr_handle	*handle;
+	int				i;
+
+	if (no_copy_xattrs || count == 0)
+		return 0;
+
+	retval = ext2fs_xattrs_open(fs, ino, &handle);
+	if (retval) {
+		if (retval == EXT2_ET_MISSING_EA_FEATURE)
+			return 0;
+		com_err(__func__, retval, _("while opening inode %u"), ino);
+		return retval;
+	}
+
+	retval = ext2fs_xattrs_read(handle);
+	if (retval) {
+		com_err(__func__, retval,
+			_("while reading xattrs for inode %u"), ino);
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		retval = ext2fs_xattr_set(handle, xattrs[i].name,
+					  xattrs[i].value,
+					  xattrs[i].value_len);
+		if (retval) {
+			com_err(__func__, retval,
+				_("while writing attribute \"%s\" to inode %u"),
+				xattrs[i].name, ino);
+			break;
+		}
+	}
+ out:
+	close_retval = ext2fs_xattrs_close(&handle);
+	if (close_retval) {
+		com_err(__func__, retval, _("while closing inode %u"), ino);
+		retval = retval ? retval : close_retval;
+	}
+	return retval;
+}
+
 #ifndef _WIN32
 /* Make a special files (block and character devices), fifo's, and sockets  */
 errcode_t do_mknod_internal(ext2_filsys fs, ext2_ino_t cwd, const char *name,
@@ -417,61 +465,238 @@ static ssize_t my_pread(int fd, void *buf, size_t count, off_t offset)
 }
 #endif /* !defined HAVE_PREAD64 && !defined HAVE_PREAD */
 
-static errcode_t copy_file_chunk(ext2_filsys fs, int fd, ext2_file_t e2_file,
-				 off_t start, off_t end, char *buf,
-				 char *zerobuf)
+static ssize_t read_at(int fd, void *buf, size_t count, off_t offset)
 {
-	off_t off, bpos;
-	ssize_t got, blen;
-	unsigned int written;
-	char *ptr;
-	errcode_t err = 0;
-
-	for (off = start; off < end; off += COPY_FILE_BUFLEN) {
 #ifdef HAVE_PREAD64
-		got = pread64(fd, buf, COPY_FILE_BUFLEN, off);
+	return pread64(fd, buf, count, offset);
 #elif HAVE_PREAD
-		got = pread(fd, buf, COPY_FILE_BUFLEN, off);
+	return pread(fd, buf, count, offset);
 #else
-		got = my_pread(fd, buf, COPY_FILE_BUFLEN, off);
+	return my_pread(fd, buf, count, offset);
 #endif
-		if (got < 0) {
-			err = errno;
-			goto fail;
+}
+
+/*
+ * Return a mask with bit N set if block N of buf is all zeroes.  A
+ * COPY_FILE_BUFLEN buffer holds at most 64 of the smallest (1KiB)
+ * blocks, so the mask always fits.
+ */
+static __u64 zero_block_mask(unsigned int blocksize, const char *buf,
+			     ssize_t got, const char *zerobuf)
+{
+	__u64 mask = 0;
+	ssize_t bpos, blen;
+	int bit;
+
+	for (bpos = 0, bit = 0; bpos < got; bpos += blocksize, bit++) {
+		blen = blocksize;
+		if (blen > got - bpos)
+			blen = got - bpos;
+		if (memcmp(buf + bpos, zerobuf, blen) == 0)
+			mask |= 1ULL << bit;
+	}
+	return mask;
+}
+
+static int all_zero_blocks(unsigned int blocksize, ssize_t got, __u64 mask)
+{
+	int nr = (got + blocksize - 1) / blocksize;
+
+	if (nr >= 64)
+		return mask == ~0ULL;
+	return mask == (1ULL << nr) - 1;
+}
+
+/*
+ * Layout planning.  Before anything is copied, the source tree is
+ * scanned to work out how many blocks its directories and symlinks will
+ * need.  Those (and other small metadata) are then allocated from a
+ * region at the start of the free space and file data from the space
+ * after it, so directory blocks don't end up strewn among the file data
+ * and the data goes out in physical block order.  The data of extent
+ * mapped files is allocated a run at a time and written straight to the
+ * device, rather than block by block through an ext2_file.
+ */
+struct layout_plan {
+	blk64_t		meta_goal;	/* next block for metadata */
+	blk64_t		data_goal;	/* next block for file data */
+	void		*old_priv_data;
+	errcode_t	(*old_get_alloc_block2)(ext2_filsys fs, blk64_t goal,
+						blk64_t *ret,
+						struct blk_alloc_ctx *ctx);
+};
+
+struct copy_ctx {
+	ext2_filsys	fs;
+	int		fd;
+	ext2_ino_t	ino;
+	ext2_file_t	e2_file;
+	/* If set, the data is written to blocks allocated for it here */
+	struct layout_plan *plan;
+	struct ext2_inode inode;
+	blk64_t		next_lblk;	/* block after the last one written */
+	char		*buf;
+	char		*zerobuf;
+};
+
+/*
+ * Map lblk to the next free block for data.  ext2fs_fallocate() keeps
+ * the logical and physical offsets of a file in step, which would leave
+ * a gap on disk for each hole; this lets a run of data after a hole
+ * carry on from where the last one ended instead.
+ */
+static errcode_t plan_start_run(struct copy_ctx *ctx, blk64_t lblk)
+{
+	ext2_filsys fs = ctx->fs;
+	blk64_t pblk;
+	errcode_t err;
+
+	err = ext2fs_new_block2(fs, ctx->plan->data_goal, fs->block_map,
+				&pblk);
+	if (err)
+		return err;
+	err = ext2fs_bmap2(fs, ctx->ino, &ctx->inode, NULL, BMAP_SET, lblk,
+			   NULL, &pblk);
+	if (err)
+		return err;
+	ext2fs_block_alloc_stats2(fs, pblk, +1);
+	ext2fs_iblk_add_blocks(fs, &ctx->inode, 1);
+	ctx->plan->data_goal = pblk + 1;
+	return 0;
+}
+
+/*
+ * Allocate and write out the blocks of buf which aren't marked in
+ * zero_mask.  off must be block aligned and past anything written
+ * before, as walk_file_data() guarantees.  buf must have room to round
+ * got up to a whole block; the tail of a partial last block is zeroed
+ * so it can be written whole.
+ */
+static errcode_t plan_write_blocks(struct copy_ctx *ctx, off_t off,
+				   char *buf, ssize_t got, __u64 zero_mask)
+{
+	ext2_filsys fs = ctx->fs;
+	struct layout_plan *plan = ctx->plan;
+	struct ext2fs_extent ext;
+	blk64_t lblk = off / fs->blocksize;
+	int nr = (got + fs->blocksize - 1) / fs->blocksize;
+	int bit, end, blk;
+	errcode_t err;
+
+	memset(buf + got, 0, (size_t) nr * fs->blocksize - got);
+	for (bit = 0; bit < nr; bit = end) {
+		end = bit + 1;
+		if (zero_mask & (1ULL << bit))
+			continue;
+		while (end < nr && !(zero_mask & (1ULL << end)))
+			end++;
+		blk = bit;
+		if (lblk + blk != ctx->next_lblk) {
+			err = plan_start_run(ctx, lblk + blk);
+			if (err)
+				return err;
+			blk++;
 		}
-		for (bpos = 0, ptr = buf; bpos < got; bpos += fs->blocksize) {
-			blen = fs->blocksize;
-			if (blen > got - bpos)
-				blen = got - bpos;
-			if (memcmp(ptr, zerobuf, blen) == 0) {
-				ptr += blen;
-				continue;
-			}
-			err = ext2fs_file_llseek(e2_file, off + bpos,
-						 EXT2_SEEK_SET, NULL);
+		if (blk < end) {
+			err = ext2fs_fallocate(fs, EXT2_FALLOCATE_FORCE_INIT |
+					EXT2_FALLOCATE_WILL_OVERWRITE,
+					ctx->ino, &ctx->inode,
+					plan->data_goal, lblk + blk,
+					end - blk);
 			if (err)
-				goto fail;
-			while (blen > 0) {
-				err = ext2fs_file_write(e2_file, ptr, blen,
-							&written);
-				if (err)
-					goto fail;
-				if (written == 0) {
-					err = EIO;
-					goto fail;
-				}
-				blen -= written;
-				ptr += written;
-			}
+				return err;
+		}
+		ctx->next_lblk = lblk + end;
+		for (blk = bit; blk < end; blk += ext.e_len) {
+			err = ext2fs_bmap_range(fs, ctx->ino, &ctx->inode, NULL,
+						lblk + blk, end - blk, &ext);
+			if (err)
+				return err;
+			if (!ext.e_pblk || !ext.e_len)
+				return EXT2_ET_BLOCK_ALLOC_FAIL;
+			err = io_channel_write_blk64(fs->io, ext.e_pblk,
+					ext.e_len,
+					buf + (size_t) blk * fs->blocksize);
+			if (err)
+				return err;
+			plan->data_goal = ext.e_pblk + ext.e_len;
 		}
 	}
-fail:
-	return err;
+	return 0;
+}
+
+/* Write the blocks of buf which aren't marked in zero_mask */
+static errcode_t write_blocks(struct copy_ctx *ctx, off_t off, char *buf,
+			      ssize_t got, __u64 zero_mask)
+{
+	unsigned int blocksize = ctx->fs->blocksize;
+	off_t bpos;
+	ssize_t blen;
+	unsigned int written;
+	char *ptr;
+	int bit;
+	errcode_t err;
+
+	if (ctx->plan)
+		return plan_write_blocks(ctx, off, buf, got, zero_mask);
+
+	for (bpos = 0, bit = 0, ptr = buf; bpos < got;
+	     bpos += blocksize, bit++) {
+		blen = blocksize;
+		if (blen > got - bpos)
+			blen = got - bpos;
+		if (zero_mask & (1ULL << bit)) {
+			ptr += blen;
+			continue;
+		}
+		err = ext2fs_file_llseek(ctx->e2_file, off + bpos,
+					 EXT2_SEEK_SET, NULL);
+		if (err)
+			return err;
+		while (blen > 0) {
+			err = ext2fs_file_write(ctx->e2_file, ptr, blen,
+						&written);
+			if (err)
+				return err;
+			if (written == 0)
+				return EIO;
+			blen -= written;
+			ptr += written;
+		}
+	}
+	return 0;
+}
+
+/* Called for each range of a source file which may contain data */
+typedef errcode_t (*copy_range_func)(void *priv, off_t start, off_t end);
+
+static errcode_t copy_file_chunk(void *priv, off_t start, off_t end)
+{
+	struct copy_ctx *ctx = priv;
+	unsigned int blocksize = ctx->fs->blocksize;
+	off_t off;
+	ssize_t got;
+	errcode_t err;
+
+	for (off = start; off < end; off += COPY_FILE_BUFLEN) {
+		got = read_at(ctx->fd, ctx->buf,
+			      end - off < COPY_FILE_BUFLEN ? end - off :
+			      COPY_FILE_BUFLEN, off);
+		if (got < 0)
+			return errno;
+		err = write_blocks(ctx, off, ctx->buf, got,
+				   zero_block_mask(blocksize, ctx->buf, got,
+						   ctx->zerobuf));
+		if (err)
+			return err;
+	}
+	return 0;
 }
 
 #if defined(SEEK_DATA) && defined(SEEK_HOLE)
-static errcode_t try_lseek_copy(ext2_filsys fs, int fd, struct stat *statbuf,
-				ext2_file_t e2_file, char *buf, char *zerobuf)
+static errcode_t try_lseek_copy(int fd, unsigned int blocksize,
+				struct stat *statbuf, copy_range_func func,
+				void *priv)
 {
 	off_t data = 0, hole;
 	off_t data_blk, hole_blk;
@@ -489,11 +714,10 @@ static errcode_t try_lseek_copy(ext2_filsys fs, int fd, struct stat *statbuf,
 		if (hole < 0)
 			return EXT2_ET_UNIMPLEMENTED;
 
-		data_blk = data & ~(off_t)(fs->blocksize - 1);
-		hole_blk = ((hole + (off_t)(fs->blocksize - 1)) &
-			    ~(off_t)(fs->blocksize - 1));
-		err = copy_file_chunk(fs, fd, e2_file, data_blk, hole_blk, buf,
-				      zerobuf);
+		data_blk = data & ~(off_t)(blocksize - 1);
+		hole_blk = ((hole + (off_t)(blocksize - 1)) &
+			    ~(off_t)(blocksize - 1));
+		err = func(priv, data_blk, hole_blk);
 		if (err)
 			return err;
 
@@ -505,8 +729,7 @@ static errcode_t try_lseek_copy(ext2_filsys fs, int fd, struct stat *statbuf,
 #endif /* SEEK_DATA and SEEK_HOLE */
 
 #if defined(FS_IOC_FIEMAP)
-static errcode_t try_fiemap_copy(ext2_filsys fs, int fd, ext2_file_t e2_file,
-				 char *buf, char *zerobuf)
+static errcode_t try_fiemap_copy(int fd, copy_range_func func, void *priv)
 {
 #define EXTENT_MAX_COUNT 512
 	struct fiemap *fiemap_buf;
@@ -543,9 +766,8 @@ static errcode_t try_fiemap_copy(ext2_filsys fs, int fd, ext2_file_t e2_file,
 			goto out;
 		for (i = 0, ext = ext_buf; i < fiemap_buf->fm_mapped_extents;
 		     i++, ext++) {
-			err = copy_file_chunk(fs, fd, e2_file, ext->fe_logical,
-					      ext->fe_logical + ext->fe_length,
-					      buf, zerobuf);
+			err = func(priv, ext->fe_logical,
+				   ext->fe_logical + ext->fe_length);
 			if (err)
 				goto out;
 		}
@@ -565,159 +787,810 @@ out:
 }
 #endif /* FS_IOC_FIEMAP */
 
-static errcode_t copy_file(ext2_filsys fs, int fd, struct stat *statbuf,
-			   ext2_ino_t ino)
+struct block_ranges {
+	copy_range_func	func;
+	void		*priv;
+	off_t		mask;		/* blocksize - 1 */
+	off_t		done;		/* end of the ranges passed on so far */
+};
+
+/*
+ * Round a range out to whole blocks and trim what an earlier range
+ * already covered: the source file's extents needn't line up with our
+ * blocks, and two of them may share one.
+ */
+static errcode_t block_range(void *priv, off_t start, off_t end)
 {
-	ext2_file_t e2_file;
-	char *buf = NULL, *zerobuf = NULL;
-	errcode_t err, close_err;
+	struct block_ranges *br = priv;
 
-	err = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &e2_file);
-	if (err)
-		return err;
+	start &= ~br->mask;
+	end = (end + br->mask) & ~br->mask;
+	if (start < br->done)
+		start = br->done;
+	if (start >= end)
+		return 0;
+	br->done = end;
+	return br->func(br->priv, start, end);
+}
 
-	err = ext2fs_get_mem(COPY_FILE_BUFLEN, &buf);
-	if (err)
-		goto out;
+/*
+ * Call func for each range of the file which may hold data, in order.
+ * The ranges are block aligned and don't overlap.
+ */
+static errcode_t walk_file_data(int fd, unsigned int blocksize,
+				struct stat *statbuf, copy_range_func func,
+				void *priv)
+{
+	struct block_ranges br;
+	errcode_t err;
 
-	err = ext2fs_get_memzero(fs->blocksize, &zerobuf);
-	if (err)
-		goto out;
+	br.func = func;
+	br.priv = priv;
+	br.mask = blocksize - 1;
+	br.done = 0;
 
 #if defined(SEEK_DATA) && defined(SEEK_HOLE)
-	err = try_lseek_copy(fs, fd, statbuf, e2_file, buf, zerobuf);
+	err = try_lseek_copy(fd, blocksize, statbuf, block_range, &br);
 	if (err != EXT2_ET_UNIMPLEMENTED)
-		goto out;
+		return err;
 #endif
 
 #if defined(FS_IOC_FIEMAP)
-	err = try_fiemap_copy(fs, fd, e2_file, buf, zerobuf);
+	err = try_fiemap_copy(fd, block_range, &br);
 	if (err != EXT2_ET_UNIMPLEMENTED)
-		goto out;
+		return err;
 #endif
 
-	err = copy_file_chunk(fs, fd, e2_file, 0, statbuf->st_size, buf,
-			      zerobuf);
-out:
-	ext2fs_free_mem(&zerobuf);
-	ext2fs_free_mem(&buf);
-	close_err = ext2fs_file_close(e2_file);
-	if (err == 0)
-		err = close_err;
-	return err;
+	return block_range(&br, 0, statbuf->st_size);
 }
 
-static int is_hardlink(struct hdlinks_s *hdlinks, dev_t dev, ino_t ino)
-{
-	int i;
+/*
+ * The lstat() results for the entries of the directory being copied,
+ * shared by the directory walk and everything that looks ahead of it.
+ */
+struct dent_stat {
+	struct stat	st;
+	errcode_t	err;
+	int		valid;
+};
 
-	for (i = 0; i < hdlinks->count; i++) {
-		if (hdlinks->hdl[i].src_dev == dev &&
-		    hdlinks->hdl[i].src_ino == ino)
-			return i;
+static errcode_t dent_lstat(struct dirent **dent, struct dent_stat *ds, int i)
+{
+	if (!ds[i].valid) {
+		ds[i].err = lstat(dent[i]->d_name, &ds[i].st) ? errno : 0;
+		ds[i].valid = 1;
 	}
-	return -1;
+	return ds[i].err;
 }
 
-/* Copy the native file to the fs */
-errcode_t do_write_internal(ext2_filsys fs, ext2_ino_t cwd, const char *src,
-			    const char *dest, ext2_ino_t root)
-{
+#ifdef HAVE_PTHREAD
+/*
+ * Producer/consumer file copying.  The directory walk queues up the
+ * regular files it is about to copy; reader threads find their data
+ * ranges, read them and weed out the zero blocks, while the main thread
+ * remains the only one touching the filesystem.  Files are consumed in
+ * the order they were queued, so the resulting image is the same as
+ * with a serial copy.
+ */
+
+/* Number of chunks a reader may buffer ahead for one file */
+#define COPY_JOB_MAX_CHUNKS	16
+
+struct copy_chunk {
+	struct copy_chunk *next;
+	off_t		off;
+	ssize_t		len;
+	__u64		zero_mask;
+	char		buf[COPY_FILE_BUFLEN];
+};
+
+struct copy_pipeline;
+
+struct copy_job {
+	struct copy_job	*next;
+	struct copy_pipeline *pipe;
+	int		index;		/* of the file's directory entry */
 	int		fd;
-	struct stat	statbuf;
-	ext2_ino_t	newfile, parent_ino;
-	errcode_t	retval;
-	struct ext2_inode inode;
-	char		*cp;
+	struct stat	st;
+	struct copy_chunk *head, *tail;
+	int		nr_chunks;
+	int		started, done, cancel;
+	errcode_t	err;
+};
 
-	fd = ext2fs_open_file(src, O_RDONLY, 0);
-	if (fd < 0) {
-		retval = errno;
-		com_err(__func__, retval, _("while opening \"%s\" to copy"),
-			src);
-		return retval;
-	}
-	if (fstat(fd, &statbuf) < 0) {
-		retval = errno;
-		goto out;
+struct copy_pipeline {
+	pthread_mutex_t	lock;
+	pthread_cond_t	work;		/* new job, or room for a chunk */
+	pthread_cond_t	data;		/* new chunk, or a job finished */
+	pthread_t	*threads;
+	int		num_threads;
+	int		shutdown;
+	unsigned int	blocksize;
+	char		*zerobuf;
+	struct copy_job	*jobs, *last;	/* queued and not yet consumed */
+	int		nr_jobs;
+	int		max_jobs;
+};
+
+static errcode_t read_chunks(void *priv, off_t start, off_t end)
+{
+	struct copy_job *job = priv;
+	struct copy_pipeline *pipe = job->pipe;
+	struct copy_chunk *chunk = NULL;
+	off_t off;
+	errcode_t err = 0;
+
+	for (off = start; off < end; off += COPY_FILE_BUFLEN) {
+		pthread_mutex_lock(&pipe->lock);
+		if (job->cancel)
+			err = EXT2_ET_CANCEL_REQUESTED;
+		pthread_mutex_unlock(&pipe->lock);
+		if (err)
+			break;
+		if (!chunk) {
+			chunk = malloc(sizeof(struct copy_chunk));
+			if (!chunk)
+				return EXT2_ET_NO_MEMORY;
+		}
+		chunk->len = read_at(job->fd, chunk->buf,
+				     end - off < COPY_FILE_BUFLEN ? end - off :
+				     COPY_FILE_BUFLEN, off);
+		if (chunk->len < 0) {
+			err = errno;
+			break;
+		}
+		chunk->zero_mask = zero_block_mask(pipe->blocksize,
+						   chunk->buf, chunk->len,
+						   pipe->zerobuf);
+		if (all_zero_blocks(pipe->blocksize, chunk->len,
+				    chunk->zero_mask))
+			continue;
+		chunk->off = off;
+		chunk->next = NULL;
+
+		pthread_mutex_lock(&pipe->lock);
+		while (job->nr_chunks >= COPY_JOB_MAX_CHUNKS && !job->cancel)
+			pthread_cond_wait(&pipe->work, &pipe->lock);
+		if (job->cancel) {
+			pthread_mutex_unlock(&pipe->lock);
+			err = EXT2_ET_CANCEL_REQUESTED;
+			break;
+		}
+		if (job->tail)
+			job->tail->next = chunk;
+		else
+			job->head = chunk;
+		job->tail = chunk;
+		job->nr_chunks++;
+		pthread_cond_broadcast(&pipe->data);
+		pthread_mutex_unlock(&pipe->lock);
+		chunk = NULL;
 	}
+	free(chunk);
+	return err;
+}
 
-	cp = strrchr(dest, '/');
-	if (cp) {
-		*cp = 0;
-		retval = ext2fs_namei(fs, root, cwd, dest, &parent_ino);
-		if (retval) {
-			com_err(dest, retval, _("while looking up \"%s\""),
-				dest);
-			goto out;
+static void *copy_reader_thread(void *data)
+{
+	struct copy_pipeline *pipe = data;
+	struct copy_job *job;
+	errcode_t err;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (1) {
+		for (job = pipe->jobs; job && job->started; job = job->next)
+			;
+		if (!job) {
+			if (pipe->shutdown)
+				break;
+			pthread_cond_wait(&pipe->work, &pipe->lock);
+			continue;
 		}
-		dest = cp+1;
-	} else
-		parent_ino = cwd;
+		job->started = 1;
+		pthread_mutex_unlock(&pipe->lock);
 
-	retval = ext2fs_namei(fs, root, parent_ino, dest, &newfile);
-	if (retval == 0) {
-		retval = EXT2_ET_FILE_EXISTS;
-		goto out;
-	}
+		err = walk_file_data(job->fd, pipe->blocksize, &job->st,
+				     read_chunks, job);
 
-	retval = ext2fs_new_inode(fs, parent_ino, 010755, 0, &newfile);
-	if (retval)
-		goto out;
-#ifdef DEBUGFS
-	printf("Allocated inode: %u\n", newfile);
-#endif
-	retval = ext2fs_link(fs, parent_ino, dest, newfile, EXT2_FT_REG_FILE);
-	if (retval == EXT2_ET_DIR_NO_SPACE) {
-		retval = ext2fs_expand_dir(fs, parent_ino);
-		if (retval)
-			goto out;
-		retval = ext2fs_link(fs, parent_ino, dest, newfile,
-					EXT2_FT_REG_FILE);
+		pthread_mutex_lock(&pipe->lock);
+		job->err = err;
+		job->done = 1;
+		pthread_cond_broadcast(&pipe->data);
 	}
-	if (retval)
-		goto out;
-	if (ext2fs_test_inode_bitmap2(fs->inode_map, newfile))
-		com_err(__func__, 0, "Warning: inode already set");
-	ext2fs_inode_alloc_stats2(fs, newfile, +1, 0);
-	memset(&inode, 0, sizeof(inode));
-	inode.i_mode = (statbuf.st_mode & ~S_IFMT) | LINUX_S_IFREG;
-	inode.i_atime = inode.i_ctime = inode.i_mtime =
-		fs->now ? fs->now : time(0);
-	inode.i_links_count = 1;
-	retval = ext2fs_inode_size_set(fs, &inode, statbuf.st_size);
-	if (retval)
-		goto out;
-	if (ext2fs_has_feature_inline_data(fs->super)) {
-		inode.i_flags |= EXT4_INLINE_DATA_FL;
-	} else if (ext2fs_has_feature_extents(fs->super)) {
-		ext2_extent_handle_t handle;
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
 
-		inode.i_flags &= ~EXT4_EXTENTS_FL;
-		retval = ext2fs_extent_open2(fs, newfile, &inode, &handle);
-		if (retval)
-			goto out;
-		ext2fs_extent_free(handle);
-	}
+/* Write out the data the readers produce for job */
+static errcode_t copy_job_data(struct copy_ctx *ctx, struct copy_job *job)
+{
+	struct copy_pipeline *pipe = job->pipe;
+	struct copy_chunk *chunk;
+	errcode_t err = 0;
 
-	retval = ext2fs_write_new_inode(fs, newfile, &inode);
-	if (retval)
-		goto out;
-	if (inode.i_flags & EXT4_INLINE_DATA_FL) {
-		retval = ext2fs_inline_data_init(fs, newfile);
-		if (retval)
-			goto out;
+	pthread_mutex_lock(&pipe->lock);
+	while (1) {
+		chunk = job->head;
+		if (!chunk) {
+			if (job->done) {
+				err = job->err;
+				break;
+			}
+			pthread_cond_wait(&pipe->data, &pipe->lock);
+			continue;
+		}
+		job->head = chunk->next;
+		if (!job->head)
+			job->tail = NULL;
+		job->nr_chunks--;
+		pthread_cond_broadcast(&pipe->work);
+		pthread_mutex_unlock(&pipe->lock);
+
+		err = write_blocks(ctx, chunk->off, chunk->buf, chunk->len,
+				   chunk->zero_mask);
+		free(chunk);
+
+		pthread_mutex_lock(&pipe->lock);
+		if (err)
+			break;
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return err;
+}
+
+/* Stop any reader working on job, and throw it away */
+static void finish_copy_job(struct copy_pipeline *pipe, struct copy_job *job)
+{
+	struct copy_job **pp, *prev = NULL;
+	struct copy_chunk *chunk;
+
+	if (!job)
+		return;
+
+	pthread_mutex_lock(&pipe->lock);
+	job->cancel = 1;
+	pthread_cond_broadcast(&pipe->work);
+	while (job->started && !job->done)
+		pthread_cond_wait(&pipe->data, &pipe->lock);
+	for (pp = &pipe->jobs; *pp != job; pp = &(*pp)->next)
+		prev = *pp;
+	*pp = job->next;
+	if (pipe->last == job)
+		pipe->last = prev;
+	pipe->nr_jobs--;
+	pthread_mutex_unlock(&pipe->lock);
+
+	while ((chunk = job->head) != NULL) {
+		job->head = chunk->next;
+		free(chunk);
+	}
+	close(job->fd);
+	free(job);
+}
+
+static void drain_copy_pipeline(struct copy_pipeline *pipe)
+{
+	if (!pipe)
+		return;
+	while (pipe->jobs)
+		finish_copy_job(pipe, pipe->jobs);
+}
+
+/*
+ * Queue up the regular files from dent[*next] onwards for the readers.
+ * Queueing stops at the first directory, so that the queue is always
+ * consumed in order by the directory walk.  Hard linked files are left
+ * to the serial path, as only their first link is copied.  Anything
+ * which can't be opened here is left for write_file() to report.
+ */
+static void fill_copy_pipeline(struct copy_pipeline *pipe,
+			       struct dirent **dent, struct dent_stat *ds,
+			       int *next, int num_dents)
+{
+	struct copy_job *job;
+	struct stat *st;
+	const char *name;
+
+	if (!pipe)
+		return;
+
+	while (pipe->nr_jobs < pipe->max_jobs && *next < num_dents) {
+		name = dent[*next]->d_name;
+		st = &ds[*next].st;
+		if (dent_lstat(dent, ds, *next) || S_ISDIR(st->st_mode))
+			break;
+		(*next)++;
+		if (!S_ISREG(st->st_mode) || st->st_nlink > 1)
+			continue;
+
+		job = calloc(1, sizeof(struct copy_job));
+		if (!job)
+			break;
+		job->fd = ext2fs_open_file(name, O_RDONLY, 0);
+		if (job->fd < 0 || fstat(job->fd, &job->st) < 0) {
+			if (job->fd >= 0)
+				close(job->fd);
+			free(job);
+			continue;
+		}
+		job->pipe = pipe;
+		job->index = *next - 1;
+
+		pthread_mutex_lock(&pipe->lock);
+		if (pipe->last)
+			pipe->last->next = job;
+		else
+			pipe->jobs = job;
+		pipe->last = job;
+		pipe->nr_jobs++;
+		pthread_cond_signal(&pipe->work);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+}
+
+/* Find the queued job for directory entry index, if there is one */
+static struct copy_job *take_copy_job(struct copy_pipeline *pipe, int index)
+{
+	if (!pipe)
+		return NULL;
+
+	while (pipe->jobs && pipe->jobs->index < index)
+		finish_copy_job(pipe, pipe->jobs);
+	if (pipe->jobs && pipe->jobs->index == index)
+		return pipe->jobs;
+	return NULL;
+}
+
+static void free_copy_pipeline(struct copy_pipeline *pipe)
+{
+	int i;
+
+	if (!pipe)
+		return;
+
+	drain_copy_pipeline(pipe);
+	pthread_mutex_lock(&pipe->lock);
+	pipe->shutdown = 1;
+	pthread_cond_broadcast(&pipe->work);
+	pthread_mutex_unlock(&pipe->lock);
+	for (i = 0; i < pipe->num_threads; i++)
+		pthread_join(pipe->threads[i], NULL);
+	pthread_cond_destroy(&pipe->data);
+	pthread_cond_destroy(&pipe->work);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe->threads);
+	free(pipe->zerobuf);
+	free(pipe);
+}
+
+/*
+ * Start the reader threads.  Returns NULL if copying should be done
+ * serially, either because that was asked for or because the threads
+ * couldn't be set up.
+ */
+static struct copy_pipeline *init_copy_pipeline(ext2_filsys fs,
+						int num_threads)
+{
+	struct copy_pipeline *pipe;
+
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_CONF)
+	if (num_threads < 0)
+		num_threads = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+	if (num_threads < 0)
+		num_threads = 4;
+	if (num_threads <= 1)
+		return NULL;
+
+	pipe = calloc(1, sizeof(struct copy_pipeline));
+	if (!pipe)
+		return NULL;
+	pipe->blocksize = fs->blocksize;
+	pipe->max_jobs = num_threads * 4;
+	pipe->zerobuf = calloc(1, fs->blocksize);
+	pipe->threads = calloc(num_threads, sizeof(pthread_t));
+	if (!pipe->zerobuf || !pipe->threads) {
+		free(pipe->zerobuf);
+		free(pipe->threads);
+		free(pipe);
+		return NULL;
+	}
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->work, NULL);
+	pthread_cond_init(&pipe->data, NULL);
+	for (; pipe->num_threads < num_threads; pipe->num_threads++) {
+		if (pthread_create(&pipe->threads[pipe->num_threads], NULL,
+				   copy_reader_thread, pipe))
+			break;
+	}
+	if (pipe->num_threads == 0) {
+		free_copy_pipeline(pipe);
+		return NULL;
+	}
+	return pipe;
+}
+#else /* HAVE_PTHREAD */
+struct copy_pipeline;
+struct copy_job;
+
+static void fill_copy_pipeline(struct copy_pipeline *pipe EXT2FS_ATTR((unused)),
+			       struct dirent **dent EXT2FS_ATTR((unused)),
+			       struct dent_stat *ds EXT2FS_ATTR((unused)),
+			       int *next EXT2FS_ATTR((unused)),
+			       int num_dents EXT2FS_ATTR((unused)))
+{
+}
+
+static struct copy_job *take_copy_job(struct copy_pipeline *pipe EXT2FS_ATTR((unused)),
+				      int index EXT2FS_ATTR((unused)))
+{
+	return NULL;
+}
+
+static void finish_copy_job(struct copy_pipeline *pipe EXT2FS_ATTR((unused)),
+			    struct copy_job *job EXT2FS_ATTR((unused)))
+{
+}
+
+static void drain_copy_pipeline(struct copy_pipeline *pipe EXT2FS_ATTR((unused)))
+{
+}
+
+static struct copy_pipeline *init_copy_pipeline(ext2_filsys fs EXT2FS_ATTR((unused)),
+						int num_threads EXT2FS_ATTR((unused)))
+{
+	return NULL;
+}
+
+static void free_copy_pipeline(struct copy_pipeline *pipe EXT2FS_ATTR((unused)))
+{
+}
+#endif /* HAVE_PTHREAD */
+
+/*
+ * Copy the data from fd into inode ino.  If job is set, the data is
+ * read by the copy pipeline instead of here.  If plan is set, extent
+ * mapped files are written to blocks allocated from it.
+ */
+static errcode_t copy_file(ext2_filsys fs, int fd, struct stat *statbuf,
+			   ext2_ino_t ino, struct copy_job *job,
+			   struct layout_plan *plan)
+{
+	struct copy_ctx ctx;
+	errcode_t err, close_err;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fs = fs;
+	ctx.fd = fd;
+	ctx.ino = ino;
+	if (plan) {
+		err = ext2fs_read_inode(fs, ino, &ctx.inode);
+		if (err)
+			return err;
+		if (ctx.inode.i_flags & EXT4_EXTENTS_FL)
+			ctx.plan = plan;
+	}
+	if (!ctx.plan) {
+		err = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE,
+				       &ctx.e2_file);
+		if (err)
+			return err;
+	}
+
+#ifdef HAVE_PTHREAD
+	if (job) {
+		err = copy_job_data(&ctx, job);
+		goto out;
+	}
+#endif
+
+	err = ext2fs_get_mem(COPY_FILE_BUFLEN, &ctx.buf);
+	if (err)
+		goto out;
+
+	err = ext2fs_get_memzero(fs->blocksize, &ctx.zerobuf);
+	if (err)
+		goto out;
+
+	err = walk_file_data(fd, fs->blocksize, statbuf, copy_file_chunk,
+			     &ctx);
+out:
+	ext2fs_free_mem(&ctx.zerobuf);
+	ext2fs_free_mem(&ctx.buf);
+	if (ctx.e2_file)
+		close_err = ext2fs_file_close(ctx.e2_file);
+	else
+		close_err = ext2fs_write_inode(fs, ino, &ctx.inode);
+	if (err == 0)
+		err = close_err;
+	return err;
+}
+
+static unsigned int hdlink_hash(struct hdlinks_s *hdlinks, dev_t dev,
+				ino_t ino)
+{
+	unsigned long long h;
+
+	h = ((unsigned long long) dev << 32) ^ (unsigned long long) ino;
+	h *= 0x9E3779B97F4A7C15ULL;
+	return (unsigned int) (h >> 32) & (hdlinks->hash_size - 1);
+}
+
+int is_hardlink(struct hdlinks_s *hdlinks, dev_t dev, ino_t ino)
+{
+	unsigned int h;
+	int i;
+
+	for (h = hdlink_hash(hdlinks, dev, ino); hdlinks->hash[h];
+	     h = (h + 1) & (hdlinks->hash_size - 1)) {
+		i = hdlinks->hash[h] - 1;
+		if (hdlinks->hdl[i].src_dev == dev &&
+		    hdlinks->hdl[i].src_ino == ino)
+			return i;
+	}
+	return -1;
+}
+
+static void hash_hardlink(struct hdlinks_s *hdlinks, int i)
+{
+	unsigned int h;
+
+	for (h = hdlink_hash(hdlinks, hdlinks->hdl[i].src_dev,
+			     hdlinks->hdl[i].src_ino);
+	     hdlinks->hash[h]; h = (h + 1) & (hdlinks->hash_size - 1))
+		;
+	hdlinks->hash[h] = i + 1;
+}
+
+errcode_t add_hardlink(struct hdlinks_s *hdlinks, dev_t dev, ino_t ino,
+		       ext2_ino_t dst_ino)
+{
+	void *p;
+	int i;
+
+	if (hdlinks->count == hdlinks->size) {
+		p = realloc(hdlinks->hdl, hdlinks->size * 2 *
+			    sizeof(struct hdlink_s));
+		if (p == NULL)
+			return EXT2_ET_NO_MEMORY;
+		hdlinks->hdl = p;
+		hdlinks->size *= 2;
+	}
+	/* Keep the hash table at most half full */
+	if ((unsigned int) hdlinks->count * 2 >= hdlinks->hash_size) {
+		p = calloc(hdlinks->hash_size * 2, sizeof(int));
+		if (p == NULL)
+			return EXT2_ET_NO_MEMORY;
+		free(hdlinks->hash);
+		hdlinks->hash = p;
+		hdlinks->hash_size *= 2;
+		for (i = 0; i < hdlinks->count; i++)
+			hash_hardlink(hdlinks, i);
+	}
+	hdlinks->hdl[hdlinks->count].src_dev = dev;
+	hdlinks->hdl[hdlinks->count].src_ino = ino;
+	hdlinks->hdl[hdlinks->count].dst_ino = dst_ino;
+	hash_hardlink(hdlinks, hdlinks->count++);
+	return 0;
+}
+
+errcode_t init_hdlinks(struct hdlinks_s *hdlinks)
+{
+	hdlinks->count = 0;
+	hdlinks->size = HDLINK_CNT;
+	hdlinks->hdl = realloc(NULL, hdlinks->size * sizeof(struct hdlink_s));
+	hdlinks->hash_size = HDLINK_CNT * 2;
+	hdlinks->hash = calloc(hdlinks->hash_size, sizeof(int));
+	if (hdlinks->hdl == NULL || hdlinks->hash == NULL) {
+		free_hdlinks(hdlinks);
+		return EXT2_ET_NO_MEMORY;
+	}
+	return 0;
+}
+
+void free_hdlinks(struct hdlinks_s *hdlinks)
+{
+	free(hdlinks->hdl);
+	free(hdlinks->hash);
+	hdlinks->hdl = NULL;
+	hdlinks->hash = NULL;
+}
+
+/*
+ * Create an empty regular file dest, with the mode and size from statbuf.
+ * If reserved is non-zero, it is an inode which has already been
+ * allocated (and accounted for) by ext2fs_new_inodes_batch().  *linked is
+ * set once the new inode has been added to its directory.
+ */
+static errcode_t create_file(ext2_filsys fs, ext2_ino_t cwd, const char *dest,
+			     ext2_ino_t root, struct stat *statbuf,
+			     ext2_ino_t reserved, ext2_ino_t *ino, int *linked)
+{
+	ext2_ino_t	newfile, parent_ino;
+	errcode_t	retval;
+	struct ext2_inode inode;
+	char		*cp;
+
+	cp = strrchr(dest, '/');
+	if (cp) {
+		*cp = 0;
+		retval = ext2fs_namei(fs, root, cwd, dest, &parent_ino);
+		if (retval) {
+			com_err(dest, retval, _("while looking up \"%s\""),
+				dest);
+			return retval;
+		}
+		dest = cp+1;
+	} else
+		parent_ino = cwd;
+
+	retval = ext2fs_namei(fs, root, parent_ino, dest, &newfile);
+	if (retval == 0)
+		return EXT2_ET_FILE_EXISTS;
+
+	if (reserved) {
+		newfile = reserved;
+	} else {
+		retval = ext2fs_new_inode(fs, parent_ino, 010755, 0, &newfile);
+		if (retval)
+			return retval;
+	}
+#ifdef DEBUGFS
+	printf("Allocated inode: %u\n", newfile);
+#endif
+	retval = ext2fs_link(fs, parent_ino, dest, newfile, EXT2_FT_REG_FILE);
+	if (retval == EXT2_ET_DIR_NO_SPACE) {
+		retval = ext2fs_expand_dir(fs, parent_ino);
+		if (retval)
+			return retval;
+		retval = ext2fs_link(fs, parent_ino, dest, newfile,
+					EXT2_FT_REG_FILE);
+	}
+	if (retval)
+		return retval;
+	*linked = 1;
+	if (!reserved) {
+		if (ext2fs_test_inode_bitmap2(fs->inode_map, newfile))
+			com_err("do_write_internal", 0,
+				"Warning: inode already set");
+		ext2fs_inode_alloc_stats2(fs, newfile, +1, 0);
+	}
+	memset(&inode, 0, sizeof(inode));
+	inode.i_mode = (statbuf->st_mode & ~S_IFMT) | LINUX_S_IFREG;
+	inode.i_atime = inode.i_ctime = inode.i_mtime =
+		fs->now ? fs->now : time(0);
+	inode.i_links_count = 1;
+	retval = ext2fs_inode_size_set(fs, &inode, statbuf->st_size);
+	if (retval)
+		return retval;
+	if (ext2fs_has_feature_inline_data(fs->super)) {
+		inode.i_flags |= EXT4_INLINE_DATA_FL;
+	} else if (ext2fs_has_feature_extents(fs->super)) {
+		ext2_extent_handle_t handle;
+
+		inode.i_flags &= ~EXT4_EXTENTS_FL;
+		retval = ext2fs_extent_open2(fs, newfile, &inode, &handle);
+		if (retval)
+			return retval;
+		ext2fs_extent_free(handle);
 	}
-	if (LINUX_S_ISREG(inode.i_mode)) {
-		retval = copy_file(fs, fd, &statbuf, newfile);
+
+	retval = ext2fs_write_new_inode(fs, newfile, &inode);
+	if (retval)
+		return retval;
+	if (inode.i_flags & EXT4_INLINE_DATA_FL) {
+		retval = ext2fs_inline_data_init(fs, newfile);
 		if (retval)
+			return retval;
+	}
+	*ino = newfile;
+	return 0;
+}
+
+errcode_t do_create_file_internal(ext2_filsys fs, ext2_ino_t cwd,
+				  const char *name, struct stat *st,
+				  ext2_ino_t root, ext2_ino_t *ino)
+{
+	int linked = 0;
+
+	return create_file(fs, cwd, name, root, st, 0, ino, &linked);
+}
+
+/*
+ * Copy the native file to the fs.  If reserved is non-zero, it is an
+ * inode which has already been allocated (and accounted for) by
+ * ext2fs_new_inodes_batch(); it is given back if the copy fails before
+ * the inode is linked in.  If job is set, the file has already been
+ * opened and its data is read by the copy pipeline.  If plan is set, the
+ * data is laid out by it.
+ */
+static errcode_t write_file(ext2_filsys fs, ext2_ino_t cwd, const char *src,
+			    const char *dest, ext2_ino_t root,
+			    ext2_ino_t reserved, struct copy_job *job,
+			    struct layout_plan *plan)
+{
+	int		fd;
+	struct stat	statbuf;
+	ext2_ino_t	newfile;
+	errcode_t	retval;
+	int		linked = 0;
+
+#ifdef HAVE_PTHREAD
+	if (job) {
+		fd = job->fd;
+		statbuf = job->st;
+	} else
+#endif
+	{
+		fd = ext2fs_open_file(src, O_RDONLY, 0);
+		if (fd < 0) {
+			retval = errno;
+			com_err("do_write_internal", retval,
+				_("while opening \"%s\" to copy"), src);
+			goto release;
+		}
+		if (fstat(fd, &statbuf) < 0) {
+			retval = errno;
 			goto out;
+		}
 	}
+
+	retval = create_file(fs, cwd, dest, root, &statbuf, reserved,
+			     &newfile, &linked);
+	if (retval)
+		goto out;
+	retval = copy_file(fs, fd, &statbuf, newfile, job, plan);
 out:
-	close(fd);
+	if (!job)
+		close(fd);
+release:
+	if (retval && reserved && !linked)
+		ext2fs_inode_alloc_stats2(fs, reserved, -1, 0);
 	return retval;
 }
 
+errcode_t do_write_internal(ext2_filsys fs, ext2_ino_t cwd, const char *src,
+			    const char *dest, ext2_ino_t root)
+{
+	return write_file(fs, cwd, src, dest, root, 0, NULL, NULL);
+}
+
+/*
+ * Inodes reserved with ext2fs_new_inodes_batch() for a run of regular
+ * files in the directory being copied.
+ */
+#define INODE_BATCH_MAX	64
+
+struct inode_batch {
+	ext2_ino_t	ino[INODE_BATCH_MAX];
+	ext2_ino_t	count;
+	ext2_ino_t	next;
+};
+
+/*
+ * Count the directory entries starting at dent[i] which will each need
+ * a new inode from write_file(): plain files which aren't hard links.
+ */
+static ext2_ino_t count_new_files(struct dirent **dent, struct dent_stat *ds,
+				  int i, int num_dents)
+{
+	ext2_ino_t	n = 0;
+
+	for (; i < num_dents && n < INODE_BATCH_MAX; i++, n++) {
+		if (dent_lstat(dent, ds, i) || !S_ISREG(ds[i].st.st_mode) ||
+		    ds[i].st.st_nlink > 1)
+			break;
+	}
+	return n;
+}
+
+static void release_inode_batch(ext2_filsys fs, struct inode_batch *batch)
+{
+	for (; batch->next < batch->count; batch->next++)
+		ext2fs_inode_alloc_stats2(fs, batch->ino[batch->next], -1, 0);
+	batch->count = batch->next = 0;
+}
+
 struct file_info {
 	char *path;
 	size_t path_len;
@@ -803,12 +1676,214 @@ static int alphasort(const struct dirent **a, const struct dirent **b) {
 }
 #endif
 
+/* Estimate of the blocks a linear directory will take */
+struct dir_estimate {
+	unsigned int	usable;		/* bytes of each block for entries */
+	unsigned int	used;		/* bytes used in the last block */
+	blk64_t		blocks;
+};
+
+static void dir_estimate_init(ext2_filsys fs, struct dir_estimate *est)
+{
+	est->usable = fs->blocksize;
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		est->usable -= sizeof(struct ext2_dir_entry_tail);
+	est->used = EXT2_DIR_REC_LEN(1) + EXT2_DIR_REC_LEN(2);
+	est->blocks = 1;
+}
+
+static void dir_estimate_add(struct dir_estimate *est, const char *name)
+{
+	unsigned int rec_len = EXT2_DIR_REC_LEN(strlen(name));
+
+	if (est->used + rec_len > est->usable) {
+		est->blocks++;
+		est->used = 0;
+	}
+	est->used += rec_len;
+}
+
+/*
+ * Add up the blocks needed by the directories and slow symlinks under
+ * the directory in path.
+ */
+static errcode_t plan_scan_dir(ext2_filsys fs, struct file_info *path,
+			       blk64_t *meta_blocks)
+{
+	struct dir_estimate est;
+	struct dirent	*dent;
+	struct stat	st;
+	size_t		path_len = path->path_len;
+	DIR		*dir;
+	errcode_t	retval = 0;
+
+	dir = opendir(path->path);
+	if (!dir)
+		return errno;
+	dir_estimate_init(fs, &est);
+	while ((dent = readdir(dir)) != NULL) {
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+			continue;
+		dir_estimate_add(&est, dent->d_name);
+		retval = path_append(path, dent->d_name);
+		if (retval)
+			break;
+		if (lstat(path->path, &st) == 0) {
+			if (S_ISDIR(st.st_mode))
+				retval = plan_scan_dir(fs, path, meta_blocks);
+			else if (S_ISLNK(st.st_mode) &&
+				 st.st_size >= EXT2_N_BLOCKS * 4)
+				(*meta_blocks)++;	/* not a fast symlink */
+		}
+		path->path_len = path_len;
+		path->path[path_len] = 0;
+		if (retval)
+			break;
+	}
+	closedir(dir);
+	*meta_blocks += est.blocks;
+	return retval;
+}
+
+static errcode_t plan_alloc_block(ext2_filsys fs, blk64_t goal,
+				  blk64_t *ret, struct blk_alloc_ctx *ctx)
+{
+	struct layout_plan *plan = fs->priv_data;
+	blk64_t *cursor = &plan->meta_goal;
+	errcode_t retval;
+
+	if (ctx && ctx->flags == BLOCK_ALLOC_DATA)
+		cursor = &plan->data_goal;
+	retval = ext2fs_new_block3(fs, *cursor, fs->block_map, ret, ctx);
+	if (retval)
+		return retval;
+	*cursor = *ret + 1;
+	return 0;
+}
+
+/*
+ * Scan source_dir and set up the layout plan for copying it in.  Returns
+ * an error if the tree should be copied in without one, which isn't
+ * fatal.
+ */
+static errcode_t start_layout_plan(ext2_filsys fs, const char *source_dir,
+				   struct layout_plan *plan)
+{
+	struct file_info path;
+	blk64_t meta_blocks = 0;
+	errcode_t retval;
+
+	/* Don't override a caller's allocator or its private data */
+	if (fs->get_alloc_block || fs->get_alloc_block2 || fs->priv_data ||
+	    !fs->block_map ||
+	    ext2fs_has_feature_bigalloc(fs->super) ||
+	    ext2fs_has_feature_inline_data(fs->super))
+		return EXT2_ET_OP_NOT_SUPPORTED;
+
+	path.path_len = strlen(source_dir);
+	path.path_max_len = path.path_len + 256;
+	path.path = malloc(path.path_max_len);
+	if (!path.path)
+		return EXT2_ET_NO_MEMORY;
+	strcpy(path.path, source_dir);
+	retval = plan_scan_dir(fs, &path, &meta_blocks);
+	free(path.path);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_new_block2(fs, fs->super->s_first_data_block,
+				   fs->block_map, &plan->meta_goal);
+	if (retval)
+		return retval;
+	plan->data_goal = plan->meta_goal + meta_blocks;
+	if (plan->data_goal >= ext2fs_blocks_count(fs->super))
+		plan->data_goal = plan->meta_goal;
+
+	plan->old_priv_data = fs->priv_data;
+	plan->old_get_alloc_block2 = fs->get_alloc_block2;
+	fs->priv_data = plan;
+	fs->get_alloc_block2 = plan_alloc_block;
+	return 0;
+}
+
+static void end_layout_plan(ext2_filsys fs, struct layout_plan *plan)
+{
+	fs->get_alloc_block2 = plan->old_get_alloc_block2;
+	fs->priv_data = plan->old_priv_data;
+}
+
+/*
+ * Give directory ino all the blocks its entries will need up front, so
+ * they're allocated together rather than as it fills up.
+ */
+static errcode_t plan_dir_blocks(ext2_filsys fs, struct layout_plan *plan,
+				 ext2_ino_t ino, struct dirent **dent,
+				 int num_dents)
+{
+	struct dir_estimate est;
+	struct ext2_inode inode;
+	blk64_t		lblk, pblk, have;
+	char		*block;
+	errcode_t	retval;
+	int		i;
+
+	dir_estimate_init(fs, &est);
+	for (i = 0; i < num_dents; i++) {
+		if (strcmp(dent[i]->d_name, ".") &&
+		    strcmp(dent[i]->d_name, ".."))
+			dir_estimate_add(&est, dent[i]->d_name);
+	}
+
+	retval = ext2fs_read_inode(fs, ino, &inode);
+	if (retval)
+		return retval;
+	have = EXT2_I_SIZE(&inode) / fs->blocksize;
+	if (have >= est.blocks)
+		return 0;
+
+	retval = ext2fs_fallocate(fs, EXT2_FALLOCATE_FORCE_INIT |
+				  EXT2_FALLOCATE_WILL_OVERWRITE |
+				  EXT2_FALLOCATE_INIT_BEYOND_EOF, ino, &inode,
+				  plan->meta_goal, have, est.blocks - have);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_new_dir_block(fs, 0, 0, &block);
+	if (retval)
+		return retval;
+	for (lblk = have; lblk < est.blocks; lblk++) {
+		retval = ext2fs_bmap2(fs, ino, &inode, NULL, 0, lblk, NULL,
+				      &pblk);
+		if (retval)
+			break;
+		if (!pblk) {
+			retval = EXT2_ET_BLOCK_ALLOC_FAIL;
+			break;
+		}
+		retval = ext2fs_write_dir_block4(fs, pblk, block, 0, ino);
+		if (retval)
+			break;
+		plan->meta_goal = pblk + 1;
+	}
+	ext2fs_free_mem(&block);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_inode_size_set(fs, &inode,
+				       est.blocks * fs->blocksize);
+	if (retval)
+		return retval;
+	return ext2fs_write_inode(fs, ino, &inode);
+}
+
 /* Copy files from source_dir to fs in alphabetical order */
 static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 			       const char *source_dir, ext2_ino_t root,
 			       struct hdlinks_s *hdlinks,
 			       struct file_info *target,
-			       struct fs_ops_callbacks *fs_callbacks)
+			       struct fs_ops_callbacks *fs_callbacks,
+			       struct copy_pipeline *pipe,
+			       struct layout_plan *plan)
 {
 	const char	*name;
 	struct dirent	**dent;
@@ -821,7 +1896,13 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 	int		hdlink;
 	size_t		cur_dir_path_len;
 	int		i, num_dents;
+	struct inode_batch batch;
+	ext2_ino_t	reserved;
+	struct copy_job	*job;
+	struct dent_stat *ds;
+	int		next_job = 0;
 
+	batch.count = batch.next = 0;
 	if (chdir(source_dir) < 0) {
 		retval = errno;
 		com_err(__func__, retval,
@@ -839,16 +1920,42 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 		return retval;
 	}
 
+	retval = ext2fs_get_arrayzero(num_dents ? num_dents : 1,
+				      sizeof(struct dent_stat), &ds);
+	if (retval) {
+		com_err(__func__, retval,
+			_("while scanning directory \"%s\""), source_dir);
+		for (i = 0; i < num_dents; i++)
+			free(dent[i]);
+		free(dent);
+		return retval;
+	}
+
+	if (plan) {
+		retval = plan_dir_blocks(fs, plan, parent_ino, dent,
+					 num_dents);
+		if (retval) {
+			com_err(__func__, retval,
+				_("while expanding directory"));
+			i = 0;
+			goto out;
+		}
+	}
+
 	for (i = 0; i < num_dents; free(dent[i]), i++) {
 		name = dent[i]->d_name;
 		if ((!strcmp(name, ".")) || (!strcmp(name, "..")))
 			continue;
-		if (lstat(name, &st)) {
-			retval = errno;
+		if (next_job < i)
+			next_job = i;
+		fill_copy_pipeline(pipe, dent, ds, &next_job, num_dents);
+		retval = dent_lstat(dent, ds, i);
+		if (retval) {
 			com_err(__func__, retval, _("while lstat \"%s\""),
 				name);
 			goto out;
 		}
+		st = ds[i].st;
 
 		/* Check for hardlinks */
 		save_inode = 0;
@@ -937,8 +2044,27 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 			break;
 #endif
 		case S_IFREG:
-			retval = do_write_internal(fs, parent_ino, name, name,
-						   root);
+			/*
+			 * Allocate the inodes for a run of new files in one
+			 * go, in the same order ext2fs_new_inode() would.
+			 */
+			if (!save_inode && batch.next == batch.count) {
+				batch.count = batch.next = 0;
+				reserved = count_new_files(dent, ds, i,
+							   num_dents);
+				if (reserved > 1 &&
+				    ext2fs_new_inodes_batch(fs, parent_ino,
+						LINUX_S_IFREG, reserved,
+						batch.ino, &batch.count))
+					batch.count = 0;
+			}
+			reserved = 0;
+			if (!save_inode && batch.next < batch.count)
+				reserved = batch.ino[batch.next++];
+			job = save_inode ? NULL : take_copy_job(pipe, i);
+			retval = write_file(fs, parent_ino, name, name, root,
+					    reserved, job, plan);
+			finish_copy_job(pipe, job);
 			if (retval) {
 				com_err(__func__, retval,
 					_("while writing file \"%s\""), name);
@@ -965,8 +2091,9 @@ find_lnf:
 					goto out;
 			}
 			/* Populate the dir recursively*/
+			drain_copy_pipeline(pipe);
 			retval = __populate_fs(fs, ino, name, root, hdlinks,
-					       target, fs_callbacks);
+					       target, fs_callbacks, pipe, plan);
 			if (retval)
 				goto out;
 			if (chdir("..")) {
@@ -1013,56 +2140,59 @@ find_lnf:
 		/* Save the hardlink ino */
 		if (save_inode) {
 			/*
-			 * Check whether need more memory, and we don't need
-			 * free() since the lifespan will be over after the fs
-			 * populated.
+			 * We don't need free() since the lifespan will be
+			 * over after the fs populated.
 			 */
-			if (hdlinks->count == hdlinks->size) {
-				void *p = realloc(hdlinks->hdl,
-						(hdlinks->size + HDLINK_CNT) *
-						sizeof(struct hdlink_s));
-				if (p == NULL) {
-					retval = EXT2_ET_NO_MEMORY;
-					com_err(name, retval,
-						_("while saving inode data"));
-					goto out;
-				}
-				hdlinks->hdl = p;
-				hdlinks->size += HDLINK_CNT;
+			retval = add_hardlink(hdlinks, st.st_dev, st.st_ino,
+					      ino);
+			if (retval) {
+				com_err(name, retval,
+					_("while saving inode data"));
+				goto out;
 			}
-			hdlinks->hdl[hdlinks->count].src_dev = st.st_dev;
-			hdlinks->hdl[hdlinks->count].src_ino = st.st_ino;
-			hdlinks->hdl[hdlinks->count].dst_ino = ino;
-			hdlinks->count++;
 		}
 		target->path_len = cur_dir_path_len;
 		target->path[target->path_len] = 0;
 	}
 
 out:
+	drain_copy_pipeline(pipe);
+	release_inode_batch(fs, &batch);
 	for (; i < num_dents; free(dent[i]), i++);
 	free(dent);
+	ext2fs_free_mem(&ds);
 	return retval;
 }
 
-errcode_t populate_fs2(ext2_filsys fs, ext2_ino_t parent_ino,
+/*
+ * As populate_fs2(), but if num_threads is not 1, the contents of
+ * regular files are read by that many threads (or one per CPU if
+ * num_threads is negative) while the filesystem is written from this
+ * one.  The resulting image is the same either way.  If flags has
+ * POPULATE_FS_LAYOUT_PLAN, the tree is scanned first so that the
+ * directories and file data can each be laid out together; this
+ * borrows fs->priv_data and the block allocator hook while the tree is
+ * copied, so it is skipped if the caller has either set.
+ */
+errcode_t populate_fs3(ext2_filsys fs, ext2_ino_t parent_ino,
 		       const char *source_dir, ext2_ino_t root,
-		       struct fs_ops_callbacks *fs_callbacks)
+		       struct fs_ops_callbacks *fs_callbacks, int num_threads,
+		       int flags)
 {
 	struct file_info file_info;
 	struct hdlinks_s hdlinks;
+	struct copy_pipeline *pipe;
+	struct layout_plan plan;
 	errcode_t retval;
+	int own_index = 0, planned = 0;
 
 	if (!(fs->flags & EXT2_FLAG_RW)) {
 		com_err(__func__, 0, "Filesystem opened readonly");
 		return EROFS;
 	}
 
-	hdlinks.count = 0;
-	hdlinks.size = HDLINK_CNT;
-	hdlinks.hdl = realloc(NULL, hdlinks.size * sizeof(struct hdlink_s));
-	if (hdlinks.hdl == NULL) {
-		retval = errno;
+	retval = init_hdlinks(&hdlinks);
+	if (retval) {
 		com_err(__func__, retval, _("while allocating memory"));
 		return retval;
 	}
@@ -1071,6 +2201,14 @@ errcode_t populate_fs2(ext2_filsys fs, ext2_ino_t parent_ino,
 	file_info.path_max_len = 255;
 	file_info.path = calloc(file_info.path_max_len, 1);
 
+	/*
+	 * Copying in a tree allocates a lot of blocks, so index the free
+	 * space unless the caller already has.  A failure here just
+	 * leaves the allocations to scan the bitmap.
+	 */
+	if (!fs->free_index && ext2fs_create_free_index(fs) == 0)
+		own_index = 1;
+
 	retval = set_inode_xattr(fs, root, source_dir);
 	if (retval) {
 		com_err(__func__, retval,
@@ -1078,15 +2216,35 @@ errcode_t populate_fs2(ext2_filsys fs, ext2_ino_t parent_ino,
 		goto out;
 	}
 
+	/* Laying out the image is an optimization too */
+	if ((flags & POPULATE_FS_LAYOUT_PLAN) &&
+	    start_layout_plan(fs, source_dir, &plan) == 0)
+		planned = 1;
+
+	pipe = init_copy_pipeline(fs, num_threads);
 	retval = __populate_fs(fs, parent_ino, source_dir, root, &hdlinks,
-			       &file_info, fs_callbacks);
+			       &file_info, fs_callbacks, pipe,
+			       planned ? &plan : NULL);
+	free_copy_pipeline(pipe);
+	if (planned)
+		end_layout_plan(fs, &plan);
 
 out:
+	if (own_index)
+		ext2fs_release_free_index(fs);
 	free(file_info.path);
-	free(hdlinks.hdl);
+	free_hdlinks(&hdlinks);
 	return retval;
 }
 
+errcode_t populate_fs2(ext2_filsys fs, ext2_ino_t parent_ino,
+		       const char *source_dir, ext2_ino_t root,
+		       struct fs_ops_callbacks *fs_callbacks)
+{
+	return populate_fs3(fs, parent_ino, source_dir, root, fs_callbacks, 1,
+			    0);
+}
+
 errcode_t populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 		      const char *source_dir, ext2_ino_t root)
 {
@@ -20,10 +20,19 @@ struct hdlinks_s
 	int count;
 	int size;
 	struct hdlink_s *hdl;
+	/* open-addressed index into hdl[], keyed on (src_dev, src_ino) */
+	unsigned int hash_size;
+	int *hash;
 };
 
 #define HDLINK_CNT	(4)
 
+struct inode_xattr {
+	const char	*name;
+	const void	*value;
+	size_t		value_len;
+};
+
 struct fs_ops_callbacks {
 	errcode_t (* create_new_inode)(ext2_filsys fs, const char *target_path,
 		const char *name, ext2_ino_t parent_ino, ext2_ino_t root,
@@ -36,12 +45,20 @@ struct fs_ops_callbacks {
 extern int no_copy_xattrs; 	/* this should eventually be a flag
 				   passed to populate_fs3() */
 
+/* Flags for populate_fs3() */
+#define POPULATE_FS_LAYOUT_PLAN	0x0001	/* lay out the directories and
+						   file data up front */
+
 /* For populating the filesystem */
 extern errcode_t populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 			     const char *source_dir, ext2_ino_t root);
 extern errcode_t populate_fs2(ext2_filsys fs, ext2_ino_t parent_ino,
 			      const char *source_dir, ext2_ino_t root,
 			      struct fs_ops_callbacks *fs_callbacks);
+extern errcode_t populate_fs3(ext2_filsys fs, ext2_ino_t parent_ino,
+			      const char *source_dir, ext2_ino_t root,
+			      struct fs_ops_callbacks *fs_callbacks,
+			      int num_threads, int flags);
 extern errcode_t do_mknod_internal(ext2_filsys fs, ext2_ino_t cwd,
 				   const char *name, unsigned int st_mode,
 				   unsigned int st_rdev);
@@ -53,5 +70,23 @@ extern errcode_t do_mkdir_internal(ext2_filsys fs, ext2_ino_t cwd,
 extern errcode_t do_write_internal(ext2_filsys fs, ext2_ino_t cwd,
 				   const char *src, const char *dest,
 				   ext2_ino_t root);
+extern errcode_t do_create_file_internal(ext2_filsys fs, ext2_ino_t cwd,
+					 const char *name, struct stat *st,
+					 ext2_ino_t root, ext2_ino_t *ino);
+extern errcode_t add_link(ext2_filsys fs, ext2_ino_t parent_ino,
+			  ext2_ino_t ino, const char *name);
+extern errcode_t set_inode_extra(ext2_filsys fs, ext2_ino_t ino,
+				 struct stat *st);
+extern errcode_t set_inode_xattrs(ext2_filsys fs, ext2_ino_t ino,
+				  struct inode_xattr *xattrs, int count);
+extern errcode_t init_hdlinks(struct hdlinks_s *hdlinks);
+extern void free_hdlinks(struct hdlinks_s *hdlinks);
+extern int is_hardlink(struct hdlinks_s *hdlinks, dev_t dev, ino_t ino);
+extern errcode_t add_hardlink(struct hdlinks_s *hdlinks, dev_t dev,
+			      ino_t ino, ext2_ino_t dst_ino);
+
+/* create_inode_archive.c */
+extern errcode_t populate_fs_archive(ext2_filsys fs, ext2_ino_t parent_ino,
+				     const char *archive, ext2_ino_t root);
 
 #endif /* _CREATE_INODE_H */
@@ -0,0 +1,1152 @@
+/*
+ * create_inode_archive.c --- populate a file system from a tar or cpio
+ * archive
+ *
+ * The archive is read sequentially, so it can come from a pipe, and each
+ * entry is created in the file system as soon as its header has been
+ * read.  Supported formats are POSIX ustar and pax, GNU tar and the SVR4
+ * "newc" cpio format.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#define _FILE_OFFSET_BITS       64
+#define _LARGEFILE64_SOURCE     1
+#define _GNU_SOURCE		1
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
+
+#include <ext2fs/ext2fs.h>
+
+#include "create_inode.h"
+#include "support/nls-enable.h"
+
+#define ARCHIVE_BUFLEN		65536
+#define TAR_BLOCK_SIZE		512
+#define CPIO_HDR_SIZE		110
+
+struct archive_ctx {
+	ext2_filsys	fs;
+	ext2_ino_t	parent_ino;
+	ext2_ino_t	root;
+	FILE		*f;
+	const char	*name;
+	char		*buf;
+	/* last directory looked up, as this is usually the next one too */
+	char		*dir_path;
+	ext2_ino_t	dir_ino;
+	/* cpio identifies hard links by their source inode numbers */
+	struct hdlinks_s hdlinks;
+};
+
+/* A run of data in a sparse file */
+struct sparse_seg {
+	__u64		off;
+	__u64		len;
+};
+
+struct archive_entry {
+	char		*path;
+	char		*link;		/* symlink target or hard link path */
+	int		hardlink;
+	ext2_ino_t	link_ino;	/* hard link target, if already known */
+	struct stat	st;
+	__u64		size;		/* bytes of data following the header */
+	__u64		consumed;	/* bytes of data read by add_entry() */
+	struct inode_xattr *xattrs;
+	int		nr_xattrs;
+	char		*xattr_buf;	/* holds the xattr names and values */
+	/* sparse files only store the runs listed here */
+	struct sparse_seg *sparse;
+	int		nr_sparse;
+	int		sparse_map_in_data;
+	__u64		realsize;
+};
+
+static errcode_t read_data(struct archive_ctx *ctx, void *buf, size_t len)
+{
+	if (len && fread(buf, len, 1, ctx->f) != 1) {
+		if (ferror(ctx->f))
+			return errno;
+		return EXT2_ET_SHORT_READ;
+	}
+	return 0;
+}
+
+static errcode_t skip_data(struct archive_ctx *ctx, __u64 len)
+{
+	size_t n;
+	errcode_t retval;
+
+	while (len) {
+		n = len < ARCHIVE_BUFLEN ? len : ARCHIVE_BUFLEN;
+		retval = read_data(ctx, ctx->buf, n);
+		if (retval)
+			return retval;
+		len -= n;
+	}
+	return 0;
+}
+
+static void free_entry(struct archive_entry *ent)
+{
+	free(ent->path);
+	free(ent->link);
+	free(ent->xattrs);
+	free(ent->xattr_buf);
+	free(ent->sparse);
+	memset(ent, 0, sizeof(*ent));
+}
+
+/* Strip any leading "/" and "./" and any trailing "/" from a path */
+static char *clean_path(char *path)
+{
+	size_t len;
+
+	while (1) {
+		if (path[0] == '/')
+			path++;
+		else if (path[0] == '.' && path[1] == '/')
+			path += 2;
+		else
+			break;
+	}
+	len = strlen(path);
+	while (len && path[len - 1] == '/')
+		path[--len] = 0;
+	if (strcmp(path, ".") == 0)
+		path[0] = 0;
+	return path;
+}
+
+/*
+ * Look up the directory path (relative to where the archive is being
+ * extracted), creating any parts of it which the archive hasn't.
+ */
+static errcode_t lookup_dir(struct archive_ctx *ctx, char *path,
+			    ext2_ino_t *ino)
+{
+	ext2_ino_t	dir, next;
+	char		*cp, *name;
+	errcode_t	retval;
+
+	if (ctx->dir_path && strcmp(ctx->dir_path, path) == 0) {
+		*ino = ctx->dir_ino;
+		return 0;
+	}
+
+	dir = ctx->parent_ino;
+	for (name = path; *name; name = cp) {
+		cp = strchr(name, '/');
+		if (cp)
+			*cp = 0;
+		retval = ext2fs_namei(ctx->fs, ctx->root, dir, name, &next);
+		if (retval == EXT2_ET_FILE_NOT_FOUND) {
+			retval = do_mkdir_internal(ctx->fs, dir, name,
+						   ctx->root);
+			if (retval == 0)
+				retval = ext2fs_namei(ctx->fs, ctx->root, dir,
+						      name, &next);
+		}
+		if (retval) {
+			com_err(__func__, retval,
+				_("while looking up \"%s\""), path);
+			return retval;
+		}
+		dir = next;
+		if (!cp)
+			break;
+		*cp++ = '/';
+	}
+
+	free(ctx->dir_path);
+	ctx->dir_path = strdup(path);
+	ctx->dir_ino = dir;
+	*ino = dir;
+	return 0;
+}
+
+static errcode_t entry_add_sparse(struct archive_entry *ent, __u64 off,
+				  __u64 len)
+{
+	void *p;
+
+	p = realloc(ent->sparse, (ent->nr_sparse + 1) *
+		    sizeof(struct sparse_seg));
+	if (!p)
+		return EXT2_ET_NO_MEMORY;
+	ent->sparse = p;
+	ent->sparse[ent->nr_sparse].off = off;
+	ent->sparse[ent->nr_sparse].len = len;
+	ent->nr_sparse++;
+	return 0;
+}
+
+/*
+ * Read one newline terminated decimal number from the sparse map at the
+ * start of a pax 1.0 sparse file's data.
+ */
+static errcode_t sparse_map_number(struct archive_ctx *ctx,
+				   struct archive_entry *ent, char *blk,
+				   int *pos, __u64 *ret)
+{
+	__u64 val = 0;
+	int digits = 0;
+	errcode_t retval;
+
+	while (1) {
+		if (*pos == TAR_BLOCK_SIZE) {
+			if (ent->consumed + TAR_BLOCK_SIZE > ent->size)
+				return EXT2_ET_INVALID_ARGUMENT;
+			retval = read_data(ctx, blk, TAR_BLOCK_SIZE);
+			if (retval)
+				return retval;
+			ent->consumed += TAR_BLOCK_SIZE;
+			*pos = 0;
+		}
+		if (blk[*pos] == '\n')
+			break;
+		if (blk[*pos] < '0' || blk[*pos] > '9' || ++digits > 20)
+			return EXT2_ET_INVALID_ARGUMENT;
+		val = val * 10 + blk[(*pos)++] - '0';
+	}
+	(*pos)++;
+	if (!digits)
+		return EXT2_ET_INVALID_ARGUMENT;
+	*ret = val;
+	return 0;
+}
+
+static errcode_t read_sparse_map(struct archive_ctx *ctx,
+				 struct archive_entry *ent)
+{
+	char blk[TAR_BLOCK_SIZE];
+	int pos = TAR_BLOCK_SIZE;
+	__u64 count, off, len;
+	errcode_t retval;
+
+	retval = sparse_map_number(ctx, ent, blk, &pos, &count);
+	while (retval == 0 && count--) {
+		retval = sparse_map_number(ctx, ent, blk, &pos, &off);
+		if (retval == 0)
+			retval = sparse_map_number(ctx, ent, blk, &pos, &len);
+		if (retval == 0)
+			retval = entry_add_sparse(ent, off, len);
+	}
+	return retval;
+}
+
+/*
+ * Read the file data for ent from the archive into the inode.  The whole
+ * blocks of each run of data are allocated up front, in as few extents
+ * as possible, before the data is written; partial blocks at either end
+ * of a run are left to ext2fs_file_write(), which zeroes the rest of
+ * them.  The gaps between runs of a sparse file are left as holes.
+ */
+static errcode_t write_entry_data(struct archive_ctx *ctx, ext2_ino_t ino,
+				  struct archive_entry *ent)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct sparse_seg whole, *seg;
+	struct ext2_inode inode;
+	ext2_file_t	e2_file;
+	unsigned int	written;
+	blk64_t		start, end;
+	__u64		left, data;
+	size_t		n;
+	char		*ptr;
+	errcode_t	retval, close_retval;
+	int		i, nr_segs;
+
+	if (ent->sparse_map_in_data) {
+		retval = read_sparse_map(ctx, ent);
+		if (retval)
+			return retval;
+	}
+	if (ent->nr_sparse || ent->sparse_map_in_data) {
+		seg = ent->sparse;
+		nr_segs = ent->nr_sparse;
+	} else {
+		whole.off = 0;
+		whole.len = ent->size;
+		seg = &whole;
+		nr_segs = 1;
+	}
+
+	/* Check the runs before allocating anything for them */
+	for (i = 0, data = ent->consumed; i < nr_segs; i++) {
+		if (seg[i].len > ent->size - data ||
+		    seg[i].off > ent->realsize ||
+		    seg[i].len > ent->realsize - seg[i].off)
+			return EXT2_ET_INVALID_ARGUMENT;
+		data += seg[i].len;
+	}
+
+	retval = ext2fs_read_inode(fs, ino, &inode);
+	if (retval)
+		return retval;
+	retval = ext2fs_inode_size_set(fs, &inode, ent->realsize);
+	if (retval)
+		return retval;
+	retval = ext2fs_write_inode(fs, ino, &inode);
+	if (retval)
+		return retval;
+
+	if (inode.i_flags & EXT4_EXTENTS_FL) {
+		for (i = 0; i < nr_segs; i++) {
+			start = (seg[i].off + fs->blocksize - 1) /
+				fs->blocksize;
+			end = (seg[i].off + seg[i].len) / fs->blocksize;
+			if (end <= start)
+				continue;
+			retval = ext2fs_fallocate(fs,
+					EXT2_FALLOCATE_FORCE_INIT |
+					EXT2_FALLOCATE_WILL_OVERWRITE,
+					ino, NULL, ~0ULL, start, end - start);
+			if (retval)
+				return retval;
+		}
+	}
+
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &e2_file);
+	if (retval)
+		return retval;
+	for (i = 0; i < nr_segs; i++) {
+		retval = ext2fs_file_llseek(e2_file, seg[i].off,
+					    EXT2_SEEK_SET, NULL);
+		if (retval)
+			goto out;
+		for (left = seg[i].len; left; left -= n) {
+			n = left < ARCHIVE_BUFLEN ? left : ARCHIVE_BUFLEN;
+			retval = read_data(ctx, ctx->buf, n);
+			if (retval)
+				goto out;
+			ent->consumed += n;
+			for (ptr = ctx->buf; n; n -= written, ptr += written) {
+				retval = ext2fs_file_write(e2_file, ptr, n,
+							   &written);
+				if (retval)
+					goto out;
+				if (written == 0) {
+					retval = EIO;
+					goto out;
+				}
+			}
+			n = ptr - ctx->buf;
+		}
+	}
+out:
+	close_retval = ext2fs_file_close(e2_file);
+	if (retval == 0)
+		retval = close_retval;
+	return retval;
+}
+
+/* Create the file system object for an archive entry */
+static errcode_t add_entry(struct archive_ctx *ctx, struct archive_entry *ent,
+			   ext2_ino_t *ret_ino)
+{
+	ext2_filsys	fs = ctx->fs;
+	ext2_ino_t	dir, ino;
+	char		*path, *name;
+	errcode_t	retval;
+
+	*ret_ino = 0;
+	path = clean_path(ent->path);
+	if (!*path)
+		return 0;	/* the root directory itself */
+
+	name = strrchr(path, '/');
+	if (name) {
+		*name++ = 0;
+		retval = lookup_dir(ctx, path, &dir);
+		if (retval)
+			return retval;
+	} else {
+		name = path;
+		dir = ctx->parent_ino;
+	}
+
+	if (ext2fs_namei(fs, ctx->root, dir, name, &ino) == 0) {
+		if (!S_ISDIR(ent->st.st_mode)) {
+			retval = EXT2_ET_FILE_EXISTS;
+			com_err(__func__, retval,
+				_("while creating \"%s\""), name);
+			return retval;
+		}
+	} else
+		ino = 0;
+
+	if (ent->hardlink) {
+		if (!ent->link_ino) {
+			retval = ext2fs_namei(fs, ctx->root, ctx->parent_ino,
+					      clean_path(ent->link),
+					      &ent->link_ino);
+			if (retval) {
+				com_err(__func__, retval,
+					_("while looking up \"%s\""),
+					ent->link);
+				return retval;
+			}
+		}
+		retval = add_link(fs, dir, ent->link_ino, name);
+		if (retval)
+			return retval;
+		*ret_ino = ent->link_ino;
+		/* cpio stores the data with one of the links */
+		if (ent->size && S_ISREG(ent->st.st_mode)) {
+			retval = write_entry_data(ctx, ent->link_ino, ent);
+			if (retval) {
+				com_err(__func__, retval,
+					_("while writing file \"%s\""), name);
+				return retval;
+			}
+		}
+		return 0;
+	}
+
+	switch (ent->st.st_mode & S_IFMT) {
+	case S_IFDIR:
+		if (ino)
+			break;
+		retval = do_mkdir_internal(fs, dir, name, ctx->root);
+		if (retval)
+			return retval;
+		break;
+	case S_IFREG:
+		ent->st.st_size = ent->realsize;
+		retval = do_create_file_internal(fs, dir, name, &ent->st,
+						 ctx->root, &ino);
+		if (retval == 0)
+			retval = write_entry_data(ctx, ino, ent);
+		if (retval) {
+			com_err(__func__, retval,
+				_("while writing file \"%s\""), name);
+			return retval;
+		}
+		break;
+	case S_IFLNK:
+		if (!ent->link) {
+			retval = EXT2_ET_INVALID_ARGUMENT;
+			com_err(__func__, retval,
+				_("while creating symlink \"%s\""), name);
+			return retval;
+		}
+		retval = do_symlink_internal(fs, dir, name, ent->link,
+					     ctx->root);
+		if (retval)
+			return retval;
+		break;
+#ifndef _WIN32
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFIFO:
+	case S_IFSOCK:
+		retval = do_mknod_internal(fs, dir, name, ent->st.st_mode,
+					   ent->st.st_rdev);
+		if (retval) {
+			com_err(__func__, retval,
+				_("while creating special file \"%s\""),
+				name);
+			return retval;
+		}
+		break;
+#endif
+	default:
+		com_err(__func__, 0, _("ignoring entry \"%s\""), name);
+		return 0;
+	}
+
+	retval = ext2fs_namei(fs, ctx->root, dir, name, &ino);
+	if (retval) {
+		com_err(name, retval, _("while looking up \"%s\""), name);
+		return retval;
+	}
+
+	retval = set_inode_extra(fs, ino, &ent->st);
+	if (retval) {
+		com_err(__func__, retval,
+			_("while setting inode for \"%s\""), name);
+		return retval;
+	}
+
+	retval = set_inode_xattrs(fs, ino, ent->xattrs, ent->nr_xattrs);
+	if (retval) {
+		com_err(__func__, retval,
+			_("while setting xattrs for \"%s\""), name);
+		return retval;
+	}
+	*ret_ino = ino;
+	return 0;
+}
+
+/*
+ * Parse a numeric tar header field, which is either octal or, for
+ * values which don't fit, big-endian base-256 flagged by the top bit of
+ * the first byte.
+ */
+static int tar_number(const char *field, int len, __u64 *ret)
+{
+	const unsigned char *p = (const unsigned char *) field;
+	__u64 val = 0;
+	int i;
+
+	if (p[0] & 0x80) {
+		if (p[0] != 0x80)
+			return -1;	/* negative, or too large */
+		for (i = 1; i < len; i++)
+			val = (val << 8) | p[i];
+		*ret = val;
+		return 0;
+	}
+	for (i = 0; i < len && p[i] == ' '; i++)
+		;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+		val = (val << 3) | (p[i] - '0');
+	if (i < len && p[i] != ' ' && p[i] != 0)
+		return -1;
+	*ret = val;
+	return 0;
+}
+
+static int tar_checksum_ok(const unsigned char *hdr)
+{
+	unsigned long usum = 0;
+	long ssum = 0;
+	__u64 sum;
+	int i;
+
+	if (tar_number((const char *) hdr + 148, 8, &sum))
+		return 0;
+	for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+		unsigned char c = (i >= 148 && i < 156) ? ' ' : hdr[i];
+
+		usum += c;
+		ssum += (signed char) c;
+	}
+	/* Some old tars summed the header as signed chars */
+	return sum == usum || (long long) sum == ssum;
+}
+
+static char *tar_string(const char *field, int len)
+{
+	return strndup(field, len);
+}
+
+/* Append one xattr; the name and value are copied */
+static errcode_t entry_add_xattr(struct archive_entry *ent, const char *name,
+				 size_t name_len, const char *value,
+				 size_t value_len)
+{
+	size_t		used = 0;
+	char		*buf;
+	void		*p;
+	int		i;
+
+	for (i = 0; i < ent->nr_xattrs; i++)
+		used += strlen(ent->xattrs[i].name) + 1 +
+			ent->xattrs[i].value_len;
+
+	p = realloc(ent->xattrs, (ent->nr_xattrs + 1) *
+		    sizeof(struct inode_xattr));
+	if (!p)
+		return EXT2_ET_NO_MEMORY;
+	ent->xattrs = p;
+	buf = realloc(ent->xattr_buf, used + name_len + 1 + value_len);
+	if (!buf)
+		return EXT2_ET_NO_MEMORY;
+
+	/* The buffer may have moved, so repoint the existing entries */
+	for (used = 0, i = 0; i < ent->nr_xattrs; i++) {
+		ent->xattrs[i].name = buf + used;
+		used += strlen(buf + used) + 1;
+		ent->xattrs[i].value = buf + used;
+		used += ent->xattrs[i].value_len;
+	}
+	ent->xattr_buf = buf;
+
+	memcpy(buf + used, name, name_len);
+	buf[used + name_len] = 0;
+	ent->xattrs[i].name = buf + used;
+	used += name_len + 1;
+	memcpy(buf + used, value, value_len);
+	ent->xattrs[i].value = buf + used;
+	ent->xattrs[i].value_len = value_len;
+	ent->nr_xattrs++;
+	return 0;
+}
+
+/*
+ * Old GNU sparse files list their runs of data in the header, and in
+ * extension blocks that follow it when there are more than four.
+ */
+static errcode_t tar_gnu_sparse(struct archive_ctx *ctx, unsigned char *hdr,
+				struct archive_entry *ent)
+{
+	unsigned char ext[TAR_BLOCK_SIZE];
+	unsigned char *sp = hdr + 386;
+	int i, nr = 4, extended = hdr[482];
+	__u64 off, len;
+	errcode_t retval;
+
+	if (tar_number((char *) hdr + 483, 12, &ent->realsize))
+		return EXT2_ET_INVALID_ARGUMENT;
+	while (1) {
+		for (i = 0; i < nr && sp[i * 24]; i++) {
+			if (tar_number((char *) sp + i * 24, 12, &off) ||
+			    tar_number((char *) sp + i * 24 + 12, 12, &len))
+				return EXT2_ET_INVALID_ARGUMENT;
+			retval = entry_add_sparse(ent, off, len);
+			if (retval)
+				return retval;
+		}
+		if (!extended)
+			break;
+		retval = read_data(ctx, ext, TAR_BLOCK_SIZE);
+		if (retval)
+			return retval;
+		sp = ext;
+		nr = 21;
+		extended = ext[504];
+	}
+	/* Mark the file sparse even if it is all hole */
+	return entry_add_sparse(ent, ent->realsize, 0);
+}
+
+/* Bits of a pax extended header which override the next tar header */
+#define PAX_PATH	0x01
+#define PAX_LINK	0x02
+#define PAX_SIZE	0x04
+#define PAX_UID		0x08
+#define PAX_GID		0x10
+#define PAX_MTIME	0x20
+#define PAX_SPARSE	0x40
+
+/*
+ * Parse the "length keyword=value\n" records of a pax extended header
+ * into ent.  Returns the PAX_* bits for the fields it set.
+ */
+static int parse_pax(struct archive_ctx *ctx, char *data, size_t len,
+		     struct archive_entry *ent, errcode_t *ret)
+{
+	char		*rec, *key, *value, *end;
+	unsigned long	rec_len;
+	size_t		value_len;
+	int		set = 0;
+
+	*ret = 0;
+	for (rec = data; rec < data + len; rec += rec_len) {
+		rec_len = strtoul(rec, &key, 10);
+		if (rec_len == 0 || *key != ' ' ||
+		    rec_len > (size_t) (data + len - rec) ||
+		    rec[rec_len - 1] != '\n')
+			goto bad;
+		key++;
+		end = rec + rec_len - 1;
+		value = memchr(key, '=', end - key);
+		if (!value)
+			goto bad;
+		*value++ = 0;
+		value_len = end - value;
+		*end = 0;
+
+		if (!strcmp(key, "path")) {
+			free(ent->path);
+			ent->path = strdup(value);
+			set |= PAX_PATH;
+		} else if (!strcmp(key, "linkpath")) {
+			free(ent->link);
+			ent->link = strdup(value);
+			set |= PAX_LINK;
+		} else if (!strcmp(key, "size")) {
+			ent->size = strtoull(value, NULL, 10);
+			set |= PAX_SIZE;
+		} else if (!strcmp(key, "uid")) {
+			ent->st.st_uid = strtoul(value, NULL, 10);
+			set |= PAX_UID;
+		} else if (!strcmp(key, "gid")) {
+			ent->st.st_gid = strtoul(value, NULL, 10);
+			set |= PAX_GID;
+		} else if (!strcmp(key, "mtime")) {
+			ent->st.st_mtime = strtoll(value, NULL, 10);
+			set |= PAX_MTIME;
+		} else if (!strcmp(key, "atime")) {
+			ent->st.st_atime = strtoll(value, NULL, 10);
+		} else if (!strcmp(key, "ctime")) {
+			ent->st.st_ctime = strtoll(value, NULL, 10);
+		} else if (!strcmp(key, "GNU.sparse.name")) {
+			free(ent->path);
+			ent->path = strdup(value);
+			set |= PAX_PATH;
+		} else if (!strcmp(key, "GNU.sparse.realsize") ||
+			   !strcmp(key, "GNU.sparse.size")) {
+			ent->realsize = strtoull(value, NULL, 10);
+			set |= PAX_SPARSE;
+		} else if (!strcmp(key, "GNU.sparse.major")) {
+			ent->sparse_map_in_data = strtoul(value, NULL, 10) == 1;
+			set |= PAX_SPARSE;
+		} else if (!strcmp(key, "GNU.sparse.offset")) {
+			/* format 0.0: the runs are listed one by one */
+			*ret = entry_add_sparse(ent, strtoull(value, NULL, 10),
+						0);
+			if (*ret)
+				return set;
+			set |= PAX_SPARSE;
+		} else if (!strcmp(key, "GNU.sparse.numbytes")) {
+			if (!ent->nr_sparse)
+				goto bad;
+			ent->sparse[ent->nr_sparse - 1].len =
+				strtoull(value, NULL, 10);
+		} else if (!strcmp(key, "GNU.sparse.map")) {
+			/* format 0.1: "offset,size,offset,size..." */
+			char *cp = value;
+
+			while (*cp) {
+				__u64 off, len;
+
+				off = strtoull(cp, &cp, 10);
+				if (*cp++ != ',')
+					goto bad;
+				len = strtoull(cp, &cp, 10);
+				if (*cp && *cp++ != ',')
+					goto bad;
+				*ret = entry_add_sparse(ent, off, len);
+				if (*ret)
+					return set;
+			}
+			set |= PAX_SPARSE;
+		} else if (!strncmp(key, "SCHILY.xattr.", 13)) {
+			*ret = entry_add_xattr(ent, key + 13, strlen(key + 13),
+					       value, value_len);
+			if (*ret)
+				return set;
+		}
+	}
+	return set;
+bad:
+	*ret = EXT2_ET_INVALID_ARGUMENT;
+	com_err(ctx->name, *ret, "%s", _("while parsing pax header"));
+	return set;
+}
+
+/* Read a whole metadata entry (pax header or GNU long name) into memory */
+static errcode_t tar_read_meta(struct archive_ctx *ctx, __u64 size,
+			       char **ret)
+{
+	errcode_t retval;
+	char *data;
+
+	if (size > 16 * 1024 * 1024)
+		return EXT2_ET_INVALID_ARGUMENT;
+	data = malloc(size + 1);
+	if (!data)
+		return EXT2_ET_NO_MEMORY;
+	retval = read_data(ctx, data, size);
+	if (retval == 0)
+		retval = skip_data(ctx, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE)
+				   % TAR_BLOCK_SIZE);
+	if (retval) {
+		free(data);
+		return retval;
+	}
+	data[size] = 0;
+	*ret = data;
+	return 0;
+}
+
+static errcode_t read_tar(struct archive_ctx *ctx, unsigned char *hdr)
+{
+	struct archive_entry ent;
+	int		pax_set = 0;
+	char		*long_name = NULL, *long_link = NULL, *data;
+	__u64		val, size;
+	ext2_ino_t	ino;
+	errcode_t	retval = 0;
+	int		i, posix;
+
+	memset(&ent, 0, sizeof(ent));
+	while (1) {
+		for (i = 0; i < TAR_BLOCK_SIZE && hdr[i] == 0; i++)
+			;
+		if (i == TAR_BLOCK_SIZE)
+			break;	/* end of archive */
+		if (!tar_checksum_ok(hdr) ||
+		    tar_number((char *) hdr + 124, 12, &size)) {
+			retval = EXT2_ET_INVALID_ARGUMENT;
+			com_err(ctx->name, retval, "%s",
+				_("while reading tar header"));
+			goto out;
+		}
+		if (pax_set & PAX_SIZE)
+			size = ent.size;
+
+		switch (hdr[156]) {
+		case 'x':		/* pax header for the next entry */
+			retval = tar_read_meta(ctx, size, &data);
+			if (retval)
+				goto out;
+			pax_set |= parse_pax(ctx, data, size, &ent, &retval);
+			free(data);
+			if (retval)
+				goto out;
+			goto next;
+		case 'g':		/* pax global header */
+		case 'V':		/* GNU volume label */
+			retval = skip_data(ctx, (size + TAR_BLOCK_SIZE - 1) &
+					   ~(__u64) (TAR_BLOCK_SIZE - 1));
+			if (retval)
+				goto out;
+			goto next;
+		case 'L':		/* GNU long name for the next entry */
+			free(long_name);
+			long_name = NULL;
+			retval = tar_read_meta(ctx, size, &long_name);
+			if (retval)
+				goto out;
+			goto next;
+		case 'K':		/* GNU long link name */
+			free(long_link);
+			long_link = NULL;
+			retval = tar_read_meta(ctx, size, &long_link);
+			if (retval)
+				goto out;
+			goto next;
+		}
+
+		/* Only POSIX ustar has a file name prefix field */
+		posix = memcmp(hdr + 257, "ustar\0", 6) == 0;
+		if (!(pax_set & PAX_PATH)) {
+			if (long_name) {
+				ent.path = long_name;
+				long_name = NULL;
+			} else if (posix && hdr[345]) {
+				char *prefix = tar_string((char *) hdr + 345,
+							  155);
+				char *name = tar_string((char *) hdr, 100);
+
+				if (prefix && name &&
+				    asprintf(&ent.path, "%s/%s", prefix,
+					     name) < 0)
+					ent.path = NULL;
+				free(prefix);
+				free(name);
+			} else
+				ent.path = tar_string((char *) hdr, 100);
+		}
+		if (!(pax_set & PAX_LINK)) {
+			if (long_link) {
+				ent.link = long_link;
+				long_link = NULL;
+			} else if (hdr[157])
+				ent.link = tar_string((char *) hdr + 157, 100);
+		}
+		if (!ent.path) {
+			retval = EXT2_ET_NO_MEMORY;
+			goto out;
+		}
+
+		tar_number((char *) hdr + 100, 8, &val);
+		ent.st.st_mode = val & 07777;
+		if (!(pax_set & PAX_UID) &&
+		    tar_number((char *) hdr + 108, 8, &val) == 0)
+			ent.st.st_uid = val;
+		if (!(pax_set & PAX_GID) &&
+		    tar_number((char *) hdr + 116, 8, &val) == 0)
+			ent.st.st_gid = val;
+		if (!(pax_set & PAX_MTIME) &&
+		    tar_number((char *) hdr + 136, 12, &val) == 0)
+			ent.st.st_mtime = val;
+		if (!ent.st.st_atime)
+			ent.st.st_atime = ent.st.st_mtime;
+		if (!ent.st.st_ctime)
+			ent.st.st_ctime = ent.st.st_mtime;
+		ent.size = size;
+		if (!(pax_set & PAX_SPARSE))
+			ent.realsize = size;
+		else if (!ent.sparse_map_in_data) {
+			/* Mark the file sparse even if it is all hole */
+			retval = entry_add_sparse(&ent, ent.realsize, 0);
+			if (retval)
+				goto out;
+		}
+
+		switch (hdr[156]) {
+		case '0':
+		case '\0':
+		case '7':		/* contiguous file */
+			ent.st.st_mode |= S_IFREG;
+			break;
+		case 'S':		/* old GNU sparse file */
+			ent.st.st_mode |= S_IFREG;
+			retval = tar_gnu_sparse(ctx, hdr, &ent);
+			if (retval)
+				goto out;
+			break;
+		case '1':
+			ent.st.st_mode |= S_IFREG;
+			ent.hardlink = 1;
+			break;
+		case '2':
+			ent.st.st_mode |= S_IFLNK;
+			break;
+		case '3':
+		case '4':
+			ent.st.st_mode |= hdr[156] == '3' ? S_IFCHR : S_IFBLK;
+			{
+				__u64 maj = 0, min = 0;
+
+				tar_number((char *) hdr + 329, 8, &maj);
+				tar_number((char *) hdr + 337, 8, &min);
+				ent.st.st_rdev = makedev(maj, min);
+			}
+			break;
+		case '5':
+			ent.st.st_mode |= S_IFDIR;
+			break;
+		case '6':
+			ent.st.st_mode |= S_IFIFO;
+			break;
+		default:
+			com_err(ctx->name, 0,
+				_("ignoring entry \"%s\" of tar type '%c'"),
+				ent.path, hdr[156]);
+			break;
+		}
+
+		if (ent.st.st_mode & S_IFMT) {
+			retval = add_entry(ctx, &ent, &ino);
+			if (retval)
+				goto out;
+		}
+		retval = skip_data(ctx, ((size + TAR_BLOCK_SIZE - 1) &
+					 ~(__u64) (TAR_BLOCK_SIZE - 1)) -
+				   ent.consumed);
+		if (retval)
+			goto out;
+		free_entry(&ent);
+		pax_set = 0;
+	next:
+		retval = read_data(ctx, hdr, TAR_BLOCK_SIZE);
+		if (retval == EXT2_ET_SHORT_READ && feof(ctx->f)) {
+			retval = 0;	/* missing end-of-archive marker */
+			break;
+		}
+		if (retval)
+			goto out;
+	}
+out:
+	free(long_name);
+	free(long_link);
+	free_entry(&ent);
+	return retval;
+}
+
+static int cpio_field(const char *hdr, int field, unsigned long *ret)
+{
+	char buf[9], *end;
+
+	memcpy(buf, hdr + 6 + field * 8, 8);
+	buf[8] = 0;
+	*ret = strtoul(buf, &end, 16);
+	return *end ? -1 : 0;
+}
+
+enum { CPIO_INO, CPIO_MODE, CPIO_UID, CPIO_GID, CPIO_NLINK, CPIO_MTIME,
+       CPIO_FILESIZE, CPIO_DEVMAJOR, CPIO_DEVMINOR, CPIO_RDEVMAJOR,
+       CPIO_RDEVMINOR, CPIO_NAMESIZE, CPIO_CHECK, CPIO_NR_FIELDS };
+
+static errcode_t read_cpio(struct archive_ctx *ctx, char *hdr)
+{
+	struct archive_entry ent;
+	unsigned long	f[CPIO_NR_FIELDS];
+	ext2_ino_t	ino;
+	dev_t		dev;
+	errcode_t	retval = 0;
+	int		i, link;
+
+	memset(&ent, 0, sizeof(ent));
+	while (1) {
+		if (memcmp(hdr, "07070", 5) || (hdr[5] != '1' && hdr[5] != '2'))
+			goto bad;
+		for (i = 0; i < CPIO_NR_FIELDS; i++)
+			if (cpio_field(hdr, i, &f[i]))
+				goto bad;
+		if (f[CPIO_NAMESIZE] == 0 || f[CPIO_NAMESIZE] > PATH_MAX)
+			goto bad;
+
+		ent.path = malloc(f[CPIO_NAMESIZE]);
+		if (!ent.path) {
+			retval = EXT2_ET_NO_MEMORY;
+			goto out;
+		}
+		retval = read_data(ctx, ent.path, f[CPIO_NAMESIZE]);
+		if (retval == 0)
+			retval = skip_data(ctx, (4 - (CPIO_HDR_SIZE +
+					f[CPIO_NAMESIZE]) % 4) % 4);
+		if (retval)
+			goto out;
+		ent.path[f[CPIO_NAMESIZE] - 1] = 0;
+		if (strcmp(ent.path, "TRAILER!!!") == 0)
+			break;
+
+		ent.st.st_mode = f[CPIO_MODE];
+		ent.st.st_uid = f[CPIO_UID];
+		ent.st.st_gid = f[CPIO_GID];
+		ent.st.st_nlink = f[CPIO_NLINK];
+		ent.st.st_atime = ent.st.st_mtime = ent.st.st_ctime =
+			f[CPIO_MTIME];
+		ent.st.st_rdev = makedev(f[CPIO_RDEVMAJOR],
+					 f[CPIO_RDEVMINOR]);
+		ent.size = ent.realsize = f[CPIO_FILESIZE];
+
+		/* A symlink's target is stored as its data */
+		if (S_ISLNK(ent.st.st_mode)) {
+			if (ent.size > PATH_MAX)
+				goto bad;
+			ent.link = malloc(ent.size + 1);
+			if (!ent.link) {
+				retval = EXT2_ET_NO_MEMORY;
+				goto out;
+			}
+			retval = read_data(ctx, ent.link, ent.size);
+			if (retval)
+				goto out;
+			ent.link[ent.size] = 0;
+			ent.consumed = ent.size;
+		}
+
+		/*
+		 * All the links to a file share its inode number, and
+		 * (usually) only the last carries the data.
+		 */
+		link = -1;
+		dev = makedev(f[CPIO_DEVMAJOR], f[CPIO_DEVMINOR]);
+		if (!S_ISDIR(ent.st.st_mode) && ent.st.st_nlink > 1) {
+			link = is_hardlink(&ctx->hdlinks, dev, f[CPIO_INO]);
+			if (link >= 0) {
+				ent.hardlink = 1;
+				ent.link_ino = ctx->hdlinks.hdl[link].dst_ino;
+			}
+		}
+
+		retval = add_entry(ctx, &ent, &ino);
+		if (retval)
+			goto out;
+		if (link < 0 && ino && !S_ISDIR(ent.st.st_mode) &&
+		    ent.st.st_nlink > 1) {
+			retval = add_hardlink(&ctx->hdlinks, dev, f[CPIO_INO],
+					      ino);
+			if (retval)
+				goto out;
+		}
+
+		retval = skip_data(ctx, ent.size - ent.consumed +
+				   (4 - ent.size % 4) % 4);
+		if (retval)
+			goto out;
+		free_entry(&ent);
+
+		retval = read_data(ctx, hdr, CPIO_HDR_SIZE);
+		if (retval)
+			goto out;
+	}
+out:
+	free_entry(&ent);
+	return retval;
+bad:
+	retval = EXT2_ET_INVALID_ARGUMENT;
+	com_err(ctx->name, retval, "%s", _("while reading cpio header"));
+	goto out;
+}
+
+/*
+ * Populate the file system from a tar or cpio archive, read from stdin
+ * if archive is "-".
+ */
+errcode_t populate_fs_archive(ext2_filsys fs, ext2_ino_t parent_ino,
+			      const char *archive, ext2_ino_t root)
+{
+	struct archive_ctx ctx;
+	unsigned char	hdr[TAR_BLOCK_SIZE];
+	errcode_t	retval;
+	int		own_index = 0;
+
+	if (!(fs->flags & EXT2_FLAG_RW)) {
+		com_err(__func__, 0, "Filesystem opened readonly");
+		return EROFS;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fs = fs;
+	ctx.parent_ino = parent_ino;
+	ctx.root = root;
+	ctx.name = strcmp(archive, "-") ? archive : _("standard input");
+	ctx.f = strcmp(archive, "-") ? fopen(archive, "r") : stdin;
+	if (!ctx.f) {
+		retval = errno;
+		com_err(__func__, retval, _("while opening \"%s\""), archive);
+		return retval;
+	}
+	retval = init_hdlinks(&ctx.hdlinks);
+	if (retval == 0)
+		retval = ext2fs_get_mem(ARCHIVE_BUFLEN, &ctx.buf);
+	if (retval) {
+		com_err(__func__, retval, _("while allocating memory"));
+		goto out;
+	}
+
+	if (!fs->free_index && ext2fs_create_free_index(fs) == 0)
+		own_index = 1;
+
+	/* The shortest header is the 110 byte cpio one */
+	retval = read_data(&ctx, hdr, CPIO_HDR_SIZE);
+	if (retval) {
+		com_err(__func__, retval, _("while reading \"%s\""),
+			ctx.name);
+		goto out;
+	}
+	if ((hdr[0] == 0x1f && hdr[1] == 0x8b) ||	/* gzip */
+	    (hdr[0] == 'B' && hdr[1] == 'Z' && hdr[2] == 'h') ||
+	    (hdr[0] == 0xfd && !memcmp(hdr + 1, "7zXZ", 4)) ||
+	    (hdr[0] == 0x28 && hdr[1] == 0xb5 && hdr[2] == 0x2f &&
+	     hdr[3] == 0xfd)) {				/* zstd */
+		retval = EXT2_ET_UNIMPLEMENTED;
+		com_err(__func__, retval, _("\"%s\" is compressed; "
+			"decompress it into mke2fs's standard input instead"),
+			ctx.name);
+		goto out;
+	}
+	if (!memcmp(hdr, "07070", 5)) {
+		retval = read_cpio(&ctx, (char *) hdr);
+	} else {
+		retval = read_data(&ctx, hdr + CPIO_HDR_SIZE,
+				   TAR_BLOCK_SIZE - CPIO_HDR_SIZE);
+		if (retval == 0)
+			retval = read_tar(&ctx, hdr);
+	}
+	if (retval == EXT2_ET_SHORT_READ)
+		com_err(__func__, retval, _("while reading \"%s\""),
+			ctx.name);
+
+out:
+	if (own_index)
+		ext2fs_release_free_index(fs);
+	if (ctx.f != stdin)
+		fclose(ctx.f);
+	ext2fs_free_mem(&ctx.buf);
+	free(ctx.dir_path);
+	free_hdlinks(&ctx.hdlinks);
+	return retval;
+}
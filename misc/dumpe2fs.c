@@ -38,6 +38,8 @@ extern int optind;
 #include "ext2fs/ext2fs.h"
 #include "e2p/e2p.h"
 #include "ext2fs/kernel-jbd.h"
+#include "ext2fs/zimage.h"
+#include "ext2fs/qcow2.h"
 #include <uuid/uuid.h>
 
 #include "support/nls-enable.h"
@@ -600,6 +602,7 @@ int main (int argc, char ** argv)
 	int		header_only = 0;
 	int		c;
 	int		grp_only = 0;
+	io_manager	io_ptr = unix_io_manager;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -675,13 +678,19 @@ int main (int argc, char ** argv)
 
 	device_name = argv[optind++];
 	flags = EXT2_FLAG_JOURNAL_DEV_OK | EXT2_FLAG_SOFTSUPP_FEATURES |
-		EXT2_FLAG_64BITS | EXT2_FLAG_THREADS;
+		EXT2_FLAG_64BITS | EXT2_FLAG_THREADS | EXT2_FLAG_LAZY_GDT;
 	if (force)
 		flags |= EXT2_FLAG_FORCE;
 	if (image_dump)
 		flags |= EXT2_FLAG_IMAGE_FILE;
 	if (header_only)
 		flags |= EXT2_FLAG_SUPER_ONLY;
+	if (!image_dump) {
+		if (ext2fs_zimage_probe(device_name, NULL))
+			io_ptr = zimage_io_manager;
+		else if (ext2fs_qcow2_probe(device_name, NULL))
+			io_ptr = qcow2_io_manager;
+	}
 try_open_again:
 	if (use_superblock && !use_blocksize) {
 		for (use_blocksize = EXT2_MIN_BLOCK_SIZE;
@@ -689,14 +698,13 @@ try_open_again:
 		     use_blocksize *= 2) {
 			retval = ext2fs_open (device_name, flags,
 					      use_superblock,
-					      use_blocksize, unix_io_manager,
-					      &fs);
+					      use_blocksize, io_ptr, &fs);
 			if (!retval)
 				break;
 		}
 	} else {
 		retval = ext2fs_open(device_name, flags, use_superblock,
-				     use_blocksize, unix_io_manager, &fs);
+				     use_blocksize, io_ptr, &fs);
 	}
 	flags |= EXT2_FLAG_IGNORE_CSUM_ERRORS;
 	if (retval && !retval_csum) {
@@ -715,6 +723,27 @@ try_open_again:
 	fs->default_bitmap_type = EXT2FS_BMAP64_RBTREE;
 	if (ext2fs_has_feature_64bit(fs->super))
 		blocks64 = 1;
+	/*
+	 * The descriptors were not read at open time; read them all now,
+	 * so that errors show up before anything is printed.
+	 */
+	if (!header_only && !mmp_check) {
+		retval = ext2fs_load_group_descs(fs);
+		if (retval == EXT2_ET_GDESC_CSUM_INVALID) {
+			if (!retval_csum) {
+				retval_csum = retval;
+				error_csum = _("while reading group descriptors "
+					       "of %s");
+			}
+			retval = 0;
+		}
+		if (retval) {
+			com_err(program_name, retval,
+				_("while reading group descriptors of %s"),
+				device_name);
+			goto out_close;
+		}
+	}
 	if (mmp_check) {
 		if (ext2fs_has_feature_mmp(fs->super) &&
 		    fs->super->s_mmp_block != 0) {
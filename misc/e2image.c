@@ -40,6 +40,9 @@ extern int optind;
 #include <sys/types.h>
 #include <assert.h>
 #include <signal.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fs.h"
@@ -49,6 +52,7 @@ extern int optind;
 #include "e2p/e2p.h"
 #include "ext2fs/e2image.h"
 #include "ext2fs/qcow2.h"
+#include "ext2fs/zimage.h"
 
 #include "support/nls-enable.h"
 #include "support/plausible.h"
@@ -61,6 +65,7 @@ extern int optind;
 /* Image types */
 #define E2IMAGE_RAW	1
 #define E2IMAGE_QCOW2	2
+#define E2IMAGE_ZIMAGE	4
 
 /* Image flags */
 #define E2IMAGE_INSTALL_FLAG	1
@@ -79,6 +84,9 @@ static char move_mode;
 static char show_progress;
 static char *check_buf;
 static int skipped_blocks;
+static int num_threads = -1;
+static int zimage_codec;
+static char *zimage_base, *zimage_fn;
 
 static blk64_t align_offset(blk64_t offset, unsigned int n)
 {
@@ -105,8 +113,8 @@ static int get_bits_from_size(size_t size)
 
 static void usage(void)
 {
-	fprintf(stderr, _("Usage: %s [ -r|-Q ] [ -f ] [ -b superblock ] [ -B blocksize ] "
-			  "device image-file\n"),
+	fprintf(stderr, _("Usage: %s [ -r|-Q|-z ] [ -f ] [ -b superblock ] [ -B blocksize ] "
+			  "[ -j threads ] [ -Z codec ] [ -D base-image ] device image-file\n"),
 		program_name);
 	fprintf(stderr, _("       %s -I device image-file\n"), program_name);
 	fprintf(stderr, _("       %s -ra [ -cfnp ] [ -o src_offset ] "
@@ -303,11 +311,92 @@ static ext2fs_block_bitmap meta_block_map;
 static ext2fs_block_bitmap scramble_block_map;	/* Directory blocks to be scrambled */
 static blk64_t meta_blocks_count;
 
+struct scan_thread;
+
 struct process_block_struct {
 	ext2_ino_t	ino;
 	int		is_dir;
+	struct scan_thread *thread;	/* NULL when scanning serially */
 };
 
+#ifdef HAVE_PTHREAD
+/*
+ * With -j, the inodes are scanned by several threads, each taking a
+ * few block groups at a time.  Blocks found by a thread are buffered
+ * and marked in the shared bitmaps in batches.
+ */
+#define SCAN_GROUP_BATCH	16
+#define MARK_BATCH		1024
+
+struct mark_entry {
+	blk64_t		blk;
+	int		scramble;
+};
+
+struct scan_pool;
+
+struct scan_thread {
+	pthread_t	thread;
+	struct scan_pool *pool;
+	ext2_inode_scan	scan;
+	char		*block_buf;
+	ext2_ino_t	ino;		/* being iterated; under pool->lock */
+	struct ext2_inode inode;
+	struct mark_entry marks[MARK_BATCH];
+	int		nr_marks;
+	blk64_t		count;
+	errcode_t	err;
+	ext2_ino_t	err_ino;
+	int		started;
+};
+
+struct scan_pool {
+	pthread_mutex_t	lock;
+	ext2_filsys	fs;
+	dgrp_t		next_group;
+	struct scan_thread *threads;
+	int		num_threads;
+};
+
+static struct scan_pool *scan_pool;
+
+static void flush_marks(struct scan_thread *t)
+{
+	int i;
+
+	pthread_mutex_lock(&t->pool->lock);
+	for (i = 0; i < t->nr_marks; i++) {
+		ext2fs_mark_block_bitmap2(meta_block_map, t->marks[i].blk);
+		if (t->marks[i].scramble)
+			ext2fs_mark_block_bitmap2(scramble_block_map,
+						  t->marks[i].blk);
+	}
+	pthread_mutex_unlock(&t->pool->lock);
+	t->nr_marks = 0;
+}
+#endif
+
+static void mark_meta_block(struct process_block_struct *pb, blk64_t blk,
+			    int scramble)
+{
+#ifdef HAVE_PTHREAD
+	struct scan_thread *t = pb->thread;
+
+	if (t) {
+		t->marks[t->nr_marks].blk = blk;
+		t->marks[t->nr_marks].scramble = scramble;
+		t->count++;
+		if (++t->nr_marks == MARK_BATCH)
+			flush_marks(t);
+		return;
+	}
+#endif
+	ext2fs_mark_block_bitmap2(meta_block_map, blk);
+	meta_blocks_count++;
+	if (scramble)
+		ext2fs_mark_block_bitmap2(scramble_block_map, blk);
+}
+
 /*
  * These subroutines short circuits ext2fs_get_blocks and
  * ext2fs_check_directory; we use them since we already have the inode
@@ -317,27 +406,56 @@ struct process_block_struct {
 static ext2_ino_t stashed_ino = 0;
 static struct ext2_inode *stashed_inode;
 
+static struct ext2_inode *find_stashed_inode(ext2_ino_t ino)
+{
+#ifdef HAVE_PTHREAD
+	if (scan_pool) {
+		struct ext2_inode *inode = NULL;
+		int i;
+
+		/*
+		 * Only the thread iterating over an inode asks for it,
+		 * so the inode itself can be used outside the lock.
+		 */
+		pthread_mutex_lock(&scan_pool->lock);
+		for (i = 0; i < scan_pool->num_threads; i++)
+			if (scan_pool->threads[i].ino == ino) {
+				inode = &scan_pool->threads[i].inode;
+				break;
+			}
+		pthread_mutex_unlock(&scan_pool->lock);
+		return inode;
+	}
+#endif
+	if ((ino != stashed_ino) || !stashed_inode)
+		return NULL;
+	return stashed_inode;
+}
+
 static errcode_t meta_get_blocks(ext2_filsys fs EXT2FS_ATTR((unused)),
 				 ext2_ino_t ino,
 				 blk_t *blocks)
 {
+	struct ext2_inode *inode = find_stashed_inode(ino);
 	int	i;
 
-	if ((ino != stashed_ino) || !stashed_inode)
+	if (!inode)
 		return EXT2_ET_CALLBACK_NOTHANDLED;
 
 	for (i=0; i < EXT2_N_BLOCKS; i++)
-		blocks[i] = stashed_inode->i_block[i];
+		blocks[i] = inode->i_block[i];
 	return 0;
 }
 
 static errcode_t meta_check_directory(ext2_filsys fs EXT2FS_ATTR((unused)),
 				      ext2_ino_t ino)
 {
-	if ((ino != stashed_ino) || !stashed_inode)
+	struct ext2_inode *inode = find_stashed_inode(ino);
+
+	if (!inode)
 		return EXT2_ET_CALLBACK_NOTHANDLED;
 
-	if (!LINUX_S_ISDIR(stashed_inode->i_mode))
+	if (!LINUX_S_ISDIR(inode->i_mode))
 		return EXT2_ET_NO_DIRECTORY;
 	return 0;
 }
@@ -346,9 +464,11 @@ static errcode_t meta_read_inode(ext2_filsys fs EXT2FS_ATTR((unused)),
 				 ext2_ino_t ino,
 				 struct ext2_inode *inode)
 {
-	if ((ino != stashed_ino) || !stashed_inode)
+	struct ext2_inode *stashed = find_stashed_inode(ino);
+
+	if (!stashed)
 		return EXT2_ET_CALLBACK_NOTHANDLED;
-	*inode = *stashed_inode;
+	*inode = *stashed;
 	return 0;
 }
 
@@ -371,16 +491,14 @@ static int process_dir_block(ext2_filsys fs EXT2FS_ATTR((unused)),
 			     e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
 			     blk64_t ref_block EXT2FS_ATTR((unused)),
 			     int ref_offset EXT2FS_ATTR((unused)),
-			     void *priv_data EXT2FS_ATTR((unused)))
+			     void *priv_data)
 {
 	struct process_block_struct *p;
 
 	p = (struct process_block_struct *) priv_data;
 
-	ext2fs_mark_block_bitmap2(meta_block_map, *block_nr);
-	meta_blocks_count++;
-	if (scramble_block_map && p->is_dir && blockcnt >= 0)
-		ext2fs_mark_block_bitmap2(scramble_block_map, *block_nr);
+	mark_meta_block(p, *block_nr,
+			scramble_block_map && p->is_dir && blockcnt >= 0);
 	return 0;
 }
 
@@ -389,12 +507,10 @@ static int process_file_block(ext2_filsys fs EXT2FS_ATTR((unused)),
 			      e2_blkcnt_t blockcnt,
 			      blk64_t ref_block EXT2FS_ATTR((unused)),
 			      int ref_offset EXT2FS_ATTR((unused)),
-			      void *priv_data EXT2FS_ATTR((unused)))
+			      void *priv_data)
 {
-	if (blockcnt < 0 || all_data) {
-		ext2fs_mark_block_bitmap2(meta_block_map, *block_nr);
-		meta_blocks_count++;
-	}
+	if (blockcnt < 0 || all_data)
+		mark_meta_block(priv_data, *block_nr, 0);
 	return 0;
 }
 
@@ -573,11 +689,307 @@ static int print_progress(blk64_t num, blk64_t total)
 		       calc_percent(num, total));
 }
 
+static int get_num_threads(void)
+{
+	int n = num_threads;
+
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_CONF)
+	if (n < 0)
+		n = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+	if (n < 0)
+		n = 4;
+	return n;
+}
+
+/*
+ * Reads the marked blocks in order for the (single) writer.  Runs of
+ * consecutive marked blocks are coalesced into chunks which are read,
+ * and checked for zero blocks, by reader threads ahead of the writer.
+ * Only the writer's thread looks at the block bitmaps.
+ */
+#define META_CHUNK_BYTES	(1024 * 1024)
+
+#define CHUNK_QUEUED	0
+#define CHUNK_READING	1
+#define CHUNK_DONE	2
+
+struct meta_chunk {
+	blk64_t		blk;
+	int		count;
+	int		state;
+	char		*buf;
+	char		*zero;		/* per block: all zeroes */
+	errcode_t	*err;		/* per block */
+};
+
+struct meta_reader {
+	ext2_filsys	fs;
+	blk64_t		cursor;		/* next block to look at */
+	blk64_t		end;
+	int		max_count;	/* blocks per chunk */
+	struct meta_chunk *ring;
+	int		ring_size;
+	unsigned long	head;		/* chunk being consumed */
+	unsigned long	tail;		/* next chunk to queue */
+	unsigned long	next_read;	/* next chunk for a thread */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	lock;
+	pthread_cond_t	work;		/* chunk queued, or shutdown */
+	pthread_cond_t	ready;		/* chunk read */
+	pthread_t	*threads;
+	int		num_threads;
+	int		shutdown;
+#endif
+};
+
+static void read_chunk(struct meta_reader *rd, struct meta_chunk *c)
+{
+	ext2_filsys fs = rd->fs;
+	errcode_t retval;
+	int i;
+
+	retval = io_channel_read_blk64(fs->io, c->blk, c->count, c->buf);
+	for (i = 0; i < c->count; i++) {
+		char *buf = c->buf + (size_t) i * fs->blocksize;
+
+		c->err[i] = 0;
+		/* Find out which blocks are unreadable */
+		if (retval)
+			c->err[i] = io_channel_read_blk64(fs->io, c->blk + i,
+							  1, buf);
+		if (c->err[i])
+			memset(buf, 0, fs->blocksize);
+		c->zero[i] = check_zero_block(buf, fs->blocksize);
+	}
+}
+
+#ifdef HAVE_PTHREAD
+static void *meta_reader_thread(void *arg)
+{
+	struct meta_reader *rd = arg;
+	struct meta_chunk *c;
+
+	pthread_mutex_lock(&rd->lock);
+	while (1) {
+		while (rd->next_read == rd->tail && !rd->shutdown)
+			pthread_cond_wait(&rd->work, &rd->lock);
+		if (rd->shutdown)
+			break;
+		c = &rd->ring[rd->next_read++ % rd->ring_size];
+		c->state = CHUNK_READING;
+		pthread_mutex_unlock(&rd->lock);
+		read_chunk(rd, c);
+		pthread_mutex_lock(&rd->lock);
+		c->state = CHUNK_DONE;
+		pthread_cond_broadcast(&rd->ready);
+	}
+	pthread_mutex_unlock(&rd->lock);
+	return NULL;
+}
+#endif
+
+static void meta_reader_lock(struct meta_reader *rd EXT2FS_ATTR((unused)))
+{
+#ifdef HAVE_PTHREAD
+	if (rd->num_threads)
+		pthread_mutex_lock(&rd->lock);
+#endif
+}
+
+static void meta_reader_unlock(struct meta_reader *rd EXT2FS_ATTR((unused)))
+{
+#ifdef HAVE_PTHREAD
+	if (rd->num_threads)
+		pthread_mutex_unlock(&rd->lock);
+#endif
+}
+
+/* Queue up the next runs of marked blocks.  Called with the lock held. */
+static void meta_reader_fill(struct meta_reader *rd)
+{
+	blk64_t first, next, last;
+	struct meta_chunk *c;
+	int queued = 0;
+
+	while (rd->tail - rd->head < (unsigned long) rd->ring_size &&
+	       rd->cursor < rd->end) {
+		if (ext2fs_find_first_set_block_bitmap2(meta_block_map,
+				rd->cursor, rd->end - 1, &first)) {
+			rd->cursor = rd->end;
+			break;
+		}
+		last = first + rd->max_count - 1;
+		if (last > rd->end - 1)
+			last = rd->end - 1;
+		if (ext2fs_find_first_zero_block_bitmap2(meta_block_map,
+				first, last, &next))
+			next = last + 1;
+		c = &rd->ring[rd->tail++ % rd->ring_size];
+		c->blk = first;
+		c->count = next - first;
+		c->state = CHUNK_QUEUED;
+		rd->cursor = next;
+		queued++;
+	}
+#ifdef HAVE_PTHREAD
+	if (queued && rd->num_threads)
+		pthread_cond_broadcast(&rd->work);
+#endif
+}
+
+static struct meta_reader *meta_reader_init(ext2_filsys fs, blk64_t start,
+					    blk64_t end, int threads)
+{
+	struct meta_reader *rd;
+	struct meta_chunk *c;
+	errcode_t retval;
+	int i;
+
+	retval = ext2fs_get_memzero(sizeof(struct meta_reader), &rd);
+	if (retval)
+		goto nomem;
+	rd->fs = fs;
+	rd->cursor = start;
+	if (rd->cursor < fs->super->s_first_data_block)
+		rd->cursor = fs->super->s_first_data_block;
+	rd->end = end;
+	rd->max_count = META_CHUNK_BYTES / fs->blocksize;
+	if (rd->max_count < 1)
+		rd->max_count = 1;
+	if (threads < 1)
+		threads = 0;
+	rd->ring_size = threads * 2 + 1;
+	retval = ext2fs_get_arrayzero(rd->ring_size,
+				      sizeof(struct meta_chunk), &rd->ring);
+	if (retval)
+		goto nomem;
+	for (i = 0, c = rd->ring; i < rd->ring_size; i++, c++) {
+		retval = ext2fs_get_array(rd->max_count, fs->blocksize,
+					  &c->buf);
+		if (!retval)
+			retval = ext2fs_get_mem(rd->max_count, &c->zero);
+		if (!retval)
+			retval = ext2fs_get_array(rd->max_count,
+						  sizeof(errcode_t), &c->err);
+		if (retval)
+			goto nomem;
+	}
+#ifdef HAVE_PTHREAD
+	if (threads) {
+		retval = ext2fs_get_array(threads, sizeof(pthread_t),
+					  &rd->threads);
+		if (retval)
+			goto nomem;
+		pthread_mutex_init(&rd->lock, NULL);
+		pthread_cond_init(&rd->work, NULL);
+		pthread_cond_init(&rd->ready, NULL);
+		for (i = 0; i < threads; i++) {
+			if (pthread_create(&rd->threads[rd->num_threads],
+					   NULL, meta_reader_thread, rd))
+				break;
+			rd->num_threads++;
+		}
+	}
+#endif
+	return rd;
+
+nomem:
+	com_err(program_name, retval, "%s", _("while allocating buffer"));
+	exit(1);
+}
+
+static void meta_reader_free(struct meta_reader *rd)
+{
+	int i;
+
+#ifdef HAVE_PTHREAD
+	if (rd->threads) {
+		pthread_mutex_lock(&rd->lock);
+		rd->shutdown = 1;
+		pthread_cond_broadcast(&rd->work);
+		pthread_mutex_unlock(&rd->lock);
+		for (i = 0; i < rd->num_threads; i++)
+			pthread_join(rd->threads[i], NULL);
+		pthread_mutex_destroy(&rd->lock);
+		pthread_cond_destroy(&rd->work);
+		pthread_cond_destroy(&rd->ready);
+		ext2fs_free_mem(&rd->threads);
+	}
+#endif
+	for (i = 0; i < rd->ring_size; i++) {
+		ext2fs_free_mem(&rd->ring[i].buf);
+		ext2fs_free_mem(&rd->ring[i].zero);
+		ext2fs_free_mem(&rd->ring[i].err);
+	}
+	ext2fs_free_mem(&rd->ring);
+	ext2fs_free_mem(&rd);
+}
+
+/*
+ * Return the contents of marked block blk, which must be beyond the
+ * block asked for last time.  The buffer stays valid until the next
+ * call, and may be modified.
+ */
+static errcode_t meta_reader_get(struct meta_reader *rd, blk64_t blk,
+				 char **buf, int *zero)
+{
+	struct meta_chunk *c;
+	int i;
+
+	meta_reader_lock(rd);
+	while (1) {
+		if (rd->head == rd->tail)
+			meta_reader_fill(rd);
+		if (rd->head == rd->tail) {
+			meta_reader_unlock(rd);
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		c = &rd->ring[rd->head % rd->ring_size];
+		if (blk < c->blk + c->count)
+			break;
+		/* Done with this chunk; wait for it before reusing it */
+#ifdef HAVE_PTHREAD
+		while (rd->num_threads && c->state == CHUNK_READING)
+			pthread_cond_wait(&rd->ready, &rd->lock);
+#endif
+		if (rd->next_read == rd->head)
+			rd->next_read++;
+		rd->head++;
+	}
+	meta_reader_fill(rd);
+	if (blk < c->blk) {
+		meta_reader_unlock(rd);
+		return EXT2_ET_INVALID_ARGUMENT;
+	}
+	if (c->state == CHUNK_QUEUED) {
+		/* Nobody has started on it yet; read it ourselves */
+		c->state = CHUNK_READING;
+		rd->next_read++;
+		meta_reader_unlock(rd);
+		read_chunk(rd, c);
+		meta_reader_lock(rd);
+		c->state = CHUNK_DONE;
+	}
+#ifdef HAVE_PTHREAD
+	while (rd->num_threads && c->state != CHUNK_DONE)
+		pthread_cond_wait(&rd->ready, &rd->lock);
+#endif
+	meta_reader_unlock(rd);
+
+	i = blk - c->blk;
+	*buf = c->buf + (size_t) i * rd->fs->blocksize;
+	*zero = c->zero[i];
+	return c->err[i];
+}
+
 static void output_meta_data_blocks(ext2_filsys fs, int fd, int flags)
 {
 	errcode_t	retval;
 	blk64_t		blk;
-	char		*buf, *zero_buf;
+	char		*buf, *read_buf, *zero_buf;
+	struct meta_reader *rd = NULL;
+	int		zero;
 	int		sparse = 0;
 	blk64_t		start = 0;
 	blk64_t		distance = 0;
@@ -587,7 +999,7 @@ static void output_meta_data_blocks(ext2_filsys fs, int fd, int flags)
 	blk64_t		total_written = 0;
 	int		bscount = 0;
 
-	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	retval = ext2fs_get_mem(fs->blocksize, &read_buf);
 	if (retval) {
 		com_err(program_name, retval, "%s",
 			_("while allocating buffer"));
@@ -617,6 +1029,12 @@ static void output_meta_data_blocks(ext2_filsys fs, int fd, int flags)
 	}
 	if (move_mode)
 		signal (SIGINT, sigint_handler);
+	/*
+	 * A move goes over the blocks in several passes, so the blocks
+	 * are read one at a time there.
+	 */
+	if (!distance)
+		rd = meta_reader_init(fs, start, end, get_num_threads());
 more_blocks:
 	if (distance)
 		seek_set(fd, (start * fs->blocksize) + dest_offset);
@@ -672,7 +1090,14 @@ more_blocks:
 		}
 		if ((blk >= fs->super->s_first_data_block) &&
 		    ext2fs_test_block_bitmap2(meta_block_map, blk)) {
-			retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+			if (rd) {
+				retval = meta_reader_get(rd, blk, &buf, &zero);
+			} else {
+				buf = read_buf;
+				retval = io_channel_read_blk64(fs->io, blk, 1,
+							       buf);
+				zero = -1;
+			}
 			if (retval) {
 				com_err(program_name, retval,
 					_("error reading block %llu"),
@@ -680,10 +1105,13 @@ more_blocks:
 			}
 			total_written++;
 			if (scramble_block_map &&
-			    ext2fs_test_block_bitmap2(scramble_block_map, blk))
+			    ext2fs_test_block_bitmap2(scramble_block_map, blk)) {
 				scramble_dir_block(fs, blk, buf);
+				zero = -1;
+			}
 			if ((flags & E2IMAGE_CHECK_ZERO_FLAG) &&
-			    check_zero_block(buf, fs->blocksize))
+			    (zero < 0 ? check_zero_block(buf, fs->blocksize) :
+			     zero))
 				goto sparse_write;
 			if (sparse)
 				seek_relative(fd, sparse);
@@ -759,8 +1187,10 @@ more_blocks:
 		generic_write(fd, zero_buf, 1, NO_BLK);
 	}
 #endif
+	if (rd)
+		meta_reader_free(rd);
 	ext2fs_free_mem(&zero_buf);
-	ext2fs_free_mem(&buf);
+	ext2fs_free_mem(&read_buf);
 }
 
 static void init_l1_table(struct ext2_qcow2_image *image)
@@ -780,9 +1210,7 @@ static void init_l1_table(struct ext2_qcow2_image *image)
 
 static void init_l2_cache(struct ext2_qcow2_image *image)
 {
-	unsigned int count, i;
 	struct ext2_qcow2_l2_cache *cache;
-	struct ext2_qcow2_l2_table *table;
 	errcode_t ret;
 
 	ret = ext2fs_get_arrayzero(1, sizeof(struct ext2_qcow2_l2_cache),
@@ -790,27 +1218,16 @@ static void init_l2_cache(struct ext2_qcow2_image *image)
 	if (ret)
 		goto alloc_err;
 
-	count = (image->l1_size > L2_CACHE_PREALLOC) ? L2_CACHE_PREALLOC :
-		 image->l1_size;
-
-	cache->count = count;
-	cache->free = count;
-	cache->next_offset = image->l2_offset;
-
-	for (i = 0; i < count; i++) {
-		ret = ext2fs_get_arrayzero(1,
-				sizeof(struct ext2_qcow2_l2_table), &table);
-		if (ret)
-			goto alloc_err;
-
-		ret = ext2fs_get_arrayzero(image->l2_size,
-						   sizeof(__u64), &table->data);
-		if (ret)
-			goto alloc_err;
+	cache->count = (image->l2_tables > L2_CACHE_PREALLOC) ?
+		L2_CACHE_PREALLOC : image->l2_tables;
+	if (!cache->count)
+		cache->count = 1;
+	cache->first_offset = image->l2_offset;
 
-		table->next = cache->free_head;
-		cache->free_head = table;
-	}
+	ret = ext2fs_get_arrayzero(cache->count, image->cluster_size,
+				   &cache->tables);
+	if (ret)
+		goto alloc_err;
 
 	image->l2_cache = cache;
 	return;
@@ -823,70 +1240,40 @@ alloc_err:
 static void put_l2_cache(struct ext2_qcow2_image *image)
 {
 	struct ext2_qcow2_l2_cache *cache = image->l2_cache;
-	struct ext2_qcow2_l2_table *tmp, *table;
 
 	if (!cache)
 		return;
 
-	table = cache->free_head;
-	cache->free_head = NULL;
-again:
-	while (table) {
-		tmp = table;
-		table = table->next;
-		ext2fs_free_mem(&tmp->data);
-		ext2fs_free_mem(&tmp);
-	}
-
-	if (cache->free != cache->count) {
+	if (cache->used)
 		fprintf(stderr, "%s", _("Warning: There are still tables in "
 					"the cache while putting the cache, "
 					"data will be lost so the image may "
 					"not be valid.\n"));
-		table = cache->used_head;
-		cache->used_head = NULL;
-		goto again;
-	}
-
+	ext2fs_free_mem(&cache->tables);
 	ext2fs_free_mem(&cache);
 }
 
-static int init_refcount(struct ext2_qcow2_image *img, blk64_t table_offset)
+/*
+ * Count the L2 tables needed to map the blocks which may be written,
+ * so that they can be laid out ahead of the data.
+ */
+static __u32 count_l2_tables(ext2_filsys fs, struct ext2_qcow2_image *img)
 {
-	struct	ext2_qcow2_refcount	*ref;
-	blk64_t table_clusters;
-	errcode_t ret;
-
-	ref = &(img->refcount);
-
-	/*
-	 * One refcount block addresses 2048 clusters, one refcount table
-	 * addresses cluster/sizeof(__u64) refcount blocks, and we need
-	 * to address meta_blocks_count clusters + qcow2 metadata clusters
-	 * in the worst case.
-	 */
-	table_clusters = meta_blocks_count + (table_offset >>
-					      img->cluster_bits);
-	table_clusters >>= (img->cluster_bits + 6 - 1);
-	table_clusters = (table_clusters == 0) ? 1 : table_clusters;
-
-	ref->refcount_table_offset = table_offset;
-	ref->refcount_table_clusters = table_clusters;
-	ref->refcount_table_index = 0;
-	ref->refcount_block_index = 0;
-
-	/* Allocate refcount table */
-	ret = ext2fs_get_arrayzero(ref->refcount_table_clusters,
-				   img->cluster_size, &ref->refcount_table);
-	if (ret)
-		return ret;
+	blk64_t start, end, found, last = ext2fs_blocks_count(fs->super) - 1;
+	__u32 count = 0;
 
-	/* Allocate refcount block */
-	ret = ext2fs_get_arrayzero(1, img->cluster_size, &ref->refcount_block);
-	if (ret)
-		ext2fs_free_mem(&ref->refcount_table);
-
-	return ret;
+	start = fs->super->s_first_data_block;
+	while (start <= last) {
+		if (ext2fs_find_first_set_block_bitmap2(meta_block_map, start,
+							last, &found))
+			break;
+		count++;
+		end = (found | (img->l2_size - 1));
+		if (end >= last)
+			break;
+		start = end + 1;
+	}
+	return count;
 }
 
 static errcode_t initialize_qcow2_image(int fd, ext2_filsys fs,
@@ -933,25 +1320,14 @@ static errcode_t initialize_qcow2_image(int fd, ext2_filsys fs,
 	/* Make space for L1 table */
 	offset += align_offset(l1_size * sizeof(blk64_t), image->cluster_size);
 
-	/* Initialize refcounting */
-	ret = init_refcount(image, offset);
-	if (ret) {
-		ext2fs_free_mem(&header);
-		return ret;
-	}
-	header->refcount_table_offset = ext2fs_cpu_to_be64(offset);
-	header->refcount_table_clusters =
-		ext2fs_cpu_to_be32(image->refcount.refcount_table_clusters);
-	offset += image->cluster_size;
-	offset += (blk64_t) image->refcount.refcount_table_clusters <<
-		image->cluster_bits;
-
-	/* Make space for L2 tables */
+	/* Make space for L2 tables, the data follows them */
 	image->l2_offset = offset;
-	offset += image->cluster_size;
+	image->l2_tables = count_l2_tables(fs, image);
+	offset += (blk64_t) image->l2_tables << cluster_bits;
+	image->data_offset = offset;
 
-	/* Make space for first refcount block */
-	image->refcount.refcount_block_offset = offset;
+	/* The refcounts are written once the size of the image is known */
+	memset(&image->refcount, 0, sizeof(image->refcount));
 
 	image->hdr = header;
 	/* Initialize l1 and l2 tables */
@@ -972,197 +1348,142 @@ static void free_qcow2_image(struct ext2_qcow2_image *img)
 	if (img->l1_table)
 		ext2fs_free_mem(&img->l1_table);
 
-	if (img->refcount.refcount_table)
-		ext2fs_free_mem(&img->refcount.refcount_table);
-	if (img->refcount.refcount_block)
-		ext2fs_free_mem(&img->refcount.refcount_block);
-
 	put_l2_cache(img);
 
 	ext2fs_free_mem(&img);
 }
 
-/**
- * Put table from used list (used_head) into free list (free_head).
- * l2_table is used to return pointer to the next used table (used_head).
+/*
+ * Write out the L2 tables in the cache, which are contiguous in the
+ * image, with a single write.
  */
-static void put_used_table(struct ext2_qcow2_image *img,
-			  struct ext2_qcow2_l2_table **l2_table)
-{
-	struct ext2_qcow2_l2_cache *cache = img->l2_cache;
-	struct ext2_qcow2_l2_table *table;
-
-	table = cache->used_head;
-	cache->used_head = table->next;
-
-	assert(table);
-	if (!table->next)
-		cache->used_tail = NULL;
-
-	/* Clean the table for case we will need to use it again */
-	memset(table->data, 0, img->cluster_size);
-	table->next = cache->free_head;
-	cache->free_head = table;
-
-	cache->free++;
-
-	*l2_table = cache->used_head;
-}
-
 static void flush_l2_cache(struct ext2_qcow2_image *image)
 {
-	blk64_t seek = 0;
-	ext2_loff_t offset;
 	struct ext2_qcow2_l2_cache *cache = image->l2_cache;
-	struct ext2_qcow2_l2_table *table = cache->used_head;
+	ext2_loff_t offset;
 	int fd = image->fd;
 
+	if (!cache->used)
+		return;
+
 	/* Store current position */
 	offset = seek_relative(fd, 0);
-
-	assert(table);
-	while (cache->free < cache->count) {
-		if (seek != table->offset) {
-			seek_set(fd, table->offset);
-			seek = table->offset;
-		}
-
-		generic_write(fd, (char *)table->data, image->cluster_size,
-			      NO_BLK);
-		put_used_table(image, &table);
-		seek += image->cluster_size;
-	}
-
-	/* Restore previous position */
+	seek_set(fd, cache->first_offset);
+	generic_write(fd, cache->tables,
+		      (size_t) cache->used * image->cluster_size, NO_BLK);
 	seek_set(fd, offset);
-}
-
-/**
- * Get first free table (from free_head) and put it into tail of used list
- * (to used_tail).
- * l2_table is used to return pointer to moved table.
- * Returns 1 if the cache is full, 0 otherwise.
- */
-static void get_free_table(struct ext2_qcow2_image *image,
-			  struct ext2_qcow2_l2_table **l2_table)
-{
-	struct ext2_qcow2_l2_table *table;
-	struct ext2_qcow2_l2_cache *cache = image->l2_cache;
-
-	if (0 == cache->free)
-		flush_l2_cache(image);
-
-	table = cache->free_head;
-	assert(table);
-	cache->free_head = table->next;
 
-	if (cache->used_tail)
-		cache->used_tail->next = table;
-	else
-		/* First item in the used list */
-		cache->used_head = table;
-
-	cache->used_tail = table;
-	cache->free--;
-
-	*l2_table = table;
+	cache->first_offset += (blk64_t) cache->used * image->cluster_size;
+	memset(cache->tables, 0, (size_t) cache->used * image->cluster_size);
+	cache->used = 0;
 }
 
-static int add_l2_item(struct ext2_qcow2_image *img, blk64_t blk,
-		       blk64_t data, blk64_t next)
+static void add_l2_item(struct ext2_qcow2_image *img, blk64_t blk,
+			blk64_t data)
 {
 	struct ext2_qcow2_l2_cache *cache = img->l2_cache;
-	struct ext2_qcow2_l2_table *table = cache->used_tail;
 	blk64_t l1_index = blk / img->l2_size;
 	blk64_t l2_index = blk & (img->l2_size - 1);
-	int ret = 0;
-
-	/*
-	 * Need to create new table if it does not exist,
-	 * or if it is full
-	 */
-	if (!table || (table->l1_index != l1_index)) {
-		get_free_table(img, &table);
-		table->l1_index = l1_index;
-		table->offset = cache->next_offset;
-		cache->next_offset = next;
-		img->l1_table[l1_index] =
-			ext2fs_cpu_to_be64(table->offset | QCOW_OFLAG_COPIED);
-		ret++;
-	}
-
-	table->data[l2_index] = ext2fs_cpu_to_be64(data | QCOW_OFLAG_COPIED);
-	return ret;
+	__u64 *table;
+
+	/* The blocks come in order, so each table is only started once */
+	if (!cache->used || cache->l1_index != l1_index) {
+		if (cache->used == cache->count)
+			flush_l2_cache(img);
+		img->l1_table[l1_index] = ext2fs_cpu_to_be64(
+			(cache->first_offset +
+			 ((blk64_t) cache->used << img->cluster_bits)) |
+			QCOW_OFLAG_COPIED);
+		cache->l1_index = l1_index;
+		cache->used++;
+	}
+
+	table = cache->tables + (size_t) (cache->used - 1) * img->l2_size;
+	table[l2_index] = ext2fs_cpu_to_be64(data | QCOW_OFLAG_COPIED);
 }
 
-static int update_refcount(int fd, struct ext2_qcow2_image *img,
-			   blk64_t offset, blk64_t rfblk_pos)
+/*
+ * Append the refcount table and blocks at end, which is where the data
+ * ends.  Every cluster in the image is in use, except for any room for
+ * L2 tables which turned out not to be needed.
+ */
+static void write_refcounts(int fd, struct ext2_qcow2_image *img,
+			    blk64_t end)
 {
-	struct	ext2_qcow2_refcount	*ref;
-	__u32	table_index;
-	int ret = 0;
+	struct ext2_qcow2_refcount *ref = &img->refcount;
+	blk64_t clusters = end >> img->cluster_bits;
+	blk64_t total, blocks = 0, table_clusters = 0, i, c;
+	blk64_t hole_start, hole_end;
+	__u32 per_block = img->cluster_size / sizeof(__u16);
+	__u32 per_cluster = img->cluster_size / sizeof(__u64);
+	__u64 *table;
+	__u16 *block;
+	errcode_t ret;
 
-	ref = &(img->refcount);
-	table_index = offset >> (2 * img->cluster_bits - 1);
+	/* The refcount structures have to count themselves as well */
+	do {
+		total = clusters + blocks + table_clusters;
+		blocks = (total + per_block - 1) / per_block;
+		table_clusters = (blocks + per_cluster - 1) / per_cluster;
+	} while (clusters + blocks + table_clusters > blocks * per_block);
 
-	/*
-	 * Need to create new refcount block when the offset addresses
-	 * another item in the refcount table
-	 */
-	if (table_index != ref->refcount_table_index) {
+	ref->refcount_table_offset = end;
+	ref->refcount_table_clusters = table_clusters;
+	ref->refcount_blocks = blocks;
+	total = clusters + blocks + table_clusters;
 
-		seek_set(fd, ref->refcount_block_offset);
+	ret = ext2fs_get_arrayzero(table_clusters, img->cluster_size, &table);
+	if (!ret)
+		ret = ext2fs_get_mem(img->cluster_size, &block);
+	if (ret) {
+		com_err(program_name, ret, "%s",
+			_("while allocating refcount table"));
+		exit(1);
+	}
+	for (i = 0; i < blocks; i++)
+		table[i] = ext2fs_cpu_to_be64(end +
+			((table_clusters + i) << img->cluster_bits));
+	seek_set(fd, end);
+	generic_write(fd, table, table_clusters << img->cluster_bits, NO_BLK);
 
-		generic_write(fd, (char *)ref->refcount_block,
-			      img->cluster_size, NO_BLK);
-		memset(ref->refcount_block, 0, img->cluster_size);
+	hole_start = img->l2_cache->first_offset >> img->cluster_bits;
+	hole_end = img->data_offset >> img->cluster_bits;
+	for (i = 0, c = 0; i < blocks; i++) {
+		unsigned int j;
 
-		ref->refcount_table[ref->refcount_table_index] =
-			ext2fs_cpu_to_be64(ref->refcount_block_offset);
-		ref->refcount_block_offset = rfblk_pos;
-		ref->refcount_block_index = 0;
-		ref->refcount_table_index = table_index;
-		ret++;
+		for (j = 0; j < per_block; j++, c++)
+			block[j] = (c >= total ||
+				    (c >= hole_start && c < hole_end)) ?
+				0 : ext2fs_cpu_to_be16(1);
+		generic_write(fd, block, img->cluster_size, NO_BLK);
 	}
 
-	/*
-	 * We are relying on the fact that we are creating the qcow2
-	 * image sequentially, hence we will always allocate refcount
-	 * block items sequentially.
-	 */
-	ref->refcount_block[ref->refcount_block_index] = ext2fs_cpu_to_be16(1);
-	ref->refcount_block_index++;
-	return ret;
+	img->hdr->refcount_table_offset = ext2fs_cpu_to_be64(end);
+	img->hdr->refcount_table_clusters = ext2fs_cpu_to_be32(table_clusters);
+	ext2fs_free_mem(&block);
+	ext2fs_free_mem(&table);
 }
 
-static int sync_refcount(int fd, struct ext2_qcow2_image *img)
-{
-	struct	ext2_qcow2_refcount	*ref;
-
-	ref = &(img->refcount);
-
-	ref->refcount_table[ref->refcount_table_index] =
-		ext2fs_cpu_to_be64(ref->refcount_block_offset);
-	seek_set(fd, ref->refcount_table_offset);
-	generic_write(fd, (char *)ref->refcount_table,
-		ref->refcount_table_clusters << img->cluster_bits, NO_BLK);
-
-	seek_set(fd, ref->refcount_block_offset);
-	generic_write(fd, (char *)ref->refcount_block, img->cluster_size,
-		      NO_BLK);
-	return 0;
-}
+/*
+ * The image is written front to back, apart from the header, the L1
+ * table and each batch of L2 tables: the data clusters are gathered in
+ * data_buf and written QCOW2_WRITE_BYTES at a time, and the refcounts
+ * are appended at the end.
+ */
+#define QCOW2_WRITE_BYTES	(1024 * 1024)
 
 static void output_qcow2_meta_data_blocks(ext2_filsys fs, int fd)
 {
 	errcode_t		retval;
-	blk64_t			blk, offset, size, end;
-	char			*buf;
+	blk64_t			blk, offset, size;
+	char			*buf, *data_buf;
 	struct ext2_qcow2_image	*img;
-	unsigned int		header_size;
+	struct meta_reader	*rd;
+	int			zero;
+	unsigned int		header_size, data_count = 0, data_max;
 
 	/* allocate  struct ext2_qcow2_image */
-	retval = ext2fs_get_mem(sizeof(struct ext2_qcow2_image), &img);
+	retval = ext2fs_get_memzero(sizeof(struct ext2_qcow2_image), &img);
 	if (retval) {
 		com_err(program_name, retval, "%s",
 			_("while allocating ext2_qcow2_image"));
@@ -1175,106 +1496,570 @@ static void output_qcow2_meta_data_blocks(ext2_filsys fs, int fd)
 			_("while initializing ext2_qcow2_image"));
 		exit(1);
 	}
+	data_max = QCOW2_WRITE_BYTES / img->cluster_size;
+	retval = ext2fs_get_array(data_max, img->cluster_size, &data_buf);
+	if (retval) {
+		com_err(program_name, retval, "%s",
+			_("while allocating buffer"));
+		exit(1);
+	}
+
+	offset = img->data_offset;
+	seek_set(fd, offset);
+
+	rd = meta_reader_init(fs, 0, ext2fs_blocks_count(fs->super),
+			      get_num_threads());
+	/* Write qcow2 data blocks */
+	for (blk = 0; blk < ext2fs_blocks_count(fs->super); blk++) {
+		if ((blk < fs->super->s_first_data_block) ||
+		    !ext2fs_test_block_bitmap2(meta_block_map, blk))
+			continue;
+		retval = meta_reader_get(rd, blk, &buf, &zero);
+		if (retval) {
+			com_err(program_name, retval,
+				_("error reading block %llu"),
+				(unsigned long long) blk);
+			continue;
+		}
+		if (scramble_block_map &&
+		    ext2fs_test_block_bitmap2(scramble_block_map, blk)) {
+			scramble_dir_block(fs, blk, buf);
+			zero = check_zero_block(buf, fs->blocksize);
+		}
+		if (zero)
+			continue;
+
+		if (data_count == data_max) {
+			generic_write(fd, data_buf,
+				      data_count * img->cluster_size, NO_BLK);
+			data_count = 0;
+		}
+		memcpy(data_buf + (size_t) data_count * img->cluster_size,
+		       buf, fs->blocksize);
+		data_count++;
+		add_l2_item(img, blk, offset);
+		offset += img->cluster_size;
+	}
+	generic_write(fd, data_buf, data_count * img->cluster_size, NO_BLK);
+	flush_l2_cache(img);
+	meta_reader_free(rd);
+	ext2fs_free_mem(&data_buf);
+
+	write_refcounts(fd, img, offset);
+
 	header_size = align_offset(sizeof(struct ext2_qcow2_hdr),
 				   img->cluster_size);
 	write_header(fd, img->hdr, sizeof(struct ext2_qcow2_hdr), header_size);
 
-	/* Refcount all qcow2 related metadata up to refcount_block_offset */
-	end = img->refcount.refcount_block_offset;
-	seek_set(fd, end);
-	blk = end + img->cluster_size;
-	for (offset = 0; offset <= end; offset += img->cluster_size) {
-		if (update_refcount(fd, img, offset, blk)) {
-			blk += img->cluster_size;
-			/*
-			 * If we create new refcount block, we need to refcount
-			 * it as well.
-			 */
-			end += img->cluster_size;
-		}
-	}
-	seek_set(fd, offset);
+	/* Write l1_table*/
+	seek_set(fd, img->l1_offset);
+	size = img->l1_size * sizeof(__u64);
+	generic_write(fd, (char *)img->l1_table, size, NO_BLK);
+
+	free_qcow2_image(img);
+}
+
+/*
+ * A compressed image is written in frames of EXT2_ZIMAGE_FRAME_BYTES.
+ * Each frame holding a marked, non-zero block is compressed on its own
+ * and appended to the file, and the crc32c of each of its blocks is
+ * noted; the frame index, the checksums and the header go in last.
+ *
+ * For a delta, every frame is compared with the base image by checksum
+ * instead, and only the blocks which differ are stored.  Blocks which
+ * the base has but which are no longer marked count as changed to zero.
+ */
+struct zimage_writer {
+	struct ext2_zimage_frame *index;
+	__u32		*csums;		/* frame_blocks per index entry */
+	__u32		*maps;		/* map_words per index entry */
+	unsigned long	index_count;
+	unsigned long	index_size;
+	ext2_loff_t	offset;		/* where the next frame goes */
+	unsigned int	block_size;
+	unsigned int	frame_blocks;
+	unsigned int	map_words;
+	size_t		frame_bytes;
+	char		*frame_buf;
+	char		*cbuf;
+	__u32		*frame_csums;
+	__u32		zero_csum;
+	blk64_t		frame;
+	int		dirty;
+	io_channel	base;
+	__u32		*base_csums;
+};
+
+static void *zimage_alloc(unsigned long count, unsigned long size)
+{
+	errcode_t retval;
+	void *p;
 
-	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	retval = ext2fs_get_arrayzero(count, size, &p);
 	if (retval) {
 		com_err(program_name, retval, "%s",
 			_("while allocating buffer"));
 		exit(1);
 	}
-	/* Write qcow2 data blocks */
+	return p;
+}
+
+static void write_zimage_frame(int fd, struct zimage_writer *zw)
+{
+	struct ext2_zimage_frame *f;
+	errcode_t retval;
+	unsigned int i, changed = 0;
+	size_t len;
+	char *buf = zw->cbuf;
+	__u32 *map;
+
+	if (zw->base) {
+		retval = ext2fs_zimage_frame_csums(zw->base, zw->frame,
+						   zw->base_csums);
+		if (retval) {
+			com_err(program_name, retval, "%s",
+				_("while reading the base image checksums"));
+			exit(1);
+		}
+		for (i = 0; i < zw->frame_blocks; i++) {
+			if (zw->frame_csums[i] != zw->base_csums[i])
+				changed++;
+			else if (zw->dirty)
+				memset(zw->frame_buf + i * zw->block_size, 0,
+				       zw->block_size);
+		}
+		if (!changed)
+			goto reset;
+	} else if (!zw->dirty)
+		return;
+
+	retval = ext2fs_zimage_compress(zimage_codec, zw->frame_buf,
+					zw->frame_bytes, zw->cbuf,
+					zw->frame_bytes, &len);
+	if (retval) {
+		com_err(program_name, retval, "%s",
+			_("while compressing image"));
+		exit(1);
+	}
+	if (zw->index_count == zw->index_size) {
+		retval = ext2fs_resize_array(sizeof(struct ext2_zimage_frame),
+					     zw->index_size,
+					     zw->index_size * 2, &zw->index);
+		if (!retval)
+			retval = ext2fs_resize_array(
+					zw->frame_blocks * sizeof(__u32),
+					zw->index_size, zw->index_size * 2,
+					&zw->csums);
+		if (!retval)
+			retval = ext2fs_resize_array(
+					zw->map_words * sizeof(__u32),
+					zw->index_size, zw->index_size * 2,
+					&zw->maps);
+		if (retval) {
+			com_err(program_name, retval, "%s",
+				_("while allocating frame index"));
+			exit(1);
+		}
+		zw->index_size *= 2;
+	}
+	map = zw->maps + zw->index_count * zw->map_words;
+	memset(map, 0, zw->map_words * sizeof(__u32));
+	for (i = 0; i < zw->frame_blocks; i++) {
+		zw->csums[zw->index_count * zw->frame_blocks + i] =
+			ext2fs_cpu_to_le32(zw->frame_csums[i]);
+		if (zw->base && zw->frame_csums[i] != zw->base_csums[i])
+			map[i / 32] |= 1U << (i % 32);
+	}
+	for (i = 0; i < zw->map_words; i++)
+		map[i] = ext2fs_cpu_to_le32(map[i]);
+
+	f = &zw->index[zw->index_count++];
+	f->frame = ext2fs_cpu_to_le64(zw->frame);
+	f->offset = ext2fs_cpu_to_le64(zw->offset);
+	f->flags = 0;
+	if (!len) {
+		buf = zw->frame_buf;
+		len = zw->frame_bytes;
+		f->flags = ext2fs_cpu_to_le32(EXT2_ZIMAGE_FRAME_RAW);
+	}
+	f->length = ext2fs_cpu_to_le32(len);
+	generic_write(fd, buf, len, NO_BLK);
+	zw->offset += len;
+reset:
+	if (!zw->dirty)
+		return;
+	memset(zw->frame_buf, 0, zw->frame_bytes);
+	for (i = 0; i < zw->frame_blocks; i++)
+		zw->frame_csums[i] = zw->zero_csum;
+	zw->dirty = 0;
+}
+
+/* Finish the current frame, and for a delta any frames up to next. */
+static void advance_zimage_frame(int fd, struct zimage_writer *zw,
+				 blk64_t next)
+{
+	write_zimage_frame(fd, zw);
+	while (zw->base && ++zw->frame < next)
+		write_zimage_frame(fd, zw);
+	zw->frame = next;
+}
+
+/*
+ * Open the base image of a delta, and work out how to refer to it: by
+ * its file name if it is in the same directory as the delta, and by
+ * its absolute path otherwise.
+ */
+static void open_zimage_base(ext2_filsys fs, struct zimage_writer *zw,
+			     struct ext2_zimage_hdr *hdr, const char *image)
+{
+	struct ext2_zimage_hdr base_hdr;
+	char *base_path, *image_dir, *dir, *cp;
+	const char *name;
+	errcode_t retval;
+	int fd;
+
+	fd = ext2fs_open_file(zimage_base, O_RDONLY, 0);
+	if (fd < 0) {
+		com_err(program_name, errno, _("while trying to open %s"),
+			zimage_base);
+		exit(1);
+	}
+	retval = ext2fs_zimage_read_header(fd, &base_hdr);
+	close(fd);
+	if (!retval)
+		retval = zimage_io_manager->open(zimage_base, 0, &zw->base);
+	if (!retval && !(base_hdr.flags & EXT2_ZIMAGE_CSUMS))
+		retval = EXT2_ET_ZIMAGE_NO_CSUMS;
+	if (!retval && (base_hdr.block_size != fs->blocksize ||
+			base_hdr.blocks_count != ext2fs_blocks_count(fs->super)))
+		retval = EXT2_ET_ZIMAGE_BASE;
+	if (retval) {
+		com_err(program_name, retval, _("while opening base image %s"),
+			zimage_base);
+		exit(1);
+	}
+	zw->frame_blocks = base_hdr.frame_blocks;
+	hdr->base_id = ext2fs_cpu_to_le64(base_hdr.image_id);
+
+	base_path = realpath(zimage_base, NULL);
+	image_dir = zimage_alloc(strlen(image) + 2, 1);
+	strcpy(image_dir, image);
+	cp = strrchr(image_dir, '/');
+	if (cp)
+		cp[1] = 0;
+	else
+		strcpy(image_dir, ".");
+	dir = realpath(image_dir, NULL);
+	if (!base_path || !dir) {
+		com_err(program_name, errno, _("while resolving %s"),
+			base_path ? image : zimage_base);
+		exit(1);
+	}
+	name = base_path;
+	cp = strrchr(base_path, '/');
+	if (cp && (size_t) (cp - base_path) == strlen(dir) &&
+	    !strncmp(base_path, dir, cp - base_path))
+		name = cp + 1;
+	if (strlen(name) >= sizeof(hdr->base_name)) {
+		com_err(program_name, 0, _("base image path too long: %s"),
+			name);
+		exit(1);
+	}
+	strcpy(hdr->base_name, name);
+	free(base_path);
+	free(dir);
+	ext2fs_free_mem(&image_dir);
+}
+
+static void output_zimage_meta_data_blocks(ext2_filsys fs, int fd)
+{
+	struct ext2_zimage_hdr	hdr;
+	struct zimage_writer	zw;
+	struct meta_reader	*rd;
+	errcode_t		retval;
+	blk64_t			blk, nframes;
+	char			*buf;
+	int			zero;
+	unsigned int		i;
+	__u32			flags = EXT2_ZIMAGE_CSUMS;
+	__u64			csum_offset, map_offset = 0;
+
+	memset(&zw, 0, sizeof(zw));
+	memset(&hdr, 0, sizeof(hdr));
+	zw.block_size = fs->blocksize;
+	zw.frame_blocks = EXT2_ZIMAGE_FRAME_BYTES / fs->blocksize;
+	if (!zw.frame_blocks)
+		zw.frame_blocks = 1;
+	if (zimage_base) {
+		open_zimage_base(fs, &zw, &hdr, zimage_fn);
+		flags |= EXT2_ZIMAGE_DELTA;
+	}
+	zw.frame_bytes = (size_t) zw.frame_blocks * fs->blocksize;
+	zw.map_words = (zw.frame_blocks + 31) / 32;
+	zw.index_size = 64;
+	zw.frame_buf = zimage_alloc(zw.frame_bytes, 1);
+	zw.cbuf = zimage_alloc(zw.frame_bytes, 1);
+	zw.frame_csums = zimage_alloc(zw.frame_blocks, sizeof(__u32));
+	zw.base_csums = zimage_alloc(zw.frame_blocks, sizeof(__u32));
+	zw.index = zimage_alloc(zw.index_size,
+				sizeof(struct ext2_zimage_frame));
+	zw.csums = zimage_alloc(zw.index_size,
+				zw.frame_blocks * sizeof(__u32));
+	zw.maps = zimage_alloc(zw.index_size, zw.map_words * sizeof(__u32));
+	zw.zero_csum = ext2fs_crc32c_le(~0, (unsigned char *) zw.frame_buf,
+					fs->blocksize);
+	for (i = 0; i < zw.frame_blocks; i++)
+		zw.frame_csums[i] = zw.zero_csum;
+	nframes = (ext2fs_blocks_count(fs->super) + zw.frame_blocks - 1) /
+		zw.frame_blocks;
+
+	zw.offset = EXT2_ZIMAGE_DATA_OFFSET;
+	seek_set(fd, zw.offset);
+
+	rd = meta_reader_init(fs, 0, ext2fs_blocks_count(fs->super),
+			      get_num_threads());
 	for (blk = 0; blk < ext2fs_blocks_count(fs->super); blk++) {
-		if ((blk >= fs->super->s_first_data_block) &&
-		    ext2fs_test_block_bitmap2(meta_block_map, blk)) {
-			retval = io_channel_read_blk64(fs->io, blk, 1, buf);
-			if (retval) {
-				com_err(program_name, retval,
-					_("error reading block %llu"),
-					(unsigned long long) blk);
-				continue;
-			}
-			if (scramble_block_map &&
-			    ext2fs_test_block_bitmap2(scramble_block_map, blk))
-				scramble_dir_block(fs, blk, buf);
-			if (check_zero_block(buf, fs->blocksize))
-				continue;
+		if ((blk < fs->super->s_first_data_block) ||
+		    !ext2fs_test_block_bitmap2(meta_block_map, blk))
+			continue;
+		retval = meta_reader_get(rd, blk, &buf, &zero);
+		if (retval) {
+			com_err(program_name, retval,
+				_("error reading block %llu"),
+				(unsigned long long) blk);
+			continue;
+		}
+		if (scramble_block_map &&
+		    ext2fs_test_block_bitmap2(scramble_block_map, blk)) {
+			scramble_dir_block(fs, blk, buf);
+			zero = check_zero_block(buf, fs->blocksize);
+		}
+		if (zero)
+			continue;
+		if (blk / zw.frame_blocks != zw.frame)
+			advance_zimage_frame(fd, &zw, blk / zw.frame_blocks);
+		i = blk % zw.frame_blocks;
+		memcpy(zw.frame_buf + (size_t) i * fs->blocksize, buf,
+		       fs->blocksize);
+		zw.frame_csums[i] = ext2fs_crc32c_le(~0, (unsigned char *) buf,
+						     fs->blocksize);
+		zw.dirty = 1;
+	}
+	advance_zimage_frame(fd, &zw, nframes);
+	meta_reader_free(rd);
+
+	generic_write(fd, zw.index,
+		      zw.index_count * sizeof(struct ext2_zimage_frame),
+		      NO_BLK);
+	csum_offset = zw.offset +
+		zw.index_count * sizeof(struct ext2_zimage_frame);
+	generic_write(fd, zw.csums,
+		      zw.index_count * zw.frame_blocks * sizeof(__u32), NO_BLK);
+	if (zw.base) {
+		map_offset = csum_offset +
+			zw.index_count * zw.frame_blocks * sizeof(__u32);
+		generic_write(fd, zw.maps,
+			      zw.index_count * zw.map_words * sizeof(__u32),
+			      NO_BLK);
+		io_channel_close(zw.base);
+	}
+
+	hdr.magic = ext2fs_cpu_to_le32(EXT2_ZIMAGE_MAGIC);
+	hdr.version = ext2fs_cpu_to_le32(EXT2_ZIMAGE_VERSION);
+	hdr.block_size = ext2fs_cpu_to_le32(fs->blocksize);
+	hdr.frame_blocks = ext2fs_cpu_to_le32(zw.frame_blocks);
+	hdr.blocks_count = ext2fs_cpu_to_le64(ext2fs_blocks_count(fs->super));
+	hdr.index_offset = ext2fs_cpu_to_le64(zw.offset);
+	hdr.index_count = ext2fs_cpu_to_le64(zw.index_count);
+	hdr.codec = ext2fs_cpu_to_le32(zimage_codec);
+	hdr.flags = ext2fs_cpu_to_le32(flags);
+	hdr.csum_offset = ext2fs_cpu_to_le64(csum_offset);
+	hdr.map_offset = ext2fs_cpu_to_le64(map_offset);
+	/* Only needs to tell this image apart from others of the fs */
+	hdr.image_id = ext2fs_cpu_to_le64(((__u64) time(NULL) << 32) ^
+			((__u64) getpid() << 16) ^
+			ext2fs_crc32c_le(~0, (unsigned char *) zw.csums,
+				zw.index_count * zw.frame_blocks *
+				sizeof(__u32)));
+	write_header(fd, &hdr, sizeof(hdr), EXT2_ZIMAGE_DATA_OFFSET);
+
+	ext2fs_free_mem(&zw.maps);
+	ext2fs_free_mem(&zw.csums);
+	ext2fs_free_mem(&zw.index);
+	ext2fs_free_mem(&zw.base_csums);
+	ext2fs_free_mem(&zw.frame_csums);
+	ext2fs_free_mem(&zw.cbuf);
+	ext2fs_free_mem(&zw.frame_buf);
+}
 
-			if (update_refcount(fd, img, offset, offset)) {
-				/* Make space for another refcount block */
-				offset += img->cluster_size;
-				seek_set(fd, offset);
-				/*
-				 * We have created the new refcount block, this
-				 * means that we need to refcount it as well.
-				 * So the previous update_refcount refcounted
-				 * the block itself and now we are going to
-				 * create refcount for data. New refcount
-				 * block should not be created!
-				 */
-				if (update_refcount(fd, img, offset, offset)) {
-					fprintf(stderr, "%s",
-						_("Programming error: multiple "
-						  "sequential refcount blocks "
-						  "created!\n"));
-					exit(1);
-				}
-			}
+static void stash_inode(struct process_block_struct *pb, ext2_ino_t ino)
+{
+#ifdef HAVE_PTHREAD
+	if (pb->thread) {
+		pthread_mutex_lock(&pb->thread->pool->lock);
+		pb->thread->ino = ino;
+		pthread_mutex_unlock(&pb->thread->pool->lock);
+		return;
+	}
+#endif
+	stashed_ino = ino;
+}
 
-			generic_write(fd, buf, fs->blocksize, blk);
-
-			if (add_l2_item(img, blk, offset,
-					offset + img->cluster_size)) {
-				offset += img->cluster_size;
-				if (update_refcount(fd, img, offset,
-					offset + img->cluster_size)) {
-					offset += img->cluster_size;
-					if (update_refcount(fd, img, offset,
-							    offset)) {
-						fprintf(stderr, "%s",
-			_("Programming error: multiple sequential refcount "
-			  "blocks created!\n"));
-						exit(1);
-					}
-				}
-				offset += img->cluster_size;
-				seek_set(fd, offset);
+/*
+ * Mark the metadata blocks of one inode returned by the inode scan.
+ */
+static errcode_t scan_inode(ext2_filsys fs, ext2_ino_t ino,
+			    struct ext2_inode *inode,
+			    struct process_block_struct *pb, char *block_buf)
+{
+	if (!inode->i_links_count)
+		return 0;
+	if (ext2fs_file_acl_block(fs, inode))
+		mark_meta_block(pb, ext2fs_file_acl_block(fs, inode), 0);
+	if (!ext2fs_inode_has_valid_blocks2(fs, inode))
+		return 0;
+
+	stash_inode(pb, ino);
+	pb->ino = ino;
+	pb->is_dir = LINUX_S_ISDIR(inode->i_mode);
+	if (LINUX_S_ISDIR(inode->i_mode) ||
+	    LINUX_S_ISLNK(inode->i_mode) ||
+	    ino == fs->super->s_journal_inum ||
+	    ino == quota_type2inum(USRQUOTA, fs->super) ||
+	    ino == quota_type2inum(GRPQUOTA, fs->super) ||
+	    ino == quota_type2inum(PRJQUOTA, fs->super) ||
+	    ino == fs->super->s_orphan_file_inum)
+		return ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY,
+					     block_buf, process_dir_block, pb);
+	if ((inode->i_flags & EXT4_EXTENTS_FL) ||
+	    inode->i_block[EXT2_IND_BLOCK] ||
+	    inode->i_block[EXT2_DIND_BLOCK] ||
+	    inode->i_block[EXT2_TIND_BLOCK] || all_data)
+		return ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY,
+					     block_buf, process_file_block, pb);
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD
+static void *scan_thread_proc(void *arg)
+{
+	struct scan_thread *t = arg;
+	struct scan_pool *pool = t->pool;
+	ext2_filsys fs = pool->fs;
+	struct process_block_struct pb;
+	unsigned long long last_ino;
+	dgrp_t group;
+	ext2_ino_t ino;
+	errcode_t retval = 0;
+
+	memset(&pb, 0, sizeof(pb));
+	pb.thread = t;
+	while (!t->err) {
+		pthread_mutex_lock(&pool->lock);
+		group = pool->next_group;
+		if (group < fs->group_desc_count)
+			pool->next_group += SCAN_GROUP_BATCH;
+		pthread_mutex_unlock(&pool->lock);
+		if (group >= fs->group_desc_count)
+			break;
+		last_ino = (unsigned long long) (group + SCAN_GROUP_BATCH) *
+			EXT2_INODES_PER_GROUP(fs->super);
+
+		retval = ext2fs_inode_scan_goto_blockgroup(t->scan, group);
+		while (!retval) {
+			retval = ext2fs_get_next_inode(t->scan, &ino, &t->inode);
+			if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE) {
+				retval = 0;
 				continue;
 			}
-
-			offset += img->cluster_size;
+			if (retval)
+				break;
+			if (ino == 0 || ino > last_ino)
+				break;
+			retval = scan_inode(fs, ino, &t->inode, &pb,
+					    t->block_buf);
+			if (retval)
+				t->err_ino = ino;
 		}
+		t->err = retval;
 	}
-	(void) update_refcount(fd, img, offset, offset);
-	flush_l2_cache(img);
-	sync_refcount(fd, img);
+	flush_marks(t);
+	return NULL;
+}
 
-	/* Write l1_table*/
-	seek_set(fd, img->l1_offset);
-	size = img->l1_size * sizeof(__u64);
-	generic_write(fd, (char *)img->l1_table, size, NO_BLK);
+/*
+ * Scan the inodes with several threads.  Returns 0 if that isn't worth
+ * it, or the threads couldn't be started, and the caller should scan
+ * serially.
+ */
+static int scan_inodes_threaded(ext2_filsys fs)
+{
+	struct scan_pool pool;
+	struct scan_thread *t;
+	int i, n = get_num_threads(), started = 0;
+	errcode_t retval;
 
-	ext2fs_free_mem(&buf);
-	free_qcow2_image(img);
+	if (n > (int) (fs->group_desc_count / SCAN_GROUP_BATCH))
+		n = fs->group_desc_count / SCAN_GROUP_BATCH;
+	if (n <= 1)
+		return 0;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.fs = fs;
+	retval = ext2fs_get_arrayzero(n, sizeof(struct scan_thread),
+				      &pool.threads);
+	if (retval)
+		return 0;
+	pool.num_threads = n;
+	for (i = 0, t = pool.threads; i < n; i++, t++) {
+		t->pool = &pool;
+		retval = ext2fs_open_inode_scan(fs, 0, &t->scan);
+		if (retval) {
+			com_err(program_name, retval, "%s",
+				_("while opening inode scan"));
+			exit(1);
+		}
+		retval = ext2fs_get_mem(fs->blocksize * 3, &t->block_buf);
+		if (retval) {
+			com_err(program_name, 0, "%s",
+				_("Can't allocate block buffer"));
+			exit(1);
+		}
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	scan_pool = &pool;
+	for (i = 0, t = pool.threads; i < n; i++, t++) {
+		t->started = !pthread_create(&t->thread, NULL,
+					     scan_thread_proc, t);
+		started += t->started;
+	}
+	for (i = 0, t = pool.threads; i < n; i++, t++)
+		if (t->started)
+			pthread_join(t->thread, NULL);
+	scan_pool = NULL;
+	pthread_mutex_destroy(&pool.lock);
+
+	for (i = 0, t = pool.threads; i < n; i++, t++) {
+		meta_blocks_count += t->count;
+		if (t->err && t->err_ino) {
+			com_err(program_name, t->err,
+				_("while iterating over inode %u"),
+				t->err_ino);
+			exit(1);
+		} else if (t->err) {
+			com_err(program_name, t->err, "%s",
+				_("while getting next inode"));
+			exit(1);
+		}
+	}
+	for (i = 0, t = pool.threads; i < n; i++, t++) {
+		ext2fs_close_inode_scan(t->scan);
+		ext2fs_free_mem(&t->block_buf);
+	}
+	ext2fs_free_mem(&pool.threads);
+	return started;
 }
+#endif
 
 static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags,
 				 blk64_t superblock)
@@ -1325,6 +2110,11 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags,
 	if (show_progress)
 		fprintf(stderr, "%s", _("Scanning inodes...\n"));
 
+	use_inode_shortcuts(fs, 1);
+#ifdef HAVE_PTHREAD
+	if (scan_inodes_threaded(fs))
+		goto scanned;
+#endif
 	retval = ext2fs_open_inode_scan(fs, 0, &scan);
 	if (retval) {
 		com_err(program_name, retval, "%s",
@@ -1339,7 +2129,7 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags,
 		exit(1);
 	}
 
-	use_inode_shortcuts(fs, 1);
+	memset(&pb, 0, sizeof(pb));
 	stashed_inode = &inode;
 	while (1) {
 		retval = ext2fs_get_next_inode(scan, &ino, &inode);
@@ -1352,60 +2142,27 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags,
 		}
 		if (ino == 0)
 			break;
-		if (!inode.i_links_count)
-			continue;
-		if (ext2fs_file_acl_block(fs, &inode)) {
-			ext2fs_mark_block_bitmap2(meta_block_map,
-					ext2fs_file_acl_block(fs, &inode));
-			meta_blocks_count++;
-		}
-		if (!ext2fs_inode_has_valid_blocks2(fs, &inode))
-			continue;
-
-		stashed_ino = ino;
-		pb.ino = ino;
-		pb.is_dir = LINUX_S_ISDIR(inode.i_mode);
-		if (LINUX_S_ISDIR(inode.i_mode) ||
-		    LINUX_S_ISLNK(inode.i_mode) ||
-		    ino == fs->super->s_journal_inum ||
-		    ino == quota_type2inum(USRQUOTA, fs->super) ||
-		    ino == quota_type2inum(GRPQUOTA, fs->super) ||
-		    ino == quota_type2inum(PRJQUOTA, fs->super) ||
-		    ino == fs->super->s_orphan_file_inum) {
-			retval = ext2fs_block_iterate3(fs, ino,
-					BLOCK_FLAG_READ_ONLY, block_buf,
-					process_dir_block, &pb);
-			if (retval) {
-				com_err(program_name, retval,
-					_("while iterating over inode %u"),
-					ino);
-				exit(1);
-			}
-		} else {
-			if ((inode.i_flags & EXT4_EXTENTS_FL) ||
-			    inode.i_block[EXT2_IND_BLOCK] ||
-			    inode.i_block[EXT2_DIND_BLOCK] ||
-			    inode.i_block[EXT2_TIND_BLOCK] || all_data) {
-				retval = ext2fs_block_iterate3(fs,
-				       ino, BLOCK_FLAG_READ_ONLY, block_buf,
-				       process_file_block, &pb);
-				if (retval) {
-					com_err(program_name, retval,
-					_("while iterating over inode %u"), ino);
-					exit(1);
-				}
-			}
+		retval = scan_inode(fs, ino, &inode, &pb, block_buf);
+		if (retval) {
+			com_err(program_name, retval,
+				_("while iterating over inode %u"), ino);
+			exit(1);
 		}
 	}
+	ext2fs_free_mem(&block_buf);
+	ext2fs_close_inode_scan(scan);
+#ifdef HAVE_PTHREAD
+scanned:
+#endif
 	use_inode_shortcuts(fs, 0);
 
 	if (type & E2IMAGE_QCOW2)
 		output_qcow2_meta_data_blocks(fs, fd);
+	else if (type & E2IMAGE_ZIMAGE)
+		output_zimage_meta_data_blocks(fs, fd);
 	else
 		output_meta_data_blocks(fs, fd, flags);
 
-	ext2fs_free_mem(&block_buf);
-	ext2fs_close_inode_scan(scan);
 	ext2fs_free_block_bitmap(meta_block_map);
 	if (type & E2IMAGE_SCRAMBLE_FLAG)
 		ext2fs_free_block_bitmap(scramble_block_map);
@@ -1506,6 +2263,7 @@ int main (int argc, char ** argv)
 	struct stat st;
 	blk64_t superblock = 0;
 	int blocksize = 0;
+	io_manager io_ptr = unix_io_manager;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -1521,7 +2279,7 @@ int main (int argc, char ** argv)
 	else
 		usage();
 	add_error_table(&et_ext2_error_table);
-	while ((c = getopt(argc, argv, "b:B:nrsIQafo:O:pc")) != EOF)
+	while ((c = getopt(argc, argv, "b:B:nrsIQafo:O:pcj:zZ:D:")) != EOF)
 		switch (c) {
 		case 'b':
 			superblock = strtoull(optarg, NULL, 0);
@@ -1566,6 +2324,29 @@ int main (int argc, char ** argv)
 		case 'c':
 			check = 1;
 			break;
+		case 'j':
+			num_threads = strtol(optarg, NULL, 0);
+			break;
+		case 'D':
+			zimage_base = optarg;
+			if (img_type & ~E2IMAGE_ZIMAGE)
+				usage();
+			img_type |= E2IMAGE_ZIMAGE;
+			break;
+		case 'Z':
+			zimage_codec = ext2fs_zimage_codec_by_name(optarg);
+			if (zimage_codec < 0) {
+				com_err(program_name, 0,
+					_("unknown compression codec: %s"),
+					optarg);
+				exit(1);
+			}
+			/* fall through */
+		case 'z':
+			if (img_type & ~E2IMAGE_ZIMAGE)
+				usage();
+			img_type |= E2IMAGE_ZIMAGE;
+			break;
 		default:
 			usage();
 		}
@@ -1595,6 +2376,15 @@ int main (int argc, char ** argv)
 			_("Move mode is only allowed with raw images."));
 		exit(1);
 	}
+	if (img_type == E2IMAGE_ZIMAGE) {
+		if (!zimage_codec)
+			zimage_codec = ext2fs_zimage_default_codec();
+		if (!ext2fs_zimage_codec_available(zimage_codec)) {
+			com_err(program_name, EXT2_ET_ZIMAGE_CODEC, "%s",
+				ext2fs_zimage_codec_name(zimage_codec));
+			exit(1);
+		}
+	}
 	if (move_mode && !all_data) {
 		com_err(program_name, 0, "%s",
 			_("Move mode requires all data mode."));
@@ -1604,6 +2394,7 @@ int main (int argc, char ** argv)
 	if (move_mode)
 		image_fn = device_name;
 	else image_fn = argv[optind+1];
+	zimage_fn = image_fn;
 
 	retval = ext2fs_check_if_mounted(device_name, &mount_flags);
 	if (retval) {
@@ -1634,9 +2425,12 @@ int main (int argc, char ** argv)
 			goto skip_device;
 		}
 	}
+	/* A compressed image can be read back, e.g. to expand it */
+	if (ext2fs_zimage_probe(device_name, NULL))
+		io_ptr = zimage_io_manager;
 	sprintf(offset_opt, "offset=%llu", (unsigned long long) source_offset);
 	retval = ext2fs_open2(device_name, offset_opt, open_flag,
-			      superblock, blocksize, unix_io_manager, &fs);
+			      superblock, blocksize, io_ptr, &fs);
         if (retval) {
 		com_err (program_name, retval, _("while trying to open %s"),
 			 device_name);
@@ -1671,6 +2465,11 @@ skip_device:
 			_("QCOW2 image can not be written to the stdout!\n"));
 		exit(1);
 	}
+	if ((img_type & E2IMAGE_ZIMAGE) && (fd == 1)) {
+		com_err(program_name, 0, "%s",
+			_("Compressed image can not be written to the stdout!\n"));
+		exit(1);
+	}
 	if (fd != 1) {
 		if (fstat(fd, &st)) {
 			com_err(program_name, 0, "%s",
@@ -35,6 +35,7 @@
 #include <inttypes.h>
 #include "ext2fs/ext2fs.h"
 #include "ext2fs/ext2_fs.h"
+#include "../debugfs/journal.h"
 
 #include "../version.h"
 
@@ -93,8 +94,6 @@ static ext2_filsys global_fs; /* Try not to use this directly */
 # define FL_PUNCH_HOLE_FLAG (0)
 #endif
 
-errcode_t ext2fs_run_ext3_journal(ext2_filsys *fs);
-
 #ifdef CONFIG_JBD_DEBUG		/* Enabled by configure --enable-jbd-debug */
 int journal_enable_debug = -1;
 #endif
@@ -310,12 +309,87 @@ struct fuse2fs_file_handle {
 	int open_flags;
 };
 
+/*
+ * Locking: operations which only look at the file system take bfl
+ * shared, and anything which may allocate, free or otherwise change
+ * metadata takes it exclusively.  The library's inode, extent tree and
+ * io caches can be used by several readers at once because the file
+ * system is opened with EXT2_FLAG_THREADS.  Nothing is written under
+ * the shared lock: a reader which finds an atime due an update makes it
+ * after dropping the lock, under the exclusive one, and errors are only
+ * noted in the in-memory superblock (under error_lock) until the next
+ * time bfl is released, when they are written out exclusively.
+ */
+
+/*
+ * Cache of name lookups, mapping (directory, name) to the inode the name
+ * refers to, or to 0 if the name does not exist.  Entries are dropped
+ * or updated by the operations which add and remove names, all of which
+ * hold bfl exclusively; dcache_lock only orders lookups made under the
+ * shared lock.
+ */
+#define FUSE2FS_DCACHE_BUCKETS	1024
+#define FUSE2FS_DCACHE_MAX	8192
+
+struct fuse2fs_dentry {
+	struct fuse2fs_dentry *hash_next;
+	struct fuse2fs_dentry *lru_prev, *lru_next;
+	ext2_ino_t dir;
+	ext2_ino_t ino;
+	unsigned int len;
+	char name[];
+};
+
+/*
+ * In write-back mode, metadata and directory blocks are kept in a large
+ * io channel cache, and the bitmaps, group descriptors and superblock
+ * stay in memory, until an fsync, the commit timer, or the cache
+ * filling up pushes them out.  Blocks evicted from the cache go to the
+ * device in between commits, so without a journal the file system is
+ * only consistent once it is cleanly unmounted.
+ */
+#define FUSE2FS_WRITEBACK_CACHE	(32 << 20)	/* bytes */
+#define FUSE2FS_COMMIT_INTERVAL	5		/* seconds */
+
+/*
+ * When the file system has a journal, every block written is captured
+ * in memory instead of going to the device.  A commit writes the blocks
+ * changed since the last one to the journal as a single transaction,
+ * and a checkpoint later writes everything committed to its final
+ * location and empties the journal.  File data is journaled along with
+ * the metadata, so a block freed and reused between two checkpoints
+ * can never be overwritten in place before the free is committed.
+ */
+struct fuse2fs_jblock {
+	struct fuse2fs_jblock *hash_next;
+	blk64_t blk;
+	int dirty;		/* not yet committed */
+	char *committed;	/* contents as of the last commit, if dirty */
+	char data[];
+};
+
+struct fuse2fs_jio {
+	io_channel real;
+	pthread_mutex_t lock;
+	struct fuse2fs_jblock **hash;
+	unsigned int hash_mask;
+	blk64_t nr_blocks;
+	blk64_t nr_dirty;
+};
+
 /* Main program context */
 #define FUSE2FS_MAGIC		(0xEF53DEADUL)
 struct fuse2fs {
 	unsigned long magic;
 	ext2_filsys fs;
-	pthread_mutex_t bfl;
+	pthread_rwlock_t bfl;
+	pthread_mutex_t error_lock;
+	int error_pending;	/* error info not written out yet */
+	pthread_mutex_t dcache_lock;
+	struct fuse2fs_dentry **dcache;
+	struct fuse2fs_dentry *dcache_lru, *dcache_lru_tail;
+	unsigned int dcache_count;
+	unsigned long long dcache_lookups, dcache_hits;
 	char *device;
 	int ro;
 	int debug;
@@ -325,6 +399,19 @@ struct fuse2fs {
 	int fakeroot;
 	int alloc_all_blocks;
 	int norecovery;
+	int writeback;
+	int nojournal;
+	unsigned int commit_interval;
+	int splice_fd;
+	journal_t *journal;
+	struct fuse2fs_jio *jio;
+	blk64_t jmax_dirty;	/* commit once this many blocks changed */
+	blk64_t jmax_blocks;	/* checkpoint once this many are held */
+	pthread_t flush_thread;
+	pthread_mutex_t flush_lock;
+	pthread_cond_t flush_cond;
+	int flush_running;
+	int flush_stop;
 	FILE *err_fp;
 	unsigned int next_generation;
 };
@@ -341,6 +428,7 @@ static int __translate_error(ext2_filsys fs, errcode_t err, ext2_ino_t ino,
 			     const char *file, int line);
 #define translate_error(fs, ino, err) __translate_error((fs), (err), (ino), \
 			__FILE__, __LINE__)
+static errcode_t fuse2fs_commit_if_full(struct fuse2fs *ff);
 
 /* for macosx */
 #ifndef W_OK
@@ -503,40 +591,6 @@ static int update_ctime(ext2_filsys fs, ext2_ino_t ino,
 	return 0;
 }
 
-static int update_atime(ext2_filsys fs, ext2_ino_t ino)
-{
-	errcode_t err;
-	struct ext2_inode_large inode, *pinode;
-	struct timespec atime, mtime, now;
-
-	if (!(fs->flags & EXT2_FLAG_RW))
-		return 0;
-	memset(&inode, 0, sizeof(inode));
-	err = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode,
-				     sizeof(inode));
-	if (err)
-		return translate_error(fs, ino, err);
-
-	pinode = &inode;
-	EXT4_INODE_GET_XTIME(i_atime, &atime, pinode);
-	EXT4_INODE_GET_XTIME(i_mtime, &mtime, pinode);
-	get_now(&now);
-	/*
-	 * If atime is newer than mtime and atime hasn't been updated in thirty
-	 * seconds, skip the atime update.  Same idea as Linux "relatime".
-	 */
-	if (atime.tv_sec >= mtime.tv_sec && atime.tv_sec >= now.tv_sec - 30)
-		return 0;
-	EXT4_INODE_SET_XTIME(i_atime, &now, &inode);
-
-	err = ext2fs_write_inode_full(fs, ino, (struct ext2_inode *)&inode,
-				      sizeof(inode));
-	if (err)
-		return translate_error(fs, ino, err);
-
-	return 0;
-}
-
 static int update_mtime(ext2_filsys fs, ext2_ino_t ino,
 			struct ext2_inode_large *pinode)
 {
@@ -629,6 +683,326 @@ static int fs_writeable(ext2_filsys fs)
 	return (fs->flags & EXT2_FLAG_RW) && (fs->super->s_error_count == 0);
 }
 
+/* Write out errors noted by __translate_error(); bfl held exclusively */
+static void fuse2fs_flush_errors(struct fuse2fs *ff)
+{
+	int pending;
+
+	pthread_mutex_lock(&ff->error_lock);
+	pending = ff->error_pending;
+	ff->error_pending = 0;
+	pthread_mutex_unlock(&ff->error_lock);
+	if (pending)
+		ext2fs_flush(ff->fs);
+}
+
+/* Drop bfl held shared, then write out any errors hit under it */
+static void fuse2fs_read_unlock(struct fuse2fs *ff)
+{
+	int pending;
+
+	pthread_rwlock_unlock(&ff->bfl);
+	pthread_mutex_lock(&ff->error_lock);
+	pending = ff->error_pending;
+	pthread_mutex_unlock(&ff->error_lock);
+	if (pending) {
+		pthread_rwlock_wrlock(&ff->bfl);
+		fuse2fs_flush_errors(ff);
+		pthread_rwlock_unlock(&ff->bfl);
+	}
+}
+
+/*
+ * Drop bfl held exclusively, first committing if a big update has piled
+ * up and writing out any errors hit under it.
+ */
+static void fuse2fs_write_unlock(struct fuse2fs *ff)
+{
+	errcode_t err;
+
+	/* The changes are safe in memory even if this fails */
+	err = fuse2fs_commit_if_full(ff);
+	if (err)
+		translate_error(ff->fs, 0, err);
+	fuse2fs_flush_errors(ff);
+	pthread_rwlock_unlock(&ff->bfl);
+}
+
+/*
+ * Does the atime in inode need updating?  Not if it is newer than the
+ * mtime and was updated in the last thirty seconds; same idea as Linux
+ * "relatime".
+ */
+static int atime_is_stale(struct ext2_inode_large *inode)
+{
+	struct timespec atime, mtime, now;
+
+	EXT4_INODE_GET_XTIME(i_atime, &atime, inode);
+	EXT4_INODE_GET_XTIME(i_mtime, &mtime, inode);
+	get_now(&now);
+	return atime.tv_sec < mtime.tv_sec || atime.tv_sec < now.tv_sec - 30;
+}
+
+/*
+ * Called with bfl held shared.  Returns 1 if ino's atime should be
+ * updated, which the caller does with update_atime() once it has
+ * dropped the lock, 0 if not, or a negative errno.
+ */
+static int atime_needs_update(ext2_filsys fs, ext2_ino_t ino)
+{
+	struct ext2_inode_large inode;
+	errcode_t err;
+
+	if (!fs_writeable(fs))
+		return 0;
+	memset(&inode, 0, sizeof(inode));
+	err = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode,
+				     sizeof(inode));
+	if (err)
+		return translate_error(fs, ino, err);
+	return atime_is_stale(&inode);
+}
+
+/*
+ * Writing the inode changes an inode table block that other operations
+ * may be reading, so this takes bfl exclusively.  Called without bfl.
+ */
+static int update_atime(struct fuse2fs *ff, ext2_ino_t ino)
+{
+	ext2_filsys fs;
+	errcode_t err;
+	struct ext2_inode_large inode;
+	struct timespec now;
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&ff->bfl);
+	fs = ff->fs;
+	if (!fs_writeable(fs))
+		goto out;
+	memset(&inode, 0, sizeof(inode));
+	err = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode,
+				     sizeof(inode));
+	if (err) {
+		ret = translate_error(fs, ino, err);
+		goto out;
+	}
+
+	/* Someone else may have got here first */
+	if (!atime_is_stale(&inode))
+		goto out;
+	get_now(&now);
+	EXT4_INODE_SET_XTIME(i_atime, &now, &inode);
+
+	err = ext2fs_write_inode_full(fs, ino, (struct ext2_inode *)&inode,
+				      sizeof(inode));
+	if (err)
+		ret = translate_error(fs, ino, err);
+out:
+	fuse2fs_write_unlock(ff);
+	return ret;
+}
+
+
+static struct fuse2fs_dentry **dcache_bucket(struct fuse2fs *ff,
+					     ext2_ino_t dir, const char *name,
+					     unsigned int len)
+{
+	__u32 hash = ext2fs_crc32c_le(dir, (unsigned char const *)name, len);
+
+	return &ff->dcache[hash % FUSE2FS_DCACHE_BUCKETS];
+}
+
+static void dcache_lru_remove(struct fuse2fs *ff, struct fuse2fs_dentry *d)
+{
+	if (d->lru_prev)
+		d->lru_prev->lru_next = d->lru_next;
+	else
+		ff->dcache_lru = d->lru_next;
+	if (d->lru_next)
+		d->lru_next->lru_prev = d->lru_prev;
+	else
+		ff->dcache_lru_tail = d->lru_prev;
+}
+
+static void dcache_lru_add(struct fuse2fs *ff, struct fuse2fs_dentry *d)
+{
+	d->lru_prev = NULL;
+	d->lru_next = ff->dcache_lru;
+	if (ff->dcache_lru)
+		ff->dcache_lru->lru_prev = d;
+	else
+		ff->dcache_lru_tail = d;
+	ff->dcache_lru = d;
+}
+
+/* Called with dcache_lock held */
+static void dcache_drop(struct fuse2fs *ff, struct fuse2fs_dentry *d)
+{
+	struct fuse2fs_dentry **pp;
+
+	pp = dcache_bucket(ff, d->dir, d->name, d->len);
+	while (*pp != d)
+		pp = &(*pp)->hash_next;
+	*pp = d->hash_next;
+	dcache_lru_remove(ff, d);
+	ff->dcache_count--;
+	ext2fs_free_mem(&d);
+}
+
+/* Called with dcache_lock held */
+static struct fuse2fs_dentry *dcache_find(struct fuse2fs *ff, ext2_ino_t dir,
+					  const char *name, unsigned int len)
+{
+	struct fuse2fs_dentry *d;
+
+	for (d = *dcache_bucket(ff, dir, name, len); d; d = d->hash_next)
+		if (d->dir == dir && d->len == len &&
+		    memcmp(d->name, name, len) == 0)
+			return d;
+	return NULL;
+}
+
+/* "." and ".." are left alone, since ".." changes on rename */
+static int dcache_wanted(struct fuse2fs *ff, const char *name,
+			 unsigned int len)
+{
+	if (!ff->dcache || len > EXT2_NAME_LEN)
+		return 0;
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+		return 0;
+	return 1;
+}
+
+static int dcache_lookup(struct fuse2fs *ff, ext2_ino_t dir, const char *name,
+			 unsigned int len, ext2_ino_t *ino)
+{
+	struct fuse2fs_dentry *d;
+
+	if (!dcache_wanted(ff, name, len))
+		return 0;
+	pthread_mutex_lock(&ff->dcache_lock);
+	ff->dcache_lookups++;
+	d = dcache_find(ff, dir, name, len);
+	if (d) {
+		*ino = d->ino;
+		dcache_lru_remove(ff, d);
+		dcache_lru_add(ff, d);
+		ff->dcache_hits++;
+	}
+	pthread_mutex_unlock(&ff->dcache_lock);
+	return d != NULL;
+}
+
+/* Record that name in dir refers to ino, or doesn't exist if ino is 0 */
+static void dcache_add(ext2_filsys fs, ext2_ino_t dir, const char *name,
+		       unsigned int len, ext2_ino_t ino)
+{
+	struct fuse2fs *ff = fs->priv_data;
+	struct fuse2fs_dentry *d, **bucket;
+
+	if (!dcache_wanted(ff, name, len))
+		return;
+	pthread_mutex_lock(&ff->dcache_lock);
+	d = dcache_find(ff, dir, name, len);
+	if (d) {
+		d->ino = ino;
+		goto out;
+	}
+	if (ff->dcache_count >= FUSE2FS_DCACHE_MAX)
+		dcache_drop(ff, ff->dcache_lru_tail);
+	if (ext2fs_get_mem(sizeof(*d) + len, &d))
+		goto out;
+	bucket = dcache_bucket(ff, dir, name, len);
+	d->hash_next = *bucket;
+	*bucket = d;
+	dcache_lru_add(ff, d);
+	d->dir = dir;
+	d->ino = ino;
+	d->len = len;
+	memcpy(d->name, name, len);
+	ff->dcache_count++;
+out:
+	pthread_mutex_unlock(&ff->dcache_lock);
+}
+
+static void dcache_forget(ext2_filsys fs, ext2_ino_t dir, const char *name)
+{
+	struct fuse2fs *ff = fs->priv_data;
+	struct fuse2fs_dentry *d;
+	unsigned int len = strlen(name);
+
+	if (!dcache_wanted(ff, name, len))
+		return;
+	pthread_mutex_lock(&ff->dcache_lock);
+	d = dcache_find(ff, dir, name, len);
+	if (d)
+		dcache_drop(ff, d);
+	pthread_mutex_unlock(&ff->dcache_lock);
+}
+
+/* Forget everything cached about the names in a removed directory */
+static void dcache_forget_dir(ext2_filsys fs, ext2_ino_t dir)
+{
+	struct fuse2fs *ff = fs->priv_data;
+	struct fuse2fs_dentry *d, *next;
+
+	if (!ff->dcache)
+		return;
+	pthread_mutex_lock(&ff->dcache_lock);
+	for (d = ff->dcache_lru; d; d = next) {
+		next = d->lru_next;
+		if (d->dir == dir)
+			dcache_drop(ff, d);
+	}
+	pthread_mutex_unlock(&ff->dcache_lock);
+}
+
+static void dcache_free(struct fuse2fs *ff)
+{
+	while (ff->dcache_lru)
+		dcache_drop(ff, ff->dcache_lru);
+	ext2fs_free_mem(&ff->dcache);
+}
+
+/*
+ * Resolve an absolute path from the root, through the dentry cache.
+ * Unlike ext2fs_namei() this doesn't follow symlinks, but the paths
+ * which fuse hands us never go through one.
+ */
+static errcode_t fuse2fs_namei(ext2_filsys fs, const char *path,
+			       ext2_ino_t *ino)
+{
+	struct fuse2fs *ff = fs->priv_data;
+	ext2_ino_t dir = EXT2_ROOT_INO, child;
+	const char *name = path;
+	unsigned int len;
+	errcode_t err;
+
+	while (1) {
+		while (*name == '/')
+			name++;
+		if (!*name)
+			break;
+		for (len = 0; name[len] && name[len] != '/'; len++)
+			;
+		if (dcache_lookup(ff, dir, name, len, &child)) {
+			if (!child)
+				return EXT2_ET_FILE_NOT_FOUND;
+		} else {
+			err = ext2fs_lookup(fs, dir, name, len, NULL, &child);
+			if (err == EXT2_ET_FILE_NOT_FOUND)
+				dcache_add(fs, dir, name, len, 0);
+			if (err)
+				return err;
+			dcache_add(fs, dir, name, len, child);
+		}
+		dir = child;
+		name += len;
+	}
+	*ino = dir;
+	return 0;
+}
+
 static int check_inum_access(ext2_filsys fs, ext2_ino_t ino, mode_t mask)
 {
 	struct fuse_context *ctxt = fuse_get_context();
@@ -637,66 +1011,773 @@ static int check_inum_access(ext2_filsys fs, ext2_ino_t ino, mode_t mask)
 	mode_t perms;
 	errcode_t err;
 
-	/* no writing to read-only or broken fs */
-	if ((mask & W_OK) && !fs_writeable(fs))
-		return -EROFS;
+	/* no writing to read-only or broken fs */
+	if ((mask & W_OK) && !fs_writeable(fs))
+		return -EROFS;
+
+	err = ext2fs_read_inode(fs, ino, &inode);
+	if (err)
+		return translate_error(fs, ino, err);
+	perms = inode.i_mode & 0777;
+
+	dbg_printf("access ino=%d mask=e%s%s%s perms=0%o fuid=%d fgid=%d "
+		   "uid=%d gid=%d\n", ino,
+		   (mask & R_OK ? "r" : ""), (mask & W_OK ? "w" : ""),
+		   (mask & X_OK ? "x" : ""), perms, inode_uid(inode),
+		   inode_gid(inode), ctxt->uid, ctxt->gid);
+
+	/* existence check */
+	if (mask == 0)
+		return 0;
+
+	/* is immutable? */
+	if ((mask & W_OK) &&
+	    (inode.i_flags & EXT2_IMMUTABLE_FL))
+		return -EACCES;
+
+	/* Figure out what root's allowed to do */
+	if (ff->fakeroot || ctxt->uid == 0) {
+		/* Non-file access always ok */
+		if (!LINUX_S_ISREG(inode.i_mode))
+			return 0;
+
+		/* R/W access to a file always ok */
+		if (!(mask & X_OK))
+			return 0;
+
+		/* X access to a file ok if a user/group/other can X */
+		if (perms & 0111)
+			return 0;
+
+		/* Trying to execute a file that's not executable. BZZT! */
+		return -EACCES;
+	}
+
+	/* allow owner, if perms match */
+	if (inode_uid(inode) == ctxt->uid) {
+		if ((mask & (perms >> 6)) == mask)
+			return 0;
+		return -EACCES;
+	}
+
+	/* allow group, if perms match */
+	if (inode_gid(inode) == ctxt->gid) {
+		if ((mask & (perms >> 3)) == mask)
+			return 0;
+		return -EACCES;
+	}
+
+	/* otherwise check other */
+	if ((mask & perms) == mask)
+		return 0;
+	return -EACCES;
+}
+
+/* Journaled writes */
+
+static struct fuse2fs_jblock *jio_find(struct fuse2fs_jio *jio, blk64_t blk)
+{
+	struct fuse2fs_jblock *jb;
+
+	for (jb = jio->hash[blk & jio->hash_mask]; jb; jb = jb->hash_next)
+		if (jb->blk == blk)
+			return jb;
+	return NULL;
+}
+
+/*
+ * Find or add a block about to be changed, reading it from the device
+ * if @fill is set.  A block that is committed but not yet checkpointed
+ * keeps a copy of its committed contents, which the checkpoint writes.
+ */
+static errcode_t jio_get(io_channel channel, blk64_t blk, int fill,
+			 struct fuse2fs_jblock **ret_jb)
+{
+	struct fuse2fs_jio *jio = channel->private_data;
+	struct fuse2fs_jblock *jb;
+	errcode_t err;
+
+	jb = jio_find(jio, blk);
+	if (jb) {
+		if (!jb->dirty) {
+			err = ext2fs_get_mem(channel->block_size,
+					     &jb->committed);
+			if (err)
+				return err;
+			memcpy(jb->committed, jb->data, channel->block_size);
+			jb->dirty = 1;
+			jio->nr_dirty++;
+		}
+		*ret_jb = jb;
+		return 0;
+	}
+
+	err = ext2fs_get_mem(sizeof(*jb) + channel->block_size, &jb);
+	if (err)
+		return err;
+	if (fill) {
+		err = io_channel_read_blk64(jio->real, blk, 1, jb->data);
+		if (err) {
+			ext2fs_free_mem(&jb);
+			return err;
+		}
+	}
+	jb->blk = blk;
+	jb->dirty = 1;
+	jb->committed = NULL;
+	jb->hash_next = jio->hash[blk & jio->hash_mask];
+	jio->hash[blk & jio->hash_mask] = jb;
+	jio->nr_blocks++;
+	jio->nr_dirty++;
+	*ret_jb = jb;
+	return 0;
+}
+
+static errcode_t jio_read_blk64(io_channel channel, unsigned long long block,
+				int count, void *buf)
+{
+	struct fuse2fs_jio *jio;
+	struct fuse2fs_jblock *jb;
+	unsigned long long off, start, end;
+	size_t size;
+	blk64_t blk;
+	int bs;
+	errcode_t err;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	jio = channel->private_data;
+	bs = channel->block_size;
+
+	if (count == 1) {
+		pthread_mutex_lock(&jio->lock);
+		jb = jio_find(jio, block);
+		if (jb)
+			memcpy(buf, jb->data, bs);
+		pthread_mutex_unlock(&jio->lock);
+		if (jb)
+			return 0;
+	}
+
+	err = io_channel_read_blk64(jio->real, block, count, buf);
+	if (err)
+		return err;
+
+	/* Lay whatever has changed since over what the device has */
+	off = block * bs;
+	size = count < 0 ? (size_t) -count : (size_t) count * bs;
+	pthread_mutex_lock(&jio->lock);
+	for (blk = block; jio->nr_blocks && blk * bs < off + size; blk++) {
+		jb = jio_find(jio, blk);
+		if (!jb)
+			continue;
+		start = blk * bs;
+		end = start + bs;
+		if (end > off + size)
+			end = off + size;
+		memcpy((char *)buf + (start - off), jb->data, end - start);
+	}
+	pthread_mutex_unlock(&jio->lock);
+	return 0;
+}
+
+static errcode_t jio_write_range(io_channel channel, unsigned long long off,
+				 size_t size, const void *buf)
+{
+	struct fuse2fs_jio *jio = channel->private_data;
+	struct fuse2fs_jblock *jb;
+	unsigned long long start, end;
+	blk64_t blk;
+	int bs = channel->block_size;
+	errcode_t err = 0;
+
+	pthread_mutex_lock(&jio->lock);
+	for (blk = off / bs; blk * bs < off + size; blk++) {
+		start = blk * bs;
+		end = start + bs;
+		if (start < off)
+			start = off;
+		if (end > off + size)
+			end = off + size;
+		err = jio_get(channel, blk, end - start < (unsigned) bs, &jb);
+		if (err)
+			break;
+		memcpy(jb->data + (start - blk * bs),
+		       (const char *)buf + (start - off), end - start);
+	}
+	pthread_mutex_unlock(&jio->lock);
+	return err;
+}
+
+static errcode_t jio_write_blk64(io_channel channel, unsigned long long block,
+				 int count, const void *buf)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	return jio_write_range(channel, block * channel->block_size,
+			       count < 0 ? (size_t) -count :
+			       (size_t) count * channel->block_size, buf);
+}
+
+static errcode_t jio_read_blk(io_channel channel, unsigned long block,
+			      int count, void *buf)
+{
+	return jio_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t jio_write_blk(io_channel channel, unsigned long block,
+			       int count, const void *buf)
+{
+	return jio_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t jio_write_byte(io_channel channel, unsigned long offset,
+				int size, const void *buf)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	return jio_write_range(channel, offset, size, buf);
+}
+
+/* Nothing reaches the device until the next commit */
+static errcode_t jio_flush(io_channel channel)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	return 0;
+}
+
+static errcode_t jio_set_blksize(io_channel channel, int blksize)
+{
+	struct fuse2fs_jio *jio;
+	errcode_t err;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	jio = channel->private_data;
+	if (jio->nr_blocks && blksize != channel->block_size)
+		return EXT2_ET_UNIMPLEMENTED;
+	err = io_channel_set_blksize(jio->real, blksize);
+	if (!err)
+		channel->block_size = blksize;
+	return err;
+}
+
+static errcode_t jio_set_option(io_channel channel, const char *option,
+				const char *arg)
+{
+	struct fuse2fs_jio *jio;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	jio = channel->private_data;
+	if (!jio->real->manager->set_option)
+		return EXT2_ET_INVALID_ARGUMENT;
+	return jio->real->manager->set_option(jio->real, option, arg);
+}
+
+static errcode_t jio_get_stats(io_channel channel, io_stats *stats)
+{
+	struct fuse2fs_jio *jio;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	jio = channel->private_data;
+	if (!jio->real->manager->get_stats)
+		return EXT2_ET_UNIMPLEMENTED;
+	return jio->real->manager->get_stats(jio->real, stats);
+}
+
+static errcode_t jio_cache_readahead(io_channel channel,
+				     unsigned long long block,
+				     unsigned long long count)
+{
+	struct fuse2fs_jio *jio;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	jio = channel->private_data;
+	return io_channel_cache_readahead(jio->real, block, count);
+}
+
+/*
+ * Discarding or zeroing the device directly could destroy blocks which
+ * the committed state still uses, so make the library write zeroes.
+ */
+static errcode_t jio_discard(io_channel channel EXT2FS_ATTR((unused)),
+			     unsigned long long block EXT2FS_ATTR((unused)),
+			     unsigned long long count EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+static errcode_t jio_close(io_channel channel)
+{
+	struct fuse2fs_jio *jio;
+	struct fuse2fs_jblock *jb;
+	unsigned int i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	jio = channel->private_data;
+	if (--channel->refcount > 0)
+		return 0;
+
+	for (i = 0; i <= jio->hash_mask; i++) {
+		while ((jb = jio->hash[i]) != NULL) {
+			jio->hash[i] = jb->hash_next;
+			ext2fs_free_mem(&jb->committed);
+			ext2fs_free_mem(&jb);
+		}
+	}
+	ext2fs_free_mem(&jio->hash);
+	pthread_mutex_destroy(&jio->lock);
+	if (jio->real)
+		io_channel_close(jio->real);
+	ext2fs_free_mem(&jio);
+	ext2fs_free_mem(&channel);
+	return 0;
+}
+
+static struct struct_io_manager fuse2fs_jio_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "fuse2fs journal I/O Manager",
+	.close		= jio_close,
+	.set_blksize	= jio_set_blksize,
+	.read_blk	= jio_read_blk,
+	.write_blk	= jio_write_blk,
+	.flush		= jio_flush,
+	.write_byte	= jio_write_byte,
+	.set_option	= jio_set_option,
+	.get_stats	= jio_get_stats,
+	.read_blk64	= jio_read_blk64,
+	.write_blk64	= jio_write_blk64,
+	.discard	= jio_discard,
+	.cache_readahead = jio_cache_readahead,
+	.zeroout	= jio_discard,
+};
+
+static int jblock_cmp(const void *a, const void *b)
+{
+	const struct fuse2fs_jblock *ja = *(struct fuse2fs_jblock * const *)a;
+	const struct fuse2fs_jblock *jb = *(struct fuse2fs_jblock * const *)b;
+
+	return (ja->blk > jb->blk) - (ja->blk < jb->blk);
+}
+
+/* What a block looked like as of the last commit, if it was committed */
+static char *jblock_committed(struct fuse2fs_jblock *jb)
+{
+	return jb->dirty ? jb->committed : jb->data;
+}
+
+/* Gather the dirty or the committed blocks, in disk order */
+static errcode_t jio_collect(struct fuse2fs_jio *jio, int dirty,
+			     struct fuse2fs_jblock ***ret_list,
+			     blk64_t *ret_count)
+{
+	struct fuse2fs_jblock **list, *jb;
+	blk64_t n = 0, want;
+	unsigned int i;
+	errcode_t err;
+
+	want = dirty ? jio->nr_dirty : jio->nr_blocks;
+	err = ext2fs_get_array(want ? want : 1, sizeof(*list), &list);
+	if (err)
+		return err;
+	for (i = 0; i <= jio->hash_mask; i++)
+		for (jb = jio->hash[i]; jb; jb = jb->hash_next)
+			if (dirty ? jb->dirty : !!jblock_committed(jb))
+				list[n++] = jb;
+	qsort(list, n, sizeof(*list), jblock_cmp);
+	*ret_list = list;
+	*ret_count = n;
+	return 0;
+}
+
+static void jio_drop(struct fuse2fs_jio *jio, struct fuse2fs_jblock *jb)
+{
+	struct fuse2fs_jblock **p;
+
+	for (p = &jio->hash[jb->blk & jio->hash_mask]; *p != jb;
+	     p = &(*p)->hash_next)
+		;
+	*p = jb->hash_next;
+	if (jb->dirty)
+		jio->nr_dirty--;
+	jio->nr_blocks--;
+	ext2fs_free_mem(&jb->committed);
+	ext2fs_free_mem(&jb);
+}
+
+/*
+ * Write every committed block to its final location as of its last
+ * commit and empty the journal.  Blocks changed since stay in memory
+ * for the next commit.  Called with bfl held exclusively.
+ */
+static errcode_t fuse2fs_checkpoint(struct fuse2fs *ff)
+{
+	struct fuse2fs_jio *jio = ff->jio;
+	journal_t *journal = ff->journal;
+	struct fuse2fs_jblock **list = NULL;
+	blk64_t i, n;
+	errcode_t err;
+
+	err = jio_collect(jio, 0, &list, &n);
+	if (err)
+		return err;
+
+	for (i = 0; i < n; i++) {
+		err = io_channel_write_blk64(jio->real, list[i]->blk, 1,
+					     jblock_committed(list[i]));
+		if (err)
+			goto out;
+	}
+	err = io_channel_flush(jio->real);
+	if (err)
+		goto out;
+
+	if (journal->j_tail) {
+		journal->j_tail = 0;
+		journal->j_tail_sequence = journal->j_transaction_sequence;
+		journal->j_head = journal->j_first;
+		err = ext2fs_write_journal_sb(journal);
+		if (!err)
+			err = io_channel_flush(jio->real);
+		if (err)
+			goto out;
+	}
+
+	pthread_mutex_lock(&jio->lock);
+	for (i = 0; i < n; i++) {
+		if (list[i]->dirty)
+			ext2fs_free_mem(&list[i]->committed);
+		else
+			jio_drop(jio, list[i]);
+	}
+	pthread_mutex_unlock(&jio->lock);
+out:
+	ext2fs_free_mem(&list);
+	return err;
+}
+
+static int journal_has_room(journal_t *journal, blk64_t blocks)
+{
+	blk64_t start = journal->j_tail ? journal->j_head : journal->j_first;
+
+	return start + blocks <= journal->j_last;
+}
+
+/* Write @n of the changed blocks to the journal as one transaction */
+static errcode_t fuse2fs_commit_trans(struct fuse2fs *ff,
+				      struct fuse2fs_jblock **list, blk64_t n)
+{
+	struct fuse2fs_jio *jio = ff->jio;
+	journal_t *journal = ff->journal;
+	journal_transaction_t trans;
+	blk64_t *blocks = NULL;
+	void **data = NULL;
+	blk64_t i;
+	int was_empty;
+	errcode_t err;
+
+	err = ext2fs_get_array(n, sizeof(*blocks), &blocks);
+	if (!err)
+		err = ext2fs_get_array(n, sizeof(*data), &data);
+	if (err)
+		goto out;
+	for (i = 0; i < n; i++) {
+		blocks[i] = list[i]->blk;
+		data[i] = list[i]->data;
+	}
+
+	/*
+	 * The journal goes straight to the device through journal_io, and
+	 * the commit block only once everything it covers is stable.
+	 */
+	was_empty = !journal->j_tail;
+	err = journal_open_trans(journal, &trans,
+				 journal_guess_blocks(journal, n, 0));
+	if (!err)
+		err = journal_add_blocks_to_trans(&trans, blocks, n, data);
+	if (!err)
+		err = io_channel_flush(jio->real);
+	if (!err)
+		err = journal_commit_trans(&trans);
+	if (!err)
+		err = journal_close_trans(&trans);
+	if (!err && was_empty)
+		err = ext2fs_write_journal_sb(journal);
+	if (!err)
+		err = io_channel_flush(jio->real);
+	if (err)
+		goto out;
+
+	pthread_mutex_lock(&jio->lock);
+	for (i = 0; i < n; i++) {
+		ext2fs_free_mem(&list[i]->committed);
+		list[i]->dirty = 0;
+	}
+	jio->nr_dirty -= n;
+	pthread_mutex_unlock(&jio->lock);
+out:
+	ext2fs_free_mem(&data);
+	ext2fs_free_mem(&blocks);
+	return err;
+}
+
+/*
+ * Write everything changed since the last commit to the journal, and
+ * checkpoint once the journal or the memory holding the committed
+ * blocks fills up.  Called with bfl held exclusively.
+ */
+static errcode_t fuse2fs_commit(struct fuse2fs *ff)
+{
+	ext2_filsys fs = ff->fs;
+	struct fuse2fs_jio *jio = ff->jio;
+	journal_t *journal = ff->journal;
+	struct fuse2fs_jblock **list = NULL;
+	blk64_t i, n, count;
+	errcode_t err;
+
+	err = ext2fs_flush2(fs, EXT2_FLAG_FLUSH_NO_SYNC);
+	if (err)
+		return err;
+	fs->flags &= ~EXT2_FLAG_CHANGED;
+	if (!jio->nr_dirty)
+		return 0;
+
+	err = jio_collect(jio, 1, &list, &n);
+	if (err)
+		return err;
+
+	/*
+	 * Every commit leaves at least half of the journal free, so only
+	 * a single big update has to checkpoint first.  One too big for
+	 * even an empty journal goes in as several transactions, and a
+	 * crash can leave it half done, but never torn within a block.
+	 */
+	for (i = 0; i < n; i += count) {
+		count = n - i;
+		while (count > 1 && journal_guess_blocks(journal, count, 0) >
+				    journal->j_last - journal->j_first)
+			count /= 2;
+		if (!journal_has_room(journal,
+				      journal_guess_blocks(journal, count, 0)))
+			err = fuse2fs_checkpoint(ff);
+		if (!err)
+			err = fuse2fs_commit_trans(ff, list + i, count);
+		if (err)
+			goto out;
+	}
+
+	/* needs_recovery has been on disk since the mount */
+	fs->flags &= ~(EXT2_FLAG_DIRTY | EXT2_FLAG_CHANGED);
+
+	if (journal->j_head - journal->j_first >
+	    (journal->j_last - journal->j_first) / 2 ||
+	    jio->nr_blocks > ff->jmax_blocks)
+		err = fuse2fs_checkpoint(ff);
+out:
+	ext2fs_free_mem(&list);
+	return err;
+}
+
+/* Commit early if a big update has piled up; called with bfl held */
+static errcode_t fuse2fs_commit_if_full(struct fuse2fs *ff)
+{
+	if (!ff->jio || ff->jio->nr_dirty <= ff->jmax_dirty)
+		return 0;
+	return fuse2fs_commit(ff);
+}
+
+/*
+ * Route all writes through the journal from now on.  The superblock
+ * says that the journal needs recovery for as long as we're mounted,
+ * so a crash leaves the file system as of the last commit.
+ */
+static errcode_t fuse2fs_start_journal(struct fuse2fs *ff)
+{
+	ext2_filsys fs = ff->fs;
+	journal_t *journal = NULL;
+	struct fuse2fs_jio *jio = NULL;
+	io_channel channel = NULL;
+	blk64_t jblocks;
+	unsigned int buckets;
+	errcode_t err;
+
+	err = ext2fs_open_journal(fs, &journal);
+	if (err)
+		return err;
+	if (journal->j_tail) {
+		err = EXT2_ET_JOURNAL_FLAGS_WRONG;
+		goto errout;
+	}
+	if (ext2fs_has_feature_64bit(fs->super) &&
+	    !jbd2_has_feature_64bit(journal)) {
+		if (journal->j_format_version < 2) {
+			err = EXT2_ET_JOURNAL_UNSUPP_VERSION;
+			goto errout;
+		}
+		jbd2_set_feature_64bit(journal);
+		err = ext2fs_write_journal_sb(journal);
+		if (err)
+			goto errout;
+	}
+
+	jblocks = journal->j_last - journal->j_first;
+	ff->jmax_blocks = FUSE2FS_WRITEBACK_CACHE / fs->blocksize;
+	if (ff->jmax_blocks > jblocks / 2)
+		ff->jmax_blocks = jblocks / 2;
+	ff->jmax_dirty = ff->jmax_blocks / 2;
+
+	for (buckets = 1024; buckets < ff->jmax_blocks; buckets <<= 1)
+		;
+	err = ext2fs_get_memzero(sizeof(*jio), &jio);
+	if (!err)
+		err = ext2fs_get_arrayzero(buckets, sizeof(*jio->hash),
+					   &jio->hash);
+	if (!err)
+		err = ext2fs_get_memzero(sizeof(*channel), &channel);
+	if (err)
+		goto errout;
+	jio->hash_mask = buckets - 1;
+	jio->real = fs->io;
+	pthread_mutex_init(&jio->lock, NULL);
+	channel->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	channel->manager = &fuse2fs_jio_manager;
+	channel->name = fs->io->name;
+	channel->block_size = fs->io->block_size;
+	channel->refcount = 1;
+	channel->flags = fs->io->flags;
+	channel->align = fs->io->align;
+	channel->private_data = jio;
+
+	ext2fs_set_feature_journal_needs_recovery(fs->super);
+	ext2fs_mark_super_dirty(fs);
+	err = ext2fs_flush2(fs, 0);
+	if (err) {
+		pthread_mutex_destroy(&jio->lock);
+		goto errout;
+	}
+
+	/* Backup superblocks and descriptors are updated at unmount */
+	fs->flags |= EXT2_FLAG_MASTER_SB_ONLY;
+	if (fs->image_io == fs->io)
+		fs->image_io = channel;
+	fs->io = channel;
+	ff->journal = journal;
+	ff->jio = jio;
+	return 0;
 
-	err = ext2fs_read_inode(fs, ino, &inode);
-	if (err)
-		return translate_error(fs, ino, err);
-	perms = inode.i_mode & 0777;
+errout:
+	if (jio)
+		ext2fs_free_mem(&jio->hash);
+	ext2fs_free_mem(&jio);
+	ext2fs_free_mem(&channel);
+	ext2fs_close_journal(fs, &journal);
+	return err;
+}
 
-	dbg_printf("access ino=%d mask=e%s%s%s perms=0%o fuid=%d fgid=%d "
-		   "uid=%d gid=%d\n", ino,
-		   (mask & R_OK ? "r" : ""), (mask & W_OK ? "w" : ""),
-		   (mask & X_OK ? "x" : ""), perms, inode_uid(inode),
-		   inode_gid(inode), ctxt->uid, ctxt->gid);
+/*
+ * Commit and checkpoint everything, then write the superblock and its
+ * backups in place with needs_recovery cleared.  If that fails the
+ * flag stays set, so the next mount or e2fsck replays what's committed.
+ */
+static errcode_t fuse2fs_stop_journal(struct fuse2fs *ff)
+{
+	ext2_filsys fs = ff->fs;
+	struct fuse2fs_jio *jio = ff->jio;
+	io_channel channel;
+	errcode_t err;
 
-	/* existence check */
-	if (mask == 0)
+	if (!jio)
 		return 0;
 
-	/* is immutable? */
-	if ((mask & W_OK) &&
-	    (inode.i_flags & EXT2_IMMUTABLE_FL))
-		return -EACCES;
+	err = fuse2fs_commit(ff);
+	if (!err)
+		err = fuse2fs_checkpoint(ff);
 
-	/* Figure out what root's allowed to do */
-	if (ff->fakeroot || ctxt->uid == 0) {
-		/* Non-file access always ok */
-		if (!LINUX_S_ISREG(inode.i_mode))
-			return 0;
+	channel = fs->io;
+	if (fs->image_io == channel)
+		fs->image_io = jio->real;
+	fs->io = jio->real;
+	jio->real = NULL;
+	io_channel_close(channel);
+	ff->jio = NULL;
 
-		/* R/W access to a file always ok */
-		if (!(mask & X_OK))
-			return 0;
+	ext2fs_close_journal(fs, &ff->journal);
+	if (err) {
+		/* Nothing uncommitted may reach the disk now */
+		fs->flags &= ~(EXT2_FLAG_DIRTY | EXT2_FLAG_CHANGED |
+			       EXT2_FLAG_BB_DIRTY | EXT2_FLAG_IB_DIRTY);
+		return err;
+	}
 
-		/* X access to a file ok if a user/group/other can X */
-		if (perms & 0111)
-			return 0;
+	fs->flags &= ~EXT2_FLAG_MASTER_SB_ONLY;
+	ext2fs_clear_feature_journal_needs_recovery(fs->super);
+	ext2fs_mark_super_dirty(fs);
+	return ext2fs_flush2(fs, 0);
+}
 
-		/* Trying to execute a file that's not executable. BZZT! */
-		return -EACCES;
-	}
+/*
+ * Write out everything that has changed.  In write-back mode the cached
+ * blocks go to disk first, so that the bitmaps, group descriptors and
+ * superblock written after them never account for blocks which aren't
+ * there yet.  With a journal, this is a commit.  Called with bfl held
+ * exclusively.
+ */
+static errcode_t fuse2fs_flush(struct fuse2fs *ff, int flags)
+{
+	ext2_filsys fs = ff->fs;
+	errcode_t err;
 
-	/* allow owner, if perms match */
-	if (inode_uid(inode) == ctxt->uid) {
-		if ((mask & (perms >> 6)) == mask)
-			return 0;
-		return -EACCES;
+	if (ff->jio)
+		return fuse2fs_commit(ff);
+	if (ff->writeback) {
+		err = io_channel_flush(fs->io);
+		if (err)
+			return err;
 	}
+	err = ext2fs_flush2(fs, flags);
+	if (!err)
+		fs->flags &= ~EXT2_FLAG_CHANGED;
+	return err;
+}
 
-	/* allow group, if perms match */
-	if (inode_gid(inode) == ctxt->gid) {
-		if ((mask & (perms >> 3)) == mask)
-			return 0;
-		return -EACCES;
+/* Commits whatever write-back mode has cached, every commit_interval */
+static void *flush_thread(void *p)
+{
+	struct fuse2fs *ff = p;
+	ext2_filsys fs = ff->fs;
+	struct timespec deadline;
+	errcode_t err;
+
+	pthread_mutex_lock(&ff->flush_lock);
+	while (!ff->flush_stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += ff->commit_interval;
+		pthread_cond_timedwait(&ff->flush_cond, &ff->flush_lock,
+				       &deadline);
+		if (ff->flush_stop)
+			break;
+		pthread_mutex_unlock(&ff->flush_lock);
+
+		pthread_rwlock_wrlock(&ff->bfl);
+		if (fs->flags & EXT2_FLAG_CHANGED) {
+			err = fuse2fs_flush(ff, 0);
+			if (err)
+				translate_error(fs, 0, err);
+		}
+		fuse2fs_write_unlock(ff);
+
+		pthread_mutex_lock(&ff->flush_lock);
 	}
+	pthread_mutex_unlock(&ff->flush_lock);
+	return NULL;
+}
 
-	/* otherwise check other */
-	if ((mask & perms) == mask)
-		return 0;
-	return -EACCES;
+static void stop_flush_thread(struct fuse2fs *ff)
+{
+	if (!ff->flush_running)
+		return;
+	pthread_mutex_lock(&ff->flush_lock);
+	ff->flush_stop = 1;
+	pthread_cond_signal(&ff->flush_cond);
+	pthread_mutex_unlock(&ff->flush_lock);
+	pthread_join(ff->flush_thread, NULL);
+	ff->flush_running = 0;
 }
 
 static void op_destroy(void *p EXT2FS_ATTR((unused)))
@@ -712,6 +1793,19 @@ static void op_destroy(void *p EXT2FS_ATTR((unused)))
 	}
 	fs = ff->fs;
 	dbg_printf("%s: dev=%s\n", __func__, fs->device_name);
+	stop_flush_thread(ff);
+	if (ff->debug) {
+		struct ext2_extent_cache_stats stats;
+
+		ext2fs_get_extent_cache_stats(fs, &stats);
+		printf("FUSE2FS (%s): extent cache %llu hits / %llu lookups, "
+		       "%llu invalidations\n", fs->device_name,
+		       (unsigned long long) stats.hits,
+		       (unsigned long long) stats.lookups,
+		       (unsigned long long) stats.invalidations);
+		printf("FUSE2FS (%s): dentry cache %llu hits / %llu lookups\n",
+		       fs->device_name, ff->dcache_hits, ff->dcache_lookups);
+	}
 	if (fs->flags & EXT2_FLAG_RW) {
 		fs->super->s_state |= EXT2_VALID_FS;
 		if (fs->super->s_error_count)
@@ -721,7 +1815,11 @@ static void op_destroy(void *p EXT2FS_ATTR((unused)))
 		if (err)
 			translate_error(fs, 0, err);
 
-		err = ext2fs_flush2(fs, 0);
+		err = fuse2fs_flush(ff, 0);
+		if (err)
+			translate_error(fs, 0, err);
+
+		err = fuse2fs_stop_journal(ff);
 		if (err)
 			translate_error(fs, 0, err);
 	}
@@ -742,15 +1840,43 @@ static void *op_init(struct fuse_conn_info *conn)
 	dbg_printf("%s: dev=%s\n", __func__, fs->device_name);
 #ifdef FUSE_CAP_IOCTL_DIR
 	conn->want |= FUSE_CAP_IOCTL_DIR;
+#endif
+	/*
+	 * libfuse starts max_write at the largest request its buffers
+	 * can take and max_readahead at what the kernel offers, so keep
+	 * those and ask for the capabilities which let streaming i/o use
+	 * them: big writes, several reads in flight at once, and read
+	 * replies spliced from the device.
+	 */
+#ifdef FUSE_CAP_BIG_WRITES
+	conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+#ifdef FUSE_CAP_ASYNC_READ
+	conn->want |= FUSE_CAP_ASYNC_READ;
+#endif
+#ifdef FUSE_CAP_SPLICE_WRITE
+	if (ff->splice_fd >= 0)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
 #endif
 	if (fs->flags & EXT2_FLAG_RW) {
 		fs->super->s_mnt_count++;
 		fs->super->s_mtime = time(NULL);
-		fs->super->s_state &= ~EXT2_VALID_FS;
+		/* Replaying the journal is all a crash calls for */
+		if (!ff->journal)
+			fs->super->s_state &= ~EXT2_VALID_FS;
 		ext2fs_mark_super_dirty(fs);
 		err = ext2fs_flush2(fs, 0);
 		if (err)
 			translate_error(fs, 0, err);
+
+		/*
+		 * The commit thread is started here rather than in main
+		 * because fuse_main forks before calling us.
+		 */
+		if (ff->writeback &&
+		    pthread_create(&ff->flush_thread, NULL, flush_thread,
+				   ff) == 0)
+			ff->flush_running = 1;
 	}
 	return ff;
 }
@@ -809,15 +1935,15 @@ static int op_getattr(const char *path, struct stat *statbuf)
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf("%s: path=%s\n", __func__, path);
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	pthread_rwlock_rdlock(&ff->bfl);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
 	}
 	ret = stat_inode(fs, ino, statbuf);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_read_unlock(ff);
 	return ret;
 }
 
@@ -836,8 +1962,8 @@ static int op_readlink(const char *path, char *buf, size_t len)
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf("%s: path=%s\n", __func__, path);
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	pthread_rwlock_rdlock(&ff->bfl);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -886,14 +2012,11 @@ out2:
 	}
 	buf[len] = 0;
 
-	if (fs_writeable(fs)) {
-		ret = update_atime(fs, ino);
-		if (ret)
-			goto out;
-	}
-
+	ret = atime_needs_update(fs, ino);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_read_unlock(ff);
+	if (ret > 0)
+		ret = update_atime(ff, ino);
 	return ret;
 }
 
@@ -928,14 +2051,13 @@ static int op_mknod(const char *path, mode_t mode, dev_t dev)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!fs_can_allocate(ff, 2)) {
 		ret = -ENOSPC;
 		goto out2;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
-			   &parent);
+	err = fuse2fs_namei(fs, temp_path, &parent);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out2;
@@ -968,6 +2090,7 @@ static int op_mknod(const char *path, mode_t mode, dev_t dev)
 
 	dbg_printf("%s: create ino=%d/name=%s in dir=%d\n", __func__, child,
 		   node_name, parent);
+	dcache_forget(fs, parent, node_name);
 	err = ext2fs_link(fs, parent, node_name, child, filetype);
 	if (err == EXT2_ET_DIR_NO_SPACE) {
 		err = ext2fs_expand_dir(fs, parent);
@@ -1021,7 +2144,7 @@ static int op_mknod(const char *path, mode_t mode, dev_t dev)
 	ext2fs_inode_alloc_stats2(fs, child, 1, 0);
 
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -1059,14 +2182,13 @@ static int op_mkdir(const char *path, mode_t mode)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!fs_can_allocate(ff, 1)) {
 		ret = -ENOSPC;
 		goto out2;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
-			   &parent);
+	err = fuse2fs_namei(fs, temp_path, &parent);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out2;
@@ -1087,6 +2209,7 @@ static int op_mkdir(const char *path, mode_t mode)
 
 	*node_name = a;
 
+	dcache_forget(fs, parent, node_name);
 	err = ext2fs_mkdir(fs, parent, 0, node_name);
 	if (err == EXT2_ET_DIR_NO_SPACE) {
 		err = ext2fs_expand_dir(fs, parent);
@@ -1107,8 +2230,7 @@ static int op_mkdir(const char *path, mode_t mode)
 		goto out2;
 
 	/* Still have to update the uid/gid of the dir */
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
-			   &child);
+	err = fuse2fs_namei(fs, temp_path, &child);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out2;
@@ -1163,7 +2285,7 @@ static int op_mkdir(const char *path, mode_t mode)
 out3:
 	ext2fs_free_mem(&block);
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -1180,8 +2302,7 @@ static int unlink_file_by_name(ext2_filsys fs, const char *path)
 	base_name = strrchr(filename, '/');
 	if (base_name) {
 		*base_name++ = '\0';
-		err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, filename,
-				   &dir);
+		err = fuse2fs_namei(fs, filename, &dir);
 		if (err) {
 			free(filename);
 			return translate_error(fs, 0, err);
@@ -1200,6 +2321,7 @@ static int unlink_file_by_name(ext2_filsys fs, const char *path)
 	dbg_printf("%s: unlinking name=%s from dir=%d\n", __func__,
 		   base_name, dir);
 	err = ext2fs_unlink(fs, dir, base_name, 0, 0);
+	dcache_forget(fs, dir, base_name);
 	free(filename);
 	if (err)
 		return translate_error(fs, dir, err);
@@ -1277,7 +2399,7 @@ static int __op_unlink(struct fuse2fs *ff, const char *path)
 	errcode_t err;
 	int ret = 0;
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -1301,9 +2423,9 @@ static int op_unlink(const char *path)
 	int ret;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	ret = __op_unlink(ff, path);
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 	return ret;
 }
 
@@ -1344,7 +2466,7 @@ static int __op_rmdir(struct fuse2fs *ff, const char *path)
 	struct rd_struct rds;
 	int ret = 0;
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &child);
+	err = fuse2fs_namei(fs, path, &child);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -1368,6 +2490,7 @@ static int __op_rmdir(struct fuse2fs *ff, const char *path)
 	ret = unlink_file_by_name(fs, path);
 	if (ret)
 		goto out;
+	dcache_forget_dir(fs, child);
 	/* Directories have to be "removed" twice. */
 	ret = remove_inode(ff, child);
 	if (ret)
@@ -1411,9 +2534,9 @@ static int op_rmdir(const char *path)
 	int ret;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	ret = __op_rmdir(ff, path);
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 	return ret;
 }
 
@@ -1446,9 +2569,8 @@ static int op_symlink(const char *src, const char *dest)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
-			   &parent);
+	pthread_rwlock_wrlock(&ff->bfl);
+	err = fuse2fs_namei(fs, temp_path, &parent);
 	*node_name = a;
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -1461,6 +2583,7 @@ static int op_symlink(const char *src, const char *dest)
 
 
 	/* Create symlink */
+	dcache_forget(fs, parent, node_name);
 	err = ext2fs_symlink(fs, parent, 0, node_name, src);
 	if (err == EXT2_ET_DIR_NO_SPACE) {
 		err = ext2fs_expand_dir(fs, parent);
@@ -1482,8 +2605,7 @@ static int op_symlink(const char *src, const char *dest)
 		goto out2;
 
 	/* Still have to update the uid/gid of the symlink */
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
-			   &child);
+	err = fuse2fs_namei(fs, temp_path, &child);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out2;
@@ -1512,7 +2634,7 @@ static int op_symlink(const char *src, const char *dest)
 		goto out2;
 	}
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -1557,19 +2679,19 @@ static int op_rename(const char *from, const char *to)
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf("%s: renaming %s to %s\n", __func__, from, to);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!fs_can_allocate(ff, 5)) {
 		ret = -ENOSPC;
 		goto out;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, from, &from_ino);
+	err = fuse2fs_namei(fs, from, &from_ino);
 	if (err || from_ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, to, &to_ino);
+	err = fuse2fs_namei(fs, to, &to_ino);
 	if (err && err != EXT2_ET_FILE_NOT_FOUND) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -1605,8 +2727,7 @@ static int op_rename(const char *from, const char *to)
 
 	a = *(cp + 1);
 	*(cp + 1) = 0;
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_from,
-			   &from_dir_ino);
+	err = fuse2fs_namei(fs, temp_from, &from_dir_ino);
 	*(cp + 1) = a;
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -1630,8 +2751,7 @@ static int op_rename(const char *from, const char *to)
 
 	a = *(cp + 1);
 	*(cp + 1) = 0;
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_to,
-			   &to_dir_ino);
+	err = fuse2fs_namei(fs, temp_to, &to_dir_ino);
 	*(cp + 1) = a;
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -1675,6 +2795,7 @@ static int op_rename(const char *from, const char *to)
 	/* Link in the new file */
 	dbg_printf("%s: linking ino=%d/path=%s to dir=%d\n", __func__,
 		   from_ino, cp + 1, to_dir_ino);
+	dcache_forget(fs, to_dir_ino, cp + 1);
 	err = ext2fs_link(fs, to_dir_ino, cp + 1, from_ino,
 			  ext2_file_type(inode.i_mode));
 	if (err == EXT2_ET_DIR_NO_SPACE) {
@@ -1753,16 +2874,18 @@ static int op_rename(const char *from, const char *to)
 	if (ret)
 		goto out2;
 
-	/* Flush the whole mess out */
-	err = ext2fs_flush2(fs, 0);
-	if (err)
-		ret = translate_error(fs, 0, err);
+	/* Flush the whole mess out, unless we're caching it */
+	if (!ff->writeback) {
+		err = ext2fs_flush2(fs, 0);
+		if (err)
+			ret = translate_error(fs, 0, err);
+	}
 
 out2:
 	free(temp_from);
 	free(temp_to);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 	return ret;
 }
 
@@ -1795,14 +2918,13 @@ static int op_link(const char *src, const char *dest)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!fs_can_allocate(ff, 2)) {
 		ret = -ENOSPC;
 		goto out2;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
-			   &parent);
+	err = fuse2fs_namei(fs, temp_path, &parent);
 	*node_name = a;
 	if (err) {
 		err = -ENOENT;
@@ -1814,7 +2936,7 @@ static int op_link(const char *src, const char *dest)
 		goto out2;
 
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, src, &ino);
+	err = fuse2fs_namei(fs, src, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out2;
@@ -1842,6 +2964,7 @@ static int op_link(const char *src, const char *dest)
 
 	dbg_printf("%s: linking ino=%d/name=%s to dir=%d\n", __func__, ino,
 		   node_name, parent);
+	dcache_forget(fs, parent, node_name);
 	err = ext2fs_link(fs, parent, node_name, ino,
 			  ext2_file_type(inode.i_mode));
 	if (err == EXT2_ET_DIR_NO_SPACE) {
@@ -1864,7 +2987,7 @@ static int op_link(const char *src, const char *dest)
 		goto out2;
 
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -1882,8 +3005,8 @@ static int op_chmod(const char *path, mode_t mode)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	pthread_rwlock_wrlock(&ff->bfl);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -1925,7 +3048,7 @@ static int op_chmod(const char *path, mode_t mode)
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 	return ret;
 }
 
@@ -1941,8 +3064,8 @@ static int op_chown(const char *path, uid_t owner, gid_t group)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	pthread_rwlock_wrlock(&ff->bfl);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -1995,7 +3118,7 @@ static int op_chown(const char *path, uid_t owner, gid_t group)
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 	return ret;
 }
 
@@ -2011,8 +3134,8 @@ static int op_truncate(const char *path, off_t len)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	pthread_rwlock_wrlock(&ff->bfl);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -2047,7 +3170,7 @@ out2:
 	ret = update_mtime(fs, ino, NULL);
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 	return err;
 }
 
@@ -2106,7 +3229,7 @@ static int __op_open(struct fuse2fs *ff, const char *path,
 	if (fp->flags & O_CREAT)
 		file->open_flags |= EXT2_FILE_CREATE;
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &file->ino);
+	err = fuse2fs_namei(fs, path, &file->ino);
 	if (err || file->ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -2146,12 +3269,50 @@ static int op_open(const char *path, struct fuse_file_info *fp)
 	int ret;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	ret = __op_open(ff, path, fp);
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_read_unlock(ff);
 	return ret;
 }
 
+/*
+ * Read file data through the file layer.  Returns the number of bytes
+ * read or a negative errno.  Called with bfl held shared.
+ */
+static int fuse2fs_read_file(ext2_filsys fs, struct fuse2fs_file_handle *fh,
+			     char *buf, size_t len, off_t offset)
+{
+	ext2_file_t efp;
+	errcode_t err;
+	unsigned int got = 0;
+	int ret = 0;
+
+	err = ext2fs_file_open(fs, fh->ino, fh->open_flags & ~EXT2_FILE_WRITE,
+			       &efp);
+	if (err)
+		return translate_error(fs, fh->ino, err);
+
+	err = ext2fs_file_llseek(efp, offset, SEEK_SET, NULL);
+	if (err) {
+		ret = translate_error(fs, fh->ino, err);
+		goto out;
+	}
+
+	err = ext2fs_file_read(efp, buf, len, &got);
+	if (err) {
+		ret = translate_error(fs, fh->ino, err);
+		goto out;
+	}
+
+out:
+	err = ext2fs_file_close(efp);
+	if (ret)
+		return got ? (int) got : ret;
+	if (err)
+		return translate_error(fs, fh->ino, err);
+	return got;
+}
+
 static int op_read(const char *path EXT2FS_ATTR((unused)), char *buf,
 		   size_t len, off_t offset,
 		   struct fuse_file_info *fp)
@@ -2161,9 +3322,60 @@ static int op_read(const char *path EXT2FS_ATTR((unused)), char *buf,
 	struct fuse2fs_file_handle *fh =
 		(struct fuse2fs_file_handle *)(uintptr_t)fp->fh;
 	ext2_filsys fs;
-	ext2_file_t efp;
+	int got, ret;
+
+	FUSE2FS_CHECK_CONTEXT(ff);
+	fs = ff->fs;
+	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
+	dbg_printf("%s: ino=%d off=%jd len=%jd\n", __func__, fh->ino, offset,
+		   len);
+	pthread_rwlock_rdlock(&ff->bfl);
+	got = ret = fuse2fs_read_file(fs, fh, buf, len, offset);
+	if (got >= 0)
+		ret = atime_needs_update(fs, fh->ino);
+	fuse2fs_read_unlock(ff);
+	if (ret > 0)
+		ret = update_atime(ff, fh->ino);
+	return got > 0 ? got : ret;
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+/* Most buffers a read_buf reply is built from */
+#define FUSE2FS_READ_SEGS	16
+
+static void free_bufvec(struct fuse_bufvec *bv)
+{
+	size_t i;
+
+	for (i = 0; i < bv->count; i++)
+		ext2fs_free_mem(&bv->buf[i].mem);
+	ext2fs_free_mem(&bv);
+}
+
+/*
+ * Answer a read with buffers that point at the file's blocks on the
+ * device, so that the kernel can splice the data straight into the
+ * reply.  Holes and unwritten extents are returned as zeroes, and
+ * whatever can't be mapped is read through the file layer.  Without a
+ * splice_fd (a writable mount), everything is read through the file
+ * layer into the buffer while bfl is held.
+ */
+static int op_read_buf(const char *path EXT2FS_ATTR((unused)),
+		       struct fuse_bufvec **bufp, size_t len, off_t offset,
+		       struct fuse_file_info *fp)
+{
+	struct fuse_context *ctxt = fuse_get_context();
+	struct fuse2fs *ff = (struct fuse2fs *)ctxt->private_data;
+	struct fuse2fs_file_handle *fh =
+		(struct fuse2fs_file_handle *)(uintptr_t)fp->fh;
+	ext2_filsys fs;
+	struct ext2_inode inode;
+	struct fuse_bufvec *bv;
+	struct fuse_buf *seg;
+	blk64_t lblk, pblk, next, n;
+	__u64 size, pos, end, run_end;
+	int ret_flags;
 	errcode_t err;
-	unsigned int got = 0;
 	int ret = 0;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
@@ -2171,43 +3383,95 @@ static int op_read(const char *path EXT2FS_ATTR((unused)), char *buf,
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d off=%jd len=%jd\n", __func__, fh->ino, offset,
 		   len);
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_file_open(fs, fh->ino, fh->open_flags, &efp);
-	if (err) {
-		ret = translate_error(fs, fh->ino, err);
-		goto out;
-	}
+	err = ext2fs_get_memzero(sizeof(*bv) + (FUSE2FS_READ_SEGS - 1) *
+				 sizeof(struct fuse_buf), &bv);
+	if (err)
+		return translate_error(fs, fh->ino, err);
 
-	err = ext2fs_file_llseek(efp, offset, SEEK_SET, NULL);
+	pthread_rwlock_rdlock(&ff->bfl);
+	err = ext2fs_read_inode(fs, fh->ino, &inode);
 	if (err) {
 		ret = translate_error(fs, fh->ino, err);
-		goto out2;
+		goto out;
 	}
+	size = EXT2_I_SIZE(&inode);
+	pos = offset;
+	end = pos + len;
+	if (end > size)
+		end = size;
 
-	err = ext2fs_file_read(efp, buf, len, &got);
-	if (err) {
-		ret = translate_error(fs, fh->ino, err);
-		goto out2;
-	}
+	if (ff->splice_fd < 0 || (inode.i_flags & EXT4_INLINE_DATA_FL))
+		goto read_rest;
 
-out2:
-	err = ext2fs_file_close(efp);
-	if (ret)
-		goto out;
-	if (err) {
-		ret = translate_error(fs, fh->ino, err);
-		goto out;
+	/* Leave a buffer for whatever is left over */
+	while (pos < end && bv->count < FUSE2FS_READ_SEGS - 1) {
+		lblk = pos / fs->blocksize;
+		err = ext2fs_bmap2(fs, fh->ino, &inode, NULL, 0, lblk,
+				   &ret_flags, &pblk);
+		if (err)
+			break;
+		if (ret_flags & BMAP_RET_UNINIT)
+			pblk = 0;
+
+		/* Extend the run while the mapping stays contiguous */
+		run_end = (lblk + 1) * fs->blocksize;
+		for (n = 1; run_end < end; n++) {
+			err = ext2fs_bmap2(fs, fh->ino, &inode, NULL, 0,
+					   lblk + n, &ret_flags, &next);
+			if (err)
+				break;
+			if (ret_flags & BMAP_RET_UNINIT)
+				next = 0;
+			if (pblk ? next != pblk + n : next != 0)
+				break;
+			run_end += fs->blocksize;
+		}
+		if (run_end > end)
+			run_end = end;
+
+		seg = &bv->buf[bv->count++];
+		seg->size = run_end - pos;
+		if (pblk) {
+			seg->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			seg->fd = ff->splice_fd;
+			seg->pos = pblk * fs->blocksize + pos % fs->blocksize;
+		} else {
+			err = ext2fs_get_memzero(seg->size, &seg->mem);
+			if (err) {
+				ret = translate_error(fs, fh->ino, err);
+				goto out;
+			}
+		}
+		pos = run_end;
 	}
 
-	if (fs_writeable(fs)) {
-		ret = update_atime(fs, fh->ino);
-		if (ret)
+read_rest:
+	if (pos < end) {
+		seg = &bv->buf[bv->count++];
+		err = ext2fs_get_mem(end - pos, &seg->mem);
+		if (err) {
+			ret = translate_error(fs, fh->ino, err);
+			goto out;
+		}
+		ret = fuse2fs_read_file(fs, fh, seg->mem, end - pos, pos);
+		if (ret < 0)
 			goto out;
+		seg->size = ret;
+		ret = 0;
 	}
+
+	ret = atime_needs_update(fs, fh->ino);
 out:
-	pthread_mutex_unlock(&ff->bfl);
-	return got ? (int) got : ret;
+	fuse2fs_read_unlock(ff);
+	if (ret > 0)
+		ret = update_atime(ff, fh->ino);
+	if (ret)
+		free_bufvec(bv);
+	else
+		*bufp = bv;
+	return ret;
 }
+#endif /* FUSE 29 */
 
 static int op_write(const char *path EXT2FS_ATTR((unused)),
 		    const char *buf, size_t len, off_t offset,
@@ -2228,7 +3492,7 @@ static int op_write(const char *path EXT2FS_ATTR((unused)),
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d off=%jd len=%jd\n", __func__, fh->ino, offset,
 		   len);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!fs_writeable(fs)) {
 		ret = -EROFS;
 		goto out;
@@ -2274,11 +3538,9 @@ out2:
 	}
 
 	ret = update_mtime(fs, fh->ino, NULL);
-	if (ret)
-		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 	return got ? (int) got : ret;
 }
 
@@ -2297,14 +3559,20 @@ static int op_release(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d\n", __func__, fh->ino);
-	pthread_mutex_lock(&ff->bfl);
-	if (fs_writeable(fs) && fh->open_flags & EXT2_FILE_WRITE) {
-		err = ext2fs_flush2(fs, EXT2_FLAG_FLUSH_NO_SYNC);
-		if (err)
-			ret = translate_error(fs, fh->ino, err);
+	/*
+	 * Read-only handles have nothing to flush, so skip the lock, and
+	 * write-back mode leaves the flushing to the commit thread.
+	 */
+	if ((fh->open_flags & EXT2_FILE_WRITE) && !ff->writeback) {
+		pthread_rwlock_wrlock(&ff->bfl);
+		if (fs_writeable(fs)) {
+			err = ext2fs_flush2(fs, EXT2_FLAG_FLUSH_NO_SYNC);
+			if (err)
+				ret = translate_error(fs, fh->ino, err);
+		}
+		fuse2fs_write_unlock(ff);
 	}
 	fp->fh = 0;
-	pthread_mutex_unlock(&ff->bfl);
 
 	ext2fs_free_mem(&fh);
 
@@ -2327,14 +3595,18 @@ static int op_fsync(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d\n", __func__, fh->ino);
-	/* For now, flush everything, even if it's slow */
-	pthread_mutex_lock(&ff->bfl);
-	if (fs_writeable(fs) && fh->open_flags & EXT2_FILE_WRITE) {
-		err = ext2fs_flush2(fs, 0);
+	/*
+	 * For now, flush everything, even if it's slow.  In write-back
+	 * mode the cache may hold anything, whatever the handle.
+	 */
+	pthread_rwlock_wrlock(&ff->bfl);
+	if (fs_writeable(fs) &&
+	    (ff->writeback || fh->open_flags & EXT2_FILE_WRITE)) {
+		err = fuse2fs_flush(ff, 0);
 		if (err)
 			ret = translate_error(fs, fh->ino, err);
 	}
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 
 	return ret;
 }
@@ -2351,6 +3623,7 @@ static int op_statfs(const char *path EXT2FS_ATTR((unused)),
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf("%s: path=%s\n", __func__, path);
+	pthread_rwlock_rdlock(&ff->bfl);
 	buf->f_bsize = fs->blocksize;
 	buf->f_frsize = 0;
 
@@ -2383,6 +3656,7 @@ static int op_statfs(const char *path EXT2FS_ATTR((unused)),
 	if (fs->flags & EXT2_FLAG_RW)
 		buf->f_flag |= ST_RDONLY;
 	buf->f_namemax = EXT2_NAME_LEN;
+	fuse2fs_read_unlock(ff);
 
 	return 0;
 }
@@ -2427,13 +3701,13 @@ static int op_getxattr(const char *path, const char *key, char *value,
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -2489,7 +3763,7 @@ out2:
 	if (err)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_read_unlock(ff);
 
 	return ret;
 }
@@ -2528,13 +3802,13 @@ static int op_listxattr(const char *path, char *names, size_t len)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, ino, err);
 		goto out;
@@ -2586,7 +3860,7 @@ out2:
 	if (err)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_read_unlock(ff);
 
 	return ret;
 }
@@ -2608,13 +3882,13 @@ static int op_setxattr(const char *path EXT2FS_ATTR((unused)),
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -2665,7 +3939,7 @@ out2:
 	if (!ret && err)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 
 	return ret;
 }
@@ -2682,7 +3956,7 @@ static int op_removexattr(const char *path, const char *key)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
@@ -2693,7 +3967,7 @@ static int op_removexattr(const char *path, const char *key)
 		goto out;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -2728,7 +4002,7 @@ out2:
 	if (err)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 
 	return ret;
 }
@@ -2776,7 +4050,7 @@ static int op_readdir(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d\n", __func__, fh->ino);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	i.buf = buf;
 	i.func = fill_func;
 	err = ext2fs_dir_iterate2(fs, fh->ino, 0, NULL, op_readdir_iter, &i);
@@ -2785,13 +4059,11 @@ static int op_readdir(const char *path EXT2FS_ATTR((unused)),
 		goto out;
 	}
 
-	if (fs_writeable(fs)) {
-		ret = update_atime(fs, fh->ino);
-		if (ret)
-			goto out;
-	}
+	ret = atime_needs_update(fs, fh->ino);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_read_unlock(ff);
+	if (ret > 0)
+		ret = update_atime(ff, fh->ino);
 	return ret;
 }
 
@@ -2807,8 +4079,8 @@ static int op_access(const char *path, int mask)
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf("%s: path=%s mask=0x%x\n", __func__, path, mask);
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	pthread_rwlock_rdlock(&ff->bfl);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -2819,7 +4091,7 @@ static int op_access(const char *path, int mask)
 		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_read_unlock(ff);
 	return ret;
 }
 
@@ -2853,14 +4125,13 @@ static int op_create(const char *path, mode_t mode, struct fuse_file_info *fp)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!fs_can_allocate(ff, 1)) {
 		ret = -ENOSPC;
 		goto out2;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
-			   &parent);
+	err = fuse2fs_namei(fs, temp_path, &parent);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out2;
@@ -2882,6 +4153,7 @@ static int op_create(const char *path, mode_t mode, struct fuse_file_info *fp)
 
 	dbg_printf("%s: creating ino=%d/name=%s in dir=%d\n", __func__, child,
 		   node_name, parent);
+	dcache_forget(fs, parent, node_name);
 	err = ext2fs_link(fs, parent, node_name, child, filetype);
 	if (err == EXT2_ET_DIR_NO_SPACE) {
 		err = ext2fs_expand_dir(fs, parent);
@@ -2943,7 +4215,7 @@ static int op_create(const char *path, mode_t mode, struct fuse_file_info *fp)
 	if (ret)
 		goto out2;
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -2965,7 +4237,7 @@ static int op_ftruncate(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d len=%jd\n", __func__, fh->ino, len);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!fs_writeable(fs)) {
 		ret = -EROFS;
 		goto out;
@@ -2997,7 +4269,7 @@ out2:
 		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 	return 0;
 }
 
@@ -3016,9 +4288,9 @@ static int op_fgetattr(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d\n", __func__, fh->ino);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	ret = stat_inode(fs, fh->ino, statbuf);
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_read_unlock(ff);
 
 	return ret;
 }
@@ -3036,8 +4308,8 @@ static int op_utimens(const char *path, const struct timespec ctv[2])
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	pthread_rwlock_wrlock(&ff->bfl);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -3082,7 +4354,7 @@ static int op_utimens(const char *path, const struct timespec ctv[2])
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 	return ret;
 }
 
@@ -3271,7 +4543,7 @@ static int op_ioctl(const char *path EXT2FS_ATTR((unused)), int cmd,
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	switch ((unsigned long) cmd) {
 #ifdef SUPPORT_I_FLAGS
 	case EXT2_IOC_GETFLAGS:
@@ -3296,7 +4568,7 @@ static int op_ioctl(const char *path EXT2FS_ATTR((unused)), int cmd,
 		dbg_printf("%s: Unknown ioctl %d\n", __func__, cmd);
 		ret = -ENOTTY;
 	}
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 
 	return ret;
 }
@@ -3314,8 +4586,8 @@ static int op_bmap(const char *path, size_t blocksize EXT2FS_ATTR((unused)),
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	pthread_rwlock_rdlock(&ff->bfl);
+	err = fuse2fs_namei(fs, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -3329,7 +4601,7 @@ static int op_bmap(const char *path, size_t blocksize EXT2FS_ATTR((unused)),
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_read_unlock(ff);
 	return ret;
 }
 
@@ -3553,7 +4825,7 @@ static int op_fallocate(const char *path EXT2FS_ATTR((unused)), int mode,
 	if (mode & ~(FL_PUNCH_HOLE_FLAG | FL_KEEP_SIZE_FLAG))
 		return -EINVAL;
 
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!fs_writeable(fs)) {
 		ret = -EROFS;
 		goto out;
@@ -3563,7 +4835,7 @@ static int op_fallocate(const char *path EXT2FS_ATTR((unused)), int mode,
 	else
 		ret = fallocate_helper(fp, mode, offset, len);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_write_unlock(ff);
 
 	return ret;
 }
@@ -3587,6 +4859,9 @@ static struct fuse_operations fs_ops = {
 	.truncate = op_truncate,
 	.open = op_open,
 	.read = op_read,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+	.read_buf = op_read_buf,
+#endif
 	.write = op_write,
 	.statfs = op_statfs,
 	.release = op_release,
@@ -3659,6 +4934,9 @@ static struct fuse_opt fuse2fs_opts[] = {
 	FUSE2FS_OPT("fuse2fs_debug",	debug,			1),
 	FUSE2FS_OPT("no_default_opts",	no_default_opts,	1),
 	FUSE2FS_OPT("norecovery",	norecovery,		1),
+	FUSE2FS_OPT("writeback",	writeback,		1),
+	FUSE2FS_OPT("nojournal",	nojournal,		1),
+	FUSE2FS_OPT("commit=%u",	commit_interval,	0),
 
 	FUSE_OPT_KEY("-V",             FUSE2FS_VERSION),
 	FUSE_OPT_KEY("--version",      FUSE2FS_VERSION),
@@ -3698,6 +4976,9 @@ static int fuse2fs_opt_proc(void *data, const char *arg,
 	"    -o fakeroot            pretend to be root for permission checks\n"
 	"    -o no_default_opts     do not include default fuse options\n"
 	"    -o norecovery	    don't replay the journal (implies ro)\n"
+	"    -o writeback           cache metadata writes in memory\n"
+	"    -o commit=<seconds>    write-back commit interval\n"
+	"    -o nojournal           write in place without journaling\n"
 	"    -o fuse2fs_debug       enable fuse2fs debugging\n"
 	"\n",
 			outargs->argv[0]);
@@ -3727,11 +5008,14 @@ int main(int argc, char *argv[])
 	errcode_t err;
 	char *logfile;
 	char extra_args[BUFSIZ];
-	int ret = 0;
+	pthread_rwlockattr_t bfl_attr;
+	int i, ret = 0;
 	int flags = EXT2_FLAG_64BITS | EXT2_FLAG_THREADS | EXT2_FLAG_EXCLUSIVE;
 
 	memset(&fctx, 0, sizeof(fctx));
 	fctx.magic = FUSE2FS_MAGIC;
+	fctx.splice_fd = -1;
+	fctx.commit_interval = FUSE2FS_COMMIT_INTERVAL;
 
 	fuse_opt_parse(&args, &fctx, fuse2fs_opts, fuse2fs_opt_proc);
 	if (fctx.device == NULL) {
@@ -3744,6 +5028,8 @@ int main(int argc, char *argv[])
 		fctx.ro = 1;
 	if (fctx.ro)
 		printf("%s", _("Mounting read-only.\n"));
+	if (fctx.ro || fctx.commit_interval == 0)
+		fctx.writeback = 0;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -3803,6 +5089,9 @@ int main(int argc, char *argv[])
 				       fctx.device);
 				goto out;
 			}
+			/* Recovery reopened the file system */
+			fctx.fs = global_fs;
+			global_fs->priv_data = &fctx;
 			ext2fs_clear_feature_journal_needs_recovery(global_fs->super);
 			ext2fs_mark_super_dirty(global_fs);
 		} else {
@@ -3813,9 +5102,6 @@ int main(int argc, char *argv[])
 	}
 
 	if (!fctx.ro) {
-		if (ext2fs_has_feature_journal(global_fs->super))
-			printf(_("%s: Writing to the journal is not supported.\n"),
-			       fctx.device);
 		err = ext2fs_read_inode_bitmap(global_fs);
 		if (err) {
 			translate_error(global_fs, 0, err);
@@ -3826,6 +5112,26 @@ int main(int argc, char *argv[])
 			translate_error(global_fs, 0, err);
 			goto out;
 		}
+		/*
+		 * Index the free space so that allocating blocks for
+		 * writes doesn't scan the bitmap from the goal each time.
+		 * Without the index, allocation falls back to that scan.
+		 */
+		(void) ext2fs_create_free_index(global_fs);
+
+		if (ext2fs_has_feature_journal(global_fs->super) &&
+		    !fctx.nojournal) {
+			err = fuse2fs_start_journal(&fctx);
+			if (err) {
+				printf(_("%s: %s while opening the journal.\n"),
+				       fctx.device, error_message(err));
+				printf(_("%s: Writing without journaling.\n"),
+				       fctx.device);
+			} else if (fctx.commit_interval) {
+				/* Commits batch up changes like write-back */
+				fctx.writeback = 1;
+			}
+		}
 	}
 
 	if (!(global_fs->super->s_state & EXT2_VALID_FS))
@@ -3850,6 +5156,57 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	/*
+	 * Let reads splice file data straight from the device.  libfuse
+	 * splices the data after op_read_buf has dropped bfl, by which
+	 * time a writer could have freed the blocks and reused them for
+	 * another file, so this is only done on a read-only mount.  It
+	 * also can't be done if the device name carries io options such
+	 * as an offset.
+	 */
+	if (global_fs->io->manager == unix_io_manager &&
+	    !(global_fs->flags & EXT2_FLAG_RW) &&
+	    !strchr(fctx.device, '?'))
+		fctx.splice_fd = open(fctx.device, O_RDONLY);
+
+	if (fctx.writeback && !fctx.jio) {
+		char opt[64];
+
+		snprintf(opt, sizeof(opt), "cache_blocks=%u",
+			 FUSE2FS_WRITEBACK_CACHE / global_fs->blocksize);
+		err = io_channel_set_options(global_fs->io, opt);
+		if (err) {
+			printf(_("%s: %s while enabling write-back mode.\n"),
+			       fctx.device, error_message(err));
+			goto out;
+		}
+	}
+	if (fctx.writeback) {
+		pthread_mutex_init(&fctx.flush_lock, NULL);
+		pthread_cond_init(&fctx.flush_cond, NULL);
+	}
+
+	/*
+	 * Cache extent tree blocks across the per-request file handles.
+	 * If it can't be allocated, each handle reads the tree itself.
+	 */
+	(void) ext2fs_create_extent_cache(global_fs, 64);
+
+	/*
+	 * The inode cache must exist before the fuse threads start,
+	 * since only then is it set up to be shared between them.
+	 */
+	err = ext2fs_create_inode_cache(global_fs, 16);
+	if (err) {
+		printf(_("%s: %s.\n"), fctx.device, error_message(err));
+		goto out;
+	}
+
+	/* Without a dentry cache, every path is looked up on disk */
+	(void) ext2fs_get_arrayzero(FUSE2FS_DCACHE_BUCKETS,
+				    sizeof(struct fuse2fs_dentry *),
+				    &fctx.dcache);
+
 	/* Initialize generation counter */
 	get_random_bytes(&fctx.next_generation, sizeof(unsigned int));
 
@@ -3870,20 +5227,43 @@ int main(int argc, char *argv[])
 	}
 
 	if (fctx.debug) {
-		int	i;
-
 		printf("fuse arguments:");
 		for (i = 0; i < args.argc; i++)
 			printf(" '%s'", args.argv[i]);
 		printf("\n");
 	}
 
-	pthread_mutex_init(&fctx.bfl, NULL);
+	pthread_rwlockattr_init(&bfl_attr);
+#ifdef __GLIBC__
+	/* Don't let a stream of readers starve out the writers */
+	pthread_rwlockattr_setkind_np(&bfl_attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&fctx.bfl, &bfl_attr);
+	pthread_rwlockattr_destroy(&bfl_attr);
+	pthread_mutex_init(&fctx.error_lock, NULL);
+	pthread_mutex_init(&fctx.dcache_lock, NULL);
 	fuse_main(args.argc, args.argv, &fs_ops, &fctx);
-	pthread_mutex_destroy(&fctx.bfl);
+	stop_flush_thread(&fctx);
+	if (fctx.writeback) {
+		pthread_cond_destroy(&fctx.flush_cond);
+		pthread_mutex_destroy(&fctx.flush_lock);
+	}
+	pthread_mutex_destroy(&fctx.dcache_lock);
+	pthread_mutex_destroy(&fctx.error_lock);
+	pthread_rwlock_destroy(&fctx.bfl);
 
 	ret = 0;
 out:
+	if (fctx.dcache)
+		dcache_free(&fctx);
+	if (fctx.splice_fd >= 0)
+		close(fctx.splice_fd);
+	if (fctx.jio) {
+		err = fuse2fs_stop_journal(&fctx);
+		if (err)
+			com_err(argv[0], err, "while closing the journal");
+	}
 	if (global_fs) {
 		err = ext2fs_close(global_fs);
 		if (err)
@@ -3977,6 +5357,7 @@ no_translation:
 	fflush(ff->err_fp);
 
 	/* Make a note in the error log */
+	pthread_mutex_lock(&ff->error_lock);
 	get_now(&now);
 	fs->super->s_last_error_time = now.tv_sec;
 	fs->super->s_last_error_ino = ino;
@@ -3995,9 +5376,17 @@ no_translation:
 
 	fs->super->s_error_count++;
 	ext2fs_mark_super_dirty(fs);
-	ext2fs_flush(fs);
-	if (ff->panic_on_error)
+	/*
+	 * bfl may only be held shared here, so leave the superblock to be
+	 * written out when it is released; see fuse2fs_flush_errors().
+	 */
+	ff->error_pending = 1;
+	pthread_mutex_unlock(&ff->error_lock);
+	if (ff->panic_on_error) {
+		/* Get the error onto the disk before going down */
+		ext2fs_flush(fs);
 		abort();
+	}
 
 	return ret;
 }
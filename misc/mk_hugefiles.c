@@ -264,7 +264,7 @@ static errcode_t mk_hugefile(ext2_filsys fs, blk64_t num,
 
 {
 	errcode_t		retval;
-	blk64_t			lblk, bend = 0;
+	blk64_t			lblk;
 	__u64			size;
 	blk64_t			left;
 	blk64_t			count = 0;
@@ -304,28 +304,21 @@ static errcode_t mk_hugefile(ext2_filsys fs, blk64_t num,
 	lblk = 0;
 	left = num ? num : 1;
 	while (left) {
-		blk64_t pblk, end;
-		blk64_t n = left;
-
-		retval =  ext2fs_find_first_zero_block_bitmap2(fs->block_map,
-			goal, ext2fs_blocks_count(fs->super) - 1, &end);
+		blk64_t pblk;
+		blk64_t n;
+
+		retval = ext2fs_new_range(fs, 0, goal, num ? left :
+				ext2fs_blocks_count(fs->super) - goal,
+				fs->block_map, &pblk, &n);
+		if (retval == 0 && pblk < goal)
+			retval = EXT2_ET_BLOCK_ALLOC_FAIL;
 		if (retval)
 			goto errout;
-		goal = end;
-
-		retval =  ext2fs_find_first_set_block_bitmap2(fs->block_map, goal,
-			       ext2fs_blocks_count(fs->super) - 1, &bend);
-		if (retval == ENOENT) {
-			bend = ext2fs_blocks_count(fs->super);
-			if (num == 0)
-				left = 0;
-		}
-		if (!num || bend - goal < left)
-			n = bend - goal;
-		pblk = goal;
 		if (num)
 			left -= n;
-		goal += n;
+		else if (pblk + n >= ext2fs_blocks_count(fs->super))
+			left = 0;
+		goal = pblk + n;
 		count += n;
 		ext2fs_block_alloc_stats_range(fs, pblk, n, +1);
 
@@ -588,6 +581,12 @@ errcode_t mk_hugefiles(ext2_filsys fs, const char *device_name)
 			       (unsigned long long) num_blocks);
 		fputs(": ", stdout);
 	}
+	/*
+	 * mk_hugefile() asks for long free runs one after another; the
+	 * free extent index finds them without rescanning the bitmap.
+	 * If the index can't be built the bitmap is scanned instead.
+	 */
+	ext2fs_create_free_index(fs);
 	for (i=0; i < num_files; i++) {
 		ext2_ino_t ino;
 
@@ -602,6 +601,7 @@ errcode_t mk_hugefiles(ext2_filsys fs, const char *device_name)
 		fputs(_("done\n"), stdout);
 
 errout:
+	ext2fs_release_free_index(fs);
 	free(fn_buf);
 	return retval;
 }
@@ -24,6 +24,7 @@
 #include <strings.h>
 #include <ctype.h>
 #include <time.h>
+#include <sys/time.h>
 #ifdef __linux__
 #include <sys/utsname.h>
 #define KERNEL_VERSION(a,b,c) (((a) << 16) + ((b) << 8) + (c))
@@ -49,6 +50,9 @@ extern int optind;
 #include <libgen.h>
 #include <limits.h>
 #include <blkid/blkid.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fsP.h"
@@ -72,6 +76,7 @@ extern int optind;
 #endif
 
 #define DISCARD_STEP_MB		(2048)
+#define DISCARD_MAX_INFLIGHT	8
 
 extern int isatty(int);
 extern FILE *fpopen(const char *cmd, const char *mode);
@@ -116,8 +121,12 @@ static char *volume_label;
 static char *mount_dir;
 char *journal_device;
 static int sync_kludge;	/* Set using the MKE2FS_SYNC env. option */
+static int copy_threads = -1;	/* Threads reading files for -d */
+static int zero_threads = -1;	/* Threads zeroing the inode tables */
+static int populate_flags = POPULATE_FS_LAYOUT_PLAN;
 char **fs_types;
-const char *src_root_dir;  /* Copy files from the specified directory */
+const char *src_root_dir;  /* Copy files from the specified directory
+			      or tar/cpio archive */
 static char *undo_file;
 
 static int android_sparse_file; /* -E android_sparse */
@@ -134,7 +143,7 @@ static void usage(void)
 	"[-C cluster-size]\n\t[-i bytes-per-inode] [-I inode-size] "
 	"[-J journal-options]\n"
 	"\t[-G flex-group-size] [-N number-of-inodes] "
-	"[-d root-directory]\n"
+	"[-d root-directory|archive]\n"
 	"\t[-m reserved-blocks-percentage] [-o creator-os]\n"
 	"\t[-g blocks-per-group] [-L volume-label] "
 	"[-M last-mounted-directory]\n\t[-O feature[,...]] "
@@ -412,20 +421,245 @@ static errcode_t packed_allocate_tables(ext2_filsys fs)
 	return 0;
 }
 
+/*
+ * A run of inode table blocks to be zeroed.  With flex_bg the tables of
+ * a flex group are packed back to back, so they coalesce into a few
+ * large ranges which can be zeroed concurrently.
+ */
+struct itable_range {
+	blk64_t		blk;
+	blk64_t		num;
+	dgrp_t		groups;
+};
+
+/* Don't coalesce more than this many bytes into a single range */
+#define ITABLE_RANGE_MAX_BYTES	(64 * 1024 * 1024)
+#define ITABLE_ZERO_STRIDE	(4 * 1024 * 1024)
+
+static double elapsed_secs(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, 0);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void report_itable_bandwidth(ext2_filsys fs, blk64_t blocks,
+				    struct timeval *start, int threads)
+{
+	double secs = elapsed_secs(start);
+	double mib = (double) blocks * fs->blocksize / (1024 * 1024);
+
+	if (!verbose || !blocks)
+		return;
+	printf(_("Zeroed %.1f MiB of inode tables in %.2f seconds "
+		 "(%.1f MiB/s, %d thread(s))\n"), mib, secs,
+	       secs > 0 ? mib / secs : 0.0, threads);
+}
+
+#ifdef HAVE_PTHREAD
+struct itable_zeroer {
+	pthread_mutex_t	lock;
+	ext2_filsys	fs;
+	struct itable_range *ranges;
+	int		nr_ranges;
+	int		next;		/* first range not yet claimed */
+	dgrp_t		groups_done;
+	int		use_zeroout;
+	char		*zerobuf;
+	blk64_t		stride;		/* in blocks */
+	errcode_t	err;
+	blk64_t		err_blk;
+	int		err_num;
+};
+
+/*
+ * Zero one range: ask the device to zero it out if it has shown it can,
+ * otherwise write zeroes.  Writes of more than a few blocks bypass the
+ * unix_io cache, and the cache itself is locked, so this is safe to run
+ * from several threads on a channel opened with IO_FLAG_THREADS.
+ */
+static errcode_t zero_itable_range(struct itable_zeroer *z,
+				   struct itable_range *r,
+				   blk64_t *ret_blk, int *ret_num)
+{
+	blk64_t blk = r->blk, end = r->blk + r->num, count;
+	errcode_t retval;
+
+	if (z->use_zeroout &&
+	    io_channel_zeroout(z->fs->io, r->blk, r->num) == 0)
+		return 0;
+	for (; blk < end; blk += count) {
+		count = end - blk;
+		if (count > z->stride)
+			count = z->stride;
+		retval = io_channel_write_blk64(z->fs->io, blk, count,
+						z->zerobuf);
+		if (retval) {
+			*ret_blk = blk;
+			*ret_num = count;
+			return retval;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Claim and zero ranges until they run out or one fails, keeping the
+ * first error.  If progress is set, update the meter after each range.
+ */
+static void zero_claimed_ranges(struct itable_zeroer *z,
+				struct ext2fs_numeric_progress_struct *progress)
+{
+	struct itable_range *r;
+	errcode_t retval;
+	dgrp_t done;
+	blk64_t blk;
+	int num;
+
+	pthread_mutex_lock(&z->lock);
+	while (!z->err && z->next < z->nr_ranges) {
+		r = &z->ranges[z->next++];
+		pthread_mutex_unlock(&z->lock);
+		retval = zero_itable_range(z, r, &blk, &num);
+		pthread_mutex_lock(&z->lock);
+		if (retval && !z->err) {
+			z->err = retval;
+			z->err_blk = blk;
+			z->err_num = num;
+		}
+		z->groups_done += r->groups;
+		if (progress) {
+			done = z->groups_done;
+			pthread_mutex_unlock(&z->lock);
+			ext2fs_numeric_progress_update(z->fs, progress, done);
+			pthread_mutex_lock(&z->lock);
+		}
+	}
+	pthread_mutex_unlock(&z->lock);
+}
+
+static void *itable_zero_thread(void *arg)
+{
+	zero_claimed_ranges(arg, NULL);
+	return NULL;
+}
+
+/*
+ * Zero the ranges with up to num_threads threads.  The last range is
+ * zeroed first, on this thread: it extends a short image file to its
+ * full size before anyone else calls zeroout (which would otherwise race
+ * on the file size), and it tells us whether the device supports zeroout
+ * at all, so the workers can go straight to writing zeroes if it doesn't.
+ *
+ * Returns the number of threads used.
+ */
+static int zero_itable_ranges(ext2_filsys fs, struct itable_range *ranges,
+			      int nr_ranges, int num_threads,
+			      struct ext2fs_numeric_progress_struct *progress)
+{
+	struct itable_zeroer z;
+	struct itable_range *last = &ranges[nr_ranges - 1];
+	pthread_t *threads;
+	int i, started = 0;
+
+	if (num_threads > nr_ranges)
+		num_threads = nr_ranges;
+	memset(&z, 0, sizeof(z));
+	z.fs = fs;
+	z.ranges = ranges;
+	z.nr_ranges = nr_ranges - 1;
+	z.stride = ITABLE_ZERO_STRIDE / fs->blocksize;
+	z.zerobuf = calloc(z.stride, fs->blocksize);
+	if (!z.zerobuf) {
+		z.stride = 1;
+		z.zerobuf = calloc(1, fs->blocksize);
+	}
+	if (!z.zerobuf) {
+		com_err(program_name, EXT2_ET_NO_MEMORY, "%s",
+			_("while zeroing inode tables"));
+		exit(1);
+	}
+	threads = calloc(num_threads, sizeof(pthread_t));
+	if (!threads)
+		num_threads = 1;
+	pthread_mutex_init(&z.lock, NULL);
+
+	z.use_zeroout = 1;
+	if (io_channel_zeroout(fs->io, last->blk, last->num)) {
+		z.use_zeroout = 0;
+		z.err = zero_itable_range(&z, last, &z.err_blk, &z.err_num);
+	}
+	z.groups_done = last->groups;
+
+	for (; started < num_threads - 1; started++)
+		if (pthread_create(&threads[started], NULL,
+				   itable_zero_thread, &z))
+			break;
+
+	/* This thread takes ranges too, and keeps the meter going */
+	zero_claimed_ranges(&z, progress);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&z.lock);
+	free(threads);
+	free(z.zerobuf);
+
+	if (z.err) {
+		fprintf(stderr, _("\nCould not write %d "
+			  "blocks in inode table starting at %llu: %s\n"),
+			z.err_num, (unsigned long long) z.err_blk,
+			error_message(z.err));
+		exit(1);
+	}
+	return started + 1;
+}
+#endif /* HAVE_PTHREAD */
+
 static void write_inode_tables(ext2_filsys fs, int lazy_flag, int itable_zeroed)
 {
 	errcode_t	retval;
-	blk64_t		blk;
+	blk64_t		blk, zeroed = 0;
 	dgrp_t		i;
-	int		num;
+	int		num, threads = 1;
 	struct ext2fs_numeric_progress_struct progress;
+	struct itable_range *ranges = NULL;
+	int		nr_ranges = 0;
+	blk64_t		max_range = ITABLE_RANGE_MAX_BYTES / fs->blocksize;
+	struct timeval	start;
 
 	ext2fs_numeric_progress_init(fs, &progress,
 				     _("Writing inode tables: "),
 				     fs->group_desc_count);
+	gettimeofday(&start, 0);
+
+#ifdef HAVE_PTHREAD
+	threads = zero_threads;
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_CONF)
+	if (threads < 0)
+		threads = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+	if (threads < 0)
+		threads = 4;
+	/*
+	 * Zeroing on several threads needs a thread-safe I/O channel,
+	 * and gives up on the sync_kludge flushes between groups.
+	 */
+	if (itable_zeroed || sync_kludge ||
+	    !(fs->io->flags & CHANNEL_FLAGS_THREADS))
+		threads = 1;
+	if (threads > 1)
+		ranges = calloc(fs->group_desc_count,
+				sizeof(struct itable_range));
+	if (!ranges)
+		threads = 1;
+#endif
 
 	for (i = 0; i < fs->group_desc_count; i++) {
-		ext2fs_numeric_progress_update(fs, &progress, i);
+		if (!ranges)
+			ext2fs_numeric_progress_update(fs, &progress, i);
 
 		blk = ext2fs_inode_table_loc(fs, i);
 		num = fs->inode_blocks_per_group;
@@ -440,15 +674,33 @@ static void write_inode_tables(ext2_filsys fs, int lazy_flag, int itable_zeroed)
 			ext2fs_bg_flags_set(fs, i, EXT2_BG_INODE_ZEROED);
 			ext2fs_group_desc_csum_set(fs, i);
 		}
-		if (!itable_zeroed) {
-			retval = ext2fs_zero_blocks2(fs, blk, num, &blk, &num);
-			if (retval) {
-				fprintf(stderr, _("\nCould not write %d "
-					  "blocks in inode table starting at %llu: %s\n"),
-					num, (unsigned long long) blk,
-					error_message(retval));
-				exit(1);
+		if (itable_zeroed)
+			continue;
+		zeroed += num;
+		if (ranges) {
+			struct itable_range *r = NULL;
+
+			if (nr_ranges)
+				r = &ranges[nr_ranges - 1];
+			if (r && (!num || (r->blk + r->num == blk &&
+					   r->num + num <= max_range))) {
+				r->num += num;
+				r->groups++;
+			} else if (num) {
+				r = &ranges[nr_ranges++];
+				r->blk = blk;
+				r->num = num;
+				r->groups = 1;
 			}
+			continue;
+		}
+		retval = ext2fs_zero_blocks2(fs, blk, num, &blk, &num);
+		if (retval) {
+			fprintf(stderr, _("\nCould not write %d "
+				  "blocks in inode table starting at %llu: %s\n"),
+				num, (unsigned long long) blk,
+				error_message(retval));
+			exit(1);
 		}
 		if (sync_kludge) {
 			if (sync_kludge == 1)
@@ -457,8 +709,15 @@ static void write_inode_tables(ext2_filsys fs, int lazy_flag, int itable_zeroed)
 				io_channel_flush(fs->io);
 		}
 	}
+#ifdef HAVE_PTHREAD
+	if (nr_ranges)
+		threads = zero_itable_ranges(fs, ranges, nr_ranges, threads,
+					     &progress);
+#endif
+	free(ranges);
 	ext2fs_numeric_progress_close(fs, &progress,
 				      _("done                            \n"));
+	report_itable_bandwidth(fs, zeroed, &start, threads);
 
 	/* Reserved inodes must always have correct checksums */
 	if (ext2fs_has_feature_metadata_csum(fs->super))
@@ -899,6 +1158,9 @@ static void parse_extended_opts(struct ext2_super_block *param,
 		} else if (strcmp(token, "no_copy_xattrs") == 0) {
 			no_copy_xattrs = 1;
 			continue;
+		} else if (strcmp(token, "no_layout_plan") == 0) {
+			populate_flags &= ~POPULATE_FS_LAYOUT_PLAN;
+			continue;
 		} else if (strcmp(token, "num_backup_sb") == 0) {
 			if (!arg) {
 				r_usage++;
@@ -1996,6 +2258,18 @@ profile_error:
 	if (tmp)
 		sync_kludge = atoi(tmp);
 
+	profile_get_integer(profile, "options", "copy_threads", 0, -1,
+			    &copy_threads);
+	tmp = getenv("MKE2FS_COPY_THREADS");
+	if (tmp)
+		copy_threads = atoi(tmp);
+
+	profile_get_integer(profile, "options", "zero_threads", 0, -1,
+			    &zero_threads);
+	tmp = getenv("MKE2FS_ZERO_THREADS");
+	if (tmp)
+		zero_threads = atoi(tmp);
+
 	profile_get_integer(profile, "options", "proceed_delay", 0, 0,
 			    &proceed_delay);
 
@@ -2873,6 +3147,7 @@ static int mke2fs_discard_device(ext2_filsys fs)
 	blk64_t blocks = ext2fs_blocks_count(fs->super);
 	blk64_t count = DISCARD_STEP_MB;
 	blk64_t cur = 0;
+	io_discard_batch batch;
 	int retval = 0;
 
 	/*
@@ -2884,6 +3159,15 @@ static int mke2fs_discard_device(ext2_filsys fs)
 	if (retval)
 		return retval;
 
+	/*
+	 * The batch cuts the device up into requests no larger than the
+	 * device takes, and keeps several of them in flight.
+	 */
+	retval = io_channel_discard_batch_init(fs->io, DISCARD_MAX_INFLIGHT,
+					       &batch);
+	if (retval)
+		return retval;
+
 	count *= (1024 * 1024);
 	count /= fs->blocksize;
 
@@ -2891,16 +3175,21 @@ static int mke2fs_discard_device(ext2_filsys fs)
 				     _("Discarding device blocks: "),
 				     blocks);
 	while (cur < blocks) {
-		ext2fs_numeric_progress_update(fs, &progress, cur);
+		ext2fs_numeric_progress_update(fs, &progress,
+				io_channel_discard_batch_progress(batch));
 
 		if (cur + count > blocks)
 			count = blocks - cur;
 
-		retval = io_channel_discard(fs->io, cur, count);
+		retval = io_channel_discard_batch_add(batch, cur, count);
 		if (retval)
 			break;
 		cur += count;
 	}
+	if (retval)
+		io_channel_discard_batch_cancel(batch);
+	else
+		retval = io_channel_discard_batch_finish(batch);
 
 	if (retval) {
 		ext2fs_numeric_progress_close(fs, &progress,
@@ -3062,6 +3351,17 @@ int main (int argc, char *argv[])
 			    &old_bitmaps);
 	if (!old_bitmaps)
 		flags |= EXT2_FLAG_64BITS;
+#ifdef HAVE_PTHREAD
+	/*
+	 * Only ask for a thread-safe channel if the device will be
+	 * discarded with several requests in flight, or the inode tables
+	 * zeroed on several threads.
+	 */
+	if ((!noaction && discard && dev_size &&
+	     io_ptr != undo_io_manager && DISCARD_MAX_INFLIGHT > 1) ||
+	    (zero_threads != 1 && !lazy_itable_init))
+		flags |= EXT2_FLAG_THREADS;
+#endif
 	/*
 	 * By default, we print how many inode tables or block groups
 	 * or whatever we've written so far.  The quiet flag disables
@@ -3549,13 +3849,22 @@ no_journal:
 	retval = mk_hugefiles(fs, device_name);
 	if (retval)
 		com_err(program_name, retval, "while creating huge files");
-	/* Copy files from the specified directory */
+	/* Copy files from the specified directory or archive */
 	if (src_root_dir) {
+		struct stat st;
+
 		if (!quiet)
 			printf("%s", _("Copying files into the device: "));
 
-		retval = populate_fs(fs, EXT2_ROOT_INO, src_root_dir,
-				     EXT2_ROOT_INO);
+		if (strcmp(src_root_dir, "-") == 0 ||
+		    (stat(src_root_dir, &st) == 0 && !S_ISDIR(st.st_mode)))
+			retval = populate_fs_archive(fs, EXT2_ROOT_INO,
+						     src_root_dir,
+						     EXT2_ROOT_INO);
+		else
+			retval = populate_fs3(fs, EXT2_ROOT_INO, src_root_dir,
+					      EXT2_ROOT_INO, NULL,
+					      copy_threads, populate_flags);
 		if (retval) {
 			com_err(program_name, retval, "%s",
 				_("while populating file system"));
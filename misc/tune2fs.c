@@ -55,9 +55,13 @@ extern int optind;
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fs.h"
+#include "ext2fs/ext2fsP.h"
 #include "ext2fs/kernel-jbd.h"
 #include "et/com_err.h"
 #include "support/plausible.h"
@@ -135,14 +139,19 @@ char *journal_device;
 static blk64_t journal_location = ~0LL;
 static e2_blkcnt_t orphan_file_blocks;
 
-static struct list_head blk_move_list;
-
+/*
+ * Blocks which have to make way for larger inode tables, as runs of
+ * consecutive blocks sorted by their old location.
+ */
 struct blk_move {
-	struct list_head list;
 	blk64_t old_loc;
 	blk64_t new_loc;
+	blk64_t len;
 };
 
+static struct blk_move *blk_moves;
+static unsigned long blk_moves_count, blk_moves_max;
+
 errcode_t ext2fs_run_ext3_journal(ext2_filsys *fs);
 
 static const char *fsck_explain = N_("\nThis operation requires a freshly checked filesystem.\n");
@@ -484,18 +493,31 @@ static int check_fsck_needed(ext2_filsys fs, const char *prompt)
 	return 0;
 }
 
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t dir_fsck_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static void request_dir_fsck_afterwards(ext2_filsys fs)
 {
 	static int requested;
 
+#ifdef HAVE_PTHREAD
+	/* May be called by several checksum rewriting threads at once */
+	pthread_mutex_lock(&dir_fsck_lock);
+#endif
 	if (requested++)
-		return;
+		goto out;
 	fsck_requested++;
 	fs->super->s_state &= ~EXT2_VALID_FS;
 	puts(_(fsck_explain));
 	puts(_(please_dir_fsck));
 	if (mount_flags & EXT2_MF_READONLY)
 		printf("%s", _("(and reboot afterwards!)\n"));
+out:
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&dir_fsck_lock);
+#endif
+	return;
 }
 
 static void request_fsck_afterwards(ext2_filsys fs)
@@ -711,25 +733,25 @@ static errcode_t rewrite_directory(ext2_filsys fs, ext2_ino_t dir,
 	if (retval)
 		return retval;
 
-	if (ctx.is_htree && ctx.clear_htree) {
+	/* The caller writes the inode back */
+	if (ctx.is_htree && ctx.clear_htree)
 		inode->i_flags &= ~EXT2_INDEX_FL;
-		retval = ext2fs_write_inode(fs, dir, inode);
-		if (retval)
-			return retval;
-	}
 
 	return ctx.errcode;
 }
 
 /*
  * Context information that does not change across rewrite_one_inode()
- * invocations.
+ * invocations.  Each rewriting thread has its own copy, with its own
+ * buffers.
  */
 struct rewrite_context {
 	ext2_filsys fs;
 	struct ext2_inode *zero_inode;
 	char *ea_buf;
 	int inode_size;
+	char *itable_buf;
+	struct ext2_inode *inode;
 };
 
 #define fatal_err(code, args...)		\
@@ -822,15 +844,19 @@ static void update_block_xattr_hashes(struct rewrite_context *ctx,
 		ext2fs_ext_attr_block_rehash(header, end);
 }
 
-static void rewrite_one_inode(struct rewrite_context *ctx, ext2_ino_t ino,
-			      struct ext2_inode *inode)
+/*
+ * Rewrite everything hanging off an inode.  Returns nonzero if the
+ * inode itself needs to be written back by the caller.
+ */
+static int rewrite_one_inode(struct rewrite_context *ctx, ext2_ino_t ino,
+			     struct ext2_inode *inode)
 {
 	blk64_t file_acl_block;
 	errcode_t retval;
 
 	if (!ext2fs_test_inode_bitmap2(ctx->fs->inode_map, ino)) {
 		if (!memcmp(inode, ctx->zero_inode, ctx->inode_size))
-			return;
+			return 0;
 		memset(inode, 0, ctx->inode_size);
 	}
 
@@ -841,10 +867,6 @@ static void rewrite_one_inode(struct rewrite_context *ctx, ext2_ino_t ino,
 		update_inline_xattr_hashes(ctx,
 					   (struct ext2_inode_large *)inode);
 
-	retval = ext2fs_write_inode_full(ctx->fs, ino, inode, ctx->inode_size);
-	if (retval)
-		fatal_err(retval, "while writing inode");
-
 	retval = ext2fs_fix_extents_checksums(ctx->fs, ino, inode);
 	if (retval)
 		fatal_err(retval, "while rewriting extents");
@@ -858,7 +880,7 @@ static void rewrite_one_inode(struct rewrite_context *ctx, ext2_ino_t ino,
 
 	file_acl_block = ext2fs_file_acl_block(ctx->fs, inode);
 	if (!file_acl_block)
-		return;
+		return 1;
 
 	retval = ext2fs_read_ext_attr3(ctx->fs, file_acl_block, ctx->ea_buf,
 				       ino);
@@ -870,6 +892,7 @@ static void rewrite_one_inode(struct rewrite_context *ctx, ext2_ino_t ino,
 					ino);
 	if (retval)
 		fatal_err(retval, "while rewriting extended attribute");
+	return 1;
 }
 
 #define REWRITE_EA_FL		0x01	/* Rewrite EA inodes */
@@ -877,46 +900,184 @@ static void rewrite_one_inode(struct rewrite_context *ctx, ext2_ino_t ino,
 #define REWRITE_NONDIR_FL	0x04	/* Rewrite other inodes */
 #define REWRITE_ALL (REWRITE_EA_FL | REWRITE_DIR_FL | REWRITE_NONDIR_FL)
 
-static void rewrite_inodes_pass(struct rewrite_context *ctx, unsigned int flags)
+static int rewrite_inode_wanted(struct ext2_inode *inode, unsigned int flags)
 {
-	ext2_inode_scan	scan;
+	if (inode->i_flags & EXT4_EA_INODE_FL)
+		return flags & REWRITE_EA_FL;
+	if (LINUX_S_ISDIR(inode->i_mode))
+		return flags & REWRITE_DIR_FL;
+	return flags & REWRITE_NONDIR_FL;
+}
+
+/*
+ * Rewrite the inodes of one block group.  The in-use part of the inode
+ * table is read with a single request, the inodes are updated in that
+ * buffer, and the table is written back with a single request, so the
+ * inode table I/O stays sequential however many groups are in flight.
+ * This bypasses the inode cache, which must be flushed afterwards.
+ */
+static void rewrite_group_inodes(struct rewrite_context *ctx, dgrp_t group,
+				 unsigned int flags)
+{
+	ext2_filsys	fs = ctx->fs;
+	ext2_ino_t	ipg = fs->super->s_inodes_per_group;
+	ext2_ino_t	i, ino, n = ipg;
+	blk64_t		itable;
+	unsigned int	nblocks;
+	char		*raw;
+	int		dirty = 0;
 	errcode_t	retval;
-	ext2_ino_t	ino;
-	struct ext2_inode *inode;
-	int rewrite;
 
-	retval = ext2fs_get_mem(ctx->inode_size, &inode);
+	if (ext2fs_has_group_desc_csum(fs)) {
+		__u32 unused = ext2fs_bg_itable_unused(fs, group);
+
+		if (ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT))
+			return;
+		n = (unused < ipg) ? ipg - unused : 0;
+	}
+	if (!n)
+		return;
+
+	itable = ext2fs_inode_table_loc(fs, group);
+	if (!itable)
+		fatal_err(EXT2_ET_MISSING_INODE_TABLE,
+			  "while reading inode table");
+	nblocks = ((unsigned long long) n * ctx->inode_size +
+		   fs->blocksize - 1) / fs->blocksize;
+	retval = io_channel_read_blk64(fs->io, itable, nblocks,
+				       ctx->itable_buf);
 	if (retval)
-		fatal_err(retval, "while allocating memory");
+		fatal_err(retval, "while reading inode table");
+
+	ino = group * ipg + 1;
+	for (i = 0; i < n; i++, ino++) {
+		raw = ctx->itable_buf + (size_t) i * ctx->inode_size;
+#ifdef WORDS_BIGENDIAN
+		ext2fs_swap_inode_full(fs,
+				(struct ext2_inode_large *) ctx->inode,
+				(struct ext2_inode_large *) raw,
+				0, ctx->inode_size);
+#else
+		memcpy(ctx->inode, raw, ctx->inode_size);
+#endif
+		if (!rewrite_inode_wanted(ctx->inode, flags) ||
+		    !rewrite_one_inode(ctx, ino, ctx->inode))
+			continue;
+#ifdef WORDS_BIGENDIAN
+		ext2fs_swap_inode_full(fs, (struct ext2_inode_large *) raw,
+				(struct ext2_inode_large *) ctx->inode,
+				1, ctx->inode_size);
+#else
+		memcpy(raw, ctx->inode, ctx->inode_size);
+#endif
+		retval = ext2fs_inode_csum_set(fs, ino,
+					(struct ext2_inode_large *) raw);
+		if (retval)
+			fatal_err(retval, "while writing inode");
+		dirty = 1;
+	}
+	if (!dirty)
+		return;
 
-	retval = ext2fs_open_inode_scan(ctx->fs, 0, &scan);
+	retval = io_channel_write_blk64(fs->io, itable, nblocks,
+					ctx->itable_buf);
 	if (retval)
-		fatal_err(retval, "while opening inode scan");
+		fatal_err(retval, "while writing inode table");
+}
 
-	do {
-		retval = ext2fs_get_next_inode_full(scan, &ino, inode,
-						    ctx->inode_size);
-		if (retval)
-			fatal_err(retval, "while getting next inode");
-		if (!ino)
+/*
+ * Block groups are handed out one at a time to the rewriting threads.
+ */
+struct rewrite_pool {
+	ext2_filsys	fs;
+	unsigned int	flags;
+	dgrp_t		next_group;
+	__u64		groups_done;
+	struct ext2fs_numeric_progress_struct progress;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	lock;
+#endif
+};
+
+struct rewrite_thread {
+	struct rewrite_context ctx;
+	struct rewrite_pool *pool;
+#ifdef HAVE_PTHREAD
+	pthread_t	thread;
+#endif
+};
+
+static void *rewrite_inodes_thread(void *arg)
+{
+	struct rewrite_thread *t = arg;
+	struct rewrite_pool *pool = t->pool;
+	dgrp_t group, count = pool->fs->group_desc_count;
+	int started = 0;
+
+	while (1) {
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&pool->lock);
+#endif
+		if (started)
+			ext2fs_numeric_progress_update(pool->fs,
+					&pool->progress, ++pool->groups_done);
+		group = pool->next_group;
+		if (group < count)
+			pool->next_group++;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&pool->lock);
+#endif
+		if (group >= count)
 			break;
+		rewrite_group_inodes(&t->ctx, group, pool->flags);
+		started = 1;
+	}
+	return NULL;
+}
 
-		rewrite = 0;
-		if (inode->i_flags & EXT4_EA_INODE_FL) {
-			if (flags & REWRITE_EA_FL)
-				rewrite = 1;
-		} else if (LINUX_S_ISDIR(inode->i_mode)) {
-			if (flags & REWRITE_DIR_FL)
-				rewrite = 1;
-		} else {
-			if (flags & REWRITE_NONDIR_FL)
-				rewrite = 1;
+static void rewrite_inodes_pass(struct rewrite_pool *pool,
+				struct rewrite_thread *threads,
+				int num_threads, unsigned int flags)
+{
+	pool->flags = flags;
+	pool->next_group = 0;
+#ifdef HAVE_PTHREAD
+	if (num_threads > 1) {
+		int i, ret;
+
+		for (i = 0; i < num_threads; i++) {
+			ret = pthread_create(&threads[i].thread, NULL,
+					     rewrite_inodes_thread,
+					     &threads[i]);
+			if (ret)
+				fatal_err(ret, "while starting threads");
 		}
-		if (rewrite)
-			rewrite_one_inode(ctx, ino, inode);
-	} while (ino);
-	ext2fs_close_inode_scan(scan);
-	ext2fs_free_mem(&inode);
+		for (i = 0; i < num_threads; i++)
+			pthread_join(threads[i].thread, NULL);
+	} else
+#endif
+		rewrite_inodes_thread(&threads[0]);
+
+	ext2fs_flush_icache(pool->fs);
+}
+
+/*
+ * Use one thread per CPU if the I/O channel allows concurrent access.
+ */
+static int get_num_threads(ext2_filsys fs)
+{
+	long n = 1;
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_SYSCONF) && \
+	defined(_SC_NPROCESSORS_ONLN)
+	if (fs->io->flags & CHANNEL_FLAGS_THREADS)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n < 1)
+		n = 1;
+	if ((unsigned long) n > fs->group_desc_count)
+		n = fs->group_desc_count;
+	return n;
 }
 
 /*
@@ -924,22 +1085,64 @@ static void rewrite_inodes_pass(struct rewrite_context *ctx, unsigned int flags)
  */
 static void rewrite_inodes(ext2_filsys fs, unsigned int flags)
 {
-	struct rewrite_context ctx = {
-		.fs = fs,
-		.inode_size = EXT2_INODE_SIZE(fs->super),
-	};
+	struct rewrite_pool pool;
+	struct rewrite_thread *threads;
+	struct ext2_inode *zero_inode;
+	int inode_size = EXT2_INODE_SIZE(fs->super);
+	int save_flags = fs->flags;
+	int i, num_threads, passes = 1;
 	errcode_t retval;
 
 	if (fs->super->s_creator_os == EXT2_OS_HURD)
 		return;
 
-	retval = ext2fs_get_memzero(ctx.inode_size, &ctx.zero_inode);
+	retval = ext2fs_get_memzero(inode_size, &zero_inode);
 	if (retval)
 		fatal_err(retval, "while allocating memory");
 
-	retval = ext2fs_get_mem(64 * 1024, &ctx.ea_buf);
+	/* The threads share the inode cache, so it can't be created lazily */
+	if (!fs->icache) {
+		retval = ext2fs_create_inode_cache(fs, 4);
+		if (retval)
+			fatal_err(retval, "while creating inode cache");
+	}
+
+	num_threads = get_num_threads(fs);
+	retval = ext2fs_get_array(num_threads, sizeof(struct rewrite_thread),
+				  &threads);
 	if (retval)
 		fatal_err(retval, "while allocating memory");
+	memset(&pool, 0, sizeof(pool));
+	pool.fs = fs;
+	for (i = 0; i < num_threads; i++) {
+		struct rewrite_context *ctx = &threads[i].ctx;
+
+		memset(&threads[i], 0, sizeof(threads[i]));
+		threads[i].pool = &pool;
+		ctx->fs = fs;
+		ctx->zero_inode = zero_inode;
+		ctx->inode_size = inode_size;
+		retval = ext2fs_get_mem(64 * 1024, &ctx->ea_buf);
+		if (!retval)
+			retval = ext2fs_get_array(fs->inode_blocks_per_group,
+						  fs->blocksize,
+						  &ctx->itable_buf);
+		if (!retval)
+			retval = ext2fs_get_mem(inode_size, &ctx->inode);
+		if (retval)
+			fatal_err(retval, "while allocating memory");
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&pool.lock, NULL);
+#endif
+
+	if (isatty(1))
+		fs->flags |= EXT2_FLAG_PRINT_PROGRESS;
+	if (ext2fs_has_feature_ea_inode(fs->super) && (flags & REWRITE_EA_FL))
+		passes = 2;
+	ext2fs_numeric_progress_init(fs, &pool.progress,
+				     _("Rewriting inode checksums: "),
+				     (__u64) passes * fs->group_desc_count);
 
 	/*
 	 * Extended attribute inodes have a lookup hash that needs to be
@@ -951,13 +1154,26 @@ static void rewrite_inodes(ext2_filsys fs, unsigned int flags)
 	 *
 	 * pass 2: go over other inodes to update their checksums.
 	 */
-	if (ext2fs_has_feature_ea_inode(fs->super) && (flags & REWRITE_EA_FL))
-		rewrite_inodes_pass(&ctx, REWRITE_EA_FL);
+	if (passes == 2)
+		rewrite_inodes_pass(&pool, threads, num_threads,
+				    REWRITE_EA_FL);
 	flags &= ~REWRITE_EA_FL;
-	rewrite_inodes_pass(&ctx, flags);
+	rewrite_inodes_pass(&pool, threads, num_threads, flags);
 
-	ext2fs_free_mem(&ctx.zero_inode);
-	ext2fs_free_mem(&ctx.ea_buf);
+	ext2fs_numeric_progress_close(fs, &pool.progress, _("done\n"));
+	fs->flags = (fs->flags & ~EXT2_FLAG_PRINT_PROGRESS) |
+		(save_flags & EXT2_FLAG_PRINT_PROGRESS);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&pool.lock);
+#endif
+	for (i = 0; i < num_threads; i++) {
+		ext2fs_free_mem(&threads[i].ctx.ea_buf);
+		ext2fs_free_mem(&threads[i].ctx.itable_buf);
+		ext2fs_free_mem(&threads[i].ctx.inode);
+	}
+	ext2fs_free_mem(&threads);
+	ext2fs_free_mem(&zero_inode);
 }
 
 static void rewrite_metadata_checksums(ext2_filsys fs, unsigned int flags)
@@ -2544,25 +2760,59 @@ static int ext2fs_is_block_in_group(ext2_filsys fs, dgrp_t group, blk64_t blk)
 	return 0;
 }
 
-static int move_block(ext2_filsys fs, ext2fs_block_bitmap bmap)
+static errcode_t add_blk_move(blk64_t old_loc, blk64_t new_loc)
 {
+	struct blk_move *bmv;
+	errcode_t retval;
 
-	char *buf;
+	if (blk_moves_count) {
+		bmv = &blk_moves[blk_moves_count - 1];
+		if (bmv->old_loc + bmv->len == old_loc &&
+		    bmv->new_loc + bmv->len == new_loc) {
+			bmv->len++;
+			return 0;
+		}
+	}
+	if (blk_moves_count == blk_moves_max) {
+		unsigned long new_max = blk_moves_max ? blk_moves_max * 2 : 64;
+
+		retval = ext2fs_resize_mem(blk_moves_max *
+					   sizeof(struct blk_move),
+					   new_max * sizeof(struct blk_move),
+					   &blk_moves);
+		if (retval)
+			return retval;
+		blk_moves_max = new_max;
+	}
+	bmv = &blk_moves[blk_moves_count++];
+	bmv->old_loc = old_loc;
+	bmv->new_loc = new_loc;
+	bmv->len = 1;
+	return 0;
+}
+
+/*
+ * Pick a new home for every block marked in bmap.  Nothing is written
+ * here; the whole move is planned before any data is copied.
+ */
+static int plan_block_moves(ext2_filsys fs, ext2fs_block_bitmap bmap)
+{
 	dgrp_t group = 0;
 	errcode_t retval;
-	int meta_data = 0;
+	int meta_data;
 	blk64_t blk, new_blk, goal;
-	struct blk_move *bmv;
-
-	retval = ext2fs_get_mem(fs->blocksize, &buf);
-	if (retval)
-		return retval;
+	blk64_t end = ext2fs_blocks_count(fs->super) - 1;
 
 	for (new_blk = blk = fs->super->s_first_data_block;
-	     blk < ext2fs_blocks_count(fs->super); blk++) {
-		if (!ext2fs_test_block_bitmap2(bmap, blk))
-			continue;
+	     blk <= end; blk++) {
+		retval = ext2fs_find_first_set_block_bitmap2(bmap, blk, end,
+							     &blk);
+		if (retval == ENOENT)
+			break;
+		if (retval)
+			return retval;
 
+		meta_data = 0;
 		if (ext2fs_is_meta_block(fs, blk)) {
 			/*
 			 * If the block is mapping a fs meta data block
@@ -2580,50 +2830,86 @@ static int move_block(ext2_filsys fs, ext2fs_block_bitmap bmap)
 		}
 		retval = ext2fs_new_block2(fs, goal, NULL, &new_blk);
 		if (retval)
-			goto err_out;
+			return retval;
 
 		/* new fs meta data block should be in the same group */
-		if (meta_data && !ext2fs_is_block_in_group(fs, group, new_blk)) {
-			retval = ENOSPC;
-			goto err_out;
-		}
+		if (meta_data && !ext2fs_is_block_in_group(fs, group, new_blk))
+			return ENOSPC;
 
 		/* Mark this block as allocated */
 		ext2fs_mark_block_bitmap2(fs->block_map, new_blk);
 
-		/* Add it to block move list */
-		retval = ext2fs_get_mem(sizeof(struct blk_move), &bmv);
+		retval = add_blk_move(blk, new_blk);
 		if (retval)
-			goto err_out;
+			return retval;
+	}
+	return 0;
+}
 
-		bmv->old_loc = blk;
-		bmv->new_loc = new_blk;
+#define MOVE_CHUNK_BYTES	(1024 * 1024)
+#define MOVE_MAX_INFLIGHT	8
 
-		list_add(&(bmv->list), &blk_move_list);
+/*
+ * Copy the planned moves, a megabyte at a time.  The old blocks are
+ * left alone, so until the inode tables are expanded over them an
+ * interrupted move leaves every reference pointing at valid data.
+ */
+static errcode_t copy_moved_blocks(ext2_filsys fs)
+{
+	io_write_batch batch;
+	struct blk_move *bmv;
+	unsigned long i;
+	blk64_t done, n, chunk = MOVE_CHUNK_BYTES / fs->blocksize;
+	char *buf;
+	errcode_t retval;
 
-		retval = io_channel_read_blk64(fs->io, blk, 1, buf);
-		if (retval)
-			goto err_out;
+	if (!chunk)
+		chunk = 1;
+	retval = ext2fs_get_array(chunk, fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	retval = io_channel_write_batch_init(fs->io, MOVE_MAX_INFLIGHT,
+					     &batch);
+	if (retval)
+		goto out;
 
-		retval = io_channel_write_blk64(fs->io, new_blk, 1, buf);
-		if (retval)
-			goto err_out;
+	for (i = 0, bmv = blk_moves; i < blk_moves_count; i++, bmv++) {
+		for (done = 0; done < bmv->len; done += n) {
+			n = bmv->len - done;
+			if (n > chunk)
+				n = chunk;
+			retval = io_channel_read_blk64(fs->io,
+						       bmv->old_loc + done,
+						       n, buf);
+			if (!retval)
+				retval = io_channel_write_batch_add(batch,
+						bmv->new_loc + done, n, buf);
+			if (retval) {
+				io_channel_write_batch_cancel(batch);
+				goto out;
+			}
+		}
 	}
-
-err_out:
+	retval = io_channel_write_batch_finish(batch);
+out:
 	ext2fs_free_mem(&buf);
 	return retval;
 }
 
 static blk64_t translate_block(blk64_t blk)
 {
-	struct list_head *entry;
+	unsigned long low = 0, high = blk_moves_count, mid;
 	struct blk_move *bmv;
 
-	list_for_each(entry, &blk_move_list) {
-		bmv = list_entry(entry, struct blk_move, list);
-		if (bmv->old_loc == blk)
-			return bmv->new_loc;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		bmv = &blk_moves[mid];
+		if (blk < bmv->old_loc)
+			high = mid;
+		else if (blk >= bmv->old_loc + bmv->len)
+			low = mid + 1;
+		else
+			return bmv->new_loc + (blk - bmv->old_loc);
 	}
 
 	return 0;
@@ -2654,6 +2940,196 @@ static int process_block(ext2_filsys fs EXT2FS_ATTR((unused)),
 	return ret;
 }
 
+struct moved_ref_check {
+	ext2fs_block_bitmap bmap;
+	int found;
+};
+
+static int check_moved_block(ext2_filsys fs EXT2FS_ATTR((unused)),
+			     blk64_t *block_nr,
+			     e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
+			     blk64_t ref_block EXT2FS_ATTR((unused)),
+			     int ref_offset EXT2FS_ATTR((unused)),
+			     void *priv_data)
+{
+	struct moved_ref_check *check = priv_data;
+
+	if (!ext2fs_test_block_bitmap2(check->bmap, *block_nr))
+		return 0;
+	check->found = 1;
+	return BLOCK_ABORT;
+}
+
+/*
+ * Finding the inodes which refer to moved blocks means reading every
+ * inode and all of its mapping blocks, so that part is shared out by
+ * block group among several threads.  The inodes found, usually few,
+ * are then fixed up in inode number order by the caller.
+ */
+struct moved_ref_scan {
+	ext2_filsys	fs;
+	ext2fs_block_bitmap bmap;
+	ext2fs_inode_bitmap fix_map;
+	dgrp_t		next_group;
+	errcode_t	err;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	lock;
+#endif
+};
+
+struct moved_ref_thread {
+	struct moved_ref_scan *ms;
+	ext2_inode_scan	scan;
+	char		*block_buf;
+#ifdef HAVE_PTHREAD
+	pthread_t	thread;
+#endif
+};
+
+static void moved_ref_lock(struct moved_ref_scan *ms EXT2FS_ATTR((unused)))
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ms->lock);
+#endif
+}
+
+static void moved_ref_unlock(struct moved_ref_scan *ms EXT2FS_ATTR((unused)))
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ms->lock);
+#endif
+}
+
+static void *find_moved_refs_thread(void *arg)
+{
+	struct moved_ref_thread *t = arg;
+	struct moved_ref_scan *ms = t->ms;
+	ext2_filsys fs = ms->fs;
+	struct moved_ref_check check = { .bmap = ms->bmap };
+	struct ext2_inode inode;
+	unsigned long long last_ino;
+	ext2_ino_t ino;
+	blk64_t blk;
+	dgrp_t group;
+	errcode_t retval = 0;
+
+	while (!retval) {
+		moved_ref_lock(ms);
+		group = ms->next_group;
+		if (group < fs->group_desc_count && !ms->err)
+			ms->next_group++;
+		else
+			group = fs->group_desc_count;
+		moved_ref_unlock(ms);
+		if (group >= fs->group_desc_count)
+			break;
+		last_ino = (unsigned long long) (group + 1) *
+			EXT2_INODES_PER_GROUP(fs->super);
+
+		retval = ext2fs_inode_scan_goto_blockgroup(t->scan, group);
+		while (!retval) {
+			retval = ext2fs_get_next_inode(t->scan, &ino, &inode);
+			if (retval || !ino || ino > last_ino)
+				break;
+
+			if (inode.i_links_count == 0)
+				continue; /* inode not in use */
+
+			blk = ext2fs_file_acl_block(fs, &inode);
+			check.found = blk &&
+				ext2fs_test_block_bitmap2(ms->bmap, blk);
+			if (!check.found &&
+			    ext2fs_inode_has_valid_blocks2(fs, &inode))
+				retval = ext2fs_block_iterate3(fs, ino,
+						BLOCK_FLAG_READ_ONLY,
+						t->block_buf,
+						check_moved_block, &check);
+			if (!retval && check.found) {
+				moved_ref_lock(ms);
+				ext2fs_mark_inode_bitmap2(ms->fix_map, ino);
+				moved_ref_unlock(ms);
+			}
+		}
+	}
+
+	if (retval) {
+		moved_ref_lock(ms);
+		if (!ms->err)
+			ms->err = retval;
+		moved_ref_unlock(ms);
+	}
+	return NULL;
+}
+
+static errcode_t find_moved_refs(ext2_filsys fs, ext2fs_block_bitmap bmap,
+				 ext2fs_inode_bitmap fix_map)
+{
+	struct moved_ref_scan ms;
+	struct moved_ref_thread *threads;
+	int i, num_threads = get_num_threads(fs);
+	errcode_t retval;
+
+	memset(&ms, 0, sizeof(ms));
+	ms.fs = fs;
+	ms.bmap = bmap;
+	ms.fix_map = fix_map;
+
+	/* The threads share the inode cache, so it can't be created lazily */
+	if (!fs->icache) {
+		retval = ext2fs_create_inode_cache(fs, 4);
+		if (retval)
+			return retval;
+	}
+
+	retval = ext2fs_get_arrayzero(num_threads,
+				      sizeof(struct moved_ref_thread),
+				      &threads);
+	if (retval)
+		return retval;
+	for (i = 0; i < num_threads; i++) {
+		threads[i].ms = &ms;
+		retval = ext2fs_open_inode_scan(fs, 0, &threads[i].scan);
+		if (!retval)
+			retval = ext2fs_get_mem(fs->blocksize * 3,
+						&threads[i].block_buf);
+		if (retval)
+			goto out;
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&ms.lock, NULL);
+	if (num_threads > 1) {
+		for (i = 0; i < num_threads; i++) {
+			retval = pthread_create(&threads[i].thread, NULL,
+						find_moved_refs_thread,
+						&threads[i]);
+			if (retval) {
+				moved_ref_lock(&ms);
+				ms.err = retval;
+				moved_ref_unlock(&ms);
+				break;
+			}
+		}
+		while (--i >= 0)
+			pthread_join(threads[i].thread, NULL);
+	} else
+#endif
+		find_moved_refs_thread(&threads[0]);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&ms.lock);
+#endif
+	retval = ms.err;
+
+out:
+	for (i = 0; i < num_threads; i++) {
+		if (threads[i].scan)
+			ext2fs_close_inode_scan(threads[i].scan);
+		ext2fs_free_mem(&threads[i].block_buf);
+	}
+	ext2fs_free_mem(&threads);
+	return retval;
+}
+
 static int inode_scan_and_fix(ext2_filsys fs, ext2fs_block_bitmap bmap)
 {
 	errcode_t retval = 0;
@@ -2661,26 +3137,29 @@ static int inode_scan_and_fix(ext2_filsys fs, ext2fs_block_bitmap bmap)
 	blk64_t blk;
 	char *block_buf = 0;
 	struct ext2_inode inode;
-	ext2_inode_scan	scan = NULL;
+	ext2fs_inode_bitmap fix_map = NULL;
 
-	retval = ext2fs_get_mem(fs->blocksize * 3, &block_buf);
+	retval = ext2fs_allocate_inode_bitmap(fs, _("inodes to be fixed"),
+					      &fix_map);
 	if (retval)
 		return retval;
 
-	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	retval = find_moved_refs(fs, bmap, fix_map);
 	if (retval)
 		goto err_out;
 
-	while (1) {
-		retval = ext2fs_get_next_inode(scan, &ino, &inode);
-		if (retval)
-			goto err_out;
+	retval = ext2fs_get_mem(fs->blocksize * 3, &block_buf);
+	if (retval)
+		goto err_out;
 
-		if (!ino)
+	for (ino = 1; ino <= fs->super->s_inodes_count; ino++) {
+		if (ext2fs_find_first_set_inode_bitmap2(fix_map, ino,
+					fs->super->s_inodes_count, &ino))
 			break;
 
-		if (inode.i_links_count == 0)
-			continue; /* inode not in use */
+		retval = ext2fs_read_inode(fs, ino, &inode);
+		if (retval)
+			goto err_out;
 
 		/* FIXME!!
 		 * If we end up modifying the journal inode
@@ -2715,12 +3194,11 @@ static int inode_scan_and_fix(ext2_filsys fs, ext2fs_block_bitmap bmap)
 					       process_block, bmap);
 		if (retval)
 			goto err_out;
-
 	}
 
 err_out:
 	ext2fs_free_mem(&block_buf);
-	ext2fs_close_inode_scan(scan);
+	ext2fs_free_inode_bitmap(fix_map);
 
 	return retval;
 }
@@ -2766,6 +3244,7 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 	char *tmp_old_itable = NULL, *tmp_new_itable = NULL;
 	unsigned long old_ino_size;
 	int old_itable_size, new_itable_size;
+	io_write_batch batch = NULL;
 
 	old_itable_size = fs->inode_blocks_per_group * fs->blocksize;
 	old_ino_size = EXT2_INODE_SIZE(fs->super);
@@ -2785,6 +3264,15 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 	if (retval)
 		goto err_out;
 
+	/*
+	 * The batch takes a copy of each new table, so the next group's
+	 * table can be read while the last one is still being written.
+	 */
+	retval = io_channel_write_batch_init(fs->io, MOVE_MAX_INFLIGHT,
+					     &batch);
+	if (retval)
+		goto err_out;
+
 	tmp_old_itable = old_itable;
 	tmp_new_itable = new_itable;
 
@@ -2809,11 +3297,15 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 		old_itable = tmp_old_itable;
 		new_itable = tmp_new_itable;
 
-		retval = io_channel_write_blk64(fs->io, blk,
+		retval = io_channel_write_batch_add(batch, blk,
 					new_ino_blks_per_grp, new_itable);
 		if (retval)
 			goto err_out;
 	}
+	retval = io_channel_write_batch_finish(batch);
+	batch = NULL;
+	if (retval)
+		goto err_out;
 
 	/* Update the meta data */
 	fs->inode_blocks_per_group = new_ino_blks_per_grp;
@@ -2822,6 +3314,9 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 	fs->super->s_inode_size = new_ino_size;
 
 err_out:
+	if (batch)
+		io_channel_write_batch_cancel(batch);
+
 	if (old_itable)
 		ext2fs_free_mem(&old_itable);
 
@@ -2831,22 +3326,10 @@ err_out:
 	return retval;
 }
 
-
-#define list_for_each_safe(pos, pnext, head) \
-	for (pos = (head)->next, pnext = pos->next; pos != (head); \
-	     pos = pnext, pnext = pos->next)
-
-static void free_blk_move_list(void)
+static void free_blk_moves(void)
 {
-	struct list_head *entry, *tmp;
-	struct blk_move *bmv;
-
-	list_for_each_safe(entry, tmp, &blk_move_list) {
-		bmv = list_entry(entry, struct blk_move, list);
-		list_del(entry);
-		ext2fs_free_mem(&bmv);
-	}
-	return;
+	ext2fs_free_mem(&blk_moves);
+	blk_moves_count = blk_moves_max = 0;
 }
 
 static int resize_inode(ext2_filsys fs, unsigned long new_size)
@@ -2865,9 +3348,6 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 		fputs(_("Failed to read block bitmap\n"), stderr);
 		return retval;
 	}
-	INIT_LIST_HEAD(&blk_move_list);
-
-
 	new_ino_blks_per_grp = ext2fs_div_ceil(
 					EXT2_INODES_PER_GROUP(fs->super)*
 					new_size,
@@ -2891,12 +3371,18 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 		fputs(_("Not enough space to increase inode size \n"), stderr);
 		goto err_out;
 	}
-	retval = move_block(fs, bmap);
+	retval = plan_block_moves(fs, bmap);
 	if (retval) {
 		fputs(_("Failed to relocate blocks during inode resize \n"),
 		      stderr);
 		goto err_out;
 	}
+	retval = copy_moved_blocks(fs);
+	if (retval) {
+		fputs(_("Failed to relocate blocks during inode resize \n"),
+		      stderr);
+		goto err_out_undo;
+	}
 	retval = inode_scan_and_fix(fs, bmap);
 	if (retval)
 		goto err_out_undo;
@@ -2917,13 +3403,13 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 	ext2fs_mark_bb_dirty(fs);
 
 err_out:
-	free_blk_move_list();
+	free_blk_moves();
 	ext2fs_free_block_bitmap(bmap);
 
 	return retval;
 
 err_out_undo:
-	free_blk_move_list();
+	free_blk_moves();
 	ext2fs_free_block_bitmap(bmap);
 	fputs(_("Error in resizing the inode size.\n"
 			"Run e2undo to undo the "
@@ -3214,8 +3700,12 @@ retry_open:
 	if ((open_flag & EXT2_FLAG_RW) == 0 || f_flag)
 		open_flag |= EXT2_FLAG_SKIP_MMP;
 
+	/*
+	 * Most changes only touch the superblock and a few groups, so
+	 * read descriptor blocks as they are needed.
+	 */
 	open_flag |= EXT2_FLAG_64BITS | EXT2_FLAG_THREADS |
-		EXT2_FLAG_JOURNAL_DEV_OK;
+		EXT2_FLAG_JOURNAL_DEV_OK | EXT2_FLAG_LAZY_GDT;
 
 	/* keep the filesystem struct around to dump MMP data */
 	open_flag |= EXT2_FLAG_NOFREE_ON_ERROR;